@@ -215,6 +215,9 @@ AC_DEFUN([DOVECOT_SSL], [
       AC_CHECK_LIB(ssl, SSL_CTX_set_ciphersuites, [
         AC_DEFINE(HAVE_SSL_CTX_SET_CIPHERSUITES,, [Build with SSL_CTX_set_ciphersuites() support])
       ],, $SSL_LIBS)
+      AC_CHECK_LIB(ssl, SSL_CTX_set_tlsext_ticket_key_evp_cb, [
+        AC_DEFINE(HAVE_SSL_CTX_SET_TLSEXT_TICKET_KEY_EVP_CB,, [Build with SSL_CTX_set_tlsext_ticket_key_evp_cb() support])
+      ],, $SSL_LIBS)
       AC_CHECK_LIB(ssl, BN_secure_new, [
         AC_DEFINE(HAVE_BN_SECURE_NEW,, [Build with BN_secure_new support])
       ],, $SSL_LIBS)
@@ -0,0 +1,176 @@
+/* Copyright (c) 2023 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "time-util.h"
+#include "strnum.h"
+#include "connect-limit.h"
+
+#include <stdio.h>
+
+/**
+ * Measures the throughput of the connect-limit operations that anvil performs
+ * for each CONNECT, DISCONNECT and CONNECT-LIMIT lookup. The scenarios mimic
+ * the ones in test-connect-limit.c, but with a large number of users,
+ * sessions and processes.
+ */
+
+#define BENCH_DEFAULT_SESSION_COUNT 200000
+#define BENCH_SESSIONS_PER_USER 4
+#define BENCH_SESSIONS_PER_PROCESS 100
+
+struct bench_session {
+	char *username;
+	struct connect_limit_key key;
+	guid_128_t conn_guid;
+	pid_t pid;
+};
+
+static struct bench_session *
+bench_sessions_create(unsigned int session_count)
+{
+	struct bench_session *sessions;
+	unsigned int i;
+
+	sessions = i_new(struct bench_session, session_count);
+	for (i = 0; i < session_count; i++) {
+		sessions[i].username =
+			i_strdup_printf("user%u", i / BENCH_SESSIONS_PER_USER);
+		sessions[i].key.username = sessions[i].username;
+		sessions[i].key.service = i % 2 == 0 ? "imap" : "pop3";
+		sessions[i].key.ip.family = AF_INET;
+		sessions[i].key.ip.u.ip4.s_addr = htonl(0x0a000000 + i % 1024);
+		guid_128_generate(sessions[i].conn_guid);
+		sessions[i].pid = 1000 + i / BENCH_SESSIONS_PER_PROCESS;
+	}
+	return sessions;
+}
+
+static void
+bench_sessions_free(struct bench_session *sessions, unsigned int session_count)
+{
+	unsigned int i;
+
+	for (i = 0; i < session_count; i++)
+		i_free(sessions[i].username);
+	i_free(sessions);
+}
+
+static void bench_result(const char *name, uint64_t ts_start,
+			 unsigned int op_count)
+{
+	uint64_t diff = i_nanoseconds() - ts_start;
+
+	printf("%-24s %10u ops %10.3f ms %12.0f ops/sec\n", name, op_count,
+	       diff / 1000000.0, op_count / (diff / 1000000000.0));
+}
+
+static void
+bench_connect(struct connect_limit *limit, struct bench_session *sessions,
+	      unsigned int session_count)
+{
+	static const char *alt_usernames[] = { "altfield", "altvalue", NULL };
+	const struct ip_addr dest_ip = { .family = 0 };
+	uint64_t ts = i_nanoseconds();
+	unsigned int i;
+
+	for (i = 0; i < session_count; i++) {
+		connect_limit_connect(limit, sessions[i].pid, &sessions[i].key,
+				      sessions[i].conn_guid,
+				      KICK_TYPE_SIGNAL, &dest_ip,
+				      i % 8 == 0 ? alt_usernames : NULL);
+	}
+	bench_result("connect", ts, session_count);
+}
+
+static void
+bench_lookup(struct connect_limit *limit, struct bench_session *sessions,
+	     unsigned int session_count)
+{
+	uint64_t ts = i_nanoseconds();
+	unsigned int i, total = 0;
+
+	for (i = 0; i < session_count; i++)
+		total += connect_limit_lookup(limit, &sessions[i].key);
+	bench_result("lookup", ts, session_count);
+	i_assert(total == session_count);
+}
+
+static void
+bench_disconnect(struct connect_limit *limit, struct bench_session *sessions,
+		 unsigned int session_count)
+{
+	uint64_t ts = i_nanoseconds();
+	unsigned int i;
+
+	for (i = 0; i < session_count; i++) {
+		connect_limit_disconnect(limit, sessions[i].pid,
+					 &sessions[i].key,
+					 sessions[i].conn_guid);
+	}
+	bench_result("disconnect", ts, session_count);
+}
+
+static void
+bench_disconnect_pid(struct connect_limit *limit,
+		     struct bench_session *sessions,
+		     unsigned int session_count)
+{
+	uint64_t ts = i_nanoseconds();
+	unsigned int i, pid_count = 0;
+
+	for (i = 0; i < session_count; i += BENCH_SESSIONS_PER_PROCESS) {
+		connect_limit_disconnect_pid(limit, sessions[i].pid);
+		pid_count++;
+	}
+	bench_result("disconnect-pid", ts, pid_count);
+}
+
+static void
+bench_iter(struct connect_limit *limit, struct bench_session *sessions,
+	   unsigned int session_count)
+{
+	struct connect_limit_iter *iter;
+	struct connect_limit_iter_result result;
+	uint64_t ts = i_nanoseconds();
+	unsigned int i, user_count = 0;
+
+	for (i = 0; i < session_count; i += BENCH_SESSIONS_PER_USER) {
+		iter = connect_limit_iter_begin(limit,
+						sessions[i].key.username, NULL);
+		while (connect_limit_iter_next(iter, &result)) ;
+		connect_limit_iter_deinit(&iter);
+		user_count++;
+	}
+	bench_result("user iter", ts, user_count);
+}
+
+int main(int argc, char *argv[])
+{
+	struct connect_limit *limit;
+	struct bench_session *sessions;
+	unsigned int session_count = BENCH_DEFAULT_SESSION_COUNT;
+
+	lib_init();
+	if (argc > 1 && str_to_uint(argv[1], &session_count) < 0)
+		i_fatal("Usage: %s [<session count>]", argv[0]);
+	if (session_count == 0)
+		i_fatal("Session count must be larger than 0");
+
+	sessions = bench_sessions_create(session_count);
+	limit = connect_limit_init();
+
+	/* sessions are disconnected one by one */
+	bench_connect(limit, sessions, session_count);
+	bench_lookup(limit, sessions, session_count);
+	bench_iter(limit, sessions, session_count);
+	bench_disconnect(limit, sessions, session_count);
+
+	/* processes die with all their sessions */
+	bench_connect(limit, sessions, session_count);
+	bench_disconnect_pid(limit, sessions, session_count);
+
+	connect_limit_deinit(&limit);
+	bench_sessions_free(sessions, session_count);
+	lib_deinit();
+	return 0;
+}
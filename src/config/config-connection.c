@@ -3,12 +3,15 @@
 #include "lib.h"
 #include "array.h"
 #include "llist.h"
+#include "buffer.h"
 #include "istream.h"
 #include "ostream.h"
 #include "strescape.h"
 #include "settings-parser.h"
+#include "master-interface.h"
 #include "master-service.h"
 #include "master-service-settings.h"
+#include "master-service-settings-blob.h"
 #include "config-request.h"
 #include "config-parser.h"
 #include "config-connection.h"
@@ -28,11 +31,16 @@ struct config_connection {
 	struct ostream *output;
 	struct io *io;
 
+	/* settings collected for the precompiled settings blob */
+	buffer_t *blob_settings;
+	unsigned int blob_settings_count;
+
 	bool version_received:1;
 	bool handshaked:1;
 };
 
 static struct config_connection *config_connections = NULL;
+static struct master_service_settings_blob_writer *config_blob_writer = NULL;
 
 static const char *const *
 config_connection_next_line(struct config_connection *conn)
@@ -50,9 +58,16 @@ static void
 config_request_output(const char *key, const char *value,
 		      enum config_key_type type ATTR_UNUSED, void *context)
 {
-	struct ostream *output = context;
+	struct config_connection *conn = context;
+	struct ostream *output = conn->output;
 	const char *p;
 
+	if (conn->blob_settings != NULL) {
+		master_service_settings_blob_append_setting(conn->blob_settings,
+							    key, value);
+		conn->blob_settings_count++;
+	}
+
 	o_stream_nsend_str(output, key);
 	o_stream_nsend_str(output, "=");
 	while ((p = strchr(value, '\n')) != NULL) {
@@ -64,6 +79,35 @@ config_request_output(const char *key, const char *value,
 	o_stream_nsend_str(output, "\n");
 }
 
+static void
+config_connection_blob_add(struct config_connection *conn,
+			   const char *const *args,
+			   const struct master_service_settings_output *output)
+{
+	enum master_service_settings_blob_flags flags = 0;
+	const char *key, *error;
+
+	if (output->service_uses_remote) {
+		/* The result depends on the client IP. Don't fill the blob
+		   with per-client records. */
+		return;
+	}
+	if (output->service_uses_local)
+		flags |= MASTER_SERVICE_SETTINGS_BLOB_FLAG_SERVICE_USES_LOCAL;
+	if (output->used_local)
+		flags |= MASTER_SERVICE_SETTINGS_BLOB_FLAG_USED_LOCAL;
+	if (output->used_remote)
+		flags |= MASTER_SERVICE_SETTINGS_BLOB_FLAG_USED_REMOTE;
+
+	key = master_service_settings_blob_key(args, output->service_uses_local);
+	if (master_service_settings_blob_writer_add(config_blob_writer, key,
+			flags, conn->blob_settings, conn->blob_settings_count,
+			&error) < 0) {
+		i_error("%s - disabling settings blob", error);
+		master_service_settings_blob_writer_destroy(&config_blob_writer);
+	}
+}
+
 static int config_connection_request(struct config_connection *conn,
 				     const char *const *args)
 {
@@ -73,6 +117,7 @@ static int config_connection_request(struct config_connection *conn,
 	const char *path, *value, *error, *module, *const *wanted_modules;
 	ARRAY(const char *) modules;
 	ARRAY(const char *) exclude_settings;
+	const char *const *orig_args = args;
 	bool is_master = FALSE;
 
 	/* [<args>] */
@@ -118,15 +163,22 @@ static int config_connection_request(struct config_connection *conn,
 			config_connection_destroy(conn);
 			return -1;
 		}
+		/* the old blob has the previous configuration */
+		config_connection_blob_reset();
 	}
 
+	if (config_blob_writer != NULL && !is_master &&
+	    filter.service != NULL) {
+		conn->blob_settings = t_buffer_create(4096);
+		conn->blob_settings_count = 0;
+	}
 	o_stream_cork(conn->output);
 
 	ctx = config_export_init(wanted_modules,
 				 array_count(&exclude_settings) == 1 ? NULL :
 				 array_front(&exclude_settings),
 				 CONFIG_DUMP_SCOPE_SET, 0,
-				 config_request_output, conn->output);
+				 config_request_output, conn);
 	config_export_by_filter(ctx, &filter);
 	config_export_get_output(ctx, &output);
 
@@ -152,6 +204,10 @@ static int config_connection_request(struct config_connection *conn,
 		config_connection_destroy(conn);
 		return -1;
 	}
+	if (conn->blob_settings != NULL && output.specific_services == NULL &&
+	    config_blob_writer != NULL)
+		config_connection_blob_add(conn, orig_args, &output);
+	conn->blob_settings = NULL;
 	o_stream_nsend_str(conn->output, "\n");
 	o_stream_uncork(conn->output);
 	return 0;
@@ -262,4 +318,34 @@ void config_connections_destroy_all(void)
 {
 	while (config_connections != NULL)
 		config_connection_destroy(config_connections);
+	master_service_settings_blob_writer_destroy(&config_blob_writer);
+}
+
+static uoff_t config_blob_get_max_size(void)
+{
+	const struct master_service_settings *set;
+	struct config_module_parser *l;
+
+	for (l = config_module_parsers; l->root != NULL; l++) {
+		if (l->root == &master_service_setting_parser_info) {
+			set = settings_parser_get(l->parser);
+			return set->config_cache_size;
+		}
+	}
+	set = master_service_setting_parser_info.defaults;
+	return set->config_cache_size;
+}
+
+void config_connection_blob_reset(void)
+{
+	const char *path, *error;
+
+	master_service_settings_blob_writer_destroy(&config_blob_writer);
+	path = getenv(MASTER_CONFIG_BLOB_ENV);
+	if (path == NULL)
+		return;
+	if (master_service_settings_blob_writer_create(path,
+			config_blob_get_max_size(), &config_blob_writer,
+			&error) < 0)
+		i_error("%s", error);
 }
@@ -6,4 +6,7 @@ void config_connection_destroy(struct config_connection *conn);
 
 void config_connections_destroy_all(void);
 
+/* (Re)create the precompiled settings blob for the current configuration. */
+void config_connection_blob_reset(void);
+
 #endif
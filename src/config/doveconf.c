@@ -260,7 +260,8 @@ hide_secrets_from_value(struct ostream *output, const char *key,
 	    (key_ends_with(key, value, "_password") ||
 	     key_ends_with(key, value, "_key") ||
 	     key_ends_with(key, value, "_nonce") ||
-	     str_begins_with(key, "ssl_dh"))) {
+	     str_begins_with(key, "ssl_dh") ||
+	     str_begins_with(key, "ssl_ticket_keys"))) {
 		o_stream_nsend_str(output, "# hidden, use -P to show it");
 		return TRUE;
 	}
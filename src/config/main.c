@@ -36,6 +36,7 @@ int main(int argc, char *argv[])
 	path = master_service_get_config_path(master_service);
 	if (config_parse_file(path, TRUE, NULL, &error) <= 0)
 		i_fatal("%s", error);
+	config_connection_blob_reset();
 
 	/* notify about our success only after successfully parsing the
 	   config file, so if the parsing fails, master won't immediately
@@ -153,6 +153,19 @@ cmd_lookup_write_reply(const char *const *values, string_t *str)
 	str_append_tabescaped(str, str_c(tmp) + 1);
 }
 
+static void
+cmd_lookup_write_result(const struct dict_lookup_result *result, string_t *str)
+{
+	if (result->ret > 0)
+		cmd_lookup_write_reply(result->values, str);
+	else if (result->ret == 0)
+		str_append_c(str, DICT_PROTOCOL_REPLY_NOTFOUND);
+	else {
+		str_append_c(str, DICT_PROTOCOL_REPLY_FAIL);
+		str_append_tabescaped(str, result->error);
+	}
+}
+
 static void
 cmd_lookup_callback(const struct dict_lookup_result *result,
 		    struct dict_connection_cmd *cmd)
@@ -161,18 +174,15 @@ cmd_lookup_callback(const struct dict_lookup_result *result,
 
 	event_set_name(cmd->event, "dict_server_lookup_finished");
 	if (result->ret > 0) {
-		cmd_lookup_write_reply(result->values, str);
 		e_debug(cmd->event, "Lookup finished");
 	} else if (result->ret == 0) {
 		event_add_str(cmd->event, "key_not_found", "yes");
-		str_append_c(str, DICT_PROTOCOL_REPLY_NOTFOUND);
 		e_debug(cmd->event, "Lookup finished without results");
 	} else {
 		event_add_str(cmd->event, "error", result->error);
 		e_error(cmd->event, "Lookup failed: %s", result->error);
-		str_append_c(str, DICT_PROTOCOL_REPLY_FAIL);
-		str_append_tabescaped(str, result->error);
 	}
+	cmd_lookup_write_result(result, str);
 	dict_cmd_reply_handle_stats(cmd, str, cmd_stats.lookups);
 	str_append_c(str, '\n');
 
@@ -201,6 +211,59 @@ static int cmd_lookup(struct dict_connection_cmd *cmd, const char *const *args)
 	return 1;
 }
 
+static void
+cmd_lookup_multi_callback(const struct dict_lookup_result *results,
+			  unsigned int count, struct dict_connection_cmd *cmd)
+{
+	string_t *str = t_str_new(128);
+	string_t *reply = t_str_new(64);
+	unsigned int i;
+
+	event_set_name(cmd->event, "dict_server_lookup_finished");
+	str_printfa(str, "%c%u", DICT_PROTOCOL_REPLY_OK, count);
+	for (i = 0; i < count; i++) {
+		if (results[i].ret < 0) {
+			e_error(cmd->event, "Lookup failed: %s",
+				results[i].error);
+		}
+		/* each result is formatted like a LOOKUP reply and
+		   tabescaped once more to make it a single parameter */
+		str_truncate(reply, 0);
+		cmd_lookup_write_result(&results[i], reply);
+		str_append_c(str, '\t');
+		str_append_tabescaped(str, str_c(reply));
+	}
+	e_debug(cmd->event, "Lookup of %u keys finished", count);
+	dict_cmd_reply_handle_stats(cmd, str, cmd_stats.lookups);
+	str_append_c(str, '\n');
+
+	cmd->reply = i_strdup(str_c(str));
+	dict_connection_cmd_try_flush(&cmd);
+}
+
+static int
+cmd_lookup_multi(struct dict_connection_cmd *cmd, const char *const *args)
+{
+	const char *username;
+
+	/* <username> <key1> [<key2> ...] */
+	if (str_array_length(args) < 2) {
+		e_error(cmd->event, "LOOKUP_MULTI: broken input");
+		return -1;
+	}
+	username = args[0];
+
+	dict_connection_cmd_async(cmd);
+	event_add_str(cmd->event, "user", username);
+	event_add_int(cmd->event, "keys_count", str_array_length(args + 1));
+	const struct dict_op_settings set = {
+		.username = username,
+	};
+	dict_lookup_multi_async(cmd->conn->dict, &set, args + 1,
+				cmd_lookup_multi_callback, cmd);
+	return 1;
+}
+
 static bool dict_connection_flush_if_full(struct dict_connection *conn)
 {
 	if (o_stream_get_buffer_used_size(conn->conn.output) >
@@ -365,13 +428,14 @@ static void
 dict_connection_transaction_array_remove(struct dict_connection *conn,
 					 unsigned int id)
 {
-	const struct dict_connection_transaction *transactions;
+	struct dict_connection_transaction *transactions;
 	unsigned int i, count;
 
-	transactions = array_get(&conn->transactions, &count);
+	transactions = array_get_modifiable(&conn->transactions, &count);
 	for (i = 0; i < count; i++) {
 		if (transactions[i].id == id) {
 			i_assert(transactions[i].ctx == NULL);
+			dict_connection_transaction_free(&transactions[i]);
 			array_delete(&conn->transactions, i, 1);
 			return;
 		}
@@ -411,6 +475,7 @@ static int cmd_begin(struct dict_connection_cmd *cmd, const char *const *args)
 	trans->id = id;
 	trans->conn = cmd->conn;
 	trans->ctx = dict_transaction_begin(cmd->conn->dict, &set);
+	trans->username = i_strdup(username);
 	return 0;
 }
 
@@ -478,6 +543,12 @@ cmd_commit_finish(struct dict_connection_cmd *cmd,
 		e_debug(cmd->event, "Transaction finished: %s", result->error);
 	else
 		e_debug(cmd->event, "Transaction finished");
+	if (result->ret != DICT_COMMIT_RET_FAILED) {
+		struct dict_connection_transaction *trans =
+			dict_connection_transaction_lookup(cmd->conn,
+							   cmd->trans_id);
+		dict_connection_transaction_notify_changes(trans);
+	}
 	dict_connection_transaction_array_remove(cmd->conn, cmd->trans_id);
 	dict_connection_cmd_try_flush(&cmd);
 }
@@ -517,6 +588,18 @@ cmd_rollback(struct dict_connection_cmd *cmd, const char *const *args)
 	return 0;
 }
 
+static void
+dict_connection_transaction_add_changed(struct dict_connection_transaction *trans,
+					const char *key)
+{
+	char *key_dup;
+
+	if (!array_is_created(&trans->changed_keys))
+		i_array_init(&trans->changed_keys, 4);
+	key_dup = i_strdup(key);
+	array_push_back(&trans->changed_keys, &key_dup);
+}
+
 static int cmd_set(struct dict_connection_cmd *cmd, const char *const *args)
 {
 	struct dict_connection_transaction *trans;
@@ -531,6 +614,7 @@ static int cmd_set(struct dict_connection_cmd *cmd, const char *const *args)
 		return -1;
 	event_add_str(cmd->event, "user", trans->ctx->set.username);
         dict_set(trans->ctx, args[1], args[2]);
+	dict_connection_transaction_add_changed(trans, args[1]);
 	return 0;
 }
 
@@ -547,6 +631,7 @@ static int cmd_unset(struct dict_connection_cmd *cmd, const char *const *args)
 	if (dict_connection_transaction_lookup_parse(cmd->conn, args[0], &trans) < 0)
 		return -1;
         dict_unset(trans->ctx, args[1]);
+	dict_connection_transaction_add_changed(trans, args[1]);
 	return 0;
 }
 
@@ -567,6 +652,7 @@ cmd_atomic_inc(struct dict_connection_cmd *cmd, const char *const *args)
 		return -1;
 
         dict_atomic_inc(trans->ctx, args[1], diff);
+	dict_connection_transaction_add_changed(trans, args[1]);
 	return 0;
 }
 
@@ -595,8 +681,16 @@ static int cmd_timestamp(struct dict_connection_cmd *cmd, const char *const *arg
 	return 0;
 }
 
+static int
+cmd_watch(struct dict_connection_cmd *cmd, const char *const *args ATTR_UNUSED)
+{
+	cmd->conn->watch_changes = TRUE;
+	return 0;
+}
+
 static const struct dict_cmd_func cmds[] = {
 	{ DICT_PROTOCOL_CMD_LOOKUP, cmd_lookup },
+	{ DICT_PROTOCOL_CMD_LOOKUP_MULTI, cmd_lookup_multi },
 	{ DICT_PROTOCOL_CMD_ITERATE, cmd_iterate },
 	{ DICT_PROTOCOL_CMD_BEGIN, cmd_begin },
 	{ DICT_PROTOCOL_CMD_COMMIT, cmd_commit },
@@ -605,6 +699,7 @@ static const struct dict_cmd_func cmds[] = {
 	{ DICT_PROTOCOL_CMD_UNSET, cmd_unset },
 	{ DICT_PROTOCOL_CMD_ATOMIC_INC, cmd_atomic_inc },
 	{ DICT_PROTOCOL_CMD_TIMESTAMP, cmd_timestamp },
+	{ DICT_PROTOCOL_CMD_WATCH, cmd_watch },
 
 	{ 0, NULL }
 };
@@ -6,6 +6,7 @@
 #include "istream.h"
 #include "ostream.h"
 #include "llist.h"
+#include "str.h"
 #include "strescape.h"
 #include "master-service.h"
 #include "dict-client.h"
@@ -17,6 +18,9 @@
 #include <unistd.h>
 
 #define DICT_CONN_MAX_PENDING_COMMANDS 1000
+/* Drop change notifications to a watching connection if its output buffer
+   has more than this many bytes. */
+#define DICT_CONN_WATCH_MAX_BUFFER_SIZE (64*1024)
 
 static int dict_connection_dict_init(struct dict_connection *conn);
 static void dict_connection_destroy(struct connection *_conn);
@@ -56,6 +60,14 @@ static int dict_connection_handshake_args(struct connection *_conn,
 	if (dict_connection_dict_init(conn) < 0)
 		return -1;
 
+	/* clients with v4.1+ know to expect the version announcement and
+	   use it to decide which commands can be sent */
+	if (conn->conn.minor_version >= 1) {
+		o_stream_nsend_str(conn->conn.output, t_strdup_printf(
+			"%c%u\t%u\n", DICT_PROTOCOL_REPLY_VERSION,
+			DICT_CLIENT_PROTOCOL_MAJOR_VERSION,
+			DICT_CLIENT_PROTOCOL_MINOR_VERSION));
+	}
 	return 1;
 }
 
@@ -105,6 +117,14 @@ static int dict_connection_dict_init(struct dict_connection *conn)
 	return 0;
 }
 
+static void dict_connection_send_changed_all(struct dict_connection *conn)
+{
+	/* empty key tells the client that anything may have changed */
+	conn->watch_overflow = FALSE;
+	o_stream_nsend_str(conn->conn.output, t_strdup_printf(
+		"%c\t\n", DICT_PROTOCOL_REPLY_CHANGED));
+}
+
 static int dict_connection_output(struct connection *_conn)
 {
 	struct dict_connection *conn = container_of(_conn, struct dict_connection, conn);
@@ -114,6 +134,8 @@ static int dict_connection_output(struct connection *_conn)
 		dict_connection_destroy(&conn->conn);
 		return 1;
 	}
+	if (ret > 0 && conn->watch_overflow)
+		dict_connection_send_changed_all(conn);
 	if (ret > 0)
 		dict_connection_cmds_output_more(conn);
 	return ret;
@@ -158,8 +180,10 @@ bool dict_connection_unref(struct dict_connection *conn)
 	/* we should have only transactions that haven't been committed or
 	   rollbacked yet. close those before dict is deinitialized. */
 	if (array_is_created(&conn->transactions)) {
-		array_foreach_modifiable(&conn->transactions, transaction)
+		array_foreach_modifiable(&conn->transactions, transaction) {
 			dict_transaction_rollback(&transaction->ctx);
+			dict_connection_transaction_free(transaction);
+		}
 	}
 
 	if (conn->dict != NULL)
@@ -179,6 +203,66 @@ bool dict_connection_unref(struct dict_connection *conn)
 	return FALSE;
 }
 
+void dict_connection_transaction_free(struct dict_connection_transaction *trans)
+{
+	char *key;
+
+	if (array_is_created(&trans->changed_keys)) {
+		array_foreach_elem(&trans->changed_keys, key)
+			i_free(key);
+		array_free(&trans->changed_keys);
+	}
+	i_free(trans->username);
+}
+
+void dict_connection_transaction_notify_changes(
+	struct dict_connection_transaction *trans)
+{
+	struct dict_connection *conn = trans->conn;
+	struct connection *_conn;
+	char *key;
+	string_t *str;
+	size_t used;
+
+	if (!array_is_created(&trans->changed_keys))
+		return;
+
+	str = t_str_new(128);
+	array_foreach_elem(&trans->changed_keys, key) {
+		str_append_c(str, DICT_PROTOCOL_REPLY_CHANGED);
+		if (key[0] == DICT_PATH_PRIVATE[0] && trans->username != NULL)
+			str_append_tabescaped(str, trans->username);
+		str_append_c(str, '\t');
+		str_append_tabescaped(str, key);
+		str_append_c(str, '\n');
+	}
+
+	for (_conn = dict_connections->connections; _conn != NULL;
+	     _conn = _conn->next) {
+		struct dict_connection *watch_conn =
+			container_of(_conn, struct dict_connection, conn);
+
+		if (watch_conn == conn || !watch_conn->watch_changes ||
+		    watch_conn->destroyed ||
+		    strcmp(watch_conn->name, conn->name) != 0)
+			continue;
+		used = o_stream_get_buffer_used_size(watch_conn->conn.output);
+		if (watch_conn->watch_overflow ||
+		    used + str_len(str) > DICT_CONN_WATCH_MAX_BUFFER_SIZE) {
+			/* Don't let a slow client grow the memory usage.
+			   Drop the notifications and tell the client to
+			   forget everything once there's space again. */
+			if (used < DICT_CONN_WATCH_MAX_BUFFER_SIZE/2)
+				dict_connection_send_changed_all(watch_conn);
+			else
+				watch_conn->watch_overflow = TRUE;
+			continue;
+		}
+		o_stream_nsend(watch_conn->conn.output,
+			       str_data(str), str_len(str));
+	}
+}
+
 static int dict_connection_input_line(struct connection *_conn, const char *line)
 {
 	struct dict_connection *conn =
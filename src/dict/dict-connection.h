@@ -8,6 +8,10 @@ struct dict_connection_transaction {
 	unsigned int id;
 	struct dict_connection *conn;
 	struct dict_transaction_context *ctx;
+
+	/* Changed keys are sent to watching connections after commit */
+	char *username;
+	ARRAY(char *) changed_keys;
 };
 
 struct dict_connection {
@@ -30,6 +34,11 @@ struct dict_connection {
 
 	bool iter_flush_pending;
 	bool destroyed;
+	/* Client wants to know about changes done by other connections */
+	bool watch_changes;
+	/* Change notifications were dropped because the output buffer was
+	   full. The client is told to forget everything when it's flushed. */
+	bool watch_overflow;
 };
 
 struct master_service_connection;
@@ -41,6 +50,12 @@ void dict_connection_ref(struct dict_connection *conn);
 bool dict_connection_unref(struct dict_connection *conn);
 void dict_connection_unref_safe(struct dict_connection *conn);
 
+void dict_connection_transaction_free(struct dict_connection_transaction *trans);
+/* Notify other connections watching the same dict about the keys changed
+   by the committed transaction. */
+void dict_connection_transaction_notify_changes(
+	struct dict_connection_transaction *trans);
+
 unsigned int dict_connections_current_count(void);
 void dict_connections_init(void);
 void dict_connections_destroy_all(void);
@@ -316,8 +316,9 @@ static bool director_request_continue_real(struct director_request *request)
 			e_debug(request->event, "waiting for sync for adding");
 			return FALSE;
 		}
-		host = mail_host_get_by_hash(dir->mail_hosts,
-					     request->username_hash, tag);
+		host = mail_host_get_by_hash_bounded(dir->mail_hosts,
+						     request->username_hash,
+						     tag, NULL);
 		if (host == NULL) {
 			/* all hosts have been removed */
 			request->delay_reason = REQUEST_DELAY_NOHOSTS;
@@ -17,6 +17,7 @@ struct director_settings {
 	unsigned int director_user_kick_delay;
 	unsigned int director_max_parallel_moves;
 	unsigned int director_max_parallel_kicks;
+	unsigned int director_max_load_percentage;
 	uoff_t director_output_buffer_size;
 };
 
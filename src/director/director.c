@@ -1455,6 +1455,8 @@ director_init(const struct director_settings *set,
 	i_array_init(&dir->connections, 8);
 	dir->mail_hosts = mail_hosts_init(dir, set->director_user_expire,
 					  director_user_freed);
+	mail_hosts_set_max_load_percentage(dir->mail_hosts,
+					   set->director_max_load_percentage);
 
 	dir->anvil = anvil_client_init(DIRECTOR_ANVIL_SOCKET_PATH, NULL, 0);
 	if (anvil_client_connect(dir->anvil, FALSE) < 0)
@@ -712,7 +712,8 @@ doveadm_cmd_user_lookup(struct doveadm_connection *conn,
 	}
 
 	/* get host if it wasn't in user directory */
-	host = mail_host_get_by_hash(conn->dir->mail_hosts, username_hash, tag);
+	host = mail_host_get_by_hash_bounded(conn->dir->mail_hosts,
+					     username_hash, tag, user);
 	if (host == NULL)
 		str_append(str, "\t");
 	else
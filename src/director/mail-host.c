@@ -18,6 +18,9 @@ struct mail_host_list {
 	user_free_hook_t *user_free_hook;
 	unsigned int hosts_hash;
 	unsigned int user_expire_secs;
+	/* 0 = unbounded, otherwise max. host load in percents of its fair
+	   share of the users */
+	unsigned int max_load_percentage;
 	bool vhosts_unsorted;
 	bool have_vhosts;
 };
@@ -406,38 +409,138 @@ mail_host_lookup(struct mail_host_list *list, const struct ip_addr *ip)
 	return NULL;
 }
 
+static bool mail_host_is_in_ring(const struct mail_host *host)
+{
+	return !host->down && host->vhost_count > 0;
+}
+
+static unsigned int
+mail_host_get_load_user_count(const struct mail_host *host,
+			      const struct user *user)
+{
+	/* don't count the user being assigned against its own host */
+	return user != NULL && user->host == host ?
+		host->user_count - 1 : host->user_count;
+}
+
+static uint64_t
+mail_tag_get_load_user_count(struct mail_host_list *list,
+			     const struct mail_tag *tag,
+			     const struct user *user)
+{
+	struct mail_host *host;
+	uint64_t total_users = 0;
+
+	array_foreach_elem(&list->hosts, host) {
+		if (host->tag == tag && mail_host_is_in_ring(host))
+			total_users += mail_host_get_load_user_count(host, user);
+	}
+	return total_users;
+}
+
+static unsigned int
+mail_host_get_max_users(struct mail_host_list *list, struct mail_tag *tag,
+			const struct mail_host *host, uint64_t total_users)
+{
+	uint64_t max_users;
+
+	/* The host is allowed to have its share of the users (based on its
+	   vhost_count) multiplied by the load factor. Count the user being
+	   assigned also, so that there's always at least one host below the
+	   limit. */
+	max_users = (total_users + 1) * host->vhost_count *
+		list->max_load_percentage;
+	max_users = (max_users + array_count(&tag->vhosts) * 100 - 1) /
+		(array_count(&tag->vhosts) * 100);
+	return max_users > UINT_MAX ? UINT_MAX : (unsigned int)max_users;
+}
+
 static struct mail_host *
-mail_host_get_by_hash_ring(struct mail_tag *tag, unsigned int hash)
+mail_host_get_by_hash_ring_bounded(struct mail_host_list *list,
+				   struct mail_tag *tag, unsigned int idx,
+				   const struct user *user)
 {
 	const struct mail_vhost *vhosts;
-	unsigned int count, idx;
+	struct mail_host *prev_host = NULL;
+	unsigned int i, count;
+	uint64_t total_users;
 
+	/* Consistent hashing with bounded loads: continue walking the ring
+	   clockwise until a host that isn't already full is found. */
+	total_users = mail_tag_get_load_user_count(list, tag, user);
 	vhosts = array_get(&tag->vhosts, &count);
+	for (i = 0; i < count; i++) {
+		struct mail_host *host = vhosts[(idx + i) % count].host;
+
+		if (host == prev_host)
+			continue;
+		if (mail_host_get_load_user_count(host, user) <
+		    mail_host_get_max_users(list, tag, host, total_users))
+			return host;
+		prev_host = host;
+	}
+	/* shouldn't happen, since the limits always add up to more than the
+	   current number of users */
+	return vhosts[idx % count].host;
+}
+
+static bool
+mail_host_get_ring_idx(struct mail_tag *tag, unsigned int hash,
+		       unsigned int *idx_r)
+{
+	unsigned int count, idx;
+
+	count = array_count(&tag->vhosts);
 	(void)array_bsearch_insert_pos(&tag->vhosts, &hash,
 				       mail_vhost_hash_cmp, &idx);
 	i_assert(idx <= count);
 	if (idx == count) {
 		if (count == 0)
-			return NULL;
+			return FALSE;
 		idx = 0;
 	}
-	return vhosts[idx % count].host;
+	*idx_r = idx;
+	return TRUE;
+}
+
+static struct mail_tag *
+mail_host_get_hash_tag(struct mail_host_list *list, const char *tag_name)
+{
+	if (list->vhosts_unsorted)
+		mail_hosts_sort(list);
+	return mail_tag_find(list, tag_name);
 }
 
 struct mail_host *
 mail_host_get_by_hash(struct mail_host_list *list, unsigned int hash,
 		      const char *tag_name)
 {
+	const struct mail_vhost *vhost;
 	struct mail_tag *tag;
+	unsigned int idx;
 
-	if (list->vhosts_unsorted)
-		mail_hosts_sort(list);
-
-	tag = mail_tag_find(list, tag_name);
-	if (tag == NULL)
+	tag = mail_host_get_hash_tag(list, tag_name);
+	if (tag == NULL || !mail_host_get_ring_idx(tag, hash, &idx))
 		return NULL;
+	vhost = array_idx(&tag->vhosts, idx);
+	return vhost->host;
+}
+
+struct mail_host *
+mail_host_get_by_hash_bounded(struct mail_host_list *list, unsigned int hash,
+			      const char *tag_name, const struct user *user)
+{
+	const struct mail_vhost *vhost;
+	struct mail_tag *tag;
+	unsigned int idx;
 
-	return mail_host_get_by_hash_ring(tag, hash);
+	tag = mail_host_get_hash_tag(list, tag_name);
+	if (tag == NULL || !mail_host_get_ring_idx(tag, hash, &idx))
+		return NULL;
+	if (list->max_load_percentage != 0)
+		return mail_host_get_by_hash_ring_bounded(list, tag, idx, user);
+	vhost = array_idx(&tag->vhosts, idx);
+	return vhost->host;
 }
 
 void mail_hosts_set_synced(struct mail_host_list *list)
@@ -490,6 +593,14 @@ const ARRAY_TYPE(mail_tag) *mail_hosts_get_tags(struct mail_host_list *list)
 	return &list->tags;
 }
 
+void mail_hosts_set_max_load_percentage(struct mail_host_list *list,
+					unsigned int max_load_percentage)
+{
+	i_assert(max_load_percentage == 0 || max_load_percentage >= 100);
+
+	list->max_load_percentage = max_load_percentage;
+}
+
 struct mail_host_list *
 mail_hosts_init(struct director *dir,
 		unsigned int user_expire_secs,
@@ -543,6 +654,7 @@ struct mail_host_list *mail_hosts_dup(const struct mail_host_list *src)
 	struct mail_host *host, *dest_host;
 
 	dest = mail_hosts_init(src->dir, src->user_expire_secs, src->user_free_hook);
+	dest->max_load_percentage = src->max_load_percentage;
 	array_foreach_elem(&src->hosts, host) {
 		dest_host = mail_host_dup(dest, host);
 		array_push_back(&dest->hosts, &dest_host);
@@ -51,9 +51,20 @@ mail_host_add_hostname(struct mail_host_list *list, const char *hostname,
 		       const struct ip_addr *ip, const char *tag_name);
 struct mail_host *
 mail_host_lookup(struct mail_host_list *list, const struct ip_addr *ip);
+/* Returns the host that the given hash maps to in the consistent hashing
+   ring. This doesn't depend on the user counts, so all directors return the
+   same host. */
 struct mail_host *
 mail_host_get_by_hash(struct mail_host_list *list, unsigned int hash,
 		      const char *tag_name);
+/* Returns the host where a new user with the given hash should be assigned
+   to. If max. load percentage is set, hosts that already have more than
+   their share of the users are skipped over, so the result depends also on
+   the current user counts. If user is non-NULL, it isn't counted towards
+   its current host's load. */
+struct mail_host *
+mail_host_get_by_hash_bounded(struct mail_host_list *list, unsigned int hash,
+			      const char *tag_name, const struct user *user);
 
 int mail_hosts_parse_and_add(struct mail_host_list *list,
 			     const char *hosts_string);
@@ -72,6 +83,10 @@ const ARRAY_TYPE(mail_host) *mail_hosts_get(struct mail_host_list *list);
 bool mail_hosts_have_tags(struct mail_host_list *list);
 
 const ARRAY_TYPE(mail_tag) *mail_hosts_get_tags(struct mail_host_list *list);
+/* Limit how many users a host may get with mail_host_get_by_hash_bounded(),
+   in percents of its fair share based on vhost_count. 0 = unlimited. */
+void mail_hosts_set_max_load_percentage(struct mail_host_list *list,
+					unsigned int max_load_percentage);
 struct mail_tag *
 mail_tag_find(struct mail_host_list *list, const char *tag_name);
 struct user *
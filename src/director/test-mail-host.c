@@ -0,0 +1,193 @@
+/* Copyright (c) 2023 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "ioloop.h"
+#include "md5.h"
+#include "director.h"
+#include "mail-host.h"
+#include "test-common.h"
+
+#define USER_DIR_TIMEOUT 1000000
+#define TEST_USER_COUNT 10000
+
+static struct director test_director;
+
+static unsigned int test_username_hash(unsigned int i)
+{
+	unsigned char md5[MD5_RESULTLEN];
+	unsigned int j, hash = 0;
+
+	md5_get_digest(&i, sizeof(i), md5);
+	for (j = 0; j < sizeof(hash); j++)
+		hash = (hash << CHAR_BIT) | md5[j];
+	return hash;
+}
+
+static struct mail_host_list *
+test_mail_hosts_init(const char *hosts, unsigned int max_load_percentage)
+{
+	struct mail_host_list *list;
+
+	list = mail_hosts_init(&test_director, USER_DIR_TIMEOUT, NULL);
+	mail_hosts_set_max_load_percentage(list, max_load_percentage);
+	test_assert(mail_hosts_parse_and_add(list, hosts) == 0);
+	return list;
+}
+
+static void
+test_mail_hosts_assign(struct mail_host_list *list, unsigned int count,
+		       const char **ips_r)
+{
+	struct mail_host *host;
+	unsigned int i, hash;
+
+	for (i = 0; i < count; i++) {
+		hash = test_username_hash(i);
+		host = mail_host_get_by_hash_bounded(list, hash, "", NULL);
+		(void)user_directory_add(host->tag->users, hash, host,
+					 ioloop_time);
+		if (ips_r != NULL)
+			ips_r[i] = host->ip_str;
+	}
+}
+
+static unsigned int test_mail_hosts_max_user_count(struct mail_host_list *list)
+{
+	struct mail_host *host;
+	unsigned int max = 0;
+
+	array_foreach_elem(mail_hosts_get(list), host)
+		max = I_MAX(max, host->user_count);
+	return max;
+}
+
+static void test_mail_host_bounded_load(void)
+{
+	const unsigned int load_percentages[] = { 100, 110, 125, 200 };
+	struct mail_host_list *list;
+	struct mail_host *host;
+	struct ip_addr ip;
+	unsigned int i, max_users;
+
+	test_begin("mail host bounded load");
+	/* hide vhost count change logging */
+	test_director.event = event_create(NULL);
+	event_set_min_log_level(test_director.event, LOG_TYPE_WARNING);
+	for (i = 0; i < N_ELEMENTS(load_percentages); i++) {
+		list = test_mail_hosts_init("10.0.0.1-10.0.0.8",
+					    load_percentages[i]);
+		test_mail_hosts_assign(list, TEST_USER_COUNT, NULL);
+		max_users = (TEST_USER_COUNT / 8) * load_percentages[i] / 100;
+		test_assert_idx(test_mail_hosts_max_user_count(list) <=
+				max_users + 1, i);
+		mail_hosts_deinit(&list);
+	}
+
+	/* vhost_count is used as the host's weight */
+	list = test_mail_hosts_init("10.0.0.1-10.0.0.4", 100);
+	test_assert(net_addr2ip("10.0.0.1", &ip) == 0);
+	host = mail_host_lookup(list, &ip);
+	i_assert(host != NULL);
+	mail_host_set_vhost_count(host, 200, "");
+	test_mail_hosts_assign(list, TEST_USER_COUNT, NULL);
+	test_assert(host->user_count >= TEST_USER_COUNT * 2 / 5 - 1);
+	test_assert(host->user_count <= TEST_USER_COUNT * 2 / 5 + 1);
+	mail_hosts_deinit(&list);
+	event_unref(&test_director.event);
+	test_end();
+}
+
+static void test_mail_host_bounded_load_consistent(void)
+{
+	struct mail_host_list *list1, *list2;
+	const char **ips1, **ips2;
+	unsigned int i;
+
+	test_begin("mail host bounded load consistency");
+	/* different directors may have added the hosts in different order */
+	list1 = test_mail_hosts_init("10.0.0.1 10.0.0.2 10.0.0.3 10.0.0.4", 125);
+	list2 = test_mail_hosts_init("10.0.0.4 10.0.0.3 10.0.0.2 10.0.0.1", 125);
+	ips1 = t_new(const char *, TEST_USER_COUNT);
+	ips2 = t_new(const char *, TEST_USER_COUNT);
+	test_mail_hosts_assign(list1, TEST_USER_COUNT, ips1);
+	test_mail_hosts_assign(list2, TEST_USER_COUNT, ips2);
+	for (i = 0; i < TEST_USER_COUNT; i++)
+		test_assert_idx(strcmp(ips1[i], ips2[i]) == 0, i);
+	mail_hosts_deinit(&list1);
+	mail_hosts_deinit(&list2);
+	test_end();
+}
+
+static void test_mail_host_add_moves_few_users(void)
+{
+	struct mail_host_list *list1, *list2;
+	const char **ips1, **ips2;
+	unsigned int i, moved = 0;
+
+	test_begin("mail host add moves few users");
+	list1 = test_mail_hosts_init("10.0.0.1-10.0.0.4", 125);
+	list2 = test_mail_hosts_init("10.0.0.1-10.0.0.5", 125);
+	ips1 = t_new(const char *, TEST_USER_COUNT);
+	ips2 = t_new(const char *, TEST_USER_COUNT);
+	test_mail_hosts_assign(list1, TEST_USER_COUNT, ips1);
+	test_mail_hosts_assign(list2, TEST_USER_COUNT, ips2);
+	for (i = 0; i < TEST_USER_COUNT; i++) {
+		if (strcmp(ips1[i], ips2[i]) != 0)
+			moved++;
+	}
+	/* ideally 1/5 of the users move to the new host. allow some slack
+	   for the users that the load bound redirects. */
+	test_assert(moved > TEST_USER_COUNT / 10);
+	test_assert(moved < TEST_USER_COUNT * 3 / 10);
+	mail_hosts_deinit(&list1);
+	mail_hosts_deinit(&list2);
+	test_end();
+}
+
+static void test_mail_host_bounded_load_existing_user(void)
+{
+	struct mail_host_list *list;
+	struct mail_host *ring_host;
+	struct user *user;
+	unsigned int i, hash, full_count = 0;
+
+	test_begin("mail host bounded load doesn't count the user itself");
+	/* with one user less than a multiple of the host count, all but one
+	   host end up exactly at their limit */
+	list = test_mail_hosts_init("10.0.0.1-10.0.0.4", 100);
+	test_mail_hosts_assign(list, TEST_USER_COUNT - 1, NULL);
+	for (i = 0; i < TEST_USER_COUNT - 1; i++) {
+		hash = test_username_hash(i);
+		ring_host = mail_host_get_by_hash(list, hash, "");
+		user = user_directory_lookup(ring_host->tag->users, hash);
+		if (user == NULL || user->host != ring_host)
+			continue;
+		/* a user in its consistent hashing host must not see its
+		   own host as full because of itself */
+		test_assert_idx(mail_host_get_by_hash_bounded(list, hash, "",
+							      user) == ring_host, i);
+		if (mail_host_get_by_hash_bounded(list, hash, "",
+						  NULL) != ring_host)
+			full_count++;
+	}
+	/* without excluding the user, hosts at their limit look full */
+	test_assert(full_count > 0);
+	mail_hosts_deinit(&list);
+	test_end();
+}
+
+int main(void)
+{
+	static void (*const test_functions[])(void) = {
+		test_mail_host_bounded_load,
+		test_mail_host_bounded_load_consistent,
+		test_mail_host_add_moves_few_users,
+		test_mail_host_bounded_load_existing_user,
+		NULL
+	};
+	struct ioloop *ioloop = io_loop_create();
+	int ret = test_run(test_functions);
+	io_loop_destroy(&ioloop);
+	return ret;
+}
@@ -83,6 +83,7 @@ static const struct setting_define doveadm_setting_defines[] = {
 	DEF(STR, doveadm_api_key),
 	DEF(STR, dsync_features),
 	DEF(UINT, dsync_commit_msgs_interval),
+	DEF(UINT, dsync_mailbox_concurrency),
 	DEF(STR, doveadm_http_rawlog_dir),
 	DEF(STR, dsync_hashed_headers),
 
@@ -112,6 +113,7 @@ const struct doveadm_settings doveadm_default_settings = {
 	.dsync_features = "",
 	.dsync_hashed_headers = "Date Message-ID",
 	.dsync_commit_msgs_interval = 100,
+	.dsync_mailbox_concurrency = 1,
 	.director_username_hash = "%Lu",
 	.doveadm_api_key = "",
 	.doveadm_http_rawlog_dir = "",
@@ -0,0 +1,255 @@
+/* Copyright (c) 2023 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "dsync-ibc.h"
+#include "dsync-brain-private.h"
+
+static void
+dsync_brain_box_channel_save(struct dsync_brain *brain,
+			     struct dsync_brain_box_channel *channel)
+{
+	channel->pre_box_state = brain->pre_box_state;
+	channel->box_recv_state = brain->box_recv_state;
+	channel->box_send_state = brain->box_send_state;
+	channel->log_scan = brain->log_scan;
+	channel->box_importer = brain->box_importer;
+	channel->box_exporter = brain->box_exporter;
+	channel->box = brain->box;
+	channel->box_lock = brain->box_lock;
+	channel->local_dsync_box = brain->local_dsync_box;
+	channel->remote_dsync_box = brain->remote_dsync_box;
+	channel->dsync_box_pool = brain->dsync_box_pool;
+	channel->mailbox_state = brain->mailbox_state;
+}
+
+static void
+dsync_brain_box_channel_load(struct dsync_brain *brain,
+			     const struct dsync_brain_box_channel *channel)
+{
+	brain->pre_box_state = channel->pre_box_state;
+	brain->box_recv_state = channel->box_recv_state;
+	brain->box_send_state = channel->box_send_state;
+	brain->log_scan = channel->log_scan;
+	brain->box_importer = channel->box_importer;
+	brain->box_exporter = channel->box_exporter;
+	brain->box = channel->box;
+	brain->box_lock = channel->box_lock;
+	brain->local_dsync_box = channel->local_dsync_box;
+	brain->remote_dsync_box = channel->remote_dsync_box;
+	brain->dsync_box_pool = channel->dsync_box_pool;
+	brain->mailbox_state = channel->mailbox_state;
+}
+
+static void
+dsync_brain_box_channel_switch(struct dsync_brain *brain,
+			       struct dsync_brain_box_channel *channel)
+{
+	if (brain->cur_box_channel != channel) {
+		if (brain->cur_box_channel != NULL) {
+			dsync_brain_box_channel_save(brain,
+						     brain->cur_box_channel);
+		}
+		dsync_brain_box_channel_load(brain, channel);
+		brain->cur_box_channel = channel;
+	}
+	dsync_ibc_set_send_channel(brain->ibc, channel->id);
+}
+
+static struct dsync_brain_box_channel *
+dsync_brain_box_channel_find(struct dsync_brain *brain, unsigned int id)
+{
+	struct dsync_brain_box_channel *channel;
+
+	array_foreach_elem(&brain->box_channels, channel) {
+		if (channel->id == id)
+			return channel;
+	}
+	return NULL;
+}
+
+static struct dsync_brain_box_channel *
+dsync_brain_box_channel_add(struct dsync_brain *brain, unsigned int id)
+{
+	struct dsync_brain_box_channel *channel;
+
+	channel = i_new(struct dsync_brain_box_channel, 1);
+	channel->id = id;
+	channel->pre_box_state = brain->state;
+	array_push_back(&brain->box_channels, &channel);
+	return channel;
+}
+
+static void
+dsync_brain_box_channel_free(struct dsync_brain *brain,
+			     struct dsync_brain_box_channel *channel)
+{
+	struct dsync_brain_box_channel *const *channels;
+	unsigned int i, count;
+
+	i_assert(brain->cur_box_channel == channel);
+	i_assert(brain->box == NULL);
+
+	pool_unref(&brain->dsync_box_pool);
+	brain->cur_box_channel = NULL;
+
+	channels = array_get(&brain->box_channels, &count);
+	for (i = 0; i < count; i++) {
+		if (channels[i] == channel) {
+			array_delete(&brain->box_channels, i, 1);
+			break;
+		}
+	}
+	i_free(channel);
+}
+
+static void
+dsync_brain_box_channel_step_finish(struct dsync_brain *brain,
+				    enum dsync_state base_state)
+{
+	/* the mailbox sync functions switch between DSYNC_STATE_SYNC_MAILS
+	   and the base state as if there was only a single mailbox */
+	if (brain->state == DSYNC_STATE_SYNC_MAILS)
+		brain->state = base_state;
+	if (brain->box == NULL) {
+		/* finished (or skipped) this channel's mailbox */
+		dsync_brain_box_channel_free(brain, brain->cur_box_channel);
+	}
+}
+
+static bool
+dsync_brain_box_channels_recv(struct dsync_brain *brain,
+			      enum dsync_state base_state)
+{
+	struct dsync_brain_box_channel *channel;
+	unsigned int id;
+	bool changed;
+
+	if (dsync_ibc_recv_channel(brain->ibc, &id) != DSYNC_IBC_RECV_RET_OK)
+		return FALSE;
+
+	channel = dsync_brain_box_channel_find(brain, id);
+	if (channel != NULL) {
+		dsync_brain_box_channel_switch(brain, channel);
+		changed = dsync_brain_sync_mails_recv(brain);
+	} else if (brain->master_brain) {
+		i_error("Remote sent input for unknown mailbox channel %u", id);
+		brain->failed = TRUE;
+		return TRUE;
+	} else {
+		/* master started syncing a new mailbox (or sent the
+		   end of mailbox list) */
+		channel = dsync_brain_box_channel_add(brain, id);
+		dsync_brain_box_channel_switch(brain, channel);
+		changed = dsync_brain_slave_recv_mailbox(brain);
+	}
+	dsync_brain_box_channel_step_finish(brain, base_state);
+	return changed;
+}
+
+static bool dsync_brain_box_channels_send(struct dsync_brain *brain)
+{
+	struct dsync_brain_box_channel *const *channels;
+	unsigned int i, count;
+	bool changed = FALSE;
+
+	/* rotate the starting channel, so mailboxes with a lot of mails
+	   don't keep the others from sending anything */
+	channels = array_get(&brain->box_channels, &count);
+	for (i = 0; i < count && !brain->failed; i++) {
+		if (dsync_ibc_is_send_queue_full(brain->ibc))
+			break;
+		dsync_brain_box_channel_switch(brain,
+			channels[(brain->box_channel_send_idx + i) % count]);
+		if (dsync_brain_sync_mails_send(brain))
+			changed = TRUE;
+	}
+	brain->box_channel_send_idx++;
+	return changed;
+}
+
+static bool
+dsync_brain_box_channels_open(struct dsync_brain *brain,
+			      enum dsync_state base_state)
+{
+	struct dsync_brain_box_channel *channel;
+	bool changed = FALSE;
+
+	i_assert(brain->master_brain);
+
+	while (!brain->box_channels_eof && !brain->failed &&
+	       array_count(&brain->box_channels) < brain->mailbox_concurrency &&
+	       !dsync_ibc_is_send_queue_full(brain->ibc)) {
+		channel = dsync_brain_box_channel_add(brain,
+					++brain->box_channel_last_id);
+		dsync_brain_box_channel_switch(brain, channel);
+		if (!dsync_brain_master_send_next_mailbox(brain)) {
+			dsync_brain_box_channel_free(brain, channel);
+			brain->box_channels_eof = TRUE;
+			break;
+		}
+		dsync_brain_box_channel_step_finish(brain, base_state);
+		changed = TRUE;
+	}
+
+	if (brain->box_channels_eof && !brain->failed &&
+	    array_count(&brain->box_channels) == 0) {
+		/* all mailboxes are synced */
+		dsync_ibc_set_send_channel(brain->ibc, 0);
+		dsync_ibc_send_end_of_list(brain->ibc, DSYNC_IBC_EOL_MAILBOX);
+		brain->state = DSYNC_STATE_FINISH;
+		changed = TRUE;
+	}
+	return changed;
+}
+
+void dsync_brain_box_channels_init(struct dsync_brain *brain)
+{
+	i_assert(brain->mailbox_concurrency > 1);
+
+	i_array_init(&brain->box_channels, brain->mailbox_concurrency);
+	if (brain->debug) {
+		i_debug("brain %c: Syncing up to %u mailboxes concurrently",
+			brain->master_brain ? 'M' : 'S',
+			brain->mailbox_concurrency);
+	}
+}
+
+void dsync_brain_box_channels_deinit(struct dsync_brain *brain)
+{
+	struct dsync_brain_box_channel *channel;
+
+	if (!array_is_created(&brain->box_channels))
+		return;
+
+	while (array_count(&brain->box_channels) > 0) {
+		channel = array_idx_elem(&brain->box_channels, 0);
+		dsync_brain_box_channel_switch(brain, channel);
+		if (brain->box != NULL)
+			dsync_brain_sync_mailbox_deinit(brain);
+		dsync_brain_box_channel_free(brain, channel);
+	}
+	array_free(&brain->box_channels);
+}
+
+bool dsync_brain_sync_box_channels(struct dsync_brain *brain)
+{
+	enum dsync_state base_state = brain->state;
+	bool changed = FALSE;
+
+	i_assert(base_state == DSYNC_STATE_MASTER_SEND_MAILBOX ||
+		 base_state == DSYNC_STATE_SLAVE_RECV_MAILBOX);
+
+	if (dsync_brain_box_channels_recv(brain, base_state))
+		changed = TRUE;
+	if (brain->state != base_state || brain->failed)
+		return TRUE;
+
+	if (dsync_brain_box_channels_send(brain))
+		changed = TRUE;
+	if (brain->master_brain) {
+		if (dsync_brain_box_channels_open(brain, base_state))
+			changed = TRUE;
+	}
+	return changed;
+}
@@ -225,6 +225,7 @@ dsync_brain_sync_mailbox_init_remote(struct dsync_brain *brain,
 
 	brain->box_importer = brain->backup_send ? NULL :
 		dsync_mailbox_import_init(brain->box, brain->virtual_all_box,
+					  brain->mail_guid_cache,
 					  brain->log_scan,
 					  last_common_uid, last_common_modseq,
 					  last_common_pvt_modseq,
@@ -577,7 +578,7 @@ dsync_brain_next_mailbox(struct dsync_brain *brain, struct mailbox **box_r,
 	return ret > 0;
 }
 
-void dsync_brain_master_send_mailbox(struct dsync_brain *brain)
+bool dsync_brain_master_send_next_mailbox(struct dsync_brain *brain)
 {
 	struct dsync_mailbox dsync_box;
 	struct mailbox *box;
@@ -586,16 +587,22 @@ void dsync_brain_master_send_mailbox(struct dsync_brain *brain)
 	i_assert(brain->master_brain);
 	i_assert(brain->box == NULL);
 
-	if (!dsync_brain_next_mailbox(brain, &box, &lock, &dsync_box)) {
-		brain->state = DSYNC_STATE_FINISH;
-		dsync_ibc_send_end_of_list(brain->ibc, DSYNC_IBC_EOL_MAILBOX);
-		return;
-	}
+	if (!dsync_brain_next_mailbox(brain, &box, &lock, &dsync_box))
+		return FALSE;
 
 	/* start exporting this mailbox (wait for remote to start importing) */
 	dsync_ibc_send_mailbox(brain->ibc, &dsync_box);
 	dsync_brain_sync_mailbox_init(brain, box, lock, &dsync_box, TRUE);
 	brain->state = DSYNC_STATE_SYNC_MAILS;
+	return TRUE;
+}
+
+void dsync_brain_master_send_mailbox(struct dsync_brain *brain)
+{
+	if (!dsync_brain_master_send_next_mailbox(brain)) {
+		brain->state = DSYNC_STATE_FINISH;
+		dsync_ibc_send_end_of_list(brain->ibc, DSYNC_IBC_EOL_MAILBOX);
+	}
 }
 
 bool dsync_boxes_need_sync(struct dsync_brain *brain,
@@ -378,7 +378,7 @@ static bool dsync_brain_recv_last_common(struct dsync_brain *brain)
 	return TRUE;
 }
 
-bool dsync_brain_sync_mails(struct dsync_brain *brain)
+bool dsync_brain_sync_mails_recv(struct dsync_brain *brain)
 {
 	bool changed = FALSE;
 
@@ -406,6 +406,12 @@ bool dsync_brain_sync_mails(struct dsync_brain *brain)
 	case DSYNC_BOX_STATE_DONE:
 		break;
 	}
+	return changed;
+}
+
+bool dsync_brain_sync_mails_send(struct dsync_brain *brain)
+{
+	bool changed = FALSE;
 
 	if (!dsync_ibc_is_send_queue_full(brain->ibc) && !brain->failed) {
 		switch (brain->box_send_state) {
@@ -436,3 +442,13 @@ bool dsync_brain_sync_mails(struct dsync_brain *brain)
 	}
 	return changed;
 }
+
+bool dsync_brain_sync_mails(struct dsync_brain *brain)
+{
+	bool changed;
+
+	changed = dsync_brain_sync_mails_recv(brain);
+	if (dsync_brain_sync_mails_send(brain))
+		changed = TRUE;
+	return changed;
+}
@@ -11,6 +11,7 @@
 #define DSYNC_MAILBOX_DEFAULT_LOCK_TIMEOUT_SECS 30
 
 struct dsync_mailbox_tree_sync_change;
+struct dsync_mail_guid_cache;
 
 enum dsync_state {
 	DSYNC_STATE_MASTER_RECV_HANDSHAKE,
@@ -48,6 +49,25 @@ enum dsync_box_state {
 	DSYNC_BOX_STATE_DONE
 };
 
+/* Mailbox that is being synced in its own ibc channel. While the channel
+   isn't the brain's current channel, it holds the brain's per-mailbox
+   fields. */
+struct dsync_brain_box_channel {
+	unsigned int id;
+
+	enum dsync_state pre_box_state;
+	enum dsync_box_state box_recv_state;
+	enum dsync_box_state box_send_state;
+	struct dsync_transaction_log_scan *log_scan;
+	struct dsync_mailbox_importer *box_importer;
+	struct dsync_mailbox_exporter *box_exporter;
+	struct mailbox *box;
+	struct file_lock *box_lock;
+	struct dsync_mailbox local_dsync_box, remote_dsync_box;
+	pool_t dsync_box_pool;
+	struct dsync_mailbox_state mailbox_state;
+};
+
 struct dsync_brain {
 	pool_t pool;
 	struct mail_user *user;
@@ -56,6 +76,9 @@ struct dsync_brain {
 	ARRAY(struct mail_namespace *) sync_namespaces;
 	const char *sync_box;
 	struct mailbox *virtual_all_box;
+	/* GUIDs of mails seen locally, for copying them between mailboxes
+	   instead of requesting them from remote */
+	struct dsync_mail_guid_cache *mail_guid_cache;
 	guid_128_t sync_box_guid;
 	const char *const *exclude_mailboxes;
 	enum dsync_brain_sync_type sync_type;
@@ -103,6 +126,16 @@ struct dsync_brain {
 	/* new states for synced mailboxes */
 	ARRAY_TYPE(dsync_mailbox_state) remote_mailbox_states;
 
+	/* Number of mailboxes to sync concurrently. If it's 1, channels
+	   aren't used and the mailboxes are synced one at a time. */
+	unsigned int mailbox_concurrency;
+	/* mailboxes currently being synced */
+	ARRAY(struct dsync_brain_box_channel *) box_channels;
+	/* channel whose mailbox is in the brain's per-mailbox fields */
+	struct dsync_brain_box_channel *cur_box_channel;
+	unsigned int box_channel_last_id;
+	unsigned int box_channel_send_idx;
+
 	const char *changes_during_sync;
 	enum mail_error mail_error;
 
@@ -124,6 +157,8 @@ struct dsync_brain {
 	bool no_notify:1;
 	bool failed:1;
 	bool empty_hdr_workaround:1;
+	/* master: no more mailboxes to add to channels */
+	bool box_channels_eof:1;
 };
 
 extern const char *dsync_box_state_names[DSYNC_BOX_STATE_DONE+1];
@@ -154,10 +189,20 @@ void dsync_brain_sync_init_box_states(struct dsync_brain *brain);
 void dsync_brain_set_changes_during_sync(struct dsync_brain *brain,
 					 const char *reason);
 
+bool dsync_brain_master_send_next_mailbox(struct dsync_brain *brain);
 void dsync_brain_master_send_mailbox(struct dsync_brain *brain);
 bool dsync_brain_slave_recv_mailbox(struct dsync_brain *brain);
 int dsync_brain_sync_mailbox_open(struct dsync_brain *brain,
 				  const struct dsync_mailbox *remote_dsync_box);
+bool dsync_brain_sync_mails_recv(struct dsync_brain *brain);
+bool dsync_brain_sync_mails_send(struct dsync_brain *brain);
 bool dsync_brain_sync_mails(struct dsync_brain *brain);
 
+void dsync_brain_box_channels_init(struct dsync_brain *brain);
+void dsync_brain_box_channels_deinit(struct dsync_brain *brain);
+/* Sync mailboxes concurrently in separate channels. Used instead of
+   DSYNC_STATE_MASTER_SEND_MAILBOX, DSYNC_STATE_SLAVE_RECV_MAILBOX and
+   DSYNC_STATE_SYNC_MAILS when mailbox_concurrency > 1. */
+bool dsync_brain_sync_box_channels(struct dsync_brain *brain);
+
 #endif
@@ -14,6 +14,7 @@
 #include "dsync-mailbox-tree.h"
 #include "dsync-ibc.h"
 #include "dsync-brain-private.h"
+#include "dsync-mail-guid-cache.h"
 #include "dsync-mailbox-import.h"
 #include "dsync-mailbox-export.h"
 
@@ -141,6 +142,8 @@ dsync_brain_common_init(struct mail_user *user, struct dsync_ibc *ibc)
 	brain->ibc = ibc;
 	brain->sync_type = DSYNC_BRAIN_SYNC_TYPE_UNKNOWN;
 	brain->lock_fd = -1;
+	brain->mailbox_concurrency = 1;
+	brain->mail_guid_cache = dsync_mail_guid_cache_init();
 	brain->verbose_proctitle = service_set->verbose_proctitle;
 	hash_table_create(&brain->mailbox_states, pool, 0,
 			  guid_128_hash, guid_128_cmp);
@@ -228,6 +231,8 @@ dsync_brain_master_init(struct mail_user *user, struct dsync_ibc *ibc,
 		brain->mailbox_lock_timeout_secs =
 			DSYNC_MAILBOX_DEFAULT_LOCK_TIMEOUT_SECS;
 	brain->import_commit_msgs_interval = set->import_commit_msgs_interval;
+	if (set->mailbox_concurrency > 1)
+		brain->mailbox_concurrency = set->mailbox_concurrency;
 	brain->master_brain = TRUE;
 	brain->hashed_headers =
 		(const char*const*)p_strarray_dup(brain->pool, set->hashed_headers);
@@ -271,6 +276,7 @@ dsync_brain_master_init(struct mail_user *user, struct dsync_ibc *ibc,
 	ibc_set.hdr_hash_v2 = TRUE;
 	ibc_set.lock_timeout = set->lock_timeout_secs;
 	ibc_set.import_commit_msgs_interval = set->import_commit_msgs_interval;
+	ibc_set.mailbox_concurrency = brain->mailbox_concurrency;
 	ibc_set.hashed_headers = set->hashed_headers;
 	/* reverse the backup direction for the slave */
 	ibc_set.brain_flags = flags & ENUM_NEGATE(DSYNC_BRAIN_FLAG_BACKUP_SEND |
@@ -362,10 +368,12 @@ int dsync_brain_deinit(struct dsync_brain **_brain, enum mail_error *error_r)
 	if (brain->purge && !brain->failed)
 		dsync_brain_purge(brain);
 
+	dsync_brain_box_channels_deinit(brain);
 	if (brain->box != NULL)
 		dsync_brain_sync_mailbox_deinit(brain);
 	if (brain->virtual_all_box != NULL)
 		mailbox_free(&brain->virtual_all_box);
+	dsync_mail_guid_cache_deinit(&brain->mail_guid_cache);
 	if (brain->local_tree_iter != NULL)
 		dsync_mailbox_tree_iter_deinit(&brain->local_tree_iter);
 	if (brain->local_mailbox_tree != NULL)
@@ -496,6 +504,13 @@ static bool dsync_brain_master_recv_handshake(struct dsync_brain *brain)
 		}
 	}
 	dsync_brain_set_hdr_hash_version(brain, ibc_set);
+	if (brain->mailbox_concurrency > 1) {
+		/* both sides use channels if the remote supports them */
+		if (!dsync_ibc_have_channels(brain->ibc))
+			brain->mailbox_concurrency = 1;
+		else
+			dsync_brain_box_channels_init(brain);
+	}
 
 	brain->state = brain->sync_type == DSYNC_BRAIN_SYNC_TYPE_STATE ?
 		DSYNC_STATE_MASTER_SEND_LAST_COMMON :
@@ -568,6 +583,11 @@ static bool dsync_brain_slave_recv_handshake(struct dsync_brain *brain)
 	/* this flag is only set on the remote slave brain */
 	brain->purge = (ibc_set->brain_flags &
 			DSYNC_BRAIN_FLAG_PURGE_REMOTE) != 0;
+	if (ibc_set->mailbox_concurrency > 1 &&
+	    dsync_ibc_have_channels(brain->ibc)) {
+		brain->mailbox_concurrency = ibc_set->mailbox_concurrency;
+		dsync_brain_box_channels_init(brain);
+	}
 
 	if (ibc_set->virtual_all_box != NULL)
 		dsync_brain_open_virtual_all_box(brain, ibc_set->virtual_all_box);
@@ -709,11 +729,18 @@ static bool dsync_brain_run_real(struct dsync_brain *brain, bool *changed_r)
 		changed = dsync_brain_recv_mailbox_tree_deletes(brain);
 		break;
 	case DSYNC_STATE_MASTER_SEND_MAILBOX:
-		dsync_brain_master_send_mailbox(brain);
-		changed = TRUE;
+		if (brain->mailbox_concurrency > 1)
+			changed = dsync_brain_sync_box_channels(brain);
+		else {
+			dsync_brain_master_send_mailbox(brain);
+			changed = TRUE;
+		}
 		break;
 	case DSYNC_STATE_SLAVE_RECV_MAILBOX:
-		changed = dsync_brain_slave_recv_mailbox(brain);
+		if (brain->mailbox_concurrency > 1)
+			changed = dsync_brain_sync_box_channels(brain);
+		else
+			changed = dsync_brain_slave_recv_mailbox(brain);
 		break;
 	case DSYNC_STATE_SYNC_MAILS:
 		changed = dsync_brain_sync_mails(brain);
@@ -83,6 +83,11 @@ struct dsync_brain_settings {
 	/* If non-zero, importing will attempt to commit transaction after
 	   saving this many messages. */
 	unsigned int import_commit_msgs_interval;
+	/* If larger than 1, sync this many mailboxes concurrently over the
+	   same connection. Each mailbox is sent in its own channel, which
+	   avoids waiting for the round trips of one mailbox at a time. Used
+	   only if the remote supports it. */
+	unsigned int mailbox_concurrency;
 	/* Input state for DSYNC_BRAIN_SYNC_TYPE_STATE */
 	const char *state;
 };
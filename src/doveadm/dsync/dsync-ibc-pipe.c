@@ -571,7 +571,10 @@ static const struct dsync_ibc_vfuncs dsync_ibc_pipe_vfuncs = {
 	dsync_ibc_pipe_recv_finish,
 	dsync_ibc_pipe_close_mail_streams,
 	dsync_ibc_pipe_is_send_queue_full,
-	dsync_ibc_pipe_has_pending_data
+	dsync_ibc_pipe_has_pending_data,
+	NULL,
+	NULL,
+	NULL
 };
 
 static struct dsync_ibc_pipe *
@@ -81,6 +81,12 @@ struct dsync_ibc_vfuncs {
 	void (*close_mail_streams)(struct dsync_ibc *ibc);
 	bool (*is_send_queue_full)(struct dsync_ibc *ibc);
 	bool (*has_pending_data)(struct dsync_ibc *ibc);
+
+	/* NULL if channels aren't supported */
+	bool (*have_channels)(struct dsync_ibc *ibc);
+	void (*set_send_channel)(struct dsync_ibc *ibc, unsigned int channel);
+	enum dsync_ibc_recv_ret
+		(*recv_channel)(struct dsync_ibc *ibc, unsigned int *channel_r);
 };
 
 struct dsync_ibc {
@@ -25,14 +25,15 @@
 #define DSYNC_IBC_STREAM_OUTBUF_THROTTLE_SIZE (1024*128)
 
 #define DSYNC_PROTOCOL_VERSION_MAJOR 3
-#define DSYNC_PROTOCOL_VERSION_MINOR 5
-#define DSYNC_HANDSHAKE_VERSION "VERSION\tdsync\t3\t5\n"
+#define DSYNC_PROTOCOL_VERSION_MINOR 6
+#define DSYNC_HANDSHAKE_VERSION "VERSION\tdsync\t3\t6\n"
 
 #define DSYNC_PROTOCOL_MINOR_HAVE_ATTRIBUTES 1
 #define DSYNC_PROTOCOL_MINOR_HAVE_SAVE_GUID 2
 #define DSYNC_PROTOCOL_MINOR_HAVE_FINISH 3
 #define DSYNC_PROTOCOL_MINOR_HAVE_HDR_HASH_V2 4
 #define DSYNC_PROTOCOL_MINOR_HAVE_HDR_HASH_V3 5
+#define DSYNC_PROTOCOL_MINOR_HAVE_CHANNELS 6
 
 enum item_type {
 	ITEM_NONE,
@@ -51,6 +52,7 @@ enum item_type {
 	ITEM_FINISH,
 
 	ITEM_MAILBOX_CACHE_FIELD,
+	ITEM_CHANNEL,
 
 	ITEM_END_OF_LIST
 };
@@ -79,7 +81,7 @@ static const struct {
 	  	"no_mail_sync no_backup_overwrite purge_remote "
 		"no_notify sync_since_timestamp sync_max_size sync_flags sync_until_timestamp "
 		"virtual_all_box empty_hdr_workaround import_commit_msgs_interval "
-		"hashed_headers alt_char"
+		"hashed_headers alt_char mailbox_concurrency"
 	},
 	{ .name = "mailbox_state",
 	  .chr = 'S',
@@ -136,6 +138,11 @@ static const struct {
 	  .required_keys = "name decision",
 	  .optional_keys = "last_used"
 	},
+	{ .name = "channel",
+	  .chr = 'K',
+	  .required_keys = "id",
+	  .min_minor_version = DSYNC_PROTOCOL_MINOR_HAVE_CHANNELS
+	},
 
 	{ "end_of_list", '\0', NULL, NULL, 0 }
 };
@@ -161,8 +168,14 @@ struct dsync_ibc_stream {
 	struct dsync_mail *cur_mail;
 	struct dsync_mailbox_attribute *cur_attr;
 	char value_output_last;
+	/* Items sent while value_output was still being sent. With mailbox
+	   channels, handling input for one mailbox may send something while
+	   another mailbox's mail body is being sent. */
+	string_t *value_output_queue;
 
 	enum item_type last_recv_item, last_sent_item;
+	/* channel of the following sent/received items */
+	unsigned int send_channel, last_sent_channel, recv_channel;
 	bool last_recv_item_eol:1;
 	bool last_sent_item_eol:1;
 
@@ -290,6 +303,11 @@ static int dsync_ibc_stream_send_value_stream(struct dsync_ibc_stream *ibc)
 	   case we're sending binary data that ends with CR. */
 	o_stream_nsend_str(ibc->output, "\r\n.\r\n");
 	i_stream_unref(&ibc->value_output);
+	if (ibc->value_output_queue != NULL) {
+		o_stream_nsend(ibc->output, str_data(ibc->value_output_queue),
+			       str_len(ibc->value_output_queue));
+		str_truncate(ibc->value_output_queue, 0);
+	}
 	return 1;
 }
 
@@ -366,6 +384,7 @@ static void dsync_ibc_stream_deinit(struct dsync_ibc *_ibc)
 	}
 	if (ibc->cur_decoder != NULL)
 		dsync_deserializer_decode_finish(&ibc->cur_decoder);
+	str_free(&ibc->value_output_queue);
 	if (ibc->value_output != NULL)
 		i_stream_unref(&ibc->value_output);
 	else {
@@ -462,7 +481,15 @@ static void
 dsync_ibc_stream_send_string(struct dsync_ibc_stream *ibc,
 			     const string_t *str)
 {
-	i_assert(ibc->value_output == NULL);
+	if (ibc->value_output != NULL) {
+		/* only mailbox channels can send while a value stream is
+		   being sent. the queue is sent after the stream. */
+		i_assert(ibc->minor_version >= DSYNC_PROTOCOL_MINOR_HAVE_CHANNELS);
+		if (ibc->value_output_queue == NULL)
+			ibc->value_output_queue = str_new(default_pool, 256);
+		str_append_str(ibc->value_output_queue, str);
+		return;
+	}
 	o_stream_nsend(ibc->output, str_data(str), str_len(str));
 }
 
@@ -579,6 +606,33 @@ dsync_ibc_stream_handshake(struct dsync_ibc_stream *ibc, const char *line)
 	return FALSE;
 }
 
+static int
+dsync_ibc_stream_input_channel(struct dsync_ibc_stream *ibc, const char *line)
+{
+	struct dsync_deserializer_decoder *decoder;
+	const char *value, *error;
+	int ret = 0;
+
+	if (ibc->deserializers[ITEM_CHANNEL] == NULL) {
+		dsync_ibc_input_error(ibc, NULL,
+			"Remote sent a channel without handshaking it");
+		return -1;
+	}
+	if (dsync_deserializer_decode_begin(ibc->deserializers[ITEM_CHANNEL],
+					    line+1, &decoder, &error) < 0) {
+		dsync_ibc_input_error(ibc, NULL, "Invalid input to %s: %s",
+				      items[ITEM_CHANNEL].name, error);
+		return -1;
+	}
+	value = dsync_deserializer_decode_get(decoder, "id");
+	if (str_to_uint(value, &ibc->recv_channel) < 0) {
+		dsync_ibc_input_error(ibc, decoder, "Invalid id: %s", value);
+		ret = -1;
+	}
+	dsync_deserializer_decode_finish(&decoder);
+	return ret;
+}
+
 static enum dsync_ibc_recv_ret
 dsync_ibc_stream_input_next(struct dsync_ibc_stream *ibc, enum item_type item,
 			    struct dsync_deserializer_decoder **decoder_r)
@@ -591,10 +645,16 @@ dsync_ibc_stream_input_next(struct dsync_ibc_stream *ibc, enum item_type item,
 
 	timeout_reset(ibc->to);
 
-	do {
+	for (;;) {
 		if (dsync_ibc_stream_next_line(ibc, &line) <= 0)
 			return DSYNC_IBC_RECV_RET_TRYAGAIN;
-	} while (!dsync_ibc_stream_handshake(ibc, line));
+		if (!dsync_ibc_stream_handshake(ibc, line))
+			continue;
+		if (line[0] != items[ITEM_CHANNEL].chr)
+			break;
+		if (dsync_ibc_stream_input_channel(ibc, line) < 0)
+			return DSYNC_IBC_RECV_RET_TRYAGAIN;
+	}
 
 	ibc->last_recv_item = item;
 	ibc->last_recv_item_eol = FALSE;
@@ -639,9 +699,28 @@ dsync_ibc_stream_input_next(struct dsync_ibc_stream *ibc, enum item_type item,
 	return DSYNC_IBC_RECV_RET_OK;
 }
 
+static void dsync_ibc_stream_send_channel(struct dsync_ibc_stream *ibc)
+{
+	struct dsync_serializer_encoder *encoder;
+	string_t *str;
+
+	if (ibc->send_channel == ibc->last_sent_channel)
+		return;
+	i_assert(ibc->minor_version >= DSYNC_PROTOCOL_MINOR_HAVE_CHANNELS);
+
+	str = t_str_new(32);
+	str_append_c(str, items[ITEM_CHANNEL].chr);
+	encoder = dsync_serializer_encode_begin(ibc->serializers[ITEM_CHANNEL]);
+	dsync_serializer_encode_add(encoder, "id", dec2str(ibc->send_channel));
+	dsync_serializer_encode_finish(&encoder, str);
+	dsync_ibc_stream_send_string(ibc, str);
+	ibc->last_sent_channel = ibc->send_channel;
+}
+
 static struct dsync_serializer_encoder *
 dsync_ibc_send_encode_begin(struct dsync_ibc_stream *ibc, enum item_type item)
 {
+	dsync_ibc_stream_send_channel(ibc);
 	ibc->last_sent_item = item;
 	ibc->last_sent_item_eol = FALSE;
 	return dsync_serializer_encode_begin(ibc->serializers[item]);
@@ -759,6 +838,10 @@ dsync_ibc_stream_send_handshake(struct dsync_ibc *_ibc,
 		}
 	}
 	dsync_serializer_encode_add(encoder, "hashed_headers", str_c(str2));
+	if (set->mailbox_concurrency > 1) {
+		dsync_serializer_encode_add(encoder, "mailbox_concurrency",
+			t_strdup_printf("%u", set->mailbox_concurrency));
+	}
 	dsync_serializer_encode_finish(&encoder, str);
 	dsync_ibc_stream_send_string(ibc, str);
 }
@@ -894,6 +977,14 @@ dsync_ibc_stream_recv_handshake(struct dsync_ibc *_ibc,
 		set->brain_flags |= DSYNC_BRAIN_FLAG_EMPTY_HDR_WORKAROUND;
 	if (dsync_deserializer_decode_try(decoder, "hashed_headers", &value))
 		set->hashed_headers = (const char*const*)p_strsplit_tabescaped(pool, value);
+	if (dsync_deserializer_decode_try(decoder, "mailbox_concurrency", &value)) {
+		if (str_to_uint(value, &set->mailbox_concurrency) < 0 ||
+		    set->mailbox_concurrency == 0) {
+			dsync_ibc_input_error(ibc, decoder,
+				"Invalid mailbox_concurrency: %s", value);
+			return DSYNC_IBC_RECV_RET_TRYAGAIN;
+		}
+	}
 	set->hdr_hash_v2 = ibc->minor_version >= DSYNC_PROTOCOL_MINOR_HAVE_HDR_HASH_V2;
 	set->hdr_hash_v3 = ibc->minor_version >= DSYNC_PROTOCOL_MINOR_HAVE_HDR_HASH_V3;
 
@@ -906,8 +997,7 @@ dsync_ibc_stream_send_end_of_list(struct dsync_ibc *_ibc,
 				  enum dsync_ibc_eol_type type)
 {
 	struct dsync_ibc_stream *ibc = (struct dsync_ibc_stream *)_ibc;
-
-	i_assert(ibc->value_output == NULL);
+	string_t *str;
 
 	switch (type) {
 	case DSYNC_IBC_EOL_MAILBOX_ATTRIBUTE:
@@ -918,8 +1008,11 @@ dsync_ibc_stream_send_end_of_list(struct dsync_ibc *_ibc,
 		break;
 	}
 
+	dsync_ibc_stream_send_channel(ibc);
 	ibc->last_sent_item_eol = TRUE;
-	o_stream_nsend_str(ibc->output, END_OF_LIST_LINE"\n");
+	str = t_str_new(8);
+	str_append(str, END_OF_LIST_LINE"\n");
+	dsync_ibc_stream_send_string(ibc, str);
 }
 
 static void
@@ -2088,6 +2181,75 @@ static bool dsync_ibc_stream_has_pending_data(struct dsync_ibc *_ibc)
 	return ibc->has_pending_data;
 }
 
+static bool dsync_ibc_stream_have_channels(struct dsync_ibc *_ibc)
+{
+	struct dsync_ibc_stream *ibc = (struct dsync_ibc_stream *)_ibc;
+
+	i_assert(ibc->version_received);
+	return ibc->minor_version >= DSYNC_PROTOCOL_MINOR_HAVE_CHANNELS;
+}
+
+static void
+dsync_ibc_stream_set_send_channel(struct dsync_ibc *_ibc, unsigned int channel)
+{
+	struct dsync_ibc_stream *ibc = (struct dsync_ibc_stream *)_ibc;
+
+	ibc->send_channel = channel;
+}
+
+static enum dsync_ibc_recv_ret
+dsync_ibc_stream_recv_channel(struct dsync_ibc *_ibc, unsigned int *channel_r)
+{
+	struct dsync_ibc_stream *ibc = (struct dsync_ibc_stream *)_ibc;
+	const unsigned char *data;
+	const char *line;
+	size_t size;
+	ssize_t ret;
+
+	i_assert(ibc->handshake_received);
+
+	if (ibc->value_input != NULL || ibc->cur_mail != NULL ||
+	    ibc->cur_attr != NULL) {
+		/* still receiving the current item */
+		*channel_r = ibc->recv_channel;
+		return DSYNC_IBC_RECV_RET_OK;
+	}
+
+	/* Skip over the channel changes, but leave the following item's line
+	   into the input buffer. */
+	for (;;) {
+		data = i_stream_get_data(ibc->input, &size);
+		if (size == 0) {
+			if ((ret = i_stream_read(ibc->input)) == 0) {
+				ibc->has_pending_data = FALSE;
+				return DSYNC_IBC_RECV_RET_TRYAGAIN;
+			}
+			if (ret < 0) {
+				/* let next_line() handle the error */
+				(void)dsync_ibc_stream_next_line(ibc, &line);
+				return DSYNC_IBC_RECV_RET_TRYAGAIN;
+			}
+			continue;
+		}
+		if (data[0] == (unsigned char)items[ITEM_DONE].chr) {
+			/* remote is closing the connection. let
+			   input_next() handle it. */
+			struct dsync_deserializer_decoder *decoder;
+
+			(void)dsync_ibc_stream_input_next(ibc, ITEM_DONE,
+							  &decoder);
+			return DSYNC_IBC_RECV_RET_TRYAGAIN;
+		}
+		if (data[0] != (unsigned char)items[ITEM_CHANNEL].chr)
+			break;
+		if (dsync_ibc_stream_next_line(ibc, &line) <= 0 ||
+		    dsync_ibc_stream_input_channel(ibc, line) < 0)
+			return DSYNC_IBC_RECV_RET_TRYAGAIN;
+	}
+	*channel_r = ibc->recv_channel;
+	return DSYNC_IBC_RECV_RET_OK;
+}
+
 static const struct dsync_ibc_vfuncs dsync_ibc_stream_vfuncs = {
 	dsync_ibc_stream_deinit,
 	dsync_ibc_stream_send_handshake,
@@ -2113,7 +2275,10 @@ static const struct dsync_ibc_vfuncs dsync_ibc_stream_vfuncs = {
 	dsync_ibc_stream_recv_finish,
 	dsync_ibc_stream_close_mail_streams,
 	dsync_ibc_stream_is_send_queue_full,
-	dsync_ibc_stream_has_pending_data
+	dsync_ibc_stream_has_pending_data,
+	dsync_ibc_stream_have_channels,
+	dsync_ibc_stream_set_send_channel,
+	dsync_ibc_stream_recv_channel
 };
 
 struct dsync_ibc *
@@ -74,6 +74,9 @@ struct dsync_ibc_settings {
 	bool hdr_hash_v3;
 	unsigned int lock_timeout;
 	unsigned int import_commit_msgs_interval;
+	/* Sync up to this many mailboxes concurrently (if the remote
+	   supports channels) */
+	unsigned int mailbox_concurrency;
 };
 
 void dsync_ibc_init_pipe(struct dsync_ibc **ibc1_r,
@@ -175,4 +178,13 @@ bool dsync_ibc_has_timed_out(struct dsync_ibc *ibc);
 bool dsync_ibc_is_send_queue_full(struct dsync_ibc *ibc);
 bool dsync_ibc_has_pending_data(struct dsync_ibc *ibc);
 
+/* Returns TRUE if both sides support multiplexing items of different
+   mailboxes into separate channels. */
+bool dsync_ibc_have_channels(struct dsync_ibc *ibc);
+/* Send the following items in this channel. Channel 0 is used by default. */
+void dsync_ibc_set_send_channel(struct dsync_ibc *ibc, unsigned int channel);
+/* Get the channel of the next received item. */
+enum dsync_ibc_recv_ret
+dsync_ibc_recv_channel(struct dsync_ibc *ibc, unsigned int *channel_r);
+
 #endif
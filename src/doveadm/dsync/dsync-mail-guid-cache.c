@@ -0,0 +1,63 @@
+/* Copyright (c) 2023 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "hash.h"
+#include "dsync-mail-guid-cache.h"
+
+struct dsync_mail_guid_cache {
+	pool_t pool;
+	/* GUID => struct dsync_mail_guid_cache_rec */
+	HASH_TABLE(char *, struct dsync_mail_guid_cache_rec *) guids;
+};
+
+struct dsync_mail_guid_cache *dsync_mail_guid_cache_init(void)
+{
+	struct dsync_mail_guid_cache *cache;
+	pool_t pool;
+
+	pool = pool_alloconly_create(MEMPOOL_GROWING"dsync mail guid cache",
+				     1024*16);
+	cache = p_new(pool, struct dsync_mail_guid_cache, 1);
+	cache->pool = pool;
+	hash_table_create(&cache->guids, pool, 0, str_hash, strcmp);
+	return cache;
+}
+
+void dsync_mail_guid_cache_deinit(struct dsync_mail_guid_cache **_cache)
+{
+	struct dsync_mail_guid_cache *cache = *_cache;
+
+	*_cache = NULL;
+	hash_table_destroy(&cache->guids);
+	pool_unref(&cache->pool);
+}
+
+void dsync_mail_guid_cache_add(struct dsync_mail_guid_cache *cache,
+			       const char *guid, struct mailbox_list *list,
+			       const guid_128_t mailbox_guid, uint32_t uid)
+{
+	struct dsync_mail_guid_cache_rec *rec;
+
+	i_assert(uid != 0);
+
+	if (*guid == '\0' ||
+	    hash_table_count(cache->guids) >= DSYNC_MAIL_GUID_CACHE_MAX_COUNT)
+		return;
+	if (hash_table_lookup(cache->guids, guid) != NULL)
+		return;
+
+	rec = p_new(cache->pool, struct dsync_mail_guid_cache_rec, 1);
+	rec->list = list;
+	guid_128_copy(rec->mailbox_guid, mailbox_guid);
+	rec->uid = uid;
+	hash_table_insert(cache->guids, p_strdup(cache->pool, guid), rec);
+}
+
+const struct dsync_mail_guid_cache_rec *
+dsync_mail_guid_cache_lookup(struct dsync_mail_guid_cache *cache,
+			     const char *guid)
+{
+	if (*guid == '\0')
+		return NULL;
+	return hash_table_lookup(cache->guids, guid);
+}
@@ -0,0 +1,36 @@
+#ifndef DSYNC_MAIL_GUID_CACHE_H
+#define DSYNC_MAIL_GUID_CACHE_H
+
+#include "guid.h"
+
+/* Remembers where mails with a given GUID were seen locally during this
+   dsync run, so that when the same mail is wanted in another mailbox it can
+   be copied locally instead of requesting its body from the remote. */
+
+/* Stop adding new GUIDs after this many to limit the memory usage with
+   very large accounts. */
+#define DSYNC_MAIL_GUID_CACHE_MAX_COUNT 200000
+
+struct mailbox_list;
+
+struct dsync_mail_guid_cache_rec {
+	struct mailbox_list *list;
+	guid_128_t mailbox_guid;
+	uint32_t uid;
+};
+
+struct dsync_mail_guid_cache *dsync_mail_guid_cache_init(void);
+void dsync_mail_guid_cache_deinit(struct dsync_mail_guid_cache **cache);
+
+/* Remember that the mail with the given GUID exists in the mailbox with the
+   given UID. If the GUID already exists in the cache, it's not changed. */
+void dsync_mail_guid_cache_add(struct dsync_mail_guid_cache *cache,
+			       const char *guid, struct mailbox_list *list,
+			       const guid_128_t mailbox_guid, uint32_t uid);
+/* Returns the location where the GUID was seen, or NULL if not found.
+   The mail may have been expunged since. */
+const struct dsync_mail_guid_cache_rec *
+dsync_mail_guid_cache_lookup(struct dsync_mail_guid_cache *cache,
+			     const char *guid);
+
+#endif
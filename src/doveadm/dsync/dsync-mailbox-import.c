@@ -12,6 +12,7 @@
 #include "mail-search-build.h"
 #include "dsync-transaction-log-scan.h"
 #include "dsync-mail.h"
+#include "dsync-mail-guid-cache.h"
 #include "dsync-mailbox.h"
 #include "dsync-mailbox-import.h"
 
@@ -47,6 +48,14 @@ struct importer_new_mail {
 	bool saved:1;
 };
 
+struct importer_guid_cache_box {
+	guid_128_t mailbox_guid;
+	/* NULL if the mailbox couldn't be opened */
+	struct mailbox *box;
+	struct mailbox_transaction_context *trans;
+	struct mail *mail;
+};
+
 /* for quickly testing that two-way sync doesn't actually do any unexpected
    modifications. */
 #define IMPORTER_DEBUG_CHANGE(importer) /*i_assert(!importer->master_brain)*/
@@ -83,6 +92,11 @@ struct dsync_mailbox_importer {
 	struct mailbox_transaction_context *virtual_trans;
 	struct mail *virtual_mail;
 
+	struct dsync_mail_guid_cache *guid_cache;
+	guid_128_t mailbox_guid;
+	/* other mailboxes opened for copying mails found via guid_cache */
+	ARRAY(struct importer_guid_cache_box) guid_cache_boxes;
+
 	struct mail *cur_mail;
 	const char *cur_guid;
 	const char *cur_hdr_hash;
@@ -217,6 +231,7 @@ dsync_mailbox_import_transaction_begin(struct dsync_mailbox_importer *importer)
 struct dsync_mailbox_importer *
 dsync_mailbox_import_init(struct mailbox *box,
 			  struct mailbox *virtual_all_box,
+			  struct dsync_mail_guid_cache *guid_cache,
 			  struct dsync_transaction_log_scan *log_scan,
 			  uint32_t last_common_uid,
 			  uint64_t last_common_modseq,
@@ -301,6 +316,19 @@ dsync_mailbox_import_init(struct mailbox *box,
 	importer->empty_hdr_workaround =
 		(flags & DSYNC_MAILBOX_IMPORT_FLAG_EMPTY_HDR_WORKAROUND) != 0;
 
+	if (guid_cache != NULL && importer->mails_have_guids) {
+		struct mailbox_metadata metadata;
+
+		/* the GUIDs must be the same on both sides for the cache to
+		   be of any use */
+		if (mailbox_get_metadata(box, MAILBOX_METADATA_GUID,
+					 &metadata) == 0) {
+			importer->guid_cache = guid_cache;
+			guid_128_copy(importer->mailbox_guid, metadata.guid);
+			p_array_init(&importer->guid_cache_boxes, pool, 4);
+		}
+	}
+
 	mailbox_get_open_status(importer->box, STATUS_UIDNEXT |
 				STATUS_HIGHESTMODSEQ | STATUS_HIGHESTPVTMODSEQ,
 				&status);
@@ -624,6 +652,17 @@ dsync_mail_change_guid_equals(struct dsync_mailbox_importer *importer,
 	return TRUE;
 }
 
+static void
+dsync_mailbox_import_guid_cache_add(struct dsync_mailbox_importer *importer,
+				    const char *guid, uint32_t uid)
+{
+	if (importer->guid_cache == NULL)
+		return;
+	dsync_mail_guid_cache_add(importer->guid_cache, guid,
+				  mailbox_get_namespace(importer->box)->list,
+				  importer->mailbox_guid, uid);
+}
+
 static int
 importer_try_next_mail(struct dsync_mailbox_importer *importer,
 		       uint32_t wanted_uid)
@@ -663,6 +702,8 @@ importer_try_next_mail(struct dsync_mailbox_importer *importer,
 			dsync_mail_error(importer, importer->cur_mail, "GUID");
 			return 0;
 		}
+		dsync_mailbox_import_guid_cache_add(importer,
+			importer->cur_guid, importer->cur_mail->uid);
 	} else {
 		if (dsync_mail_get_hdr_hash(importer->cur_mail,
 					    importer->hdr_hash_version,
@@ -1954,6 +1995,8 @@ dsync_mailbox_import_saved_newmail(struct dsync_mailbox_importer *importer,
 				   struct importer_new_mail *newmail)
 {
 	dsync_mailbox_import_saved_uid(importer, newmail->final_uid);
+	dsync_mailbox_import_guid_cache_add(importer, newmail->guid,
+					    newmail->final_uid);
 	newmail->saved = TRUE;
 
 	dsync_mailbox_import_update_first_saved(importer);
@@ -2133,6 +2176,84 @@ dsync_mailbox_import_try_virtual_all(struct dsync_mailbox_importer *importer,
 	return FALSE;
 }
 
+static struct mail *
+dsync_mailbox_import_guid_cache_mail(struct dsync_mailbox_importer *importer,
+				     const struct dsync_mail_guid_cache_rec *rec)
+{
+	struct importer_guid_cache_box *cbox;
+
+	array_foreach_modifiable(&importer->guid_cache_boxes, cbox) {
+		if (guid_128_equals(cbox->mailbox_guid, rec->mailbox_guid))
+			return cbox->mail;
+	}
+
+	cbox = array_append_space(&importer->guid_cache_boxes);
+	guid_128_copy(cbox->mailbox_guid, rec->mailbox_guid);
+	cbox->box = mailbox_alloc_guid(rec->list, rec->mailbox_guid,
+				       MAILBOX_FLAG_READONLY);
+	if (mailbox_open(cbox->box) < 0) {
+		/* not fatal, the mails are just requested from remote */
+		imp_debug(importer, "Couldn't open mailbox %s for copying: %s",
+			  guid_128_to_string(rec->mailbox_guid),
+			  mailbox_get_last_internal_error(cbox->box, NULL));
+		mailbox_free(&cbox->box);
+		return NULL;
+	}
+	cbox->trans = mailbox_transaction_begin(cbox->box, 0, __func__);
+	cbox->mail = mail_alloc(cbox->trans, 0, NULL);
+	return cbox->mail;
+}
+
+static void
+dsync_mailbox_import_guid_cache_boxes_free(struct dsync_mailbox_importer *importer)
+{
+	struct importer_guid_cache_box *cbox;
+
+	array_foreach_modifiable(&importer->guid_cache_boxes, cbox) {
+		if (cbox->box == NULL)
+			continue;
+		mail_free(&cbox->mail);
+		(void)mailbox_transaction_commit(&cbox->trans);
+		mailbox_free(&cbox->box);
+	}
+}
+
+static bool
+dsync_mailbox_import_try_guid_cache(struct dsync_mailbox_importer *importer,
+				    struct importer_new_mail *all_newmails)
+{
+	const struct dsync_mail_guid_cache_rec *rec;
+	struct dsync_mail dmail;
+	struct mail *mail;
+	const char *guid;
+
+	if (importer->guid_cache == NULL)
+		return FALSE;
+	rec = dsync_mail_guid_cache_lookup(importer->guid_cache,
+					   all_newmails->guid);
+	if (rec == NULL ||
+	    guid_128_equals(rec->mailbox_guid, importer->mailbox_guid))
+		return FALSE;
+
+	mail = dsync_mailbox_import_guid_cache_mail(importer, rec);
+	if (mail == NULL || !mail_set_uid(mail, rec->uid))
+		return FALSE;
+	/* the mail may have been expunged and its UID reassigned to some
+	   other mail after it was added to the cache */
+	if (mail_get_special(mail, MAIL_FETCH_GUID, &guid) < 0 ||
+	    strcmp(guid, all_newmails->guid) != 0)
+		return FALSE;
+
+	if (dsync_mailbox_import_local_uid(importer, mail, rec->uid,
+					   all_newmails->guid, &dmail) <= 0)
+		return FALSE;
+	imp_debug(importer, "Copying GUID=%s from mailbox %s UID=%u "
+		  "instead of requesting it", all_newmails->guid,
+		  mailbox_get_vname(mail->box), rec->uid);
+	return dsync_mailbox_save_newmails(importer, &dmail,
+					   all_newmails, FALSE);
+}
+
 static bool
 dsync_mailbox_import_handle_mail(struct dsync_mailbox_importer *importer,
 				 struct importer_new_mail *all_newmails)
@@ -2166,7 +2287,8 @@ dsync_mailbox_import_handle_mail(struct dsync_mailbox_importer *importer,
 
 	if (!dsync_mailbox_import_try_local(importer, all_newmails,
 					    &local_uids, &wanted_uids) &&
-	    !dsync_mailbox_import_try_virtual_all(importer, all_newmails)) {
+	    !dsync_mailbox_import_try_virtual_all(importer, all_newmails) &&
+	    !dsync_mailbox_import_try_guid_cache(importer, all_newmails)) {
 		/* no local instance. request from remote */
 		IMPORTER_DEBUG_CHANGE(importer);
 		if (importer->want_mail_requests) {
@@ -2944,6 +3066,8 @@ int dsync_mailbox_import_deinit(struct dsync_mailbox_importer **_importer,
 		mail_free(&importer->virtual_mail);
 	if (importer->virtual_trans != NULL)
 		(void)mailbox_transaction_commit(&importer->virtual_trans);
+	if (importer->guid_cache != NULL)
+		dsync_mailbox_import_guid_cache_boxes_free(importer);
 
 	hash_table_destroy(&importer->import_guids);
 	hash_table_destroy(&importer->import_uids);
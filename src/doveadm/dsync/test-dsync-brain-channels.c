@@ -0,0 +1,271 @@
+/* Copyright (c) 2023 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "str.h"
+#include "istream.h"
+#include "ostream.h"
+#include "master-service.h"
+#include "mail-search-build.h"
+#include "test-common.h"
+#include "test-mail-storage-common.h"
+#include "dsync-ibc.h"
+#include "dsync-brain-private.h"
+
+#include <sys/socket.h>
+
+#define TEST_LARGE_MAIL_COUNT 4
+#define TEST_LARGE_MAIL_SIZE (1024*1024)
+#define TEST_MAILBOX_COUNT 6
+#define TEST_TIMEOUT_SECS 30
+
+static bool test_timed_out;
+
+static void test_user_init_dsync(struct mail_user *user)
+{
+	struct mail_namespace *ns;
+
+	user->dsyncing = TRUE;
+	for (ns = user->namespaces; ns != NULL; ns = ns->next) {
+		struct dsync_mailbox_list *dlist =
+			p_new(ns->list->pool, struct dsync_mailbox_list, 1);
+		MODULE_CONTEXT_SET(ns->list, dsync_mailbox_list_module, dlist);
+		if (ns->list->set.vname_escape_char == '\0')
+			ns->list->set.vname_escape_char = '%';
+	}
+}
+
+static int
+test_mail_save_trans(struct mailbox_transaction_context *trans,
+		     struct istream *input)
+{
+	struct mail_save_context *save_ctx;
+	int ret;
+
+	save_ctx = mailbox_save_alloc(trans);
+	if (mailbox_save_begin(&save_ctx, input) < 0)
+		return -1;
+	do {
+		if (mailbox_save_continue(save_ctx) < 0) {
+			mailbox_save_cancel(&save_ctx);
+			return -1;
+		}
+	} while ((ret = i_stream_read(input)) > 0);
+	i_assert(ret == -1);
+	i_assert(input->stream_errno == 0);
+
+	return mailbox_save_finish(&save_ctx);
+}
+
+static void
+test_mail_save(struct mail_user *user, const char *vname, const char *data)
+{
+	struct mailbox *box;
+	struct mailbox_transaction_context *trans;
+	struct istream *input;
+	int ret;
+
+	box = mailbox_alloc(user->namespaces->list, vname, 0);
+	if (mailbox_open(box) < 0 &&
+	    (mailbox_create(box, NULL, FALSE) < 0 || mailbox_open(box) < 0)) {
+		i_fatal("Failed to open mailbox %s: %s", vname,
+			mailbox_get_last_internal_error(box, NULL));
+	}
+
+	input = i_stream_create_from_data(data, strlen(data));
+	trans = mailbox_transaction_begin(box,
+			MAILBOX_TRANSACTION_FLAG_EXTERNAL, __func__);
+	ret = test_mail_save_trans(trans, input);
+	i_stream_unref(&input);
+	if (ret < 0)
+		mailbox_transaction_rollback(&trans);
+	else
+		ret = mailbox_transaction_commit(&trans);
+	if (ret < 0) {
+		i_fatal("Failed to save mail to %s: %s", vname,
+			mailbox_get_last_internal_error(box, NULL));
+	}
+	mailbox_free(&box);
+}
+
+static const char *test_large_mail(unsigned int n)
+{
+	string_t *str = t_str_new(TEST_LARGE_MAIL_SIZE + 256);
+
+	str_printfa(str, "Date: Thu, 1 Jun 2023 12:00:%02u +0000\n"
+		    "Message-ID: <large%u@example.com>\n"
+		    "Subject: large mail %u\n\n", n, n, n);
+	while (str_len(str) < TEST_LARGE_MAIL_SIZE) {
+		str_printfa(str, "%u: 0123456789abcdefghijklmnopqrstuvwxyz"
+			    "0123456789abcdefghijklmnopqrstuvwxyz\n",
+			    (unsigned int)str_len(str));
+	}
+	return str_c(str);
+}
+
+static void
+test_mailbox_check(struct mail_user *user, const char *vname,
+		   unsigned int expected_count, uoff_t min_size)
+{
+	struct mailbox *box;
+	struct mailbox_transaction_context *trans;
+	struct mail_search_args *search_args;
+	struct mail_search_context *search_ctx;
+	struct mail *mail;
+	unsigned int count = 0;
+	uoff_t size;
+
+	box = mailbox_alloc(user->namespaces->list, vname, 0);
+	if (mailbox_sync(box, 0) < 0) {
+		i_error("mailbox_sync(%s) failed: %s", vname,
+			mailbox_get_last_internal_error(box, NULL));
+		test_assert(FALSE);
+		mailbox_free(&box);
+		return;
+	}
+	trans = mailbox_transaction_begin(box, 0, __func__);
+	search_args = mail_search_build_init();
+	mail_search_build_add_all(search_args);
+	search_ctx = mailbox_search_init(trans, search_args, NULL,
+					 MAIL_FETCH_PHYSICAL_SIZE, NULL);
+	mail_search_args_unref(&search_args);
+	while (mailbox_search_next(search_ctx, &mail)) {
+		test_assert_idx(mail_get_physical_size(mail, &size) == 0 &&
+				size >= min_size, count);
+		count++;
+	}
+	test_assert(mailbox_search_deinit(&search_ctx) == 0);
+	test_assert(mailbox_transaction_commit(&trans) == 0);
+	test_assert_ucmp(count, ==, expected_count);
+	mailbox_free(&box);
+}
+
+static bool test_brain_is_done(struct dsync_brain *brain)
+{
+	return brain->state == DSYNC_STATE_DONE || brain->failed;
+}
+
+static void test_timeout(void *context ATTR_UNUSED)
+{
+	test_timed_out = TRUE;
+	io_loop_stop(current_ioloop);
+}
+
+static void test_dsync_brain_channels_large_mail(void)
+{
+	struct test_mail_storage_ctx *ctx;
+	struct test_mail_storage_settings set = {
+		.driver = "sdbox",
+	};
+	struct mail_user *master_user, *slave_user;
+	struct mail_storage_service_user *master_service_user;
+	struct dsync_brain_settings brain_set;
+	struct dsync_brain *master_brain, *slave_brain;
+	struct dsync_ibc *master_ibc, *slave_ibc;
+	struct istream *input[2];
+	struct ostream *output[2];
+	struct timeout *to;
+	enum mail_error mail_error;
+	const char *const hashed_headers[] = { "Date", "Message-ID", NULL };
+	unsigned int i;
+	int fd[2];
+
+	test_begin("dsync brain channels with large mails");
+	ctx = test_mail_storage_init();
+
+	set.username = "master";
+	test_mail_storage_init_user(ctx, &set);
+	master_user = ctx->user;
+	master_service_user = ctx->service_user;
+	set.username = "slave";
+	test_mail_storage_init_user(ctx, &set);
+	slave_user = ctx->user;
+
+	/* Both sides stream large mails to each other, so new mailboxes
+	   are received while a mail body is still being sent. */
+	for (i = 0; i < TEST_LARGE_MAIL_COUNT; i++) T_BEGIN {
+		test_mail_save(slave_user, "INBOX", test_large_mail(i));
+	} T_END;
+	for (i = 0; i < TEST_MAILBOX_COUNT; i++) T_BEGIN {
+		test_mail_save(master_user, t_strdup_printf("box%u", i),
+			       test_large_mail(TEST_LARGE_MAIL_COUNT + i));
+	} T_END;
+	test_user_init_dsync(master_user);
+	test_user_init_dsync(slave_user);
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fd) < 0)
+		i_fatal("socketpair() failed: %m");
+	for (i = 0; i < 2; i++) {
+		fd_set_nonblock(fd[i], TRUE);
+		input[i] = i_stream_create_fd(fd[i], SIZE_MAX);
+		output[i] = o_stream_create_fd(fd[i], SIZE_MAX);
+	}
+	master_ibc = dsync_ibc_init_stream(input[0], output[0], "slave",
+					   ".temp.master", TEST_TIMEOUT_SECS);
+	slave_ibc = dsync_ibc_init_stream(input[1], output[1], "master",
+					  ".temp.slave", TEST_TIMEOUT_SECS);
+
+	i_zero(&brain_set);
+	t_array_init(&brain_set.sync_namespaces, 1);
+	brain_set.mailbox_alt_char = '_';
+	brain_set.hashed_headers = hashed_headers;
+	brain_set.mailbox_concurrency = 2;
+	master_brain = dsync_brain_master_init(master_user, master_ibc,
+		DSYNC_BRAIN_SYNC_TYPE_FULL,
+		DSYNC_BRAIN_FLAG_SEND_MAIL_REQUESTS, &brain_set);
+	slave_brain = dsync_brain_slave_init(slave_user, slave_ibc, FALSE,
+					     "", '_');
+
+	test_timed_out = FALSE;
+	to = timeout_add(TEST_TIMEOUT_SECS * 1000, test_timeout, NULL);
+	while (!test_timed_out &&
+	       (!test_brain_is_done(master_brain) ||
+		!test_brain_is_done(slave_brain)))
+		io_loop_run(current_ioloop);
+	timeout_remove(&to);
+	test_assert(!test_timed_out);
+
+	test_assert(dsync_brain_deinit(&master_brain, &mail_error) == 0);
+	test_assert(dsync_brain_deinit(&slave_brain, &mail_error) == 0);
+	dsync_ibc_deinit(&master_ibc);
+	dsync_ibc_deinit(&slave_ibc);
+	for (i = 0; i < 2; i++) {
+		i_stream_unref(&input[i]);
+		o_stream_unref(&output[i]);
+		i_close_fd(&fd[i]);
+	}
+
+	test_mailbox_check(master_user, "INBOX", TEST_LARGE_MAIL_COUNT,
+			   TEST_LARGE_MAIL_SIZE);
+	for (i = 0; i < TEST_MAILBOX_COUNT; i++) T_BEGIN {
+		test_mailbox_check(slave_user, t_strdup_printf("box%u", i),
+				   1, TEST_LARGE_MAIL_SIZE);
+	} T_END;
+
+	test_mail_storage_deinit_user(ctx);
+	ctx->user = master_user;
+	ctx->service_user = master_service_user;
+	test_mail_storage_deinit_user(ctx);
+	test_mail_storage_deinit(&ctx);
+	test_end();
+}
+
+int main(int argc, char **argv)
+{
+	static void (*const test_functions[])(void) = {
+		test_dsync_brain_channels_large_mail,
+		NULL
+	};
+	int ret;
+
+	master_service = master_service_init("test-dsync-brain-channels",
+					     MASTER_SERVICE_FLAG_STANDALONE |
+					     MASTER_SERVICE_FLAG_DONT_SEND_STATS |
+					     MASTER_SERVICE_FLAG_NO_CONFIG_SETTINGS |
+					     MASTER_SERVICE_FLAG_NO_SSL_INIT |
+					     MASTER_SERVICE_FLAG_NO_INIT_DATASTACK_FRAME,
+					     &argc, &argv, "");
+	ret = test_run(test_functions);
+	master_service_deinit(&master_service);
+	return ret;
+}
@@ -13,6 +13,7 @@
 #include "priorityq.h"
 #include "base64.h"
 #include "str.h"
+#include "str-table.h"
 #include "strescape.h"
 #include "time-util.h"
 #include "var-expand.h"
@@ -56,17 +57,22 @@ struct imap_client_notify {
 	struct io *io;
 };
 
+/* A single hibernation process may have a very large number of idling clients,
+   so try to keep the per-client memory usage small: Strings commonly shared
+   by clients (username, userdb fields, log prefix) are in imap_client_strings.
+   The client input and output streams are created only when they're actually
+   needed. Most of the clients never send anything and only receive the
+   keepalive notifications. */
 struct imap_client {
 	struct priorityq_item item;
 
 	struct imap_client *prev, *next;
-	pool_t pool;
 	struct event *event;
 	struct imap_client_state state;
+	/* Created only when there are notify fds */
 	ARRAY(struct imap_client_notify) notifys;
 
 	time_t move_back_start;
-	struct timeout *to_move_back;
 
 	int fd;
 	struct io *io;
@@ -75,14 +81,17 @@ struct imap_client {
 	struct timeout *to_keepalive;
 	struct imap_master_connection *master_conn;
 	struct ioloop_context *ioloop_ctx;
+	/* points to imap_client_strings */
 	const char *log_prefix;
 	unsigned int next_read_threshold;
-	bool bad_done, idle_done;
-	bool unhibernate_queued;
-	bool input_pending;
+	bool bad_done:1;
+	bool idle_done:1;
+	bool unhibernate_queued:1;
+	bool input_pending:1;
 };
 
 static struct imap_client *imap_clients;
+static struct str_table *imap_client_strings;
 static struct priorityq *unhibernate_queue;
 static struct timeout *to_unhibernate;
 static const char imap_still_here_text[] = "* OK Still here\r\n";
@@ -101,6 +110,28 @@ static void imap_client_add_idle_keepalive_timeout(struct imap_client *client);
 static void imap_clients_unhibernate(void *context);
 static void imap_client_stop_notify_listening(struct imap_client *client);
 
+static struct istream *imap_client_get_input(struct imap_client *client)
+{
+	if (client->input == NULL)
+		client->input = i_stream_create_fd(client->fd, IMAP_MAX_INBUF);
+	return client->input;
+}
+
+static struct ostream *imap_client_get_output(struct imap_client *client)
+{
+	if (client->output == NULL) {
+		client->output = o_stream_create_fd(client->fd, IMAP_MAX_OUTBUF);
+		o_stream_set_no_error_handling(client->output, TRUE);
+	}
+	return client->output;
+}
+
+static size_t imap_client_get_output_used_size(struct imap_client *client)
+{
+	return client->output == NULL ? 0 :
+		o_stream_get_buffer_used_size(client->output);
+}
+
 static void imap_client_disconnected(struct imap_client **_client)
 {
 	struct imap_client *client = *_client;
@@ -195,12 +226,14 @@ imap_client_move_back_send_callback(void *context, struct ostream *output)
 		str_append(str, "\tstate=");
 		base64_encode(state->state, state->state_size, str);
 	}
-	input_data = i_stream_get_data(client->input, &input_size);
-	if (input_size > 0) {
-		str_append(str, "\tclient_input=");
-		base64_encode(input_data, input_size, str);
+	if (client->input != NULL) {
+		input_data = i_stream_get_data(client->input, &input_size);
+		if (input_size > 0) {
+			str_append(str, "\tclient_input=");
+			base64_encode(input_data, input_size, str);
+		}
 	}
-	i_assert(o_stream_get_buffer_used_size(client->output) == 0);
+	i_assert(imap_client_get_output_used_size(client) == 0);
 	if (client->idle_done) {
 		if (client->bad_done)
 			str_append(str, "\tbad-done");
@@ -250,7 +283,7 @@ static bool imap_client_try_move_back(struct imap_client *client)
 	const char *path, *error;
 	int ret;
 
-	if (o_stream_get_buffer_used_size(client->output) > 0) {
+	if (imap_client_get_output_used_size(client) > 0) {
 		/* there is data buffered, so we have to disconnect you */
 		imap_client_destroy(&client, IMAP_CLIENT_BUFFER_FULL_ERROR);
 		return TRUE;
@@ -377,7 +410,7 @@ static void imap_client_input_idle_cmd(struct imap_client *client)
 
 	/* we should read either DONE or disconnection. also handle if client
 	   sends DONE\nIDLE simply to recreate the IDLE. */
-	ret = i_stream_read_bytes(client->input, &data, &size,
+	ret = i_stream_read_bytes(imap_client_get_input(client), &data, &size,
 				  client->next_read_threshold + 1);
 	if (size == 0) {
 		if (ret < 0)
@@ -407,7 +440,7 @@ static void imap_client_input_idle_cmd(struct imap_client *client)
 		client->state.tag = i_strdup(new_tag);
 		output = t_strdup_printf("%s OK Idle completed.\r\n+ idling\r\n", old_tag);
 		i_free(old_tag);
-		ret = o_stream_flush(client->output);
+		ret = o_stream_flush(imap_client_get_output(client));
 		if (ret > 0)
 			ret = o_stream_send_str(client->output, output);
 		if (ret < 0) {
@@ -435,7 +468,7 @@ static void imap_client_input_idle_cmd(struct imap_client *client)
 
 static void imap_client_input_nonidle(struct imap_client *client)
 {
-	if (i_stream_read(client->input) < 0)
+	if (i_stream_read(imap_client_get_input(client)) < 0)
 		imap_client_disconnected(&client);
 	else {
 		client->input_pending = TRUE;
@@ -453,7 +486,7 @@ static void keepalive_timeout(struct imap_client *client)
 	ssize_t ret;
 
 	/* do not send this if there is data buffered */
-	if ((ret = o_stream_flush(client->output)) < 0) {
+	if ((ret = o_stream_flush(imap_client_get_output(client))) < 0) {
 		imap_client_disconnected(&client);
 		return;
 	} else if (ret == 0)
@@ -571,8 +604,8 @@ imap_client_create(int fd, const struct imap_client_state *state)
 		{ NULL, NULL }
 	};
 	struct imap_client *client;
-	pool_t pool = pool_alloconly_create("imap client", 256);
-	void *statebuf;
+	size_t session_id_size, stats_size;
+	char *p;
 	const char *error;
 
 	i_assert(state->username != NULL);
@@ -580,17 +613,36 @@ imap_client_create(int fd, const struct imap_client_state *state)
 
 	fd_set_nonblock(fd, TRUE); /* it should already be, but be sure */
 
-	client = p_new(pool, struct imap_client, 1);
-	client->pool = pool;
+	/* allocate the client-specific strings and state together with the
+	   client struct */
+	session_id_size = state->session_id == NULL ? 0 :
+		strlen(state->session_id) + 1;
+	stats_size = state->stats == NULL ? 0 : strlen(state->stats) + 1;
+	client = i_malloc(MALLOC_ADD(sizeof(*client),
+		MALLOC_ADD(session_id_size,
+			   MALLOC_ADD(stats_size, state->state_size))));
+	p = PTR_OFFSET(client, sizeof(*client));
+
 	client->fd = fd;
-	client->input = i_stream_create_fd(fd, IMAP_MAX_INBUF);
-	client->output = o_stream_create_fd(fd, IMAP_MAX_OUTBUF);
-	o_stream_set_no_error_handling(client->output, TRUE);
 	client->state = *state;
-	client->state.username = p_strdup(pool, state->username);
-	client->state.session_id = p_strdup(pool, state->session_id);
-	client->state.userdb_fields = p_strdup(pool, state->userdb_fields);
-	client->state.stats = p_strdup(pool, state->stats);
+	/* these aren't used after the client is created */
+	client->state.mail_log_prefix = NULL;
+	client->state.mailbox_vname = NULL;
+	client->state.username =
+		str_table_ref(imap_client_strings, state->username);
+	client->state.session_id = session_id_size == 0 ? NULL :
+		memcpy(p, state->session_id, session_id_size);
+	p += session_id_size;
+	if (state->userdb_fields != NULL) {
+		client->state.userdb_fields =
+			str_table_ref(imap_client_strings,
+				      state->userdb_fields);
+	}
+	client->state.stats = stats_size == 0 ? NULL :
+		memcpy(p, state->stats, stats_size);
+	p += stats_size;
+	if (state->state_size > 0)
+		client->state.state = memcpy(p, state->state, state->state_size);
 
 	client->event = event_create(NULL);
 	event_add_category(client->event, &event_category_imap_hibernate);
@@ -609,11 +661,6 @@ imap_client_create(int fd, const struct imap_client_state *state)
 	if (state->remote_port != 0)
 		event_add_int(client->event, "remote_port", state->remote_port);
 
-	if (state->state_size > 0) {
-		client->state.state = statebuf = p_malloc(pool, state->state_size);
-		memcpy(statebuf, state->state, state->state_size);
-		client->state.state_size = state->state_size;
-	}
 	T_BEGIN {
 		string_t *str;
 		char **fields = p_strsplit_tabescaped(unsafe_data_stack_pool,
@@ -626,7 +673,8 @@ imap_client_create(int fd, const struct imap_client_state *state)
 				"Failed to expand mail_log_prefix=%s: %s",
 				state->mail_log_prefix, error);
 		}
-		client->log_prefix = p_strdup(pool, str_c(str));
+		client->log_prefix =
+			str_table_ref(imap_client_strings, str_c(str));
 	} T_END;
 
 	struct master_service_anvil_session anvil_session = {
@@ -638,7 +686,6 @@ imap_client_create(int fd, const struct imap_client_state *state)
 					 TRUE, client->state.anvil_conn_guid))
 		client->state.anvil_sent = TRUE;
 
-	p_array_init(&client->notifys, pool, 2);
 	DLLIST_PREPEND(&imap_clients, client);
 	return client;
 }
@@ -647,6 +694,8 @@ static void imap_client_stop_notify_listening(struct imap_client *client)
 {
 	struct imap_client_notify *notify;
 
+	if (!array_is_created(&client->notifys))
+		return;
 	array_foreach_modifiable(&client->notifys, notify) {
 		io_remove(&notify->io);
 		i_close_fd(&notify->fd);
@@ -706,7 +755,16 @@ void imap_client_destroy(struct imap_client **_client, const char *reason)
 	o_stream_destroy(&client->output);
 	i_close_fd(&client->fd);
 	event_unref(&client->event);
-	pool_unref(&client->pool);
+
+	if (array_is_created(&client->notifys))
+		array_free(&client->notifys);
+	str_table_unref(imap_client_strings, &client->state.username);
+	if (client->state.userdb_fields != NULL) {
+		str_table_unref(imap_client_strings,
+				&client->state.userdb_fields);
+	}
+	str_table_unref(imap_client_strings, &client->log_prefix);
+	i_free(client);
 
 	master_service_client_connection_destroyed(master_service);
 }
@@ -715,6 +773,8 @@ void imap_client_add_notify_fd(struct imap_client *client, int fd)
 {
 	struct imap_client_notify *notify;
 
+	if (!array_is_created(&client->notifys))
+		i_array_init(&client->notifys, 2);
 	notify = array_append_space(&client->notifys);
 	notify->fd = fd;
 }
@@ -738,6 +798,8 @@ void imap_client_create_finish(struct imap_client *client)
 	}
 	imap_client_add_idle_keepalive_timeout(client);
 
+	if (!array_is_created(&client->notifys))
+		return;
 	array_foreach_modifiable(&client->notifys, notify) {
 		notify->io = io_add(notify->fd, IO_READ,
 				    imap_client_input_notify, client);
@@ -780,7 +842,7 @@ static void imap_clients_unhibernate(void *context ATTR_UNUSED)
 static void imap_client_kick(struct imap_client *client)
 {
 	imap_client_io_activate_user(client);
-	o_stream_nsend_str(client->output,
+	o_stream_nsend_str(imap_client_get_output(client),
 			   "* BYE "MASTER_SERVICE_SHUTTING_DOWN_MSG".\r\n");
 	imap_client_destroy(&client, MASTER_SERVICE_SHUTTING_DOWN_MSG);
 }
@@ -803,6 +865,7 @@ unsigned int imap_clients_kick(const char *user, const guid_128_t conn_guid)
 void imap_clients_init(void)
 {
 	unhibernate_queue = priorityq_init(client_unhibernate_cmp, 64);
+	imap_client_strings = str_table_init();
 }
 
 void imap_clients_deinit(void)
@@ -812,4 +875,5 @@ void imap_clients_deinit(void)
 
 	timeout_remove(&to_unhibernate);
 	priorityq_deinit(&unhibernate_queue);
+	str_table_deinit(&imap_client_strings);
 }
@@ -566,6 +566,20 @@ int main(int argc, char *argv[])
 	storage_service =
 		mail_storage_service_init(master_service,
 					  set_roots, storage_service_flags);
+	if (!IS_STANDALONE()) {
+		/* Do the user-independent part of the initialization before
+		   accepting any connections. When the process is created
+		   in advance (process_min_avail), this makes the logins and
+		   especially the unhibernations faster. */
+		struct mail_storage_service_input input = {
+			.module = "imap",
+			.service = "imap",
+		};
+		/* Errors are ignored here. The user lookup fails with the
+		   same error and logs it with the user's log prefix. */
+		(void)mail_storage_service_preload(storage_service, &input,
+						   &error);
+	}
 	master_service_init_finish(master_service);
 	/* NOTE: login_set.*_socket_path are now invalid due to data stack
 	   having been freed */
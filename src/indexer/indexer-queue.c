@@ -109,12 +109,25 @@ indexer_queue_append_request(struct indexer_queue *queue, bool append,
 		request->mailbox = i_strdup(mailbox);
 		request->session_id = i_strdup(session_id);
 		request->max_recent_msgs = max_recent_msgs;
+		request->interactive = !append;
 		request_add_context(request, context);
 		hash_table_insert(queue->requests, request, request);
+
+		if (!hash_table_lookup_full(queue->users, username,
+					    &first_username, &first_request)) {
+			first_username = i_strdup(username);
+			hash_table_insert(queue->users, first_username, request);
+		} else {
+			DLLIST_PREPEND_FULL(&first_request, request,
+					    user_prev, user_next);
+			hash_table_update(queue->users, first_username, request);
+		}
 	} else {
 		if (request->max_recent_msgs > max_recent_msgs)
 			request->max_recent_msgs = max_recent_msgs;
 		request_add_context(request, context);
+		if (!append)
+			request->interactive = TRUE;
 		if (request->working) {
 			/* we're already indexing this mailbox. */
 			if (append)
@@ -131,16 +144,6 @@ indexer_queue_append_request(struct indexer_queue *queue, bool append,
 		DLLIST2_REMOVE(&queue->head, &queue->tail, request);
 	}
 
-	if (!hash_table_lookup_full(queue->users, username,
-				    &first_username, &first_request)) {
-		first_username = i_strdup(username);
-		hash_table_insert(queue->users, first_username, request);
-	} else {
-		DLLIST_PREPEND_FULL(&first_request, request,
-				    user_prev, user_next);
-		hash_table_update(queue->users, first_username, request);
-	}
-
 	if (append)
 		DLLIST2_APPEND(&queue->head, &queue->tail, request);
 	else
@@ -225,6 +228,28 @@ void indexer_queue_move_head_to_tail(struct indexer_queue *queue)
 	DLLIST2_APPEND(&queue->head, &queue->tail, request);
 }
 
+void indexer_queue_move_user_to_tail(struct indexer_queue *queue,
+				     const char *username)
+{
+	struct indexer_request *request, *next;
+
+	/* The user's requests are linked newest first. Move them starting
+	   from the oldest, so their relative order is preserved. */
+	request = hash_table_lookup(queue->users, username);
+	if (request == NULL)
+		return;
+	while (request->user_next != NULL)
+		request = request->user_next;
+
+	for (; request != NULL; request = next) {
+		next = request->user_prev;
+		if (request->working || request->interactive)
+			continue;
+		DLLIST2_REMOVE(&queue->head, &queue->tail, request);
+		DLLIST2_APPEND(&queue->head, &queue->tail, request);
+	}
+}
+
 void indexer_queue_request_work(struct indexer_request *request)
 {
 	request->working = TRUE;
@@ -281,6 +306,33 @@ void indexer_queue_request_finish(struct indexer_queue *queue,
 	indexer_refresh_proctitle();
 }
 
+void indexer_queue_request_continue(struct indexer_queue *queue,
+				    struct indexer_request **_request)
+{
+	struct indexer_request *request = *_request;
+
+	*_request = NULL;
+
+	i_assert(request->working);
+
+	if (request->cancelled) {
+		request->reindex_head = request->reindex_tail = FALSE;
+		indexer_queue_request_finish(queue, &request, FALSE);
+		return;
+	}
+
+	/* The contexts that were waiting for the request keep waiting for
+	   it to finish, so they'll be counted again once it continues. */
+	request->working = FALSE;
+	if (request->reindex_head)
+		DLLIST2_PREPEND(&queue->head, &queue->tail, request);
+	else
+		DLLIST2_APPEND(&queue->head, &queue->tail, request);
+	request->reindex_head = FALSE;
+	request->reindex_tail = FALSE;
+	indexer_refresh_proctitle();
+}
+
 static void
 indexer_queue_request_cancel(struct indexer_queue *queue,
 			     struct indexer_request **_request)
@@ -315,6 +367,7 @@ void indexer_queue_cancel(struct indexer_queue *queue, const char *username,
 			   but we can make sure it won't be added back to the
 			   queue. */
 			request->reindex_head = request->reindex_tail = FALSE;
+			request->cancelled = TRUE;
 		} else {
 			indexer_queue_request_cancel(queue, &request);
 		}
@@ -333,8 +386,10 @@ void indexer_queue_cancel_all(struct indexer_queue *queue)
 	   (or are cancelled) we don't try to retry them (especially during
 	   deinit where it crashes) */
 	iter = hash_table_iterate_init(queue->requests);
-	while (hash_table_iterate(iter, queue->requests, &request, &request))
+	while (hash_table_iterate(iter, queue->requests, &request, &request)) {
 		request->reindex_head = request->reindex_tail = FALSE;
+		request->cancelled = TRUE;
+	}
 	hash_table_iterate_deinit(&iter);
 
 	while ((request = indexer_queue_request_peek(queue)) != NULL)
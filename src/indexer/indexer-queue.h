@@ -25,8 +25,14 @@ struct indexer_request {
 
 	enum indexer_request_type type;
 
+	/* someone is waiting for this request to finish, e.g. a SEARCH.
+	   Otherwise this is a background request, e.g. after mail delivery. */
+	bool interactive:1;
 	/* currently indexing this mailbox */
 	bool working:1;
+	/* the request was cancelled while working on it. Don't add it back
+	   to the queue even if it's unfinished. */
+	bool cancelled:1;
 	/* after indexing is finished, add this request back to the queue and
 	   reindex it (i.e. a new indexing request came while we were
 	   working.) */
@@ -75,8 +81,17 @@ void indexer_queue_request_status(struct indexer_queue *queue,
 				  int percentage);
 /* Move the next request to the end of the queue. */
 void indexer_queue_move_head_to_tail(struct indexer_queue *queue);
+/* Move the user's queued background requests to the end of the queue, so
+   other users' requests are handled before them. */
+void indexer_queue_move_user_to_tail(struct indexer_queue *queue,
+				     const char *username);
 /* Start working on a request */
 void indexer_queue_request_work(struct indexer_request *request);
+/* Only a part of the request was finished. Add it back to the end of the
+   queue (or the beginning, if an interactive request came while working on
+   it), so other requests get a chance to run before it's continued. */
+void indexer_queue_request_continue(struct indexer_queue *queue,
+				    struct indexer_request **request);
 /* Finish the request and free its memory. */
 void indexer_queue_request_finish(struct indexer_queue *queue,
 				  struct indexer_request **request,
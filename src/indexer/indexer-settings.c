@@ -4,6 +4,7 @@
 #include "buffer.h"
 #include "settings-parser.h"
 #include "service-settings.h"
+#include "indexer-settings.h"
 
 #include <stddef.h>
 
@@ -48,3 +49,32 @@ struct service_settings indexer_service_settings = {
 
 	.process_limit_1 = TRUE
 };
+
+#undef DEF
+#define DEF(type, name) \
+	SETTING_DEFINE_STRUCT_##type(#name, name, struct indexer_settings)
+
+static const struct setting_define indexer_setting_defines[] = {
+	DEF(UINT, indexer_user_process_limit),
+	DEF(UINT, indexer_background_slice_messages),
+
+	SETTING_DEFINE_LIST_END
+};
+
+const struct indexer_settings indexer_default_settings = {
+	.indexer_user_process_limit = 1,
+	.indexer_background_slice_messages = 1000
+};
+
+const struct setting_parser_info indexer_setting_parser_info = {
+	.module_name = "indexer",
+	.defines = indexer_setting_defines,
+	.defaults = &indexer_default_settings,
+
+	.type_offset = SIZE_MAX,
+	.struct_size = sizeof(struct indexer_settings),
+
+	.parent_offset = SIZE_MAX
+};
+
+const struct indexer_settings *indexer_settings;
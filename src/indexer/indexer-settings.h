@@ -0,0 +1,18 @@
+#ifndef INDEXER_SETTINGS_H
+#define INDEXER_SETTINGS_H
+
+struct indexer_settings {
+	/* Maximum number of indexer-worker processes indexing different
+	   mailboxes of the same user in parallel. 0 = unlimited. */
+	unsigned int indexer_user_process_limit;
+	/* Index at most this many messages of a background request at a
+	   time. The rest of the request is then added back to the end of the
+	   queue, so interactive and other users' requests don't have to wait
+	   for the whole mailbox to be indexed. 0 = unlimited. */
+	unsigned int indexer_background_slice_messages;
+};
+
+extern const struct setting_parser_info indexer_setting_parser_info;
+extern const struct indexer_settings *indexer_settings;
+
+#endif
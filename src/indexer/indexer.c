@@ -8,6 +8,7 @@
 #include "master-service-settings.h"
 #include "indexer-client.h"
 #include "indexer-queue.h"
+#include "indexer-settings.h"
 #include "worker-connection.h"
 
 static const struct master_service_settings *set;
@@ -47,21 +48,33 @@ static bool worker_send_request(struct indexer_request *request)
 		return FALSE;
 	indexer_queue_request_remove(queue);
 	indexer_queue_request_work(request);
+	if (!request->interactive) {
+		/* let other users' background requests run before this
+		   user's next ones */
+		indexer_queue_move_user_to_tail(queue, request->username);
+	}
 	return TRUE;
 }
 
 static void queue_try_send_more(struct indexer_queue *queue)
 {
-	struct worker_connection *worker;
 	struct indexer_request *request, *first_moved_request = NULL;
+	unsigned int user_count, user_limit;
+	bool mailbox_busy;
+
+	user_limit = indexer_settings->indexer_user_process_limit;
 
 	while ((request = indexer_queue_request_peek(queue)) != NULL) {
-		worker = worker_connections_find_user(request->username);
-		if (worker != NULL) {
-			/* There is already a connection handling a request
-			 * for this user. Move the request to the back of the
-			 * queue and handle requests from other users.
-			 * Terminate if we went through all requests. */
+		user_count = worker_connections_get_user_count(
+			request->username, request->mailbox, &mailbox_busy);
+		if (mailbox_busy ||
+		    (user_limit != 0 && user_count >= user_limit)) {
+			/* There are already too many connections handling
+			 * requests for this user, or one of them is indexing
+			 * this same mailbox. Move the request to the back of
+			 * the queue and handle requests from other users and
+			 * mailboxes. Terminate if we went through all
+			 * requests. */
 			if (request == first_moved_request) {
 				/* all requests are waiting for existing users
 				   to finish. */
@@ -92,6 +105,10 @@ worker_status_callback(int percentage, struct indexer_request *request)
 					     percentage);
 		return;
 	}
+	if (percentage == INDEXER_STATUS_CONTINUE) {
+		indexer_queue_request_continue(queue, &request);
+		return;
+	}
 
 	indexer_queue_request_finish(queue, &request,
 				     percentage == 100);
@@ -105,16 +122,23 @@ static void worker_avail_callback(void)
 
 int main(int argc, char *argv[])
 {
+	const struct setting_parser_info *set_roots[] = {
+		&indexer_setting_parser_info,
+		NULL
+	};
 	const char *error;
+	void **sets;
 
 	master_service = master_service_init("indexer", 0, &argc, &argv, "");
 	if (master_getopt(master_service) > 0)
 		return FATAL_DEFAULT;
 
-	if (master_service_settings_read_simple(master_service, NULL,
+	if (master_service_settings_read_simple(master_service, set_roots,
 						&error) < 0)
 		i_fatal("Error reading configuration: %s", error);
 	set = master_service_settings_get(master_service);
+	sets = master_service_settings_get_others(master_service);
+	indexer_settings = sets[0];
 
 	master_service_init_log(master_service);
 	restrict_access_by_env(RESTRICT_ACCESS_FLAG_ALLOW_ROOT, NULL);
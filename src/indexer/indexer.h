@@ -3,7 +3,12 @@
 
 struct indexer_request;
 
-/* percentage: -1 = failed, 0..99 = indexing in progress, 100 = done */
+/* Returned as the percentage when only a part of the request was indexed,
+   and it needs to be continued later. */
+#define INDEXER_STATUS_CONTINUE 101
+
+/* percentage: -1 = failed, 0..99 = indexing in progress, 100 = done,
+   INDEXER_STATUS_CONTINUE = partially done */
 typedef void
 indexer_status_callback_t(int percentage, struct indexer_request *request);
 
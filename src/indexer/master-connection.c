@@ -19,7 +19,7 @@
 #include <unistd.h>
 
 #define INDEXER_PROTOCOL_MAJOR_VERSION 1
-#define INDEXER_PROTOCOL_MINOR_VERSION 0
+#define INDEXER_PROTOCOL_MINOR_VERSION 1
 
 #define INDEXER_MASTER_NAME "indexer-master-worker"
 #define INDEXER_WORKER_NAME "indexer-worker-master"
@@ -63,7 +63,8 @@ get_attempt_error(unsigned int counter, uint32_t first_uid, uint32_t last_uid)
 }
 
 static int
-index_mailbox_precache(struct master_connection *conn, struct mailbox *box)
+index_mailbox_precache(struct master_connection *conn, struct mailbox *box,
+		       unsigned int max_messages, bool *unfinished_r)
 {
 	struct mail_storage *storage = mailbox_get_storage(box);
 	const char *username = mail_storage_get_user(storage)->username;
@@ -76,7 +77,7 @@ index_mailbox_precache(struct master_connection *conn, struct mailbox *box)
 	struct mail_search_context *ctx;
 	struct mail *mail;
 	struct mailbox_metadata metadata;
-	uint32_t seq, first_uid = 0, last_uid = 0;
+	uint32_t seq, last_seq, first_uid = 0, last_uid = 0;
 	char percentage_str[2+1+1];
 	unsigned int counter = 0, max, percentage, percentage_sent = 0;
 	int ret = 0;
@@ -98,11 +99,19 @@ index_mailbox_precache(struct master_connection *conn, struct mailbox *box)
 		return -1;
 	}
 	seq = status.last_cached_seq + 1;
+	last_seq = status.messages;
+	if (max_messages != 0 && last_seq >= seq &&
+	    last_seq - seq >= max_messages) {
+		/* index only a slice of the mailbox now. The indexer will
+		   send the rest of it later on. */
+		last_seq = seq + max_messages - 1;
+		*unfinished_r = TRUE;
+	}
 
 	trans = mailbox_transaction_begin(box, MAILBOX_TRANSACTION_FLAG_NO_CACHE_DEC,
 					  "indexing");
 	search_args = mail_search_build_init();
-	mail_search_build_add_seqset(search_args, seq, status.messages);
+	mail_search_build_add_seqset(search_args, seq, last_seq);
 
 	event_enable_user_cpu_usecs(index_event);
 
@@ -110,7 +119,7 @@ index_mailbox_precache(struct master_connection *conn, struct mailbox *box)
 				  metadata.precache_fields, NULL);
 	mail_search_args_unref(&search_args);
 
-	max = status.messages + 1 - seq;
+	max = last_seq + 1 - seq;
 	while (mailbox_search_next(ctx, &mail)) {
 		if (first_uid == 0)
 			first_uid = mail->uid;
@@ -178,6 +187,14 @@ index_mailbox_precache(struct master_connection *conn, struct mailbox *box)
 			set_name(FINISHED_EVENT_NAME);
 		e_debug(e->event(), "Indexed %u messages%s", counter, uids);
 	}
+	if (ret == 0 && *unfinished_r) {
+		/* Continue only if the slice made some progress. Otherwise
+		   the same messages would just be attempted again. */
+		if (mailbox_get_status(box, STATUS_LAST_CACHED_SEQ,
+				       &status) < 0 ||
+		    status.last_cached_seq < seq)
+			*unfinished_r = FALSE;
+	}
 	event_unref(&index_event);
 	return ret;
 }
@@ -185,7 +202,7 @@ index_mailbox_precache(struct master_connection *conn, struct mailbox *box)
 static int
 index_mailbox(struct master_connection *conn, struct mail_user *user,
 	      const char *mailbox, unsigned int max_recent_msgs,
-	      const char *what)
+	      const char *what, unsigned int max_messages, bool *unfinished_r)
 {
 	struct mail_namespace *ns;
 	struct mailbox *box;
@@ -243,7 +260,8 @@ index_mailbox(struct master_connection *conn, struct mail_user *user,
 		}
 		ret = -1;
 	} else if (strchr(what, 'i') != NULL) {
-		if (index_mailbox_precache(conn, box) < 0)
+		if (index_mailbox_precache(conn, box, max_messages,
+					   unfinished_r) < 0)
 			ret = -1;
 	}
 	mailbox_free(&box);
@@ -254,7 +272,8 @@ static int
 master_connection_cmd_index(struct master_connection *conn,
 			    const char *username, const char *mailbox,
 			    const char *session_id,
-			    unsigned int max_recent_msgs, const char *what)
+			    unsigned int max_recent_msgs, const char *what,
+			    unsigned int max_messages, bool *unfinished_r)
 {
 	struct mail_storage_service_input input;
 	struct mail_storage_service_user *service_user;
@@ -291,7 +310,8 @@ master_connection_cmd_index(struct master_connection *conn,
 	indexer_worker_refresh_proctitle(user->username, mailbox, 0, 0);
 	struct event_reason *reason =
 		event_reason_begin("indexer:index_mailbox");
-	ret = index_mailbox(conn, user, mailbox, max_recent_msgs, what);
+	ret = index_mailbox(conn, user, mailbox, max_recent_msgs, what,
+			    max_messages, unfinished_r);
 	event_reason_end(&reason);
 	/* refresh proctitle before a potentially long-running
 	   user unref */
@@ -314,12 +334,15 @@ master_connection_input_args(struct connection *_conn, const char *const *args)
 	struct master_connection *conn =
 		container_of(_conn, struct master_connection, conn);
 	const char *str;
-	unsigned int max_recent_msgs;
+	unsigned int max_recent_msgs, max_messages = 0;
+	bool unfinished = FALSE;
 	int ret;
 
-	/* <username> <mailbox> <session ID> <max_recent_msgs> [i][o] */
-	if (str_array_length(args) != 5 ||
-	    str_to_uint(args[3], &max_recent_msgs) < 0 || args[4][0] == '\0') {
+	/* <username> <mailbox> <session ID> <max_recent_msgs> [i][o]
+	   [<max_messages>] */
+	if (str_array_length(args) < 5 ||
+	    str_to_uint(args[3], &max_recent_msgs) < 0 || args[4][0] == '\0' ||
+	    (args[5] != NULL && str_to_uint(args[5], &max_messages) < 0)) {
 		e_error(conn->conn.event, "Invalid input from master: %s",
 			t_strarray_join(args, "\t"));
 		return -1;
@@ -330,9 +353,15 @@ master_connection_input_args(struct connection *_conn, const char *const *args)
 	const char *what = args[4];
 
 	ret = master_connection_cmd_index(conn, username, mailbox, session_id,
-					  max_recent_msgs, what);
-
-	str = ret < 0 ? "-1\n" : "100\n";
+					  max_recent_msgs, what, max_messages,
+					  &unfinished);
+
+	if (ret < 0)
+		str = "-1\n";
+	else if (unfinished)
+		str = "0\tcontinue\n";
+	else
+		str = "100\n";
 	o_stream_nsend_str(conn->conn.output, str);
 	return ret;
 }
@@ -233,6 +233,114 @@ static void test_indexer_queue_iter(void)
 	test_end();
 }
 
+static void test_indexer_queue_continue(void)
+{
+	struct indexer_queue *queue;
+	struct indexer_request *request;
+
+	test_begin("indexer queue continue");
+	queue = indexer_queue_init(indexer_queue_status_callback);
+
+	indexer_queue_append(queue, TRUE, "user1", "mailbox1", "session1", 0, NULL);
+	indexer_queue_append(queue, TRUE, "user2", "mailbox2", "session2", 0, NULL);
+
+	request = indexer_queue_request_peek(queue);
+	test_assert_strcmp(request->mailbox, "mailbox1");
+	test_assert(!request->interactive);
+	indexer_queue_request_remove(queue);
+	indexer_queue_request_work(request);
+
+	/* an unfinished background request goes to the end of the queue */
+	indexer_queue_request_continue(queue, &request);
+	request = indexer_queue_request_peek(queue);
+	test_assert_strcmp(request->mailbox, "mailbox2");
+	test_assert_strcmp(request->next->mailbox, "mailbox1");
+	test_assert(!request->next->working);
+	test_assert(indexer_queue_count(queue) == 2);
+
+	/* continue working on it */
+	indexer_queue_move_head_to_tail(queue);
+	request = indexer_queue_request_peek(queue);
+	test_assert_strcmp(request->mailbox, "mailbox1");
+	indexer_queue_request_remove(queue);
+	indexer_queue_request_work(request);
+
+	/* a search for the mailbox while working on it makes it interactive
+	   and puts it back to the head of the queue */
+	indexer_queue_append(queue, FALSE, "user1", "mailbox1", "session1", 0, NULL);
+	test_assert(request->interactive);
+	test_assert(request->reindex_head);
+	indexer_queue_request_continue(queue, &request);
+	request = indexer_queue_request_peek(queue);
+	test_assert_strcmp(request->mailbox, "mailbox1");
+	test_assert(!request->reindex_head);
+
+	/* cancelled requests aren't continued */
+	indexer_queue_request_remove(queue);
+	indexer_queue_request_work(request);
+	indexer_queue_cancel(queue, "user1", NULL);
+	indexer_queue_request_continue(queue, &request);
+	test_assert(indexer_queue_count(queue) == 1);
+	request = indexer_queue_request_peek(queue);
+	test_assert_strcmp(request->mailbox, "mailbox2");
+	test_assert(request->next == NULL);
+
+	indexer_queue_cancel_all(queue);
+	indexer_queue_deinit(&queue);
+	test_end();
+}
+
+static void test_indexer_queue_move_user_to_tail(void)
+{
+	struct indexer_queue *queue;
+	struct indexer_request *request;
+	unsigned int i;
+
+	test_begin("indexer queue move user to tail");
+	queue = indexer_queue_init(indexer_queue_status_callback);
+
+	indexer_queue_append(queue, TRUE, "user1", "mailbox1", "session1", 0, NULL);
+	indexer_queue_append(queue, TRUE, "user1", "mailbox2", "session1", 0, NULL);
+	indexer_queue_append(queue, TRUE, "user1", "mailbox3", "session1", 0, NULL);
+	indexer_queue_append(queue, TRUE, "user2", "mailbox1", "session2", 0, NULL);
+	indexer_queue_append(queue, FALSE, "user1", "inbox", "session1", 0, NULL);
+
+	/* start working on user1's first background request */
+	indexer_queue_move_head_to_tail(queue);
+	request = indexer_queue_request_peek(queue);
+	test_assert_strcmp(request->mailbox, "mailbox1");
+	indexer_queue_request_remove(queue);
+	indexer_queue_request_work(request);
+
+	/* user1's other background requests are moved after user2's, but the
+	   interactive one isn't */
+	indexer_queue_move_user_to_tail(queue, "user1");
+	indexer_queue_move_user_to_tail(queue, "user-none");
+
+	static const struct {
+		const char *username;
+		const char *mailbox;
+	} expected[] = {
+		{ "user2", "mailbox1" },
+		{ "user1", "inbox" },
+		{ "user1", "mailbox2" },
+		{ "user1", "mailbox3" },
+	};
+	struct indexer_request *next = indexer_queue_request_peek(queue);
+	for (i = 0; i < N_ELEMENTS(expected); i++) {
+		test_assert_strcmp_idx(next->username, expected[i].username, i);
+		test_assert_strcmp_idx(next->mailbox, expected[i].mailbox, i);
+		next = next->next;
+	}
+	test_assert(next == NULL);
+
+	indexer_queue_request_finish(queue, &request, TRUE);
+	indexer_queue_cancel_all(queue);
+	test_assert(indexer_queue_count(queue) == 0);
+	indexer_queue_deinit(&queue);
+	test_end();
+}
+
 int main(void)
 {
 	static void (*const test_functions[])(void) = {
@@ -240,6 +348,8 @@ int main(void)
 		test_indexer_queue_reindex,
 		test_indexer_queue_cancel,
 		test_indexer_queue_iter,
+		test_indexer_queue_continue,
+		test_indexer_queue_move_user_to_tail,
 		NULL
 	};
 	return test_run(test_functions);
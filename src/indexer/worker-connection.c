@@ -12,12 +12,13 @@
 #include "strescape.h"
 #include "master-service.h"
 #include "indexer-queue.h"
+#include "indexer-settings.h"
 #include "worker-connection.h"
 
 #include <unistd.h>
 
 #define INDEXER_PROTOCOL_MAJOR_VERSION 1
-#define INDEXER_PROTOCOL_MINOR_VERSION 0
+#define INDEXER_PROTOCOL_MINOR_VERSION 1
 
 #define INDEXER_MASTER_NAME "indexer-master-worker"
 #define INDEXER_WORKER_NAME "indexer-worker-master"
@@ -30,6 +31,7 @@ struct worker_connection {
 
 	pid_t pid;
 	char *request_username;
+	char *request_mailbox;
 	struct indexer_request *request;
 };
 
@@ -41,7 +43,7 @@ static void worker_connection_call_callback(struct worker_connection *worker,
 {
 	if (worker->request != NULL)
 		worker->callback(percentage, worker->request);
-	if (percentage < 0 || percentage == 100)
+	if (percentage < 0 || percentage >= 100)
 		worker->request = NULL;
 }
 
@@ -52,6 +54,7 @@ static void worker_connection_destroy(struct connection *conn)
 
 	worker_connection_call_callback(worker, -1);
 	i_free_and_null(worker->request_username);
+	i_free_and_null(worker->request_mailbox);
 	connection_deinit(conn);
 
 	worker->avail_callback();
@@ -107,6 +110,10 @@ worker_connection_input_args(struct connection *conn, const char *const *args)
 
 	if (percentage < 0)
 		ret = -1;
+	else if (args[1] != NULL && strcmp(args[1], "continue") == 0) {
+		/* the worker indexed a slice of the request */
+		percentage = INDEXER_STATUS_CONTINUE;
+	}
 
 	worker_connection_call_callback(worker, percentage);
 	if (worker->request == NULL) {
@@ -122,6 +129,7 @@ worker_connection_send_request(struct worker_connection *worker,
 			       struct indexer_request *request)
 {
 	worker->request_username = i_strdup(request->username);
+	worker->request_mailbox = i_strdup(request->mailbox);
 	worker->request = request;
 
 	T_BEGIN {
@@ -142,7 +150,8 @@ worker_connection_send_request(struct worker_connection *worker,
 			str_append_c(str, 'o');
 			break;
 		}
-		str_append_c(str, '\n');
+		str_printfa(str, "\t%u\n", request->interactive ? 0 :
+			    indexer_settings->indexer_background_slice_messages);
 		o_stream_nsend(worker->conn.output, str_data(str), str_len(str));
 	} T_END;
 }
@@ -205,16 +214,23 @@ unsigned int worker_connections_get_count(void)
 	return worker_connections->connections_count;
 }
 
-struct worker_connection *worker_connections_find_user(const char *username)
+unsigned int
+worker_connections_get_user_count(const char *username, const char *mailbox,
+				  bool *mailbox_busy_r)
 {
 	struct connection *conn;
+	unsigned int count = 0;
 
+	*mailbox_busy_r = FALSE;
 	for (conn = worker_connections->connections; conn != NULL; conn = conn->next) {
 		struct worker_connection *worker =
 			container_of(conn, struct worker_connection, conn);
 
-		if (strcmp(worker->request_username, username) == 0)
-			return worker;
+		if (strcmp(worker->request_username, username) != 0)
+			continue;
+		if (strcmp(worker->request_mailbox, mailbox) == 0)
+			*mailbox_busy_r = TRUE;
+		count++;
 	}
-	return NULL;
+	return count;
 }
@@ -18,7 +18,11 @@ int worker_connection_try_create(const char *socket_path,
 				 worker_available_callback_t *avail_callback);
 
 unsigned int worker_connections_get_count(void);
-struct worker_connection *worker_connections_find_user(const char *username);
+/* Returns the number of worker connections handling requests for the user.
+   mailbox_busy_r is set to TRUE if one of them is for the given mailbox. */
+unsigned int
+worker_connections_get_user_count(const char *username, const char *mailbox,
+				  bool *mailbox_busy_r);
 
 void worker_connections_init(void);
 void worker_connections_deinit(void);
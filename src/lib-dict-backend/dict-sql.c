@@ -510,7 +510,8 @@ sql_dict_result_unescape(enum dict_sql_type type, pool_t pool,
 
 static const char *const *
 sql_dict_result_unescape_values(const struct dict_sql_map *map, pool_t pool,
-				struct sql_result *result)
+				struct sql_result *result,
+				unsigned int first_result_idx)
 {
 	const char **values;
 	unsigned int i;
@@ -518,7 +519,8 @@ sql_dict_result_unescape_values(const struct dict_sql_map *map, pool_t pool,
 	values = p_new(pool, const char *, map->values_count + 1);
 	for (i = 0; i < map->values_count; i++) {
 		values[i] = sql_dict_result_unescape(map->value_types[i],
-						     pool, result, i);
+						     pool, result,
+						     first_result_idx + i);
 	}
 	return values;
 }
@@ -554,7 +556,7 @@ static int sql_dict_lookup(struct dict *_dict, const struct dict_op_settings *se
 		*error_r = t_strdup_printf("dict sql lookup failed: %s",
 					   sql_result_get_error(result));
 	} else if (ret > 0) {
-		*values_r = sql_dict_result_unescape_values(map, pool, result);
+		*values_r = sql_dict_result_unescape_values(map, pool, result, 0);
 	}
 
 	sql_result_unref(result);
@@ -579,7 +581,7 @@ sql_dict_lookup_async_callback(struct sql_result *sql_result,
 		result.error = sql_result_get_error(sql_result);
 	else if (result.ret > 0) {
 		result.values = sql_dict_result_unescape_values(ctx->map,
-			pool_datastack_create(), sql_result);
+			pool_datastack_create(), sql_result, 0);
 		result.value = result.values[0];
 		if (result.value == NULL) {
 			/* NULL value returned. we'll treat this as
@@ -621,6 +623,230 @@ sql_dict_lookup_async(struct dict *_dict,
 	}
 }
 
+struct sql_dict_lookup_multi_key {
+	const struct dict_sql_map *map;
+	ARRAY_TYPE(const_string) pattern_values;
+	/* index of the query and its first result field used for the key */
+	unsigned int query_idx, first_result_idx;
+};
+
+struct sql_dict_lookup_multi_query {
+	struct sql_dict_lookup_multi_context *ctx;
+	unsigned int idx;
+
+	/* used only while building the queries */
+	unsigned int first_key_idx;
+	string_t *fields;
+	unsigned int fields_count;
+};
+
+struct sql_dict_lookup_multi_context {
+	pool_t pool;
+	dict_lookup_multi_callback_t *callback;
+	void *context;
+
+	struct sql_dict_lookup_multi_key *keys;
+	struct dict_lookup_result *results;
+	unsigned int count, pending_count;
+};
+
+static bool
+sql_dict_lookup_keys_are_mergeable(const char *key1,
+				   const struct sql_dict_lookup_multi_key *lkey1,
+				   const char *key2,
+				   const struct sql_dict_lookup_multi_key *lkey2)
+{
+	const struct dict_sql_map *map1 = lkey1->map, *map2 = lkey2->map;
+	const struct dict_sql_field *fields1, *fields2;
+	unsigned int i, count1, count2;
+
+	/* sql table names must equal */
+	if (strcmp(map1->table, map2->table) != 0)
+		return FALSE;
+	/* private vs shared prefix must equal */
+	if (key1[0] != key2[0])
+		return FALSE;
+	if (key1[0] == DICT_PATH_PRIVATE[0]) {
+		/* for private keys, username must equal */
+		if (strcmp(map1->username_field, map2->username_field) != 0)
+			return FALSE;
+	}
+	/* the WHERE must be the same: same pattern fields with exactly the
+	   same values */
+	fields1 = array_get(&map1->pattern_fields, &count1);
+	fields2 = array_get(&map2->pattern_fields, &count2);
+	if (count1 != count2)
+		return FALSE;
+	for (i = 0; i < count1; i++) {
+		if (strcmp(fields1[i].name, fields2[i].name) != 0 ||
+		    fields1[i].value_type != fields2[i].value_type)
+			return FALSE;
+	}
+	return array_equal_fn(&lkey1->pattern_values, &lkey2->pattern_values,
+			      i_strcmp_p);
+}
+
+static void
+sql_dict_lookup_multi_finish_one(struct sql_dict_lookup_multi_context *ctx)
+{
+	i_assert(ctx->pending_count > 0);
+	if (--ctx->pending_count > 0)
+		return;
+
+	ctx->callback(ctx->results, ctx->count, ctx->context);
+	pool_unref(&ctx->pool);
+}
+
+static void
+sql_dict_lookup_multi_set_error(struct sql_dict_lookup_multi_context *ctx,
+				unsigned int query_idx, const char *error)
+{
+	unsigned int i;
+
+	for (i = 0; i < ctx->count; i++) {
+		if (ctx->keys[i].query_idx == query_idx) {
+			ctx->results[i].ret = -1;
+			ctx->results[i].error = p_strdup(ctx->pool, error);
+		}
+	}
+}
+
+static void
+sql_dict_lookup_multi_callback(struct sql_result *sql_result,
+			       struct sql_dict_lookup_multi_query *query)
+{
+	struct sql_dict_lookup_multi_context *ctx = query->ctx;
+	struct dict_lookup_result *result;
+	unsigned int i;
+	int ret;
+
+	ret = sql_result_next_row(sql_result);
+	if (ret < 0) {
+		sql_dict_lookup_multi_set_error(ctx, query->idx,
+			sql_result_get_error(sql_result));
+	} else for (i = 0; i < ctx->count; i++) {
+		if (ctx->keys[i].query_idx != query->idx)
+			continue;
+
+		result = &ctx->results[i];
+		result->ret = ret;
+		if (ret == 0)
+			continue;
+		result->values = sql_dict_result_unescape_values(
+			ctx->keys[i].map, ctx->pool, sql_result,
+			ctx->keys[i].first_result_idx);
+		result->value = result->values[0];
+		if (result->value == NULL) {
+			/* NULL value returned. we'll treat this as
+			   "not found", which is probably what is usually
+			   wanted. */
+			result->ret = 0;
+		}
+	}
+	sql_dict_lookup_multi_finish_one(ctx);
+}
+
+static void
+sql_dict_lookup_multi_async(struct dict *_dict,
+			    const struct dict_op_settings *set,
+			    const char *const *keys,
+			    dict_lookup_multi_callback_t *callback,
+			    void *context)
+{
+	struct sql_dict *dict = (struct sql_dict *)_dict;
+	struct sql_dict_lookup_multi_context *ctx;
+	struct sql_dict_lookup_multi_key *lkey;
+	struct sql_dict_lookup_multi_query *query;
+	ARRAY(struct sql_dict_lookup_multi_query *) queries;
+	const char *error;
+	unsigned int i, j;
+	pool_t pool;
+
+	pool = pool_alloconly_create("sql dict lookup multi", 512);
+	ctx = p_new(pool, struct sql_dict_lookup_multi_context, 1);
+	ctx->pool = pool;
+	ctx->callback = callback;
+	ctx->context = context;
+	ctx->count = str_array_length(keys);
+	ctx->keys = p_new(pool, struct sql_dict_lookup_multi_key, ctx->count);
+	ctx->results = p_new(pool, struct dict_lookup_result, ctx->count);
+
+	/* Keys that differ only by their value field are looked up with a
+	   single query that selects all of their value fields. This is
+	   common e.g. with quota where all the values are in the same row. */
+	t_array_init(&queries, ctx->count);
+	for (i = 0; i < ctx->count; i++) {
+		lkey = &ctx->keys[i];
+		lkey->query_idx = UINT_MAX;
+		lkey->map = sql_dict_find_map(dict, keys[i],
+					      &lkey->pattern_values);
+		if (lkey->map == NULL) {
+			ctx->results[i].ret = -1;
+			ctx->results[i].error = p_strdup_printf(pool,
+				"sql dict lookup: Invalid/unmapped key: %s",
+				keys[i]);
+			continue;
+		}
+
+		query = NULL;
+		for (j = 0; j < array_count(&queries); j++) {
+			query = array_idx_elem(&queries, j);
+			if (sql_dict_lookup_keys_are_mergeable(
+					keys[query->first_key_idx],
+					&ctx->keys[query->first_key_idx],
+					keys[i], lkey))
+				break;
+			query = NULL;
+		}
+		if (query == NULL) {
+			query = p_new(pool, struct sql_dict_lookup_multi_query, 1);
+			query->ctx = ctx;
+			query->idx = array_count(&queries);
+			query->first_key_idx = i;
+			query->fields = t_str_new(64);
+			array_push_back(&queries, &query);
+		} else {
+			str_append_c(query->fields, ',');
+		}
+		str_append(query->fields, lkey->map->value_field);
+		lkey->query_idx = query->idx;
+		lkey->first_result_idx = query->fields_count;
+		query->fields_count += lkey->map->values_count;
+	}
+
+	/* The extra pending count prevents finishing before all the queries
+	   have been sent. */
+	ctx->pending_count = array_count(&queries) + 1;
+	array_foreach_elem(&queries, query) {
+		const struct sql_dict_lookup_multi_key *first_key =
+			&ctx->keys[query->first_key_idx];
+		const char *first_key_str = keys[query->first_key_idx];
+		struct sql_statement *stmt;
+		ARRAY_TYPE(sql_dict_param) params;
+		string_t *query_str = t_str_new(256);
+
+		t_array_init(&params, 4);
+		str_printfa(query_str, "SELECT %s FROM %s",
+			    str_c(query->fields), first_key->map->table);
+		if (sql_dict_where_build(set->username, first_key->map,
+					 &first_key->pattern_values,
+					 first_key_str[0] == DICT_PATH_PRIVATE[0],
+					 SQL_DICT_RECURSE_NONE, query_str,
+					 &params, &error) < 0) {
+			sql_dict_lookup_multi_set_error(ctx, query->idx,
+				t_strdup_printf(
+					"sql dict lookup: Failed to lookup key %s: %s",
+					first_key_str, error));
+			sql_dict_lookup_multi_finish_one(ctx);
+			continue;
+		}
+		stmt = sql_dict_statement_init(dict, str_c(query_str), &params);
+		sql_statement_query(&stmt, sql_dict_lookup_multi_callback,
+				    query);
+	}
+	sql_dict_lookup_multi_finish_one(ctx);
+}
+
 static const struct dict_sql_map *
 sql_dict_iterate_find_next_map(struct sql_dict_iterate_context *ctx,
 			       ARRAY_TYPE(const_string) *pattern_values)
@@ -886,7 +1112,7 @@ static bool sql_dict_iterate(struct dict_iterate_context *_ctx,
 	*key_r = str_c(ctx->key);
 	if ((ctx->flags & DICT_ITERATE_FLAG_NO_VALUE) == 0) {
 		*values_r = sql_dict_result_unescape_values(ctx->map,
-			pool_datastack_create(), ctx->result);
+			pool_datastack_create(), ctx->result, 0);
 	}
 	return TRUE;
 }
@@ -1533,6 +1759,7 @@ static struct dict sql_dict = {
 		.unset = sql_dict_unset,
 		.atomic_inc = sql_dict_atomic_inc,
 		.lookup_async = sql_dict_lookup_async,
+		.lookup_multi_async = sql_dict_lookup_multi_async,
 	}
 };
 
@@ -78,6 +78,75 @@ static void test_lookup_one(void)
 	test_end();
 }
 
+static void
+test_lookup_multi_callback(const struct dict_lookup_result *results,
+			   unsigned int count, unsigned int *called_r)
+{
+	test_assert(count == 5);
+	if (count != 5)
+		return;
+	/* the quota keys were looked up with a single query */
+	test_assert(results[0].ret == 1);
+	test_assert_strcmp(results[0].value, "100");
+	test_assert(results[1].ret == 0);
+	test_assert(results[2].ret == 1);
+	test_assert_strcmp(results[2].value, "10");
+	test_assert(results[3].ret == -1);
+	test_assert(results[3].error != NULL);
+	test_assert(results[4].ret == 1);
+	test_assert_strcmp(results[4].value, "100");
+	(*called_r)++;
+}
+
+static void test_lookup_multi(void)
+{
+	struct test_driver_result_set quota_rset = {
+		.rows = 1,
+		.cols = 3,
+		.col_names = (const char *[]){"bytes", "count", "bytes", NULL},
+		.row_data = (const char **[]){(const char*[]){"100", "10", "100", NULL}},
+	};
+	struct test_driver_result quota_res = {
+		.nqueries = 1,
+		.queries = (const char *[]){"SELECT bytes,count,bytes FROM quota WHERE username = 'testuser'", NULL},
+		.result = &quota_rset,
+	};
+	struct test_driver_result_set dictmap_rset = {
+		.rows = 0,
+		.cols = 1,
+		.col_names = (const char *[]){"value", NULL},
+	};
+	struct test_driver_result dictmap_res = {
+		.nqueries = 1,
+		.queries = (const char *[]){"SELECT value FROM table WHERE a = 'hello' AND b = 'world'", NULL},
+		.result = &dictmap_rset,
+	};
+	const char *const keys[] = {
+		"priv/quota/bytes",
+		"shared/dictmap/hello/world",
+		"priv/quota/count",
+		"priv/unmapped",
+		"priv/quota/bytes",
+		NULL
+	};
+	unsigned int called = 0;
+	struct dict *dict;
+
+	test_begin("dict lookup multi");
+	test_setup(&dict);
+
+	test_set_expected(dict, &quota_res);
+	test_set_expected(dict, &dictmap_res);
+
+	dict_lookup_multi_async(dict, &dict_op_settings, keys,
+				test_lookup_multi_callback, &called);
+	dict_wait(dict);
+	test_assert(called == 1);
+
+	test_teardown(&dict);
+	test_end();
+}
+
 static void test_atomic_inc(void)
 {
 	const char *error;
@@ -297,6 +366,7 @@ int main(void) {
 
 	static void (*const test_functions[])(void) = {
 		test_lookup_one,
+		test_lookup_multi,
 		test_atomic_inc,
 		test_set,
 		test_unset,
@@ -10,6 +10,7 @@ void dict_drivers_register_builtin(void)
 	if (refcount++ > 0)
 		return;
 	dict_driver_register(&dict_driver_client);
+	dict_driver_register(&dict_driver_cache);
 	dict_driver_register(&dict_driver_file);
 	dict_driver_register(&dict_driver_fs);
 	dict_driver_register(&dict_driver_redis);
@@ -20,6 +21,7 @@ void dict_drivers_unregister_builtin(void)
 	if (--refcount > 0)
 		return;
 	dict_driver_unregister(&dict_driver_client);
+	dict_driver_unregister(&dict_driver_cache);
 	dict_driver_unregister(&dict_driver_file);
 	dict_driver_unregister(&dict_driver_fs);
 	dict_driver_unregister(&dict_driver_redis);
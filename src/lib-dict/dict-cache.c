@@ -0,0 +1,673 @@
+/* Copyright (c) 2023 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "hash.h"
+#include "llist.h"
+#include "str.h"
+#include "strescape.h"
+#include "ioloop.h"
+#include "dict-private.h"
+
+/* Cache lookups of existing keys this many seconds by default. */
+#define DICT_CACHE_DEFAULT_TTL_SECS 60
+/* Cache lookups of nonexistent keys this many seconds by default. */
+#define DICT_CACHE_DEFAULT_NEGATIVE_TTL_SECS 10
+/* Maximum number of cached keys by default. */
+#define DICT_CACHE_DEFAULT_MAX_KEYS 10000
+
+struct cache_dict_entry {
+	/* LRU list - head is the most recently used entry */
+	struct cache_dict_entry *prev, *next;
+
+	char *key;
+	/* NULL if the key doesn't exist */
+	char **values;
+	time_t expire_time;
+};
+
+struct cache_dict {
+	struct dict dict;
+	struct dict *child;
+
+	unsigned int ttl_secs, negative_ttl_secs, max_keys;
+	bool watch;
+
+	HASH_TABLE(char *, struct cache_dict_entry *) entries;
+	struct cache_dict_entry *lru_head, *lru_tail;
+	/* Increased whenever anything is invalidated. Lookup results are
+	   cached only if nothing was invalidated while they were running,
+	   otherwise the result could already be stale. */
+	unsigned int generation;
+};
+
+struct cache_dict_lookup_context {
+	struct cache_dict *dict;
+	char *cache_key;
+	unsigned int generation;
+
+	dict_lookup_callback_t *callback;
+	void *context;
+};
+
+struct cache_dict_lookup_multi_context {
+	pool_t pool;
+	struct cache_dict *dict;
+	unsigned int generation;
+
+	struct dict_lookup_result *results;
+	unsigned int count;
+	/* cache keys and result indexes of the keys looked up from child */
+	const char **missing_cache_keys;
+	unsigned int *missing_idx;
+
+	dict_lookup_multi_callback_t *callback;
+	void *context;
+};
+
+struct cache_dict_iterate_context {
+	struct dict_iterate_context ctx;
+	struct dict_iterate_context *child_iter;
+};
+
+struct cache_dict_transaction_context {
+	struct dict_transaction_context ctx;
+	struct dict_transaction_context *child_ctx;
+
+	pool_t pool;
+	ARRAY_TYPE(const_string) changed_keys;
+
+	dict_transaction_commit_callback_t *callback;
+	void *context;
+};
+
+static void
+cache_dict_op_settings_get(const struct dict_op_settings_private *set_private,
+			   struct dict_op_settings *set_r)
+{
+	i_zero(set_r);
+	set_r->username = set_private->username;
+	set_r->home_dir = set_private->home_dir;
+	set_r->no_slowness_warning = set_private->no_slowness_warning;
+}
+
+static const char *cache_dict_key(const char *username, const char *key)
+{
+	/* private keys are different for each user */
+	if (key[0] != DICT_PATH_PRIVATE[0])
+		return t_strconcat("s", key, NULL);
+	i_assert(username != NULL);
+	return t_strconcat("p", str_tabescape(username), "\t", key, NULL);
+}
+
+static void
+cache_dict_entry_free(struct cache_dict *dict, struct cache_dict_entry *entry)
+{
+	DLLIST2_REMOVE(&dict->lru_head, &dict->lru_tail, entry);
+	if (entry->values != NULL) {
+		for (unsigned int i = 0; entry->values[i] != NULL; i++)
+			i_free(entry->values[i]);
+		i_free(entry->values);
+	}
+	i_free(entry->key);
+	i_free(entry);
+}
+
+static void
+cache_dict_entry_remove(struct cache_dict *dict, struct cache_dict_entry *entry)
+{
+	hash_table_remove(dict->entries, entry->key);
+	cache_dict_entry_free(dict, entry);
+}
+
+static void cache_dict_invalidate_all(struct cache_dict *dict)
+{
+	dict->generation++;
+	while (dict->lru_head != NULL)
+		cache_dict_entry_free(dict, dict->lru_head);
+	hash_table_clear(dict->entries, FALSE);
+}
+
+static void cache_dict_invalidate(struct cache_dict *dict, const char *cache_key)
+{
+	struct cache_dict_entry *entry;
+
+	dict->generation++;
+	entry = hash_table_lookup(dict->entries, cache_key);
+	if (entry != NULL)
+		cache_dict_entry_remove(dict, entry);
+}
+
+static struct cache_dict_entry *
+cache_dict_entry_lookup(struct cache_dict *dict, const char *cache_key)
+{
+	struct cache_dict_entry *entry;
+
+	entry = hash_table_lookup(dict->entries, cache_key);
+	if (entry == NULL)
+		return NULL;
+	if (entry->expire_time <= ioloop_time) {
+		cache_dict_entry_remove(dict, entry);
+		return NULL;
+	}
+	DLLIST2_REMOVE(&dict->lru_head, &dict->lru_tail, entry);
+	DLLIST2_PREPEND(&dict->lru_head, &dict->lru_tail, entry);
+	return entry;
+}
+
+static void
+cache_dict_entry_add(struct cache_dict *dict, const char *cache_key,
+		     unsigned int generation, int ret,
+		     const char *const *values)
+{
+	struct cache_dict_entry *entry;
+	unsigned int i, ttl_secs;
+
+	if (ret < 0 || generation != dict->generation) {
+		/* failed or possibly stale */
+		return;
+	}
+	ttl_secs = ret > 0 ? dict->ttl_secs : dict->negative_ttl_secs;
+	if (ttl_secs == 0)
+		return;
+
+	entry = hash_table_lookup(dict->entries, cache_key);
+	if (entry != NULL)
+		cache_dict_entry_remove(dict, entry);
+	else if (hash_table_count(dict->entries) >= dict->max_keys)
+		cache_dict_entry_remove(dict, dict->lru_tail);
+
+	entry = i_new(struct cache_dict_entry, 1);
+	entry->key = i_strdup(cache_key);
+	if (ret > 0) {
+		unsigned int count = str_array_length(values);
+
+		entry->values = i_new(char *, count + 1);
+		for (i = 0; i < count; i++)
+			entry->values[i] = i_strdup(values[i]);
+	}
+	entry->expire_time = ioloop_time + ttl_secs;
+	hash_table_insert(dict->entries, entry->key, entry);
+	DLLIST2_PREPEND(&dict->lru_head, &dict->lru_tail, entry);
+}
+
+static void
+cache_dict_entry_get_result(const struct cache_dict_entry *entry, pool_t pool,
+			    struct dict_lookup_result *result_r)
+{
+	/* copy the values, since the entry may be freed before the
+	   result is used */
+	i_zero(result_r);
+	if (entry->values == NULL)
+		result_r->ret = 0;
+	else {
+		result_r->ret = 1;
+		result_r->values = p_strarray_dup(pool,
+			(const char *const *)entry->values);
+		result_r->value = result_r->values[0];
+	}
+}
+
+static void
+cache_dict_changed(const char *username, const char *key, void *context)
+{
+	struct cache_dict *dict = context;
+
+	if (key == NULL)
+		cache_dict_invalidate_all(dict);
+	else if (key[0] == DICT_PATH_PRIVATE[0] && username == NULL) {
+		/* we don't know which user's key it was */
+		cache_dict_invalidate_all(dict);
+	} else T_BEGIN {
+		cache_dict_invalidate(dict, cache_dict_key(username, key));
+	} T_END;
+}
+
+static int
+cache_dict_init(struct dict *driver, const char *uri,
+		const struct dict_settings *set,
+		struct dict **dict_r, const char **error_r)
+{
+	struct cache_dict *dict;
+	struct dict *child;
+	unsigned int ttl_secs = DICT_CACHE_DEFAULT_TTL_SECS;
+	unsigned int negative_ttl_secs = DICT_CACHE_DEFAULT_NEGATIVE_TTL_SECS;
+	unsigned int max_keys = DICT_CACHE_DEFAULT_MAX_KEYS;
+	unsigned int *num_r;
+	const char *p, *value, *error;
+	bool watch = FALSE;
+
+	/* uri = [ttl_secs=<n>:] [negative_ttl_secs=<n>:] [max_keys=<n>:]
+	         [watch=yes:] <child dict uri> */
+	for (;;) {
+		if (str_begins(uri, "ttl_secs=", &value))
+			num_r = &ttl_secs;
+		else if (str_begins(uri, "negative_ttl_secs=", &value))
+			num_r = &negative_ttl_secs;
+		else if (str_begins(uri, "max_keys=", &value))
+			num_r = &max_keys;
+		else if (str_begins(uri, "watch=yes:", &value)) {
+			watch = TRUE;
+			uri = value;
+			continue;
+		} else
+			break;
+
+		p = strchr(value, ':');
+		if (p == NULL ||
+		    str_to_uint(t_strdup_until(value, p), num_r) < 0) {
+			*error_r = t_strdup_printf("Invalid URI: %s", uri);
+			return -1;
+		}
+		uri = p + 1;
+	}
+	if (max_keys == 0) {
+		*error_r = "max_keys must not be 0";
+		return -1;
+	}
+
+	if (dict_init(uri, set, &child, &error) < 0) {
+		*error_r = t_strdup_printf("Failed to initialize child dict: %s",
+					   error);
+		return -1;
+	}
+	if (watch && child->v.set_change_callback == NULL) {
+		*error_r = t_strdup_printf(
+			"watch=yes isn't supported by dict %s", child->name);
+		dict_deinit(&child);
+		return -1;
+	}
+
+	dict = i_new(struct cache_dict, 1);
+	dict->dict = *driver;
+	dict->child = child;
+	dict->ttl_secs = ttl_secs;
+	dict->negative_ttl_secs = negative_ttl_secs;
+	dict->max_keys = max_keys;
+	dict->watch = watch;
+	hash_table_create(&dict->entries, default_pool, 0, str_hash, strcmp);
+	if (watch) {
+		child->v.set_change_callback(child, cache_dict_changed, dict);
+	}
+	*dict_r = &dict->dict;
+	return 0;
+}
+
+static void cache_dict_deinit(struct dict *_dict)
+{
+	struct cache_dict *dict = (struct cache_dict *)_dict;
+
+	if (dict->watch)
+		dict->child->v.set_change_callback(dict->child, NULL, NULL);
+	dict_deinit(&dict->child);
+	cache_dict_invalidate_all(dict);
+	hash_table_destroy(&dict->entries);
+	i_free(dict);
+}
+
+static void cache_dict_wait(struct dict *_dict)
+{
+	struct cache_dict *dict = (struct cache_dict *)_dict;
+
+	dict_wait(dict->child);
+}
+
+static bool cache_dict_switch_ioloop(struct dict *_dict)
+{
+	struct cache_dict *dict = (struct cache_dict *)_dict;
+
+	return dict_switch_ioloop(dict->child);
+}
+
+static int
+cache_dict_lookup(struct dict *_dict, const struct dict_op_settings *set,
+		  pool_t pool, const char *key, const char *const **values_r,
+		  const char **error_r)
+{
+	struct cache_dict *dict = (struct cache_dict *)_dict;
+	const char *cache_key = cache_dict_key(set->username, key);
+	struct cache_dict_entry *entry;
+	unsigned int generation = dict->generation;
+	int ret;
+
+	entry = cache_dict_entry_lookup(dict, cache_key);
+	if (entry != NULL) {
+		if (entry->values == NULL)
+			return 0;
+		*values_r = p_strarray_dup(pool,
+			(const char *const *)entry->values);
+		return 1;
+	}
+
+	*values_r = NULL;
+	ret = dict_lookup_values(dict->child, set, pool, key, values_r, error_r);
+	cache_dict_entry_add(dict, cache_key, generation, ret, *values_r);
+	return ret;
+}
+
+static void
+cache_dict_lookup_async_callback(const struct dict_lookup_result *result,
+				 struct cache_dict_lookup_context *ctx)
+{
+	cache_dict_entry_add(ctx->dict, ctx->cache_key, ctx->generation,
+			     result->ret, result->values);
+	ctx->callback(result, ctx->context);
+	i_free(ctx->cache_key);
+	i_free(ctx);
+}
+
+static void
+cache_dict_lookup_async(struct dict *_dict, const struct dict_op_settings *set,
+			const char *key, dict_lookup_callback_t *callback,
+			void *context)
+{
+	struct cache_dict *dict = (struct cache_dict *)_dict;
+	const char *cache_key = cache_dict_key(set->username, key);
+	struct cache_dict_lookup_context *ctx;
+	struct cache_dict_entry *entry;
+	struct dict_lookup_result result;
+
+	entry = cache_dict_entry_lookup(dict, cache_key);
+	if (entry != NULL) {
+		cache_dict_entry_get_result(entry, pool_datastack_create(),
+					    &result);
+		callback(&result, context);
+		return;
+	}
+
+	ctx = i_new(struct cache_dict_lookup_context, 1);
+	ctx->dict = dict;
+	ctx->cache_key = i_strdup(cache_key);
+	ctx->generation = dict->generation;
+	ctx->callback = callback;
+	ctx->context = context;
+	dict_lookup_async(dict->child, set, key,
+			  cache_dict_lookup_async_callback, ctx);
+}
+
+static void
+cache_dict_lookup_multi_callback(const struct dict_lookup_result *results,
+				 unsigned int count,
+				 struct cache_dict_lookup_multi_context *ctx)
+{
+	struct dict_lookup_result *result;
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		cache_dict_entry_add(ctx->dict, ctx->missing_cache_keys[i],
+				     ctx->generation, results[i].ret,
+				     results[i].values);
+		result = &ctx->results[ctx->missing_idx[i]];
+		*result = results[i];
+	}
+	ctx->callback(ctx->results, ctx->count, ctx->context);
+	pool_unref(&ctx->pool);
+}
+
+static void
+cache_dict_lookup_multi_async(struct dict *_dict,
+			      const struct dict_op_settings *set,
+			      const char *const *keys,
+			      dict_lookup_multi_callback_t *callback,
+			      void *context)
+{
+	struct cache_dict *dict = (struct cache_dict *)_dict;
+	struct cache_dict_lookup_multi_context *ctx;
+	struct cache_dict_entry *entry;
+	ARRAY_TYPE(const_string) missing_keys;
+	unsigned int i, missing_count = 0;
+	pool_t pool;
+
+	pool = pool_alloconly_create("cache dict lookup multi", 512);
+	ctx = p_new(pool, struct cache_dict_lookup_multi_context, 1);
+	ctx->pool = pool;
+	ctx->dict = dict;
+	ctx->generation = dict->generation;
+	ctx->count = str_array_length(keys);
+	ctx->results = p_new(pool, struct dict_lookup_result, ctx->count);
+	ctx->missing_cache_keys = p_new(pool, const char *, ctx->count);
+	ctx->missing_idx = p_new(pool, unsigned int, ctx->count);
+	ctx->callback = callback;
+	ctx->context = context;
+
+	t_array_init(&missing_keys, ctx->count + 1);
+	for (i = 0; i < ctx->count; i++) {
+		const char *cache_key = cache_dict_key(set->username, keys[i]);
+
+		entry = cache_dict_entry_lookup(dict, cache_key);
+		if (entry != NULL) {
+			cache_dict_entry_get_result(entry, pool,
+						    &ctx->results[i]);
+			continue;
+		}
+		ctx->missing_cache_keys[missing_count] =
+			p_strdup(pool, cache_key);
+		ctx->missing_idx[missing_count] = i;
+		missing_count++;
+		array_push_back(&missing_keys, &keys[i]);
+	}
+
+	if (missing_count == 0) {
+		cache_dict_lookup_multi_callback(NULL, 0, ctx);
+		return;
+	}
+	array_append_zero(&missing_keys);
+	dict_lookup_multi_async(dict->child, set, array_front(&missing_keys),
+				cache_dict_lookup_multi_callback, ctx);
+}
+
+static void cache_dict_iterate_callback(struct cache_dict_iterate_context *ctx)
+{
+	if (ctx->ctx.async_callback != NULL)
+		ctx->ctx.async_callback(ctx->ctx.async_context);
+}
+
+static struct dict_iterate_context *
+cache_dict_iterate_init(struct dict *_dict, const struct dict_op_settings *set,
+			const char *path, enum dict_iterate_flags flags)
+{
+	struct cache_dict *dict = (struct cache_dict *)_dict;
+	struct cache_dict_iterate_context *ctx;
+
+	/* iterations aren't cached */
+	ctx = i_new(struct cache_dict_iterate_context, 1);
+	ctx->ctx.dict = _dict;
+	ctx->child_iter = dict_iterate_init(dict->child, set, path, flags);
+	dict_iterate_set_async_callback(ctx->child_iter,
+					cache_dict_iterate_callback, ctx);
+	return &ctx->ctx;
+}
+
+static bool cache_dict_iterate(struct dict_iterate_context *_ctx,
+			       const char **key_r, const char *const **values_r)
+{
+	struct cache_dict_iterate_context *ctx =
+		(struct cache_dict_iterate_context *)_ctx;
+	bool ret;
+
+	ret = dict_iterate_values(ctx->child_iter, key_r, values_r);
+	ctx->ctx.has_more = dict_iterate_has_more(ctx->child_iter);
+	return ret;
+}
+
+static int cache_dict_iterate_deinit(struct dict_iterate_context *_ctx,
+				     const char **error_r)
+{
+	struct cache_dict_iterate_context *ctx =
+		(struct cache_dict_iterate_context *)_ctx;
+	int ret;
+
+	ret = dict_iterate_deinit(&ctx->child_iter, error_r);
+	i_free(ctx);
+	return ret;
+}
+
+static struct dict_transaction_context *
+cache_dict_transaction_init(struct dict *_dict)
+{
+	struct cache_dict_transaction_context *ctx;
+	pool_t pool;
+
+	pool = pool_alloconly_create("cache dict transaction", 256);
+	ctx = p_new(pool, struct cache_dict_transaction_context, 1);
+	ctx->ctx.dict = _dict;
+	ctx->pool = pool;
+	p_array_init(&ctx->changed_keys, pool, 8);
+	return &ctx->ctx;
+}
+
+static struct dict_transaction_context *
+cache_dict_transaction_get_child(struct cache_dict_transaction_context *ctx)
+{
+	struct cache_dict *dict = (struct cache_dict *)ctx->ctx.dict;
+	struct dict_op_settings set;
+
+	if (ctx->child_ctx == NULL) {
+		/* the settings aren't known yet in transaction_init() */
+		cache_dict_op_settings_get(&ctx->ctx.set, &set);
+		ctx->child_ctx = dict_transaction_begin(dict->child, &set);
+	}
+	return ctx->child_ctx;
+}
+
+static void
+cache_dict_transaction_changed(struct cache_dict_transaction_context *ctx,
+			       const char *key)
+{
+	struct cache_dict *dict = (struct cache_dict *)ctx->ctx.dict;
+	const char *cache_key = cache_dict_key(ctx->ctx.set.username, key);
+
+	/* invalidate now so the following lookups won't see the old value,
+	   and again after commit in case they were looked up meanwhile */
+	cache_dict_invalidate(dict, cache_key);
+	cache_key = p_strdup(ctx->pool, cache_key);
+	array_push_back(&ctx->changed_keys, &cache_key);
+}
+
+static void
+cache_dict_transaction_free(struct cache_dict_transaction_context *ctx)
+{
+	struct cache_dict *dict = (struct cache_dict *)ctx->ctx.dict;
+	const char *cache_key;
+
+	array_foreach_elem(&ctx->changed_keys, cache_key)
+		cache_dict_invalidate(dict, cache_key);
+	pool_unref(&ctx->pool);
+}
+
+static void
+cache_dict_transaction_commit_callback(const struct dict_commit_result *result,
+				       struct cache_dict_transaction_context *ctx)
+{
+	dict_transaction_commit_callback_t *callback = ctx->callback;
+	void *context = ctx->context;
+
+	cache_dict_transaction_free(ctx);
+	callback(result, context);
+}
+
+static void
+cache_dict_transaction_commit(struct dict_transaction_context *_ctx,
+			      bool async,
+			      dict_transaction_commit_callback_t *callback,
+			      void *context)
+{
+	struct cache_dict_transaction_context *ctx =
+		(struct cache_dict_transaction_context *)_ctx;
+	struct dict_commit_result result;
+
+	if (ctx->child_ctx == NULL) {
+		/* nothing was changed */
+		i_zero(&result);
+		result.ret = DICT_COMMIT_RET_OK;
+		cache_dict_transaction_free(ctx);
+		callback(&result, context);
+		return;
+	}
+
+	ctx->callback = callback;
+	ctx->context = context;
+	if (async) {
+		dict_transaction_commit_async(&ctx->child_ctx,
+			cache_dict_transaction_commit_callback, ctx);
+	} else {
+		i_zero(&result);
+		result.ret = dict_transaction_commit(&ctx->child_ctx,
+						     &result.error);
+		cache_dict_transaction_commit_callback(&result, ctx);
+	}
+}
+
+static void
+cache_dict_transaction_rollback(struct dict_transaction_context *_ctx)
+{
+	struct cache_dict_transaction_context *ctx =
+		(struct cache_dict_transaction_context *)_ctx;
+
+	dict_transaction_rollback(&ctx->child_ctx);
+	cache_dict_transaction_free(ctx);
+}
+
+static void cache_dict_set(struct dict_transaction_context *_ctx,
+			   const char *key, const char *value)
+{
+	struct cache_dict_transaction_context *ctx =
+		(struct cache_dict_transaction_context *)_ctx;
+
+	dict_set(cache_dict_transaction_get_child(ctx), key, value);
+	cache_dict_transaction_changed(ctx, key);
+}
+
+static void cache_dict_unset(struct dict_transaction_context *_ctx,
+			     const char *key)
+{
+	struct cache_dict_transaction_context *ctx =
+		(struct cache_dict_transaction_context *)_ctx;
+
+	dict_unset(cache_dict_transaction_get_child(ctx), key);
+	cache_dict_transaction_changed(ctx, key);
+}
+
+static void cache_dict_atomic_inc(struct dict_transaction_context *_ctx,
+				  const char *key, long long diff)
+{
+	struct cache_dict_transaction_context *ctx =
+		(struct cache_dict_transaction_context *)_ctx;
+
+	dict_atomic_inc(cache_dict_transaction_get_child(ctx), key, diff);
+	cache_dict_transaction_changed(ctx, key);
+}
+
+static void
+cache_dict_set_timestamp(struct dict_transaction_context *_ctx,
+			 const struct timespec *ts)
+{
+	struct cache_dict_transaction_context *ctx =
+		(struct cache_dict_transaction_context *)_ctx;
+
+	dict_transaction_set_timestamp(cache_dict_transaction_get_child(ctx),
+				       ts);
+}
+
+struct dict dict_driver_cache = {
+	.name = "cache",
+	.v = {
+		.init = cache_dict_init,
+		.deinit = cache_dict_deinit,
+		.wait = cache_dict_wait,
+		.lookup = cache_dict_lookup,
+		.iterate_init = cache_dict_iterate_init,
+		.iterate = cache_dict_iterate,
+		.iterate_deinit = cache_dict_iterate_deinit,
+		.transaction_init = cache_dict_transaction_init,
+		.transaction_commit = cache_dict_transaction_commit,
+		.transaction_rollback = cache_dict_transaction_rollback,
+		.set = cache_dict_set,
+		.unset = cache_dict_unset,
+		.atomic_inc = cache_dict_atomic_inc,
+		.lookup_async = cache_dict_lookup_async,
+		.switch_ioloop = cache_dict_switch_ioloop,
+		.set_timestamp = cache_dict_set_timestamp,
+		.lookup_multi_async = cache_dict_lookup_multi_async,
+	},
+};
@@ -43,11 +43,17 @@ struct client_dict_cmd {
 	uint64_t start_dict_ioloop_usecs;
 	uint64_t start_lock_usecs;
 
+	/* Number of keys in a multi-key lookup */
+	unsigned int lookup_count;
+
 	bool reconnected;
 	bool retry_errors;
 	bool no_replies;
 	bool unfinished;
 	bool background;
+	/* The command isn't sent until the server has announced its
+	   version. It's still in the cmds array while waiting. */
+	bool wait_server_version;
 
 	void (*callback)(struct client_dict_cmd *cmd,
 			 enum dict_protocol_reply reply, const char *value,
@@ -58,6 +64,7 @@ struct client_dict_cmd {
 
 	struct {
 		dict_lookup_callback_t *lookup;
+		dict_lookup_multi_callback_t *lookup_multi;
 		dict_transaction_commit_callback_t *commit;
 		void *context;
 	} api_callback;
@@ -88,7 +95,15 @@ struct client_dict {
 	ARRAY(struct client_dict_cmd *) cmds;
 	struct client_dict_transaction_context *transactions;
 
+	dict_change_callback_t *change_callback;
+	void *change_context;
+
 	unsigned int transaction_id_counter;
+	/* Server's protocol minor version on the current connection. Valid
+	   only after server_version_received is set. */
+	unsigned int server_minor_version;
+	bool server_version_received:1;
+	bool watch_unsupported_warned:1;
 };
 
 struct client_dict_iter_result {
@@ -300,7 +315,12 @@ client_dict_cmd_send(struct client_dict *dict, struct client_dict_cmd **_cmd,
 	if (client_dict_connect(dict, &error) < 0) {
 		retry = FALSE;
 		ret = -1;
+	} else if (cmd->wait_server_version &&
+		   !dict->server_version_received) {
+		/* sent by client_dict_send_version_wait_cmds() */
+		ret = 0;
 	} else {
+		cmd->wait_server_version = FALSE;
 		ret = client_dict_cmd_query_send(dict, cmd->query);
 		if (ret < 0) {
 			error = t_strdup_printf("write(%s) failed: %s", dict->conn.conn.name,
@@ -402,7 +422,9 @@ static bool client_dict_is_finished(struct client_dict *dict)
 
 static void client_dict_timeout(struct client_dict *dict)
 {
-	if (client_dict_is_finished(dict))
+	/* keep the connection while watching for changes, or the
+	   notifications would be lost */
+	if (client_dict_is_finished(dict) && dict->change_callback == NULL)
 		client_dict_disconnect(dict, "Idle disconnection");
 	else
 		timeout_remove(&dict->to_idle);
@@ -503,6 +525,103 @@ static int dict_conn_find_async_id(struct dict_client_connection *conn,
 	return -1;
 }
 
+static int
+client_dict_changed_line(struct dict_client_connection *conn, const char *line)
+{
+	struct client_dict *dict = conn->dict;
+	const char *const *args = t_strsplit_tabescaped(line + 1);
+
+	/* <username> <key> */
+	if (str_array_length(args) < 2) {
+		e_error(conn->conn.event, "Received invalid change line: %s",
+			line);
+		return -1;
+	}
+	if (dict->change_callback != NULL) {
+		dict->change_callback(args[0][0] == '\0' ? NULL : args[0],
+				      args[1][0] == '\0' ? NULL : args[1],
+				      dict->change_context);
+	}
+	return 0;
+}
+
+static int
+client_dict_version_line(struct dict_client_connection *conn, const char *line)
+{
+	const char *const *args = t_strsplit_tabescaped(line + 1);
+	unsigned int major;
+
+	/* <major-version> <minor-version> */
+	if (str_array_length(args) < 2 ||
+	    str_to_uint(args[0], &major) < 0 ||
+	    str_to_uint(args[1], &conn->dict->server_minor_version) < 0 ||
+	    major != DICT_CLIENT_PROTOCOL_MAJOR_VERSION) {
+		e_error(conn->conn.event, "Received invalid version line: %s",
+			line);
+		return -1;
+	}
+	return 0;
+}
+
+static void client_dict_watch_start(struct client_dict *dict)
+{
+	i_assert(dict->server_version_received);
+
+	if (dict->server_minor_version < 2) {
+		if (!dict->watch_unsupported_warned) {
+			e_warning(dict->conn.conn.event,
+				  "dict-server doesn't support watching for "
+				  "changes - cached values may be stale until "
+				  "they expire");
+			dict->watch_unsupported_warned = TRUE;
+		}
+		return;
+	}
+	o_stream_nsend_str(dict->conn.conn.output, t_strdup_printf(
+		"%c\n", DICT_PROTOCOL_CMD_WATCH));
+	/* changes done before the server started watching were missed */
+	dict->change_callback(NULL, NULL, dict->change_context);
+}
+
+static void client_dict_send_version_wait_cmds(struct client_dict *dict)
+{
+	ARRAY(struct client_dict_cmd *) wait_cmds;
+	struct client_dict_cmd *cmd;
+
+	i_assert(dict->server_version_received);
+
+	t_array_init(&wait_cmds, 4);
+	for (unsigned int i = 0; i < array_count(&dict->cmds); ) {
+		cmd = array_idx_elem(&dict->cmds, i);
+		if (!cmd->wait_server_version)
+			i++;
+		else {
+			array_push_back(&wait_cmds, &cmd);
+			array_delete(&dict->cmds, i, 1);
+		}
+	}
+
+	array_foreach_elem(&wait_cmds, cmd) {
+		/* only LOOKUP_MULTI waits for the version */
+		i_assert(cmd->query[0] == DICT_PROTOCOL_CMD_LOOKUP_MULTI);
+		if (dict->server_minor_version >= 1) {
+			(void)client_dict_cmd_send(dict, &cmd, NULL);
+			continue;
+		}
+		/* Old servers would disconnect on an unknown command, so
+		   send the keys as separate lookups. */
+		const char *const *args =
+			t_strsplit_tabescaped(cmd->query + 1);
+		struct dict_op_settings set = {
+			.username = args[0][0] == '\0' ? NULL : args[0],
+		};
+		dict_lookup_multi_async_separately(&dict->dict, &set, args + 1,
+			cmd->api_callback.lookup_multi,
+			cmd->api_callback.context);
+		client_dict_cmd_unref(cmd);
+	}
+}
+
 static int dict_conn_input_line(struct connection *_conn, const char *line)
 {
 	struct dict_client_connection *conn =
@@ -513,6 +632,25 @@ static int dict_conn_input_line(struct connection *_conn, const char *line)
 	unsigned int i, count;
 	bool finished;
 
+	if (!dict->server_version_received) {
+		bool version_line = line[0] == DICT_PROTOCOL_REPLY_VERSION;
+
+		dict->server_version_received = TRUE;
+		if (!version_line) {
+			/* old server, which doesn't announce its version */
+			dict->server_minor_version = 0;
+		} else if (client_dict_version_line(conn, line) < 0)
+			return -1;
+		if (dict->change_callback != NULL)
+			client_dict_watch_start(dict);
+		client_dict_send_version_wait_cmds(dict);
+		if (version_line)
+			return 1;
+	}
+
+	if (line[0] == DICT_PROTOCOL_REPLY_CHANGED)
+		return client_dict_changed_line(conn, line) < 0 ? -1 : 1;
+
 	if (dict->to_requests != NULL)
 		timeout_reset(dict->to_requests);
 
@@ -579,6 +717,8 @@ static int client_dict_connect(struct client_dict *dict, const char **error_r)
 		*error_r = error;
 		return -1;
 	}
+	dict->server_version_received = FALSE;
+	dict->server_minor_version = 0;
 
 	query = t_strdup_printf("%c%u\t%u\t%d\t%s\t%s\n",
 				DICT_PROTOCOL_CMD_HELLO,
@@ -588,6 +728,7 @@ static int client_dict_connect(struct client_dict *dict, const char **error_r)
 				"",
 				str_tabescape(dict->uri));
 	o_stream_nsend_str(dict->conn.conn.output, query);
+	/* WATCH is sent after the server has announced its version */
 	client_dict_add_timeout(dict);
 	return 0;
 }
@@ -624,6 +765,10 @@ static void client_dict_disconnect(struct client_dict *dict, const char *reason)
 
 	timeout_remove(&dict->to_idle);
 	timeout_remove(&dict->to_requests);
+	if (dict->conn.conn.fd_in != -1 && dict->change_callback != NULL) {
+		/* changes can't be noticed while disconnected */
+		dict->change_callback(NULL, NULL, dict->change_context);
+	}
 	connection_disconnect(&dict->conn.conn);
 }
 
@@ -903,6 +1048,41 @@ dict_warnings_sec(const struct client_dict_cmd *cmd, int msecs,
 	return str_c(str);
 }
 
+static bool
+client_dict_lookup_result_parse(enum dict_protocol_reply reply,
+				const char *value,
+				struct dict_lookup_result *result)
+{
+	const char **values;
+
+	switch (reply) {
+	case DICT_PROTOCOL_REPLY_OK:
+		values = t_new(const char *, 2);
+		values[0] = value;
+		result->value = value;
+		result->values = values;
+		result->ret = 1;
+		break;
+	case DICT_PROTOCOL_REPLY_MULTI_OK:
+		result->values = t_strsplit_tabescaped(value);
+		result->value = result->values[0];
+		result->ret = 1;
+		break;
+	case DICT_PROTOCOL_REPLY_NOTFOUND:
+		result->ret = 0;
+		break;
+	case DICT_PROTOCOL_REPLY_FAIL:
+		result->error = value[0] == '\0' ? "dict-server returned failure" :
+			t_strdup_printf("dict-server returned failure: %s",
+			value);
+		result->ret = -1;
+		break;
+	default:
+		return FALSE;
+	}
+	return TRUE;
+}
+
 static void
 client_dict_lookup_async_callback(struct client_dict_cmd *cmd,
 				  enum dict_protocol_reply reply,
@@ -913,39 +1093,17 @@ client_dict_lookup_async_callback(struct client_dict_cmd *cmd,
 {
 	struct client_dict *dict = cmd->dict;
 	struct dict_lookup_result result;
-	const char *const values[] = { value, NULL };
 
 	i_zero(&result);
 	if (error != NULL) {
 		result.ret = -1;
 		result.error = error;
-	} else switch (reply) {
-	case DICT_PROTOCOL_REPLY_OK:
-		result.value = value;
-		result.values = values;
-		result.ret = 1;
-		break;
-	case DICT_PROTOCOL_REPLY_MULTI_OK:
-		result.values = t_strsplit_tabescaped(value);
-		result.value = result.values[0];
-		result.ret = 1;
-		break;
-	case DICT_PROTOCOL_REPLY_NOTFOUND:
-		result.ret = 0;
-		break;
-	case DICT_PROTOCOL_REPLY_FAIL:
-		result.error = value[0] == '\0' ? "dict-server returned failure" :
-			t_strdup_printf("dict-server returned failure: %s",
-			value);
-		result.ret = -1;
-		break;
-	default:
+	} else if (!client_dict_lookup_result_parse(reply, value, &result)) {
 		result.error = t_strdup_printf(
 			"dict-client: Invalid lookup '%s' reply: %c%s",
 			cmd->query, reply, value);
 		client_dict_disconnect(dict, result.error);
 		result.ret = -1;
-		break;
 	}
 
 	int diff = timeval_diff_msecs(&ioloop_timeval, &cmd->start_time);
@@ -965,6 +1123,86 @@ client_dict_lookup_async_callback(struct client_dict_cmd *cmd,
 	dict_post_api_callback(&dict->dict);
 }
 
+static bool
+client_dict_lookup_multi_parse(struct client_dict_cmd *cmd,
+			       enum dict_protocol_reply reply,
+			       const char *value,
+			       const char *const *extra_args,
+			       struct dict_lookup_result *results)
+{
+	unsigned int i, count;
+
+	/* O<count> <lookup reply 1> .. <lookup reply count> */
+	if (reply != DICT_PROTOCOL_REPLY_OK ||
+	    str_to_uint(value, &count) < 0 || count != cmd->lookup_count ||
+	    str_array_length(extra_args) < count)
+		return FALSE;
+	for (i = 0; i < count; i++) {
+		if (extra_args[i][0] == '\0')
+			return FALSE;
+		if (!client_dict_lookup_result_parse(extra_args[i][0],
+				t_str_tabunescape(extra_args[i] + 1),
+				&results[i]))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static void
+client_dict_lookup_multi_async_callback(struct client_dict_cmd *cmd,
+					enum dict_protocol_reply reply,
+					const char *value,
+					const char *const *extra_args,
+					const char *error,
+					bool disconnected ATTR_UNUSED)
+{
+	struct client_dict *dict = cmd->dict;
+	struct dict_lookup_result *results;
+	const char *null_arg = NULL, *timing;
+	unsigned int i, count = cmd->lookup_count;
+
+	results = t_new(struct dict_lookup_result, count);
+	if (error == NULL &&
+	    !client_dict_lookup_multi_parse(cmd, reply, value, extra_args,
+					    results)) {
+		error = t_strdup_printf(
+			"dict-client: Invalid lookup '%s' reply: %c%s",
+			cmd->query, reply, value);
+		client_dict_disconnect(dict, error);
+		extra_args = &null_arg;
+	} else if (error == NULL) {
+		/* the timing info is after the results */
+		extra_args += count;
+	}
+
+	int diff = timeval_diff_msecs(&ioloop_timeval, &cmd->start_time);
+	timing = dict_warnings_sec(cmd, diff, extra_args);
+	bool failed = FALSE;
+	for (i = 0; i < count; i++) {
+		if (error != NULL) {
+			i_zero(&results[i]);
+			results[i].ret = -1;
+			results[i].error = error;
+		}
+		if (results[i].error != NULL) {
+			/* include timing info always in error messages */
+			results[i].error = t_strdup_printf("%s (reply took %s)",
+				results[i].error, timing);
+			failed = TRUE;
+		}
+	}
+	if (!failed && !cmd->background &&
+	    diff >= (int)dict->warn_slow_msecs) {
+		e_warning(dict->conn.conn.event, "dict lookup took %s: %s",
+			  timing, cmd->query);
+	}
+
+	dict_pre_api_callback(&dict->dict);
+	cmd->api_callback.lookup_multi(results, count,
+				       cmd->api_callback.context);
+	dict_post_api_callback(&dict->dict);
+}
+
 static void
 client_dict_lookup_async(struct dict *_dict, const struct dict_op_settings *set,
 			 const char *key, dict_lookup_callback_t *callback,
@@ -986,6 +1224,62 @@ client_dict_lookup_async(struct dict *_dict, const struct dict_op_settings *set,
 	client_dict_cmd_send(dict, &cmd, NULL);
 }
 
+static void
+client_dict_version_probe_callback(const struct dict_lookup_result *result ATTR_UNUSED,
+				   void *context ATTR_UNUSED)
+{
+}
+
+static void
+client_dict_lookup_multi_async(struct dict *_dict,
+			       const struct dict_op_settings *set,
+			       const char *const *keys,
+			       dict_lookup_multi_callback_t *callback,
+			       void *context)
+{
+	struct client_dict *dict = (struct client_dict *)_dict;
+	struct client_dict_cmd *cmd;
+	string_t *query;
+	unsigned int i;
+
+	if (dict->conn.conn.fd_in != -1 && dict->server_version_received &&
+	    dict->server_minor_version < 1) {
+		/* Old servers would disconnect on an unknown command, so
+		   send the keys as separate lookups. */
+		dict_lookup_multi_async_separately(_dict, set, keys,
+						   callback, context);
+		return;
+	}
+
+	query = t_str_new(128);
+	str_append_c(query, DICT_PROTOCOL_CMD_LOOKUP_MULTI);
+	if (set->username != NULL)
+		str_append_tabescaped(query, set->username);
+	for (i = 0; keys[i] != NULL; i++) {
+		str_append_c(query, '\t');
+		str_append_tabescaped(query, keys[i]);
+	}
+	cmd = client_dict_cmd_init(dict, str_c(query));
+	cmd->callback = client_dict_lookup_multi_async_callback;
+	cmd->api_callback.lookup_multi = callback;
+	cmd->api_callback.context = context;
+	cmd->lookup_count = i;
+	cmd->retry_errors = TRUE;
+	/* with a new connection the server's version isn't known yet */
+	cmd->wait_server_version = TRUE;
+
+	if ((dict->conn.conn.fd_in == -1 || !dict->server_version_received) &&
+	    array_count(&dict->cmds) == 0) {
+		/* Old servers don't announce their version, so make sure
+		   there's a reply coming. It (or the version line before it)
+		   tells whether LOOKUP_MULTI can be sent. */
+		client_dict_lookup_async(_dict, set, keys[0],
+					 client_dict_version_probe_callback,
+					 NULL);
+	}
+	client_dict_cmd_send(dict, &cmd, NULL);
+}
+
 struct client_dict_sync_lookup {
 	char *error;
 	const char **values;
@@ -1472,6 +1766,24 @@ static void client_dict_set_timestamp(struct dict_transaction_context *_ctx,
 	client_dict_send_transaction_query(ctx, query);
 }
 
+static void
+client_dict_set_change_callback(struct dict *_dict,
+				dict_change_callback_t *callback,
+				void *context)
+{
+	struct client_dict *dict = (struct client_dict *)_dict;
+
+	bool start = callback != NULL && dict->change_callback == NULL &&
+		dict->conn.conn.fd_in != -1 && dict->server_version_received;
+
+	/* when stopping, the server may still send notifications.
+	   they're just ignored. */
+	dict->change_callback = callback;
+	dict->change_context = context;
+	if (start)
+		client_dict_watch_start(dict);
+}
+
 struct dict dict_driver_client = {
 	.name = "proxy",
 
@@ -1492,5 +1804,7 @@ struct dict dict_driver_client = {
 		.lookup_async = client_dict_lookup_async,
 		.switch_ioloop = client_dict_switch_ioloop,
 		.set_timestamp = client_dict_set_timestamp,
+		.lookup_multi_async = client_dict_lookup_multi_async,
+		.set_change_callback = client_dict_set_change_callback,
 	}
 };
@@ -6,7 +6,7 @@
 #define DEFAULT_DICT_SERVER_SOCKET_FNAME "dict"
 
 #define DICT_CLIENT_PROTOCOL_MAJOR_VERSION 4
-#define DICT_CLIENT_PROTOCOL_MINOR_VERSION 0
+#define DICT_CLIENT_PROTOCOL_MINOR_VERSION 2
 
 #define DICT_CLIENT_MAX_LINE_LENGTH (64*1024)
 
@@ -16,6 +16,10 @@ enum dict_protocol_cmd {
 
 	DICT_PROTOCOL_CMD_LOOKUP = 'L', /* <key> */
 	DICT_PROTOCOL_CMD_ITERATE = 'I', /* <flags> <path> */
+	/* <username> <key1> [<key2> ...] - protocol v4.1+
+	   Reply is O<count> followed by <count> parameters, each of them
+	   formatted like a LOOKUP reply and tabescaped once more. */
+	DICT_PROTOCOL_CMD_LOOKUP_MULTI = 'M',
 
 	DICT_PROTOCOL_CMD_BEGIN = 'B', /* <id> */
 	DICT_PROTOCOL_CMD_COMMIT = 'C', /* <id> */
@@ -25,6 +29,10 @@ enum dict_protocol_cmd {
 	DICT_PROTOCOL_CMD_UNSET = 'U', /* <id> <key> */
 	DICT_PROTOCOL_CMD_ATOMIC_INC = 'A', /* <id> <key> <diff> */
 	DICT_PROTOCOL_CMD_TIMESTAMP = 'T', /* <id> <secs> <nsecs> */
+
+	/* Send CHANGED notifications about keys committed by other
+	   connections - protocol v4.2+ */
+	DICT_PROTOCOL_CMD_WATCH = 'W',
 };
 
 enum dict_protocol_reply {
@@ -39,6 +47,13 @@ enum dict_protocol_reply {
 	DICT_PROTOCOL_REPLY_ITER_FINISHED = '\0',
 	DICT_PROTOCOL_REPLY_ASYNC_ID = '*',
 	DICT_PROTOCOL_REPLY_ASYNC_REPLY = '+',
+	/* <username> <key> - unsolicited notification after WATCH. Empty
+	   key means that any key may have changed. */
+	DICT_PROTOCOL_REPLY_CHANGED = 'C',
+	/* <major-version> <minor-version> - sent by the server right after
+	   the handshake to clients with protocol v4.1+. Older servers don't
+	   send it, so its absence means the server's minor version is 0. */
+	DICT_PROTOCOL_REPLY_VERSION = 'V',
 };
 
 #endif
@@ -130,6 +130,8 @@ struct dict dict_driver_fail = {
 		.atomic_inc = dict_fail_atomic_inc,
 		.lookup_async = NULL,
 		.switch_ioloop = dict_fail_switch_ioloop,
-		.set_timestamp = dict_fail_set_timestamp
+		.set_timestamp = dict_fail_set_timestamp,
+		.lookup_multi_async = NULL,
+		.set_change_callback = NULL,
 	},
 };
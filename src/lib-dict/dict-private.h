@@ -7,6 +7,11 @@
 
 struct ioloop;
 
+/* Called when the key may have been changed by someone else. username is
+   NULL for shared keys. If key is NULL, any key may have changed. */
+typedef void dict_change_callback_t(const char *username, const char *key,
+				    void *context);
+
 struct dict_vfuncs {
 	int (*init)(struct dict *dict_driver, const char *uri,
 		    const struct dict_settings *set,
@@ -49,6 +54,16 @@ struct dict_vfuncs {
 	bool (*switch_ioloop)(struct dict *dict);
 	void (*set_timestamp)(struct dict_transaction_context *ctx,
 			      const struct timespec *ts);
+	void (*lookup_multi_async)(struct dict *dict,
+				   const struct dict_op_settings *set,
+				   const char *const *keys,
+				   dict_lookup_multi_callback_t *callback,
+				   void *context);
+	/* Start (callback != NULL) or stop watching for changes made to the
+	   dict by other processes. */
+	void (*set_change_callback)(struct dict *dict,
+				    dict_change_callback_t *callback,
+				    void *context);
 };
 
 struct dict_commit_callback_ctx;
@@ -101,6 +116,7 @@ void dict_transaction_commit_async_noop_callback(
 	const struct dict_commit_result *result, void *context);
 
 extern struct dict dict_driver_client;
+extern struct dict dict_driver_cache;
 extern struct dict dict_driver_file;
 extern struct dict dict_driver_fs;
 extern struct dict dict_driver_redis;
@@ -113,6 +129,15 @@ extern struct dict_transaction_context dict_transaction_unsupported;
 void dict_pre_api_callback(struct dict *dict);
 void dict_post_api_callback(struct dict *dict);
 
+/* Look up the keys with separate lookup_async() calls and call the callback
+   once all of them have finished. Drivers can use this as a fallback in
+   lookup_multi_async() when they can't do the lookups at once. */
+void dict_lookup_multi_async_separately(struct dict *dict,
+					const struct dict_op_settings *set,
+					const char *const *keys,
+					dict_lookup_multi_callback_t *callback,
+					void *context);
+
 /* Duplicate an object of type dict_op_settings. Used for initializing/freeing
    iterator and transaction contexts. */
 void dict_op_settings_dup(const struct dict_op_settings *source,
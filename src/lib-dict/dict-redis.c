@@ -3,6 +3,8 @@
 #include "lib.h"
 #include "array.h"
 #include "str.h"
+#include "str-sanitize.h"
+#include "ioloop.h"
 #include "istream.h"
 #include "ostream.h"
 #include "connection.h"
@@ -10,304 +12,906 @@
 
 #define REDIS_DEFAULT_PORT 6379
 #define REDIS_DEFAULT_LOOKUP_TIMEOUT_MSECS (1000*30)
+#define REDIS_DEFAULT_MAX_CONNECTIONS 1
+#define REDIS_CLUSTER_SLOT_COUNT 16384
+/* Give up after this many MOVED/ASK redirections of the same request */
+#define REDIS_CLUSTER_MAX_REDIRECTS 5
+/* Maximum nesting of array replies. CLUSTER SLOTS needs 3. */
+#define REDIS_REPLY_MAX_DEPTH 8
 #define DICT_USERNAME_SEPARATOR '/'
 
-enum redis_input_state {
-	/* expecting +OK reply for AUTH */
-	REDIS_INPUT_STATE_AUTH,
-	/* expecting +OK reply for SELECT */
-	REDIS_INPUT_STATE_SELECT,
-	/* expecting $-1 / $<size> followed by GET reply */
-	REDIS_INPUT_STATE_GET,
-	/* expecting +QUEUED */
-	REDIS_INPUT_STATE_MULTI,
-	/* expecting +OK reply for DISCARD */
-	REDIS_INPUT_STATE_DISCARD,
-	/* expecting *<nreplies> */
-	REDIS_INPUT_STATE_EXEC,
-	/* expecting EXEC reply */
-	REDIS_INPUT_STATE_EXEC_REPLY
+enum redis_reply_type {
+	REDIS_REPLY_TYPE_STATUS,
+	REDIS_REPLY_TYPE_ERROR,
+	REDIS_REPLY_TYPE_INTEGER,
+	REDIS_REPLY_TYPE_STRING,
+	REDIS_REPLY_TYPE_NIL,
+	REDIS_REPLY_TYPE_ARRAY
 };
 
-struct redis_connection {
-	struct connection conn;
-	struct redis_dict *dict;
+struct redis_reply {
+	enum redis_reply_type type;
+	/* STATUS, ERROR and STRING */
+	const char *str;
+	/* INTEGER */
+	long long integer;
+	/* ARRAY */
+	struct redis_reply *elements;
+	unsigned int count;
+};
 
-	string_t *last_reply;
-	unsigned int bytes_left;
-	bool value_not_found;
-	bool value_received;
+enum redis_request_type {
+	REDIS_REQUEST_TYPE_AUTH,
+	REDIS_REQUEST_TYPE_SELECT,
+	REDIS_REQUEST_TYPE_CLUSTER_SLOTS,
+	/* GET or MGET */
+	REDIS_REQUEST_TYPE_LOOKUP,
+	/* MULTI, the queued commands and EXEC */
+	REDIS_REQUEST_TYPE_COMMIT
 };
 
-struct redis_dict_reply {
-	unsigned int reply_count;
+struct redis_lookup {
+	pool_t pool;
+	struct dict_lookup_result *results;
+	unsigned int count;
+	unsigned int pending_requests;
+
+	dict_lookup_callback_t *callback;
+	dict_lookup_multi_callback_t *multi_callback;
+	void *context;
+};
+
+struct redis_commit {
+	unsigned int pending_requests;
+	struct dict_commit_result result;
+	char *error;
+
 	dict_transaction_commit_callback_t *callback;
 	void *context;
 };
 
+struct redis_request {
+	struct redis_dict *dict;
+	enum redis_request_type type;
+	/* The full command(s). Kept until the reply is received, so the
+	   request can be sent again after a cluster redirect. */
+	string_t *cmd;
+	/* Number of replies the cmd produces, and the number of them still
+	   missing. */
+	unsigned int reply_count, replies_left;
+	/* Cluster hash slot of all the keys in the request */
+	unsigned int slot;
+	unsigned int redirect_count;
+	/* First error reply */
+	char *error;
+
+	/* REDIS_REQUEST_TYPE_LOOKUP: Result indexes of the looked up keys */
+	struct redis_lookup *lookup;
+	unsigned int *key_indexes;
+	unsigned int key_count;
+	/* REDIS_REQUEST_TYPE_COMMIT */
+	struct redis_commit *commit;
+	unsigned int commit_cmd_count;
+
+	/* Send ASKING before the command (cluster ASK redirect) */
+	bool asking:1;
+	bool sent:1;
+};
+
+struct redis_connection {
+	struct connection conn;
+	struct redis_node *node;
+	int refcount;
+
+	pool_t reply_pool;
+	/* Requests in the order they were sent */
+	ARRAY(struct redis_request *) requests;
+	struct timeout *to_request;
+	char *connect_error;
+
+	bool connected:1;
+	bool destroyed:1;
+};
+
+struct redis_node {
+	struct redis_dict *dict;
+	struct ip_addr ip;
+	in_port_t port;
+	char *unix_path;
+
+	/* Pool of connections. Requests are pipelined, and a new
+	   connection is created only when all the existing ones have
+	   requests pending. */
+	ARRAY(struct redis_connection *) conns;
+};
+
 struct redis_dict {
 	struct dict dict;
 	char *password, *key_prefix, *expire_value;
-	unsigned int timeout_msecs, db_id;
-
-	struct redis_connection conn;
-
-	ARRAY(enum redis_input_state) input_states;
-	ARRAY(struct redis_dict_reply) replies;
+	unsigned int timeout_msecs, db_id, max_connections;
+
+	/* The first node is the one given in the URI. With cluster=yes the
+	   rest of the nodes are learned from the cluster. */
+	ARRAY(struct redis_node *) nodes;
+	/* cluster=yes: Hash slot => node, or NULL if not known. */
+	struct redis_node **slots;
+	/* Number of requests waiting for a reply in all connections */
+	unsigned int request_count;
+
+	bool cluster:1;
+	bool cluster_slots_requested:1;
+	bool cluster_slots_refreshing:1;
+};
 
-	bool connected;
-	bool transaction_open;
-	bool db_id_set;
+struct redis_dict_transaction_slot {
+	unsigned int slot;
+	string_t *cmd;
+	unsigned int cmd_count;
 };
 
 struct redis_dict_transaction_context {
 	struct dict_transaction_context ctx;
-	unsigned int cmd_count;
-	char *error;
+	/* Commands are buffered until commit and then sent within a single
+	   MULTI/EXEC. A Redis cluster transaction can only access a single
+	   hash slot, so the commands are grouped by slot. Without cluster
+	   there's only a single group. */
+	ARRAY(struct redis_dict_transaction_slot) slots;
 };
 
 static struct connection_list *redis_connections;
 
+static void redis_request_send(struct redis_request *req);
+static void redis_node_add_request(struct redis_node *node,
+				   struct redis_request *req);
 static void
-redis_input_state_add(struct redis_dict *dict, enum redis_input_state state)
+redis_cluster_refresh_slots(struct redis_dict *dict, struct redis_node *node);
+
+static uint16_t redis_crc16(const unsigned char *data, size_t size)
 {
-	array_push_back(&dict->input_states, &state);
+	/* CRC16-CCITT (XMODEM), as used by Redis cluster */
+	uint16_t crc = 0;
+	unsigned int i;
+
+	for (; size > 0; data++, size--) {
+		crc ^= *data << 8;
+		for (i = 0; i < 8; i++) {
+			if ((crc & 0x8000) != 0)
+				crc = (crc << 1) ^ 0x1021;
+			else
+				crc <<= 1;
+		}
+	}
+	return crc;
 }
 
-static void redis_input_state_remove(struct redis_dict *dict)
+static unsigned int redis_key_hash_slot(const char *key)
 {
-	array_pop_front(&dict->input_states);
+	const char *start, *end;
+
+	/* If the key contains a non-empty {hashtag}, only it is hashed */
+	start = strchr(key, '{');
+	if (start != NULL) {
+		end = strchr(start + 1, '}');
+		if (end != NULL && end > start + 1) {
+			return redis_crc16((const void *)(start + 1),
+					   end - (start + 1)) %
+				REDIS_CLUSTER_SLOT_COUNT;
+		}
+	}
+	return redis_crc16((const void *)key, strlen(key)) %
+		REDIS_CLUSTER_SLOT_COUNT;
 }
 
-static void redis_reply_callback(struct redis_connection *conn,
-				 const struct redis_dict_reply *reply,
-				 const struct dict_commit_result *result)
+static void redis_append_command(string_t *cmd, unsigned int argc)
 {
-	if (conn->dict->dict.prev_ioloop != NULL)
-		io_loop_set_current(conn->dict->dict.prev_ioloop);
-	reply->callback(result, reply->context);
-	if (conn->dict->dict.prev_ioloop != NULL)
-		io_loop_set_current(conn->dict->dict.ioloop);
+	str_printfa(cmd, "*%u\r\n", argc);
 }
 
-static void
-redis_disconnected(struct redis_connection *conn, const char *reason)
+static void redis_append_arg(string_t *cmd, const char *arg)
 {
-	const struct dict_commit_result result = {
-		DICT_COMMIT_RET_FAILED, reason
-	};
-	const struct redis_dict_reply *reply;
+	str_printfa(cmd, "$%zu\r\n", strlen(arg));
+	str_append(cmd, arg);
+	str_append(cmd, "\r\n");
+}
 
-	conn->dict->db_id_set = FALSE;
-	conn->dict->connected = FALSE;
-	connection_disconnect(&conn->conn);
+static int
+redis_reply_parse(pool_t pool, const unsigned char **_p,
+		  const unsigned char *end, unsigned int depth,
+		  struct redis_reply *reply_r, const char **error_r)
+{
+	const unsigned char *p = *_p, *line_end;
+	const char *line;
+	unsigned int i, len;
+	int ret;
 
-	array_foreach(&conn->dict->replies, reply)
-		redis_reply_callback(conn, reply, &result);
-	array_clear(&conn->dict->replies);
-	array_clear(&conn->dict->input_states);
+	line_end = memchr(p, '\n', end - p);
+	if (line_end == NULL)
+		return 0;
+	if (line_end == p || line_end[-1] != '\r') {
+		*error_r = "Reply line doesn't end with CRLF";
+		return -1;
+	}
+	line = p_strndup(pool, p + 1, line_end - 1 - (p + 1));
+	p = line_end + 1;
+
+	i_zero(reply_r);
+	switch (**_p) {
+	case '+':
+		reply_r->type = REDIS_REPLY_TYPE_STATUS;
+		reply_r->str = line;
+		break;
+	case '-':
+		reply_r->type = REDIS_REPLY_TYPE_ERROR;
+		reply_r->str = line;
+		break;
+	case ':':
+		reply_r->type = REDIS_REPLY_TYPE_INTEGER;
+		if (str_to_llong(line, &reply_r->integer) < 0) {
+			*error_r = t_strdup_printf("Invalid integer: %s", line);
+			return -1;
+		}
+		break;
+	case '$':
+		if (strcmp(line, "-1") == 0) {
+			reply_r->type = REDIS_REPLY_TYPE_NIL;
+			break;
+		}
+		if (str_to_uint(line, &len) < 0) {
+			*error_r = t_strdup_printf(
+				"Invalid string length: %s", line);
+			return -1;
+		}
+		if ((size_t)(end - p) < (size_t)len + 2)
+			return 0;
+		if (p[len] != '\r' || p[len+1] != '\n') {
+			*error_r = "String doesn't end with CRLF";
+			return -1;
+		}
+		reply_r->type = REDIS_REPLY_TYPE_STRING;
+		reply_r->str = p_strndup(pool, p, len);
+		p += len + 2;
+		break;
+	case '*':
+		if (strcmp(line, "-1") == 0) {
+			reply_r->type = REDIS_REPLY_TYPE_NIL;
+			break;
+		}
+		if (str_to_uint(line, &reply_r->count) < 0) {
+			*error_r = t_strdup_printf(
+				"Invalid array length: %s", line);
+			return -1;
+		}
+		if (depth >= REDIS_REPLY_MAX_DEPTH) {
+			*error_r = "Too deeply nested array reply";
+			return -1;
+		}
+		/* Each element takes at least 3 bytes. Don't allocate memory
+		   for the elements before they have been received. */
+		if (reply_r->count > (size_t)(end - p) / 3)
+			return 0;
+		reply_r->type = REDIS_REPLY_TYPE_ARRAY;
+		reply_r->elements = p_new(pool, struct redis_reply,
+					  reply_r->count);
+		for (i = 0; i < reply_r->count; i++) {
+			ret = redis_reply_parse(pool, &p, end, depth + 1,
+						&reply_r->elements[i], error_r);
+			if (ret <= 0)
+				return ret;
+		}
+		break;
+	default:
+		*error_r = t_strdup_printf("Unexpected input: %s",
+			str_sanitize(t_strndup(*_p, line_end - *_p), 80));
+		return -1;
+	}
+	*_p = p;
+	return 1;
+}
 
-	if (conn->dict->dict.ioloop != NULL)
-		io_loop_stop(conn->dict->dict.ioloop);
+static void redis_dict_request_finished(struct redis_dict *dict)
+{
+	i_assert(dict->request_count > 0);
+	dict->request_count--;
+	if (dict->dict.prev_ioloop != NULL)
+		io_loop_stop(dict->dict.ioloop);
 }
 
-static void redis_conn_destroy(struct connection *_conn)
+static struct redis_request *
+redis_request_create(struct redis_dict *dict, enum redis_request_type type,
+		     unsigned int slot)
 {
-	struct redis_connection *conn = (struct redis_connection *)_conn;
+	struct redis_request *req;
+
+	req = i_new(struct redis_request, 1);
+	req->dict = dict;
+	req->type = type;
+	req->slot = slot;
+	req->reply_count = 1;
+	req->cmd = str_new(default_pool, 128);
+	dict->request_count++;
+	return req;
+}
 
-	redis_disconnected(conn, connection_disconnect_reason(_conn));
+static void redis_request_free(struct redis_request **_req)
+{
+	struct redis_request *req = *_req;
+
+	*_req = NULL;
+	redis_dict_request_finished(req->dict);
+	str_free(&req->cmd);
+	i_free(req->error);
+	i_free(req);
 }
 
-static void redis_dict_wait_timeout(struct redis_dict *dict)
+static void
+redis_lookup_finish_request(struct redis_lookup *lookup)
 {
-	const char *reason = t_strdup_printf(
-		"redis: Commit timed out in %u.%03u secs",
-		dict->timeout_msecs/1000, dict->timeout_msecs%1000);
-	redis_disconnected(&dict->conn, reason);
+	i_assert(lookup->pending_requests > 0);
+	if (--lookup->pending_requests > 0)
+		return;
+
+	if (lookup->callback != NULL)
+		lookup->callback(&lookup->results[0], lookup->context);
+	else {
+		lookup->multi_callback(lookup->results, lookup->count,
+				       lookup->context);
+	}
+	pool_unref(&lookup->pool);
 }
 
-static void redis_wait(struct redis_dict *dict)
+static void
+redis_lookup_set_error(struct redis_request *req, const char *error)
 {
-	struct timeout *to;
+	struct redis_lookup *lookup = req->lookup;
+	struct dict_lookup_result *result;
+	unsigned int i;
 
-	i_assert(dict->dict.ioloop == NULL);
+	for (i = 0; i < req->key_count; i++) {
+		result = &lookup->results[req->key_indexes[i]];
+		result->ret = -1;
+		result->error = p_strdup(lookup->pool, error);
+	}
+}
 
-	dict->dict.prev_ioloop = current_ioloop;
-	dict->dict.ioloop = io_loop_create();
-	to = timeout_add(dict->timeout_msecs, redis_dict_wait_timeout, dict);
-	connection_switch_ioloop(&dict->conn.conn);
+static void
+redis_lookup_set_value(struct redis_lookup *lookup, unsigned int idx,
+		       const struct redis_reply *value)
+{
+	struct dict_lookup_result *result = &lookup->results[idx];
+	const char **values;
 
-	do {
-		io_loop_run(dict->dict.ioloop);
-	} while (array_count(&dict->input_states) > 0);
+	if (value->type == REDIS_REPLY_TYPE_NIL) {
+		result->ret = 0;
+		return;
+	}
+	values = p_new(lookup->pool, const char *, 2);
+	values[0] = p_strdup(lookup->pool, value->str);
+	result->ret = 1;
+	result->value = values[0];
+	result->values = values;
+}
 
-	timeout_remove(&to);
-	io_loop_set_current(dict->dict.prev_ioloop);
-	connection_switch_ioloop(&dict->conn.conn);
-	io_loop_set_current(dict->dict.ioloop);
-	io_loop_destroy(&dict->dict.ioloop);
-	dict->dict.prev_ioloop = NULL;
+static void
+redis_lookup_reply(struct redis_request *req, const struct redis_reply *reply)
+{
+	const struct redis_reply *values;
+	unsigned int i;
+
+	if (req->error != NULL) {
+		redis_lookup_set_error(req, t_strdup_printf(
+			"redis: Lookup failed: %s", req->error));
+		return;
+	}
+
+	if (req->key_count == 1) {
+		/* GET */
+		values = reply;
+	} else if (reply->type != REDIS_REPLY_TYPE_ARRAY ||
+		   reply->count != req->key_count) {
+		redis_lookup_set_error(req, t_strdup_printf(
+			"redis: MGET returned unexpected reply (expected %u values)",
+			req->key_count));
+		return;
+	} else {
+		values = reply->elements;
+	}
+	for (i = 0; i < req->key_count; i++) {
+		if (values[i].type != REDIS_REPLY_TYPE_STRING &&
+		    values[i].type != REDIS_REPLY_TYPE_NIL) {
+			redis_lookup_set_error(req,
+				"redis: Lookup returned unexpected reply type");
+			return;
+		}
+	}
+	for (i = 0; i < req->key_count; i++)
+		redis_lookup_set_value(req->lookup, req->key_indexes[i],
+				       &values[i]);
 }
 
-static int redis_input_get(struct redis_connection *conn, const char **error_r)
+static void
+redis_commit_set_error(struct redis_commit *commit, enum dict_commit_ret ret,
+		       const char *error)
 {
-	const unsigned char *data;
-	size_t size;
-	const char *line;
+	if (commit->result.ret < 0)
+		return;
+	commit->result.ret = ret;
+	commit->error = i_strdup(error);
+	commit->result.error = commit->error;
+}
 
-	if (conn->bytes_left == 0) {
-		/* read the size first */
-		line = i_stream_next_line(conn->conn.input);
-		if (line == NULL)
-			return 0;
-		if (strcmp(line, "$-1") == 0) {
-			conn->value_received = TRUE;
-			conn->value_not_found = TRUE;
-			if (conn->dict->dict.ioloop != NULL)
-				io_loop_stop(conn->dict->dict.ioloop);
-			redis_input_state_remove(conn->dict);
-			return 1;
+static void redis_commit_finish_request(struct redis_commit *commit)
+{
+	i_assert(commit->pending_requests > 0);
+	if (--commit->pending_requests > 0)
+		return;
+
+	commit->callback(&commit->result, commit->context);
+	i_free(commit->error);
+	i_free(commit);
+}
+
+static void
+redis_commit_reply(struct redis_request *req, const struct redis_reply *reply)
+{
+	struct redis_commit *commit = req->commit;
+	unsigned int i;
+
+	if (req->error != NULL) {
+		redis_commit_set_error(commit, DICT_COMMIT_RET_FAILED,
+			t_strdup_printf("redis: Commit failed: %s", req->error));
+		return;
+	}
+	if (reply->type != REDIS_REPLY_TYPE_ARRAY ||
+	    reply->count != req->commit_cmd_count) {
+		redis_commit_set_error(commit, DICT_COMMIT_RET_FAILED,
+			t_strdup_printf("redis: EXEC expected %u replies",
+					req->commit_cmd_count));
+		return;
+	}
+	for (i = 0; i < reply->count; i++) {
+		if (reply->elements[i].type == REDIS_REPLY_TYPE_ERROR) {
+			redis_commit_set_error(commit, DICT_COMMIT_RET_FAILED,
+				t_strdup_printf("redis: Commit failed: %s",
+						reply->elements[i].str));
+			return;
 		}
-		if (line[0] != '$' || str_to_uint(line+1, &conn->bytes_left) < 0) {
-			*error_r = t_strdup_printf(
-				"redis: Unexpected input (wanted $size): %s", line);
-			return -1;
+	}
+}
+
+static void
+redis_request_fail(struct redis_request *req, const char *error)
+{
+	switch (req->type) {
+	case REDIS_REQUEST_TYPE_AUTH:
+	case REDIS_REQUEST_TYPE_SELECT:
+		break;
+	case REDIS_REQUEST_TYPE_CLUSTER_SLOTS:
+		req->dict->cluster_slots_refreshing = FALSE;
+		break;
+	case REDIS_REQUEST_TYPE_LOOKUP:
+		redis_lookup_set_error(req, error);
+		redis_lookup_finish_request(req->lookup);
+		break;
+	case REDIS_REQUEST_TYPE_COMMIT:
+		/* EXEC may have already been processed by the server */
+		redis_commit_set_error(req->commit, req->sent ?
+				       DICT_COMMIT_RET_WRITE_UNCERTAIN :
+				       DICT_COMMIT_RET_FAILED, error);
+		redis_commit_finish_request(req->commit);
+		break;
+	}
+	redis_request_free(&req);
+}
+
+static void redis_connection_unref(struct redis_connection **_conn)
+{
+	struct redis_connection *conn = *_conn;
+
+	*_conn = NULL;
+	i_assert(conn->refcount > 0);
+	if (--conn->refcount > 0)
+		return;
+
+	i_assert(conn->destroyed);
+	i_assert(array_count(&conn->requests) == 0);
+	array_free(&conn->requests);
+	pool_unref(&conn->reply_pool);
+	i_free(conn->connect_error);
+	i_free(conn);
+}
+
+static void
+redis_connection_destroy(struct redis_connection *conn, const char *error)
+{
+	struct redis_connection *const *conns;
+	struct redis_request *req;
+	unsigned int i, count;
+
+	if (conn->destroyed)
+		return;
+	conn->destroyed = TRUE;
+
+	conns = array_get(&conn->node->conns, &count);
+	for (i = 0; i < count; i++) {
+		if (conns[i] == conn) {
+			array_delete(&conn->node->conns, i, 1);
+			break;
 		}
-		conn->bytes_left += 2; /* include trailing CRLF */
 	}
+	timeout_remove(&conn->to_request);
+	connection_deinit(&conn->conn);
+
+	/* The connection is already gone, so the callbacks can't try to
+	   use it anymore. */
+	while (array_count(&conn->requests) > 0) {
+		req = array_idx_elem(&conn->requests, 0);
+		array_pop_front(&conn->requests);
+		redis_request_fail(req, error);
+	}
+	redis_connection_unref(&conn);
+}
 
-	data = i_stream_get_data(conn->conn.input, &size);
-	if (size > conn->bytes_left)
-		size = conn->bytes_left;
-	str_append_data(conn->last_reply, data, size);
+static void redis_connection_timeout(struct redis_connection *conn)
+{
+	struct redis_dict *dict = conn->node->dict;
 
-	conn->bytes_left -= size;
-	i_stream_skip(conn->conn.input, size);
+	redis_connection_destroy(conn, t_strdup_printf(
+		"redis: Request timed out in %u.%03u secs (%u requests pending)",
+		dict->timeout_msecs/1000, dict->timeout_msecs%1000,
+		array_count(&conn->requests)));
+}
 
-	if (conn->bytes_left > 0)
-		return 0;
+static void
+redis_connection_send_request(struct redis_connection *conn,
+			      struct redis_request *req)
+{
+	if (req->asking) {
+		o_stream_nsend_str(conn->conn.output,
+				   "*1\r\n$6\r\nASKING\r\n");
+	}
+	o_stream_nsend(conn->conn.output, str_data(req->cmd),
+		       str_len(req->cmd));
+	req->sent = TRUE;
+}
 
-	/* reply fully read - drop trailing CRLF */
-	conn->value_received = TRUE;
-	str_truncate(conn->last_reply, str_len(conn->last_reply)-2);
+static void
+redis_connection_add_request(struct redis_connection *conn,
+			     struct redis_request *req)
+{
+	struct redis_dict *dict = conn->node->dict;
+
+	req->replies_left = req->reply_count + (req->asking ? 1 : 0);
+	req->sent = FALSE;
+	array_push_back(&conn->requests, &req);
+	if (conn->to_request == NULL) {
+		conn->to_request = timeout_add(dict->timeout_msecs,
+					       redis_connection_timeout, conn);
+	}
+	if (conn->connected)
+		redis_connection_send_request(conn, req);
+}
 
-	if (conn->dict->dict.ioloop != NULL)
-		io_loop_stop(conn->dict->dict.ioloop);
-	redis_input_state_remove(conn->dict);
-	return 1;
+static struct redis_node *
+redis_node_create(struct redis_dict *dict, const struct ip_addr *ip,
+		  in_port_t port, const char *unix_path)
+{
+	struct redis_node *node;
+
+	node = i_new(struct redis_node, 1);
+	node->dict = dict;
+	node->ip = *ip;
+	node->port = port;
+	node->unix_path = i_strdup(unix_path);
+	i_array_init(&node->conns, dict->max_connections);
+	array_push_back(&dict->nodes, &node);
+	return node;
 }
 
-static int
-redis_conn_input_more(struct redis_connection *conn, const char **error_r)
+static struct redis_node *
+redis_dict_get_node(struct redis_dict *dict, const struct ip_addr *ip,
+		    in_port_t port)
 {
-	struct redis_dict *dict = conn->dict;
-	struct redis_dict_reply *reply;
-	const enum redis_input_state *states;
-	enum redis_input_state state;
-	unsigned int count, num_replies;
-	const char *line;
+	struct redis_node *node;
 
-	states = array_get(&dict->input_states, &count);
-	if (count == 0) {
-		line = i_stream_next_line(conn->conn.input);
-		if (line == NULL)
-			return 0;
-		*error_r = t_strdup_printf(
-			"redis: Unexpected input (expected nothing): %s", line);
-		return -1;
+	array_foreach_elem(&dict->nodes, node) {
+		if (net_ip_compare(&node->ip, ip) && node->port == port)
+			return node;
 	}
-	state = states[0];
-	if (state == REDIS_INPUT_STATE_GET)
-		return redis_input_get(conn, error_r);
+	return redis_node_create(dict, ip, port, NULL);
+}
 
-	line = i_stream_next_line(conn->conn.input);
-	if (line == NULL)
-		return 0;
+static bool
+redis_request_redirect(struct redis_request *req)
+{
+	struct redis_dict *dict = req->dict;
+	struct redis_node *node;
+	const char *const *args, *p, *value;
+	struct ip_addr ip;
+	in_port_t port;
+	unsigned int slot;
+	bool ask;
+
+	/* -MOVED <slot> <ip>:<port> or -ASK <slot> <ip>:<port> */
+	if (!dict->cluster || req->error == NULL)
+		return FALSE;
+	if (str_begins(req->error, "MOVED ", &value))
+		ask = FALSE;
+	else if (str_begins(req->error, "ASK ", &value))
+		ask = TRUE;
+	else
+		return FALSE;
+
+	args = t_strsplit(value, " ");
+	if (str_array_length(args) != 2 ||
+	    str_to_uint(args[0], &slot) < 0 ||
+	    slot >= REDIS_CLUSTER_SLOT_COUNT ||
+	    (p = strrchr(args[1], ':')) == NULL ||
+	    net_addr2ip(t_strdup_until(args[1], p), &ip) < 0 ||
+	    net_str2port(p + 1, &port) < 0)
+		return FALSE;
+	if (req->redirect_count >= REDIS_CLUSTER_MAX_REDIRECTS)
+		return FALSE;
+
+	node = redis_dict_get_node(dict, &ip, port);
+	if (!ask) {
+		/* the slot has been permanently moved. The rest of the slots
+		   have likely changed as well. */
+		dict->slots[slot] = node;
+		redis_cluster_refresh_slots(dict, node);
+	}
+	e_debug(dict->dict.event, "Redirecting request: %s", req->error);
+	i_free(req->error);
+	req->redirect_count++;
+	req->asking = ask;
+	redis_node_add_request(node, req);
+	return TRUE;
+}
 
-	redis_input_state_remove(dict);
-	switch (state) {
-	case REDIS_INPUT_STATE_GET:
-		i_unreached();
-	case REDIS_INPUT_STATE_AUTH:
-	case REDIS_INPUT_STATE_SELECT:
-	case REDIS_INPUT_STATE_MULTI:
-	case REDIS_INPUT_STATE_DISCARD:
-		if (line[0] != '+')
-			break;
-		return 1;
-	case REDIS_INPUT_STATE_EXEC:
-		if (line[0] != '*' || str_to_uint(line+1, &num_replies) < 0)
-			break;
+static struct redis_node *
+redis_cluster_node_get(struct redis_dict *dict,
+		       const struct redis_reply *reply,
+		       struct redis_node *asked_node)
+{
+	struct ip_addr ip;
+	in_port_t port;
+
+	/* [ip, port, node-id, ...] */
+	if (reply->type != REDIS_REPLY_TYPE_ARRAY || reply->count < 2 ||
+	    reply->elements[0].type != REDIS_REPLY_TYPE_STRING ||
+	    reply->elements[1].type != REDIS_REPLY_TYPE_INTEGER ||
+	    reply->elements[1].integer <= 0 ||
+	    reply->elements[1].integer > (in_port_t)-1)
+		return NULL;
+	if (reply->elements[0].str[0] == '\0' ||
+	    strcmp(reply->elements[0].str, "?") == 0) {
+		/* unknown endpoint - it's the node we asked */
+		ip = asked_node->ip;
+	} else if (net_addr2ip(reply->elements[0].str, &ip) < 0) {
+		return NULL;
+	}
+	port = reply->elements[1].integer;
+	return redis_dict_get_node(dict, &ip, port);
+}
 
-		reply = array_front_modifiable(&dict->replies);
-		i_assert(reply->reply_count > 0);
-		if (reply->reply_count != num_replies) {
-			*error_r = t_strdup_printf(
-				"redis: EXEC expected %u replies, not %u",
-				reply->reply_count, num_replies);
-			return -1;
+static void
+redis_cluster_slots_reply(struct redis_dict *dict, struct redis_node *node,
+			  struct redis_request *req,
+			  const struct redis_reply *reply)
+{
+	const struct redis_reply *range;
+	struct redis_node *range_node;
+	unsigned int i, slot;
+
+	dict->cluster_slots_refreshing = FALSE;
+	if (req->error != NULL) {
+		e_error(dict->dict.event, "CLUSTER SLOTS failed: %s",
+			req->error);
+		return;
+	}
+	if (reply->type != REDIS_REPLY_TYPE_ARRAY) {
+		e_error(dict->dict.event,
+			"CLUSTER SLOTS returned unexpected reply");
+		return;
+	}
+
+	/* [[start, end, [master ip, port, ...], replicas...], ...] */
+	memset(dict->slots, 0, sizeof(*dict->slots) * REDIS_CLUSTER_SLOT_COUNT);
+	for (i = 0; i < reply->count; i++) {
+		range = &reply->elements[i];
+		if (range->type != REDIS_REPLY_TYPE_ARRAY ||
+		    range->count < 3 ||
+		    range->elements[0].type != REDIS_REPLY_TYPE_INTEGER ||
+		    range->elements[1].type != REDIS_REPLY_TYPE_INTEGER ||
+		    range->elements[0].integer < 0 ||
+		    range->elements[0].integer > range->elements[1].integer ||
+		    range->elements[1].integer >= REDIS_CLUSTER_SLOT_COUNT ||
+		    (range_node = redis_cluster_node_get(dict,
+				&range->elements[2], node)) == NULL) {
+			e_error(dict->dict.event,
+				"CLUSTER SLOTS returned invalid slot range");
+			continue;
 		}
-		return 1;
-	case REDIS_INPUT_STATE_EXEC_REPLY:
-		if (*line != '+' && *line != ':')
-			break;
-		/* success, just ignore the actual reply */
-		reply = array_front_modifiable(&dict->replies);
-		i_assert(reply->reply_count > 0);
-		if (--reply->reply_count == 0) {
-			const struct dict_commit_result result = {
-				DICT_COMMIT_RET_OK, NULL
-			};
-			redis_reply_callback(conn, reply, &result);
-			array_pop_front(&dict->replies);
-			/* if we're running in a dict-ioloop, we're handling a
-			   synchronous commit and need to stop now */
-			if (array_count(&dict->replies) == 0 &&
-			    conn->dict->dict.ioloop != NULL)
-				io_loop_stop(conn->dict->dict.ioloop);
+		for (slot = range->elements[0].integer;
+		     slot <= range->elements[1].integer; slot++)
+			dict->slots[slot] = range_node;
+	}
+}
+
+static void
+redis_request_reply(struct redis_connection *conn, struct redis_request *req,
+		    const struct redis_reply *reply)
+{
+	struct redis_dict *dict = conn->node->dict;
+
+	if (reply->type == REDIS_REPLY_TYPE_ERROR && req->error == NULL)
+		req->error = i_strdup(reply->str);
+	if (redis_request_redirect(req))
+		return;
+
+	switch (req->type) {
+	case REDIS_REQUEST_TYPE_AUTH:
+	case REDIS_REQUEST_TYPE_SELECT:
+		if (req->error != NULL) {
+			const char *error = t_strdup_printf(
+				"redis: %s failed: %s",
+				req->type == REDIS_REQUEST_TYPE_AUTH ?
+				"AUTH" : "SELECT", req->error);
+			e_error(conn->conn.event, "%s", error);
+			redis_request_free(&req);
+			redis_connection_destroy(conn, error);
+			return;
 		}
-		return 1;
+		break;
+	case REDIS_REQUEST_TYPE_CLUSTER_SLOTS:
+		redis_cluster_slots_reply(dict, conn->node, req, reply);
+		break;
+	case REDIS_REQUEST_TYPE_LOOKUP:
+		redis_lookup_reply(req, reply);
+		redis_lookup_finish_request(req->lookup);
+		break;
+	case REDIS_REQUEST_TYPE_COMMIT:
+		redis_commit_reply(req, reply);
+		redis_commit_finish_request(req->commit);
+		break;
 	}
-	str_truncate(dict->conn.last_reply, 0);
-	str_append(dict->conn.last_reply, line);
-	*error_r = t_strdup_printf("redis: Unexpected input (state=%d): %s", state, line);
-	return -1;
+	redis_request_free(&req);
+}
+
+static int
+redis_connection_input_reply(struct redis_connection *conn,
+			     const struct redis_reply *reply)
+{
+	struct redis_request *req;
+
+	if (array_count(&conn->requests) == 0) {
+		redis_connection_destroy(conn,
+			"redis: Unexpected reply while no requests pending");
+		return -1;
+	}
+	req = array_idx_elem(&conn->requests, 0);
+	if (--req->replies_left > 0) {
+		/* Reply to ASKING, MULTI or a queued command. Only the
+		   possible error matters. */
+		if (reply->type == REDIS_REPLY_TYPE_ERROR &&
+		    req->error == NULL)
+			req->error = i_strdup(reply->str);
+		return 0;
+	}
+
+	array_pop_front(&conn->requests);
+	if (array_count(&conn->requests) == 0)
+		timeout_remove(&conn->to_request);
+	else
+		timeout_reset(conn->to_request);
+	redis_request_reply(conn, req, reply);
+	return 0;
 }
 
 static void redis_conn_input(struct connection *_conn)
 {
-	struct redis_connection *conn = (struct redis_connection *)_conn;
-	const char *error = NULL;
+	struct redis_connection *conn =
+		container_of(_conn, struct redis_connection, conn);
+	struct redis_reply reply;
+	const unsigned char *data, *p;
+	const char *error;
+	size_t size;
 	int ret;
 
 	switch (i_stream_read(_conn->input)) {
 	case 0:
 		return;
 	case -1:
-		redis_disconnected(conn, i_stream_get_error(_conn->input));
+		redis_connection_destroy(conn, t_strdup_printf(
+			"redis: Disconnected: %s",
+			i_stream_get_disconnect_reason(_conn->input)));
 		return;
 	default:
 		break;
 	}
 
-	while ((ret = redis_conn_input_more(conn, &error)) > 0) ;
-	if (ret < 0) {
-		i_assert(error != NULL);
-		redis_disconnected(conn, error);
+	conn->refcount++;
+	while (!conn->destroyed) {
+		data = i_stream_get_data(_conn->input, &size);
+		if (size == 0)
+			break;
+		p_clear(conn->reply_pool);
+		p = data;
+		ret = redis_reply_parse(conn->reply_pool, &p, data + size, 0,
+					&reply, &error);
+		if (ret == 0)
+			break;
+		if (ret < 0) {
+			redis_connection_destroy(conn,
+				t_strdup_printf("redis: %s", error));
+			break;
+		}
+		i_stream_skip(_conn->input, p - data);
+		if (redis_connection_input_reply(conn, &reply) < 0)
+			break;
 	}
+	redis_connection_unref(&conn);
 }
 
 static void redis_conn_connected(struct connection *_conn, bool success)
 {
-	struct redis_connection *conn = (struct redis_connection *)_conn;
+	struct redis_connection *conn =
+		container_of(_conn, struct redis_connection, conn);
+	struct redis_dict *dict = conn->node->dict;
+	struct redis_request *req;
+	unsigned int idx = 0;
 
 	if (!success) {
-		e_error(conn->conn.event, "connect() failed: %m");
-	} else {
-		conn->dict->connected = TRUE;
+		conn->connect_error = i_strdup_printf(
+			"connect(%s) failed: %m", _conn->name);
+		e_error(_conn->event, "%s", conn->connect_error);
+		return;
+	}
+	conn->connected = TRUE;
+
+	/* AUTH and SELECT must be handled before the requests that were
+	   already queued. */
+	if (*dict->password != '\0') {
+		req = redis_request_create(dict, REDIS_REQUEST_TYPE_AUTH, 0);
+		redis_append_command(req->cmd, 2);
+		redis_append_arg(req->cmd, "AUTH");
+		redis_append_arg(req->cmd, dict->password);
+		req->replies_left = req->reply_count;
+		array_insert(&conn->requests, idx++, &req, 1);
+	}
+	if (dict->db_id != 0) {
+		req = redis_request_create(dict, REDIS_REQUEST_TYPE_SELECT, 0);
+		redis_append_command(req->cmd, 2);
+		redis_append_arg(req->cmd, "SELECT");
+		redis_append_arg(req->cmd, dec2str(dict->db_id));
+		req->replies_left = req->reply_count;
+		array_insert(&conn->requests, idx++, &req, 1);
+	}
+	if (array_count(&conn->requests) == 0)
+		return;
+
+	if (conn->to_request == NULL) {
+		conn->to_request = timeout_add(dict->timeout_msecs,
+					       redis_connection_timeout, conn);
+	}
+	o_stream_cork(_conn->output);
+	array_foreach_elem(&conn->requests, req)
+		redis_connection_send_request(conn, req);
+	o_stream_uncork(_conn->output);
+}
+
+static void redis_conn_destroy(struct connection *_conn)
+{
+	struct redis_connection *conn =
+		container_of(_conn, struct redis_connection, conn);
+	const char *error;
+
+	if (conn->connect_error != NULL)
+		error = t_strdup_printf("redis: %s", conn->connect_error);
+	else {
+		error = t_strdup_printf("redis: %s",
+			connection_disconnect_reason(_conn));
 	}
-	if (conn->dict->dict.ioloop != NULL)
-		io_loop_stop(conn->dict->dict.ioloop);
+	redis_connection_destroy(conn, error);
 }
 
 static const struct connection_settings redis_conn_set = {
@@ -322,6 +926,84 @@ static const struct connection_vfuncs redis_conn_vfuncs = {
 	.client_connected = redis_conn_connected
 };
 
+static struct redis_connection *redis_connection_create(struct redis_node *node)
+{
+	struct redis_dict *dict = node->dict;
+	struct redis_connection *conn;
+
+	conn = i_new(struct redis_connection, 1);
+	conn->refcount = 1;
+	conn->node = node;
+	conn->reply_pool = pool_alloconly_create("redis reply", 1024);
+	i_array_init(&conn->requests, 16);
+	array_push_back(&node->conns, &conn);
+
+	conn->conn.event_parent = dict->dict.event;
+	if (node->unix_path != NULL) {
+		connection_init_client_unix(redis_connections, &conn->conn,
+					    node->unix_path);
+	} else {
+		connection_init_client_ip(redis_connections, &conn->conn,
+					  NULL, &node->ip, node->port);
+	}
+	event_set_append_log_prefix(conn->conn.event, "redis: ");
+	(void)connection_client_connect_async(&conn->conn);
+	return conn;
+}
+
+static void
+redis_node_add_request(struct redis_node *node, struct redis_request *req)
+{
+	struct redis_connection *conn, *best = NULL;
+
+	/* Use the connection with the fewest pending requests. If they're
+	   all busy, grow the pool. */
+	array_foreach_elem(&node->conns, conn) {
+		if (best == NULL ||
+		    array_count(&conn->requests) < array_count(&best->requests))
+			best = conn;
+	}
+	if (best == NULL ||
+	    (array_count(&best->requests) > 0 &&
+	     array_count(&node->conns) < node->dict->max_connections))
+		best = redis_connection_create(node);
+	redis_connection_add_request(best, req);
+}
+
+static void
+redis_cluster_refresh_slots(struct redis_dict *dict, struct redis_node *node)
+{
+	struct redis_request *req;
+
+	if (dict->cluster_slots_refreshing)
+		return;
+	dict->cluster_slots_requested = TRUE;
+	dict->cluster_slots_refreshing = TRUE;
+
+	req = redis_request_create(dict, REDIS_REQUEST_TYPE_CLUSTER_SLOTS, 0);
+	redis_append_command(req->cmd, 2);
+	redis_append_arg(req->cmd, "CLUSTER");
+	redis_append_arg(req->cmd, "SLOTS");
+	redis_node_add_request(node, req);
+}
+
+static void redis_request_send(struct redis_request *req)
+{
+	struct redis_dict *dict = req->dict;
+	struct redis_node *node, *seed_node = array_idx_elem(&dict->nodes, 0);
+
+	if (!dict->cluster) {
+		redis_node_add_request(seed_node, req);
+		return;
+	}
+	if (!dict->cluster_slots_requested)
+		redis_cluster_refresh_slots(dict, seed_node);
+	/* Until the slots are known, the seed node redirects the requests
+	   to the right nodes. */
+	node = dict->slots[req->slot];
+	redis_node_add_request(node != NULL ? node : seed_node, req);
+}
+
 static const char *redis_escape_username(const char *username)
 {
 	const char *p;
@@ -344,9 +1026,10 @@ static const char *redis_escape_username(const char *username)
 
 static int
 redis_dict_init(struct dict *driver, const char *uri,
-		const struct dict_settings *set,
+		const struct dict_settings *set ATTR_UNUSED,
 		struct dict **dict_r, const char **error_r)
 {
+	struct ioloop *old_ioloop = current_ioloop;
 	struct redis_dict *dict;
 	struct ip_addr ip;
 	unsigned int secs;
@@ -364,6 +1047,7 @@ redis_dict_init(struct dict *driver, const char *uri,
 	if (net_addr2ip("127.0.0.1", &ip) < 0)
 		i_unreached();
 	dict->timeout_msecs = REDIS_DEFAULT_LOOKUP_TIMEOUT_MSECS;
+	dict->max_connections = REDIS_DEFAULT_MAX_CONNECTIONS;
 	dict->key_prefix = i_strdup("");
 	dict->password   = i_strdup("");
 
@@ -401,11 +1085,27 @@ redis_dict_init(struct dict *driver, const char *uri,
 			i_free(dict->expire_value);
 			dict->expire_value = i_strdup(value);
 		} else if (str_begins(*args, "timeout_msecs=", &value)) {
-			if (str_to_uint(value, &dict->timeout_msecs) < 0) {
+			if (str_to_uint(value, &dict->timeout_msecs) < 0 ||
+			    dict->timeout_msecs == 0) {
 				*error_r = t_strdup_printf(
 					"Invalid timeout_msecs: %s", value);
 				ret = -1;
 			}
+		} else if (str_begins(*args, "connections=", &value)) {
+			if (str_to_uint(value, &dict->max_connections) < 0 ||
+			    dict->max_connections == 0) {
+				*error_r = t_strdup_printf(
+					"Invalid connections: %s", value);
+				ret = -1;
+			}
+		} else if (str_begins(*args, "cluster=", &value)) {
+			if (strcmp(value, "yes") == 0)
+				dict->cluster = TRUE;
+			else if (strcmp(value, "no") != 0) {
+				*error_r = t_strdup_printf(
+					"Invalid cluster: %s", value);
+				ret = -1;
+			}
 		} else if (str_begins(*args, "password=", &value)) {
 			i_free(dict->password);
 			dict->password = i_strdup(value);
@@ -415,46 +1115,73 @@ redis_dict_init(struct dict *driver, const char *uri,
 			ret = -1;
 		}
 	}
+	if (ret == 0 && dict->cluster && unix_path != NULL) {
+		*error_r = "cluster=yes can't be used with path";
+		ret = -1;
+	}
 	if (ret < 0) {
+		i_free(dict->expire_value);
 		i_free(dict->password);
 		i_free(dict->key_prefix);
 		i_free(dict);
 		return -1;
 	}
 
-	dict->conn.conn.event_parent = set->event_parent;
-
-	if (unix_path != NULL) {
-		connection_init_client_unix(redis_connections, &dict->conn.conn,
-					    unix_path);
-	} else {
-		connection_init_client_ip(redis_connections, &dict->conn.conn,
-					  NULL, &ip, port);
-	}
-	event_set_append_log_prefix(dict->conn.conn.event, "redis: ");
 	dict->dict = *driver;
-	dict->conn.last_reply = str_new(default_pool, 256);
-	dict->conn.dict = dict;
-
-	i_array_init(&dict->input_states, 4);
-	i_array_init(&dict->replies, 4);
+	i_array_init(&dict->nodes, 4);
+	(void)redis_node_create(dict, &ip, port, unix_path);
+	if (dict->cluster) {
+		dict->slots = i_new(struct redis_node *,
+				    REDIS_CLUSTER_SLOT_COUNT);
+	}
 
+	dict->dict.ioloop = io_loop_create();
+	io_loop_set_current(old_ioloop);
 	*dict_r = &dict->dict;
 	return 0;
 }
 
+static void redis_wait(struct redis_dict *dict)
+{
+	i_assert(io_loop_is_empty(dict->dict.ioloop));
+	dict->dict.prev_ioloop = current_ioloop;
+	io_loop_set_current(dict->dict.ioloop);
+	dict_switch_ioloop(&dict->dict);
+	while (dict->request_count > 0)
+		io_loop_run(dict->dict.ioloop);
+
+	io_loop_set_current(dict->dict.prev_ioloop);
+	dict->dict.prev_ioloop = NULL;
+
+	dict_switch_ioloop(&dict->dict);
+	i_assert(io_loop_is_empty(dict->dict.ioloop));
+}
+
 static void redis_dict_deinit(struct dict *_dict)
 {
 	struct redis_dict *dict = (struct redis_dict *)_dict;
+	struct ioloop *old_ioloop = current_ioloop;
+	struct redis_node *node;
 
-	if (array_count(&dict->input_states) > 0) {
-		i_assert(dict->connected);
+	if (dict->request_count > 0)
 		redis_wait(dict);
+	array_foreach_elem(&dict->nodes, node) {
+		while (array_count(&node->conns) > 0) {
+			redis_connection_destroy(
+				array_idx_elem(&node->conns, 0), "Deinit");
+		}
+		array_free(&node->conns);
+		i_free(node->unix_path);
+		i_free(node);
 	}
-	connection_deinit(&dict->conn.conn);
-	str_free(&dict->conn.last_reply);
-	array_free(&dict->replies);
-	array_free(&dict->input_states);
+	i_assert(dict->request_count == 0);
+
+	io_loop_set_current(dict->dict.ioloop);
+	io_loop_destroy(&dict->dict.ioloop);
+	io_loop_set_current(old_ioloop);
+
+	array_free(&dict->nodes);
+	i_free(dict->slots);
 	i_free(dict->expire_value);
 	i_free(dict->key_prefix);
 	i_free(dict->password);
@@ -468,16 +1195,26 @@ static void redis_dict_wait(struct dict *_dict)
 {
 	struct redis_dict *dict = (struct redis_dict *)_dict;
 
-	if (array_count(&dict->input_states) > 0)
+	if (dict->request_count > 0)
 		redis_wait(dict);
 }
 
-static void redis_dict_lookup_timeout(struct redis_dict *dict)
+static bool redis_dict_switch_ioloop(struct dict *_dict)
 {
-	const char *reason = t_strdup_printf(
-		"redis: Lookup timed out in %u.%03u secs",
-		dict->timeout_msecs/1000, dict->timeout_msecs%1000);
-	redis_disconnected(&dict->conn, reason);
+	struct redis_dict *dict = (struct redis_dict *)_dict;
+	struct redis_node *node;
+	struct redis_connection *conn;
+
+	array_foreach_elem(&dict->nodes, node) {
+		array_foreach_elem(&node->conns, conn) {
+			connection_switch_ioloop(&conn->conn);
+			if (conn->to_request != NULL) {
+				conn->to_request =
+					io_loop_move_timeout(&conn->to_request);
+			}
+		}
+	}
+	return dict->request_count > 0;
 }
 
 static const char *
@@ -501,134 +1238,168 @@ redis_dict_get_full_key(struct redis_dict *dict, const char *username,
 	return key;
 }
 
-static void redis_dict_auth(struct redis_dict *dict)
+static void
+redis_lookup_send(struct redis_dict *dict, struct redis_lookup *lookup,
+		  const char *username, const char *const *keys)
 {
-	const char *cmd;
+	struct redis_request *req;
+	const char **full_keys;
+	unsigned int *slots, i, j;
+	bool *sent;
+
+	full_keys = t_new(const char *, lookup->count);
+	slots = t_new(unsigned int, lookup->count);
+	sent = t_new(bool, lookup->count);
+	for (i = 0; i < lookup->count; i++) {
+		full_keys[i] = redis_dict_get_full_key(dict, username, keys[i]);
+		if (dict->cluster)
+			slots[i] = redis_key_hash_slot(full_keys[i]);
+	}
 
-	if (*dict->password == '\0')
-		return;
+	/* Look up all the keys in the same hash slot with a single GET or
+	   MGET. Without cluster all the slots are 0. */
+	lookup->pending_requests = 1;
+	for (i = 0; i < lookup->count; i++) {
+		if (sent[i])
+			continue;
+		req = redis_request_create(dict, REDIS_REQUEST_TYPE_LOOKUP,
+					   slots[i]);
+		req->lookup = lookup;
+		req->key_indexes = p_new(lookup->pool, unsigned int,
+					 lookup->count - i);
+		for (j = i; j < lookup->count; j++) {
+			if (!sent[j] && slots[j] == slots[i]) {
+				req->key_indexes[req->key_count++] = j;
+				sent[j] = TRUE;
+			}
+		}
+		redis_append_command(req->cmd, req->key_count + 1);
+		redis_append_arg(req->cmd, req->key_count == 1 ? "GET" : "MGET");
+		for (j = 0; j < req->key_count; j++) {
+			redis_append_arg(req->cmd,
+					 full_keys[req->key_indexes[j]]);
+		}
+		lookup->pending_requests++;
+		redis_request_send(req);
+	}
+	redis_lookup_finish_request(lookup);
+}
 
-	cmd = t_strdup_printf("*2\r\n$4\r\nAUTH\r\n$%d\r\n%s\r\n",
-	                      (int)strlen(dict->password), dict->password);
-	o_stream_nsend_str(dict->conn.conn.output, cmd);
-	redis_input_state_add(dict, REDIS_INPUT_STATE_AUTH);
+static struct redis_lookup *redis_lookup_init(unsigned int count)
+{
+	struct redis_lookup *lookup;
+	pool_t pool;
+
+	pool = pool_alloconly_create("redis lookup", 256);
+	lookup = p_new(pool, struct redis_lookup, 1);
+	lookup->pool = pool;
+	lookup->count = count;
+	lookup->results = p_new(pool, struct dict_lookup_result, count);
+	return lookup;
 }
 
-static void redis_dict_select_db(struct redis_dict *dict)
+static void
+redis_dict_lookup_async(struct dict *_dict, const struct dict_op_settings *set,
+			const char *key, dict_lookup_callback_t *callback,
+			void *context)
 {
-	const char *cmd, *db_str;
+	struct redis_dict *dict = (struct redis_dict *)_dict;
+	const char *keys[] = { key, NULL };
+	struct redis_lookup *lookup;
 
-	if (dict->db_id_set)
-		return;
-	dict->db_id_set = TRUE;
-	if (dict->db_id == 0) {
-		/* 0 is the default */
-		return;
-	}
-	db_str = dec2str(dict->db_id);
-	cmd = t_strdup_printf("*2\r\n$6\r\nSELECT\r\n$%d\r\n%s\r\n",
-			      (int)strlen(db_str), db_str);
-	o_stream_nsend_str(dict->conn.conn.output, cmd);
-	redis_input_state_add(dict, REDIS_INPUT_STATE_SELECT);
+	lookup = redis_lookup_init(1);
+	lookup->callback = callback;
+	lookup->context = context;
+	redis_lookup_send(dict, lookup, set->username, keys);
 }
 
-static int redis_dict_lookup(struct dict *_dict,
-			     const struct dict_op_settings *set,
-			     pool_t pool, const char *key,
-			     const char *const **values_r, const char **error_r)
+static void
+redis_dict_lookup_multi_async(struct dict *_dict,
+			      const struct dict_op_settings *set,
+			      const char *const *keys,
+			      dict_lookup_multi_callback_t *callback,
+			      void *context)
 {
 	struct redis_dict *dict = (struct redis_dict *)_dict;
-	struct timeout *to;
-	const char *cmd;
-
-	key = redis_dict_get_full_key(dict, set->username, key);
+	struct redis_lookup *lookup;
 
-	dict->conn.value_received = FALSE;
-	dict->conn.value_not_found = FALSE;
+	lookup = redis_lookup_init(str_array_length(keys));
+	lookup->multi_callback = callback;
+	lookup->context = context;
+	redis_lookup_send(dict, lookup, set->username, keys);
+}
 
-	i_assert(dict->dict.ioloop == NULL);
+struct redis_dict_sync_lookup {
+	char *error;
+	const char **values;
+	int ret;
+};
 
-	dict->dict.prev_ioloop = current_ioloop;
-	dict->dict.ioloop = io_loop_create();
-	connection_switch_ioloop(&dict->conn.conn);
+static void
+redis_dict_lookup_callback(const struct dict_lookup_result *result,
+			   void *context)
+{
+	struct redis_dict_sync_lookup *lookup = context;
 
-	if (dict->conn.conn.fd_in == -1 &&
-	    connection_client_connect(&dict->conn.conn) < 0) {
-		e_error(dict->conn.conn.event, "Couldn't connect");
-	} else {
-		to = timeout_add(dict->timeout_msecs,
-				 redis_dict_lookup_timeout, dict);
-		if (!dict->connected) {
-			/* wait for connection */
-			io_loop_run(dict->dict.ioloop);
-			if (dict->connected)
-				redis_dict_auth(dict);
-		}
+	lookup->ret = result->ret;
+	if (result->ret == -1)
+		lookup->error = i_strdup(result->error);
+	else if (result->ret == 1)
+		lookup->values = p_strarray_dup(default_pool, result->values);
+}
 
-		if (dict->connected) {
-			redis_dict_select_db(dict);
-			cmd = t_strdup_printf("*2\r\n$3\r\nGET\r\n$%d\r\n%s\r\n",
-					      (int)strlen(key), key);
-			o_stream_nsend_str(dict->conn.conn.output, cmd);
-
-			str_truncate(dict->conn.last_reply, 0);
-			redis_input_state_add(dict, REDIS_INPUT_STATE_GET);
-			do {
-				io_loop_run(dict->dict.ioloop);
-			} while (array_count(&dict->input_states) > 0);
-		}
-		timeout_remove(&to);
-	}
+static int redis_dict_lookup(struct dict *_dict,
+			     const struct dict_op_settings *set,
+			     pool_t pool, const char *key,
+			     const char *const **values_r, const char **error_r)
+{
+	struct redis_dict *dict = (struct redis_dict *)_dict;
+	struct redis_dict_sync_lookup lookup;
 
-	io_loop_set_current(dict->dict.prev_ioloop);
-	connection_switch_ioloop(&dict->conn.conn);
-	io_loop_set_current(dict->dict.ioloop);
-	io_loop_destroy(&dict->dict.ioloop);
-	dict->dict.prev_ioloop = NULL;
+	i_zero(&lookup);
+	lookup.ret = -2;
+	redis_dict_lookup_async(_dict, set, key,
+				redis_dict_lookup_callback, &lookup);
+	if (lookup.ret == -2)
+		redis_wait(dict);
+	i_assert(lookup.ret != -2);
 
-	if (!dict->conn.value_received) {
-		/* we failed in some way. make sure we disconnect since the
-		   connection state isn't known anymore */
-		*error_r = t_strdup_printf("redis: Communication failure (last reply: %s)",
-					   str_c(dict->conn.last_reply));
-		redis_disconnected(&dict->conn, *error_r);
+	switch (lookup.ret) {
+	case -1:
+		*error_r = t_strdup(lookup.error);
+		i_free(lookup.error);
 		return -1;
-	}
-	if (dict->conn.value_not_found)
+	case 0:
 		return 0;
-
-	const char **values = p_new(pool, const char *, 2);
-	values[0] = p_strdup(pool, str_c(dict->conn.last_reply));
-	*values_r = values;
-	return 1;
+	default:
+		*values_r = p_strarray_dup(pool, lookup.values);
+		i_free(lookup.values);
+		return 1;
+	}
 }
 
 static struct dict_transaction_context *
 redis_transaction_init(struct dict *_dict)
 {
-	struct redis_dict *dict = (struct redis_dict *)_dict;
 	struct redis_dict_transaction_context *ctx;
 
-	i_assert(!dict->transaction_open);
-	dict->transaction_open = TRUE;
-
 	ctx = i_new(struct redis_dict_transaction_context, 1);
 	ctx->ctx.dict = _dict;
-
-	if (dict->conn.conn.fd_in == -1 &&
-	    connection_client_connect(&dict->conn.conn) < 0) {
-		e_error(dict->conn.conn.event, "Couldn't connect");
-	} else if (!dict->connected) {
-		/* wait for connection */
-		redis_wait(dict);
-		if (dict->connected)
-			redis_dict_auth(dict);
-	}
-	if (dict->connected)
-		redis_dict_select_db(dict);
+	i_array_init(&ctx->slots, 2);
 	return &ctx->ctx;
 }
 
+static void
+redis_transaction_free(struct redis_dict_transaction_context *ctx)
+{
+	struct redis_dict_transaction_slot *tslot;
+
+	array_foreach_modifiable(&ctx->slots, tslot)
+		str_free(&tslot->cmd);
+	array_free(&ctx->slots);
+	i_free(ctx);
+}
+
 static void
 redis_transaction_commit(struct dict_transaction_context *_ctx, bool async,
 			 dict_transaction_commit_callback_t *callback,
@@ -637,103 +1408,88 @@ redis_transaction_commit(struct dict_transaction_context *_ctx, bool async,
 	struct redis_dict_transaction_context *ctx =
 		(struct redis_dict_transaction_context *)_ctx;
 	struct redis_dict *dict = (struct redis_dict *)_ctx->dict;
-	struct redis_dict_reply *reply;
-	unsigned int i;
-	struct dict_commit_result result = { .ret = DICT_COMMIT_RET_OK };
-
-	i_assert(dict->transaction_open);
-	dict->transaction_open = FALSE;
-
-	if (ctx->error != NULL) {
-		/* make sure we're disconnected */
-		redis_disconnected(&dict->conn, ctx->error);
-		result.ret = -1;
-		result.error = ctx->error;
-	} else if (_ctx->changed) {
-		i_assert(ctx->cmd_count > 0);
-
-		o_stream_nsend_str(dict->conn.conn.output,
-				   "*1\r\n$4\r\nEXEC\r\n");
-		reply = array_append_space(&dict->replies);
-		reply->callback = callback;
-		reply->context = context;
-		reply->reply_count = ctx->cmd_count;
-		redis_input_state_add(dict, REDIS_INPUT_STATE_EXEC);
-		for (i = 0; i < ctx->cmd_count; i++)
-			redis_input_state_add(dict, REDIS_INPUT_STATE_EXEC_REPLY);
-		if (async) {
-			i_free(ctx);
-			return;
-		}
-		redis_wait(dict);
+	struct redis_dict_transaction_slot *tslot;
+	struct redis_commit *commit;
+	struct redis_request *req;
+
+	if (array_count(&ctx->slots) == 0) {
+		const struct dict_commit_result result = {
+			.ret = DICT_COMMIT_RET_OK
+		};
+		redis_transaction_free(ctx);
+		callback(&result, context);
+		return;
 	}
-	callback(&result, context);
-	i_free(ctx->error);
-	i_free(ctx);
+
+	commit = i_new(struct redis_commit, 1);
+	commit->result.ret = DICT_COMMIT_RET_OK;
+	commit->callback = callback;
+	commit->context = context;
+	/* keep the commit alive until all the requests have been sent */
+	commit->pending_requests = 1;
+	array_foreach_modifiable(&ctx->slots, tslot) {
+		req = redis_request_create(dict, REDIS_REQUEST_TYPE_COMMIT,
+					   tslot->slot);
+		req->commit = commit;
+		req->commit_cmd_count = tslot->cmd_count;
+		/* replies: +OK to MULTI, +QUEUED to each command and the
+		   EXEC reply */
+		req->reply_count = tslot->cmd_count + 2;
+		str_append(req->cmd, "*1\r\n$5\r\nMULTI\r\n");
+		str_append_str(req->cmd, tslot->cmd);
+		str_append(req->cmd, "*1\r\n$4\r\nEXEC\r\n");
+		commit->pending_requests++;
+		redis_request_send(req);
+	}
+	redis_transaction_free(ctx);
+	redis_commit_finish_request(commit);
+
+	if (!async)
+		redis_wait(dict);
 }
 
 static void redis_transaction_rollback(struct dict_transaction_context *_ctx)
 {
 	struct redis_dict_transaction_context *ctx =
 		(struct redis_dict_transaction_context *)_ctx;
-	struct redis_dict *dict = (struct redis_dict *)_ctx->dict;
-	struct redis_dict_reply *reply;
-
-	i_assert(dict->transaction_open);
-	dict->transaction_open = FALSE;
-
-	if (ctx->error != NULL) {
-		/* make sure we're disconnected */
-		redis_disconnected(&dict->conn, ctx->error);
-	} else if (_ctx->changed) {
-		o_stream_nsend_str(dict->conn.conn.output,
-				   "*1\r\n$7\r\nDISCARD\r\n");
-		reply = array_append_space(&dict->replies);
-		reply->reply_count = 1;
-		redis_input_state_add(dict, REDIS_INPUT_STATE_DISCARD);
-	}
-	i_free(ctx->error);
-	i_free(ctx);
+
+	/* nothing has been sent yet */
+	redis_transaction_free(ctx);
 }
 
-static int redis_check_transaction(struct redis_dict_transaction_context *ctx)
+static struct redis_dict_transaction_slot *
+redis_transaction_get_slot(struct redis_dict_transaction_context *ctx,
+			   const char *key)
 {
 	struct redis_dict *dict = (struct redis_dict *)ctx->ctx.dict;
+	struct redis_dict_transaction_slot *tslot;
+	unsigned int slot;
 
-	if (ctx->error != NULL)
-		return -1;
-	if (!dict->connected) {
-		ctx->error = i_strdup("Disconnected during transaction");
-		return -1;
-	}
-	if (ctx->ctx.changed)
-		return 0;
-
-	redis_input_state_add(dict, REDIS_INPUT_STATE_MULTI);
-	if (o_stream_send_str(dict->conn.conn.output,
-			      "*1\r\n$5\r\nMULTI\r\n") < 0) {
-		ctx->error = i_strdup_printf("write() failed: %s",
-			o_stream_get_error(dict->conn.conn.output));
-		return -1;
+	slot = dict->cluster ? redis_key_hash_slot(key) : 0;
+	array_foreach_modifiable(&ctx->slots, tslot) {
+		if (tslot->slot == slot)
+			return tslot;
 	}
-	return 0;
+	tslot = array_append_space(&ctx->slots);
+	tslot->slot = slot;
+	tslot->cmd = str_new(default_pool, 256);
+	return tslot;
 }
 
 static void
 redis_append_expire(struct redis_dict_transaction_context *ctx,
-		    string_t *cmd, const char *key)
+		    struct redis_dict_transaction_slot *tslot, const char *key)
 {
 	struct redis_dict *dict = (struct redis_dict *)ctx->ctx.dict;
 
 	if (dict->expire_value == NULL)
 		return;
 
-	str_printfa(cmd, "*3\r\n$6\r\nEXPIRE\r\n$%u\r\n%s\r\n$%u\r\n%s\r\n",
-		    (unsigned int)strlen(key), key,
-		    (unsigned int)strlen(dict->expire_value),
-		    dict->expire_value);
-	redis_input_state_add(dict, REDIS_INPUT_STATE_MULTI);
-	ctx->cmd_count++;
+	redis_append_command(tslot->cmd, 3);
+	redis_append_arg(tslot->cmd, "EXPIRE");
+	redis_append_arg(tslot->cmd, key);
+	redis_append_arg(tslot->cmd, dict->expire_value);
+	tslot->cmd_count++;
 }
 
 static void redis_set(struct dict_transaction_context *_ctx,
@@ -743,23 +1499,16 @@ static void redis_set(struct dict_transaction_context *_ctx,
 		(struct redis_dict_transaction_context *)_ctx;
 	struct redis_dict *dict = (struct redis_dict *)_ctx->dict;
 	const struct dict_op_settings_private *set = &_ctx->set;
-	string_t *cmd;
-
-	if (redis_check_transaction(ctx) < 0)
-		return;
+	struct redis_dict_transaction_slot *tslot;
 
 	key = redis_dict_get_full_key(dict, set->username, key);
-	cmd = t_str_new(128);
-	str_printfa(cmd, "*3\r\n$3\r\nSET\r\n$%u\r\n%s\r\n$%u\r\n%s\r\n",
-		    (unsigned int)strlen(key), key,
-		    (unsigned int)strlen(value), value);
-	redis_input_state_add(dict, REDIS_INPUT_STATE_MULTI);
-	ctx->cmd_count++;
-	redis_append_expire(ctx, cmd, key);
-	if (o_stream_send(dict->conn.conn.output, str_data(cmd), str_len(cmd)) < 0) {
-		ctx->error = i_strdup_printf("write() failed: %s",
-			o_stream_get_error(dict->conn.conn.output));
-	}
+	tslot = redis_transaction_get_slot(ctx, key);
+	redis_append_command(tslot->cmd, 3);
+	redis_append_arg(tslot->cmd, "SET");
+	redis_append_arg(tslot->cmd, key);
+	redis_append_arg(tslot->cmd, value);
+	tslot->cmd_count++;
+	redis_append_expire(ctx, tslot, key);
 }
 
 static void redis_unset(struct dict_transaction_context *_ctx,
@@ -769,20 +1518,14 @@ static void redis_unset(struct dict_transaction_context *_ctx,
 		(struct redis_dict_transaction_context *)_ctx;
 	struct redis_dict *dict = (struct redis_dict *)_ctx->dict;
 	const struct dict_op_settings_private *set = &_ctx->set;
-	const char *cmd;
-
-	if (redis_check_transaction(ctx) < 0)
-		return;
+	struct redis_dict_transaction_slot *tslot;
 
 	key = redis_dict_get_full_key(dict, set->username, key);
-	cmd = t_strdup_printf("*2\r\n$3\r\nDEL\r\n$%u\r\n%s\r\n",
-			      (unsigned int)strlen(key), key);
-	if (o_stream_send_str(dict->conn.conn.output, cmd) < 0) {
-		ctx->error = i_strdup_printf("write() failed: %s",
-			o_stream_get_error(dict->conn.conn.output));
-	}
-	redis_input_state_add(dict, REDIS_INPUT_STATE_MULTI);
-	ctx->cmd_count++;
+	tslot = redis_transaction_get_slot(ctx, key);
+	redis_append_command(tslot->cmd, 2);
+	redis_append_arg(tslot->cmd, "DEL");
+	redis_append_arg(tslot->cmd, key);
+	tslot->cmd_count++;
 }
 
 static void redis_atomic_inc(struct dict_transaction_context *_ctx,
@@ -792,25 +1535,16 @@ static void redis_atomic_inc(struct dict_transaction_context *_ctx,
 		(struct redis_dict_transaction_context *)_ctx;
 	struct redis_dict *dict = (struct redis_dict *)_ctx->dict;
 	const struct dict_op_settings_private *set = &_ctx->set;
-	const char *diffstr;
-	string_t *cmd;
-
-	if (redis_check_transaction(ctx) < 0)
-		return;
+	struct redis_dict_transaction_slot *tslot;
 
 	key = redis_dict_get_full_key(dict, set->username, key);
-	diffstr = t_strdup_printf("%lld", diff);
-	cmd = t_str_new(128);
-	str_printfa(cmd, "*3\r\n$6\r\nINCRBY\r\n$%u\r\n%s\r\n$%u\r\n%s\r\n",
-		    (unsigned int)strlen(key), key,
-		    (unsigned int)strlen(diffstr), diffstr);
-	redis_input_state_add(dict, REDIS_INPUT_STATE_MULTI);
-	ctx->cmd_count++;
-	redis_append_expire(ctx, cmd, key);
-	if (o_stream_send(dict->conn.conn.output, str_data(cmd), str_len(cmd)) < 0) {
-		ctx->error = i_strdup_printf("write() failed: %s",
-			o_stream_get_error(dict->conn.conn.output));
-	}
+	tslot = redis_transaction_get_slot(ctx, key);
+	redis_append_command(tslot->cmd, 3);
+	redis_append_arg(tslot->cmd, "INCRBY");
+	redis_append_arg(tslot->cmd, key);
+	redis_append_arg(tslot->cmd, t_strdup_printf("%lld", diff));
+	tslot->cmd_count++;
+	redis_append_expire(ctx, tslot, key);
 }
 
 struct dict dict_driver_redis = {
@@ -826,5 +1560,8 @@ struct dict dict_driver_redis = {
 		.set = redis_set,
 		.unset = redis_unset,
 		.atomic_inc = redis_atomic_inc,
+		.lookup_async = redis_dict_lookup_async,
+		.switch_ioloop = redis_dict_switch_ioloop,
+		.lookup_multi_async = redis_dict_lookup_multi_async,
 	}
 };
@@ -29,6 +29,25 @@ struct dict_lookup_callback_ctx {
 	void *context;
 };
 
+struct dict_lookup_multi_key {
+	struct dict_lookup_multi_callback_ctx *ctx;
+	unsigned int idx;
+};
+
+struct dict_lookup_multi_callback_ctx {
+	pool_t pool;
+	struct dict *dict;
+	dict_lookup_multi_callback_t *callback;
+	void *context;
+
+	unsigned int count;
+	/* Events for each key, used by dict_lookup_multi_async() */
+	struct event **events;
+	/* Results for each key, used when the lookups are done separately */
+	struct dict_lookup_result *results;
+	unsigned int pending_count;
+};
+
 static ARRAY(struct dict *) dict_drivers;
 
 static void
@@ -379,6 +398,146 @@ void dict_lookup_async(struct dict *dict, const struct dict_op_settings *set,
 	dict->v.lookup_async(dict, set, key, dict_lookup_callback, lctx);
 }
 
+static void
+dict_lookup_multi_callback(const struct dict_lookup_result *results,
+			   unsigned int count, void *context)
+{
+	struct dict_lookup_multi_callback_ctx *ctx = context;
+	unsigned int i;
+
+	i_assert(count == ctx->count);
+
+	dict_pre_api_callback(ctx->dict);
+	ctx->callback(results, count, ctx->context);
+	dict_post_api_callback(ctx->dict);
+	for (i = 0; i < count; i++) {
+		dict_lookup_finished(ctx->events[i], results[i].ret,
+				     results[i].error);
+		event_unref(&ctx->events[i]);
+	}
+
+	dict_unref(&ctx->dict);
+	pool_unref(&ctx->pool);
+}
+
+static void
+dict_lookup_multi_finish_one(struct dict_lookup_multi_callback_ctx *ctx)
+{
+	i_assert(ctx->pending_count > 0);
+	if (--ctx->pending_count > 0)
+		return;
+
+	ctx->callback(ctx->results, ctx->count, ctx->context);
+	dict_unref(&ctx->dict);
+	pool_unref(&ctx->pool);
+}
+
+static void
+dict_lookup_multi_key_callback(const struct dict_lookup_result *result,
+			       void *context)
+{
+	struct dict_lookup_multi_key *key = context;
+	struct dict_lookup_multi_callback_ctx *ctx = key->ctx;
+	struct dict_lookup_result *dest = &ctx->results[key->idx];
+
+	dest->ret = result->ret;
+	if (result->ret > 0) {
+		dest->values = p_strarray_dup(ctx->pool, result->values);
+		dest->value = dest->values[0];
+	} else if (result->ret < 0) {
+		dest->error = p_strdup(ctx->pool, result->error);
+	}
+	dict_lookup_multi_finish_one(ctx);
+}
+
+void dict_lookup_multi_async_separately(struct dict *dict,
+					const struct dict_op_settings *set,
+					const char *const *keys,
+					dict_lookup_multi_callback_t *callback,
+					void *context)
+{
+	struct dict_lookup_multi_callback_ctx *ctx;
+	unsigned int i, count = str_array_length(keys);
+	pool_t pool;
+
+	pool = pool_alloconly_create("dict lookup multi separately", 256);
+	ctx = p_new(pool, struct dict_lookup_multi_callback_ctx, 1);
+	ctx->pool = pool;
+	ctx->dict = dict;
+	dict_ref(ctx->dict);
+	ctx->callback = callback;
+	ctx->context = context;
+	ctx->count = count;
+	ctx->results = p_new(pool, struct dict_lookup_result, count);
+
+	/* Send all the lookups separately so they can still be processed in
+	   parallel. The extra pending count prevents finishing before all the
+	   lookups have been sent. */
+	ctx->pending_count = count + 1;
+	for (i = 0; i < count; i++) {
+		struct dict_lookup_multi_key *key =
+			p_new(pool, struct dict_lookup_multi_key, 1);
+		key->ctx = ctx;
+		key->idx = i;
+		if (dict->v.lookup_async != NULL) {
+			dict->v.lookup_async(dict, set, keys[i],
+				dict_lookup_multi_key_callback, key);
+			continue;
+		}
+
+		struct dict_lookup_result result;
+		i_zero(&result);
+		result.ret = dict->v.lookup(dict, set, pool_datastack_create(),
+					    keys[i], &result.values,
+					    &result.error);
+		if (result.ret > 0)
+			result.value = result.values[0];
+		dict_lookup_multi_key_callback(&result, key);
+	}
+	dict_lookup_multi_finish_one(ctx);
+}
+
+#undef dict_lookup_multi_async
+void dict_lookup_multi_async(struct dict *dict,
+			     const struct dict_op_settings *set,
+			     const char *const *keys,
+			     dict_lookup_multi_callback_t *callback,
+			     void *context)
+{
+	struct dict_lookup_multi_callback_ctx *ctx;
+	unsigned int i, count = str_array_length(keys);
+	pool_t pool;
+
+	i_assert(count > 0);
+	for (i = 0; i < count; i++)
+		i_assert(dict_key_prefix_is_valid(keys[i], set->username));
+
+	pool = pool_alloconly_create("dict lookup multi", 256);
+	ctx = p_new(pool, struct dict_lookup_multi_callback_ctx, 1);
+	ctx->pool = pool;
+	ctx->dict = dict;
+	dict_ref(ctx->dict);
+	ctx->callback = callback;
+	ctx->context = context;
+	ctx->count = count;
+
+	ctx->events = p_new(pool, struct event *, count);
+	for (i = 0; i < count; i++) {
+		ctx->events[i] = dict_event_create(dict, set);
+		event_add_str(ctx->events[i], "key", keys[i]);
+	}
+	e_debug(ctx->events[0], "Looking up (async) %u keys", count);
+	if (dict->v.lookup_multi_async != NULL) {
+		dict->v.lookup_multi_async(dict, set, keys,
+					   dict_lookup_multi_callback, ctx);
+	} else {
+		/* The driver can't do the lookups at once */
+		dict_lookup_multi_async_separately(dict, set, keys,
+						   dict_lookup_multi_callback,
+						   ctx);
+	}
+}
+
 struct dict_iterate_context *
 dict_iterate_init(struct dict *dict, const struct dict_op_settings *set,
 		  const char *path, enum dict_iterate_flags flags)
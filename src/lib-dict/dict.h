@@ -77,6 +77,8 @@ struct dict_commit_result {
 
 typedef void dict_lookup_callback_t(const struct dict_lookup_result *result,
 				    void *context);
+typedef void dict_lookup_multi_callback_t(const struct dict_lookup_result *results,
+					  unsigned int count, void *context);
 typedef void dict_iterate_callback_t(void *context);
 typedef void
 dict_transaction_commit_callback_t(const struct dict_commit_result *result,
@@ -124,6 +126,22 @@ void dict_lookup_async(struct dict *dict, const struct dict_op_settings *set,
 		1 ? (context) : \
 		CALLBACK_TYPECHECK(callback, \
 			void (*)(const struct dict_lookup_result *, typeof(context))))
+/* Asynchronously lookup values for all the NULL-terminated keys. The callback
+   is called once after all the lookups have finished. results[i] is the
+   result for keys[i]. Drivers that support it do all the lookups with a
+   single request, others do them as separate parallel lookups. */
+void dict_lookup_multi_async(struct dict *dict,
+			     const struct dict_op_settings *set,
+			     const char *const *keys,
+			     dict_lookup_multi_callback_t *callback,
+			     void *context);
+#define dict_lookup_multi_async(dict, set, keys, callback, context) \
+	dict_lookup_multi_async(dict, set, keys, \
+		(dict_lookup_multi_callback_t *)(callback), \
+		1 ? (context) : \
+		CALLBACK_TYPECHECK(callback, \
+			void (*)(const struct dict_lookup_result *, \
+				 unsigned int, typeof(context))))
 
 /* Iterate through all values in a path. flag indicates how iteration
    is carried out */
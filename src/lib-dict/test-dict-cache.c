@@ -0,0 +1,229 @@
+/* Copyright (c) 2023 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "test-common.h"
+#include "dict-private.h"
+
+#include <unistd.h>
+
+#define TEST_DICT_PATH ".test-dict-cache.tmp"
+
+static const struct dict_op_settings test_set = {
+	.username = "testuser",
+};
+
+static void test_dict_set(struct dict *dict, const char *key, const char *value)
+{
+	struct dict_transaction_context *trans;
+	const char *error;
+
+	trans = dict_transaction_begin(dict, &test_set);
+	if (value == NULL)
+		dict_unset(trans, key);
+	else
+		dict_set(trans, key, value);
+	if (dict_transaction_commit(&trans, &error) < 0)
+		i_fatal("dict_transaction_commit(%s) failed: %s", key, error);
+}
+
+static const char *test_dict_get(struct dict *dict, const char *key)
+{
+	const char *value, *error;
+
+	if (dict_lookup(dict, &test_set, pool_datastack_create(), key,
+			&value, &error) < 0)
+		i_fatal("dict_lookup(%s) failed: %s", key, error);
+	return value;
+}
+
+static void test_dict_init(const char *uri, struct dict **dict_r)
+{
+	const struct dict_settings set = {
+		.base_dir = ".",
+	};
+	const char *error;
+
+	if (dict_init(uri, &set, dict_r, &error) < 0)
+		i_fatal("dict_init(%s) failed: %s", uri, error);
+}
+
+static void test_dict_cache_ttl(void)
+{
+	struct dict *cache, *file;
+
+	test_begin("dict cache ttl");
+	i_unlink_if_exists(TEST_DICT_PATH);
+	test_dict_init("cache:ttl_secs=10:negative_ttl_secs=5:file:"
+		       TEST_DICT_PATH, &cache);
+	test_dict_init("file:"TEST_DICT_PATH, &file);
+
+	/* negative caching */
+	test_assert(test_dict_get(cache, "shared/foo") == NULL);
+	test_dict_set(file, "shared/foo", "1");
+	test_assert(test_dict_get(cache, "shared/foo") == NULL);
+	ioloop_time += 5;
+	test_assert_strcmp(test_dict_get(cache, "shared/foo"), "1");
+
+	/* positive caching */
+	test_dict_set(file, "shared/foo", "2");
+	test_assert_strcmp(test_dict_get(cache, "shared/foo"), "1");
+	ioloop_time += 9;
+	test_assert_strcmp(test_dict_get(cache, "shared/foo"), "1");
+	ioloop_time += 1;
+	test_assert_strcmp(test_dict_get(cache, "shared/foo"), "2");
+
+	/* private keys are cached separately for each user */
+	test_dict_set(file, "priv/bar", "3");
+	test_assert_strcmp(test_dict_get(cache, "priv/bar"), "3");
+	test_dict_set(file, "priv/bar", "4");
+	test_assert_strcmp(test_dict_get(cache, "priv/bar"), "3");
+
+	dict_deinit(&file);
+	dict_deinit(&cache);
+	i_unlink(TEST_DICT_PATH);
+	test_end();
+}
+
+static void test_dict_cache_invalidate(void)
+{
+	struct dict *cache;
+
+	test_begin("dict cache invalidate");
+	i_unlink_if_exists(TEST_DICT_PATH);
+	test_dict_init("cache:file:"TEST_DICT_PATH, &cache);
+
+	/* changes through the cache dict are seen immediately */
+	test_assert(test_dict_get(cache, "shared/foo") == NULL);
+	test_dict_set(cache, "shared/foo", "1");
+	test_assert_strcmp(test_dict_get(cache, "shared/foo"), "1");
+	test_dict_set(cache, "shared/foo", "2");
+	test_assert_strcmp(test_dict_get(cache, "shared/foo"), "2");
+	test_dict_set(cache, "shared/foo", NULL);
+	test_assert(test_dict_get(cache, "shared/foo") == NULL);
+
+	dict_deinit(&cache);
+	i_unlink(TEST_DICT_PATH);
+	test_end();
+}
+
+static void test_dict_cache_max_keys(void)
+{
+	struct dict *cache, *file;
+
+	test_begin("dict cache max_keys");
+	i_unlink_if_exists(TEST_DICT_PATH);
+	test_dict_init("cache:max_keys=2:file:"TEST_DICT_PATH, &cache);
+	test_dict_init("file:"TEST_DICT_PATH, &file);
+
+	test_dict_set(file, "shared/1", "1");
+	test_dict_set(file, "shared/2", "2");
+	test_dict_set(file, "shared/3", "3");
+	test_assert_strcmp(test_dict_get(cache, "shared/1"), "1");
+	test_assert_strcmp(test_dict_get(cache, "shared/2"), "2");
+	/* shared/1 is the least recently used */
+	test_assert_strcmp(test_dict_get(cache, "shared/1"), "1");
+	test_assert_strcmp(test_dict_get(cache, "shared/3"), "3");
+
+	test_dict_set(file, "shared/1", "x");
+	test_dict_set(file, "shared/2", "x");
+	test_assert_strcmp(test_dict_get(cache, "shared/1"), "1");
+	test_assert_strcmp(test_dict_get(cache, "shared/2"), "x");
+
+	dict_deinit(&file);
+	dict_deinit(&cache);
+	i_unlink(TEST_DICT_PATH);
+	test_end();
+}
+
+static void
+test_dict_cache_lookup_multi_callback(const struct dict_lookup_result *results,
+				      unsigned int count, unsigned int *called)
+{
+	test_assert(count == 3);
+	if (count != 3)
+		return;
+	test_assert(results[0].ret == 1);
+	test_assert_strcmp(results[0].value, "1");
+	test_assert(results[1].ret == 0);
+	test_assert(results[2].ret == 1);
+	test_assert_strcmp(results[2].value, "2");
+	(*called)++;
+}
+
+static void test_dict_cache_lookup_multi(void)
+{
+	const char *const keys[] = {
+		"shared/1", "shared/missing", "priv/2", NULL
+	};
+	struct dict *cache, *file;
+	unsigned int called = 0;
+
+	test_begin("dict cache lookup multi");
+	i_unlink_if_exists(TEST_DICT_PATH);
+	test_dict_init("cache:file:"TEST_DICT_PATH, &cache);
+	test_dict_init("file:"TEST_DICT_PATH, &file);
+
+	test_dict_set(file, "shared/1", "1");
+	test_dict_set(file, "priv/2", "2");
+	/* partially cached */
+	test_assert_strcmp(test_dict_get(cache, "priv/2"), "2");
+	dict_lookup_multi_async(cache, &test_set, keys,
+				test_dict_cache_lookup_multi_callback, &called);
+	dict_wait(cache);
+	test_assert(called == 1);
+
+	/* fully cached */
+	test_dict_set(file, "shared/1", "x");
+	dict_lookup_multi_async(cache, &test_set, keys,
+				test_dict_cache_lookup_multi_callback, &called);
+	dict_wait(cache);
+	test_assert(called == 2);
+
+	dict_deinit(&file);
+	dict_deinit(&cache);
+	i_unlink(TEST_DICT_PATH);
+	test_end();
+}
+
+static void test_dict_cache_init_errors(void)
+{
+	const struct dict_settings set = {
+		.base_dir = ".",
+	};
+	struct dict *dict;
+	const char *error;
+
+	test_begin("dict cache init errors");
+	test_assert(dict_init("cache:ttl_secs=foo:file:"TEST_DICT_PATH,
+			      &set, &dict, &error) < 0);
+	test_assert(dict_init("cache:max_keys=0:file:"TEST_DICT_PATH,
+			      &set, &dict, &error) < 0);
+	/* dict-file can't notify about changes */
+	test_assert(dict_init("cache:watch=yes:file:"TEST_DICT_PATH,
+			      &set, &dict, &error) < 0);
+	test_end();
+}
+
+int main(void)
+{
+	static void (*const test_functions[])(void) = {
+		test_dict_cache_ttl,
+		test_dict_cache_invalidate,
+		test_dict_cache_max_keys,
+		test_dict_cache_lookup_multi,
+		test_dict_cache_init_errors,
+		NULL
+	};
+	struct ioloop *ioloop;
+	int ret;
+
+	dict_driver_register(&dict_driver_cache);
+	dict_driver_register(&dict_driver_file);
+	ioloop = io_loop_create();
+	ret = test_run(test_functions);
+	io_loop_destroy(&ioloop);
+	dict_driver_unregister(&dict_driver_file);
+	dict_driver_unregister(&dict_driver_cache);
+	return ret;
+}
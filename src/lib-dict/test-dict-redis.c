@@ -0,0 +1,770 @@
+/* Copyright (c) 2023 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "hash.h"
+#include "llist.h"
+#include "net.h"
+#include "str.h"
+#include "istream.h"
+#include "ostream.h"
+#include "ioloop.h"
+#include "test-common.h"
+#include "test-subprocess.h"
+#include "dict-private.h"
+
+#include <unistd.h>
+
+#define SERVER_KILL_TIMEOUT_SECS 20
+#define SERVER_NODE_COUNT 2
+#define SERVER_CLUSTER_SLOT_COUNT 16384
+
+struct test_server_settings {
+	const char *password;
+	bool cluster;
+};
+
+struct test_server_client {
+	struct test_server_client *prev, *next;
+	unsigned int node_idx;
+
+	int fd;
+	struct io *io;
+	struct istream *input;
+	struct ostream *output;
+
+	ARRAY_TYPE(const_string) args;
+	unsigned int args_left;
+	pool_t pool;
+	string_t *queued_replies;
+	unsigned int queued_count;
+
+	bool want_data;
+	bool authenticated;
+	bool multi;
+	bool multi_failed;
+};
+
+static struct ip_addr bind_ip;
+static in_port_t server_ports[SERVER_NODE_COUNT];
+static int server_fd_listen[SERVER_NODE_COUNT];
+static struct test_server_settings server_set;
+
+static struct io *server_io_listen[SERVER_NODE_COUNT];
+static struct test_server_client *server_clients;
+static unsigned int server_client_count, server_mget_count;
+static HASH_TABLE(char *, char *) server_store;
+
+static bool debug = FALSE;
+
+/*
+ * Test server: A minimal in-memory Redis stand-in. Each listener acts as a
+ * node. With cluster enabled, the first node owns the lower half of the
+ * hash slots and the second node the upper half.
+ */
+
+static uint16_t test_crc16(const char *data, size_t size)
+{
+	uint16_t crc = 0;
+	unsigned int i;
+
+	for (; size > 0; data++, size--) {
+		crc ^= (unsigned char)*data << 8;
+		for (i = 0; i < 8; i++)
+			crc = (crc & 0x8000) != 0 ? (crc << 1) ^ 0x1021 : crc << 1;
+	}
+	return crc;
+}
+
+static unsigned int test_key_slot(const char *key)
+{
+	const char *start = strchr(key, '{'), *end;
+
+	if (start != NULL && (end = strchr(start + 1, '}')) != NULL &&
+	    end > start + 1)
+		return test_crc16(start + 1, end - (start + 1)) %
+			SERVER_CLUSTER_SLOT_COUNT;
+	return test_crc16(key, strlen(key)) % SERVER_CLUSTER_SLOT_COUNT;
+}
+
+static unsigned int test_slot_node(unsigned int slot)
+{
+	return slot < SERVER_CLUSTER_SLOT_COUNT / 2 ? 0 : 1;
+}
+
+static void test_server_append_string(string_t *reply, const char *value)
+{
+	if (value == NULL)
+		str_append(reply, "$-1\r\n");
+	else
+		str_printfa(reply, "$%zu\r\n%s\r\n", strlen(value), value);
+}
+
+static void
+test_server_set(const char *key, const char *value)
+{
+	char *orig_key, *orig_value;
+
+	if (hash_table_lookup_full(server_store, key, &orig_key, &orig_value)) {
+		hash_table_remove(server_store, key);
+		i_free(orig_key);
+		i_free(orig_value);
+	}
+	if (value != NULL)
+		hash_table_insert(server_store, i_strdup(key), i_strdup(value));
+}
+
+static const char *
+test_server_get(const char *key)
+{
+	if (strcmp(key, "test:connections") == 0)
+		return dec2str(server_client_count);
+	if (strcmp(key, "test:mget") == 0)
+		return dec2str(server_mget_count);
+	return hash_table_lookup(server_store, key);
+}
+
+/* Returns FALSE and adds -MOVED reply if the keys don't belong to this
+   node. */
+static bool
+test_server_check_slot(struct test_server_client *client,
+		       const char *const *keys, unsigned int count,
+		       string_t *reply)
+{
+	unsigned int i, slot;
+
+	if (!server_set.cluster || count == 0)
+		return TRUE;
+	slot = test_key_slot(keys[0]);
+	for (i = 1; i < count; i++) {
+		if (test_key_slot(keys[i]) != slot) {
+			str_append(reply, "-CROSSSLOT Keys in request "
+				   "don't hash to the same slot\r\n");
+			return FALSE;
+		}
+	}
+	if (test_slot_node(slot) == client->node_idx)
+		return TRUE;
+	str_printfa(reply, "-MOVED %u %s:%u\r\n", slot,
+		    net_ip2addr(&bind_ip), server_ports[test_slot_node(slot)]);
+	return FALSE;
+}
+
+static void
+test_server_cmd_data(struct test_server_client *client,
+		     const char *const *args, unsigned int count,
+		     string_t *reply)
+{
+	const char *cmd = args[0], *value;
+	long long num, diff;
+	unsigned int i;
+
+	if (strcasecmp(cmd, "GET") == 0 && count == 2) {
+		test_server_append_string(reply, test_server_get(args[1]));
+	} else if (strcasecmp(cmd, "MGET") == 0 && count >= 2) {
+		server_mget_count++;
+		str_printfa(reply, "*%u\r\n", count - 1);
+		for (i = 1; i < count; i++)
+			test_server_append_string(reply, test_server_get(args[i]));
+	} else if (strcasecmp(cmd, "SET") == 0 && count == 3) {
+		test_server_set(args[1], args[2]);
+		str_append(reply, "+OK\r\n");
+	} else if (strcasecmp(cmd, "DEL") == 0 && count == 2) {
+		str_printfa(reply, ":%d\r\n",
+			    test_server_get(args[1]) != NULL ? 1 : 0);
+		test_server_set(args[1], NULL);
+	} else if (strcasecmp(cmd, "INCRBY") == 0 && count == 3) {
+		value = test_server_get(args[1]);
+		if ((value != NULL && str_to_llong(value, &num) < 0) ||
+		    str_to_llong(args[2], &diff) < 0) {
+			str_append(reply, "-ERR value is not an integer\r\n");
+			return;
+		}
+		if (value == NULL)
+			num = 0;
+		num += diff;
+		test_server_set(args[1], t_strdup_printf("%lld", num));
+		str_printfa(reply, ":%lld\r\n", num);
+	} else if (strcasecmp(cmd, "EXPIRE") == 0 && count == 3) {
+		str_printfa(reply, ":%d\r\n",
+			    test_server_get(args[1]) != NULL ? 1 : 0);
+	} else {
+		str_printfa(reply, "-ERR unknown command '%s'\r\n", cmd);
+		return;
+	}
+	(void)client;
+}
+
+static void
+test_server_cmd(struct test_server_client *client,
+		const char *const *args, unsigned int count, string_t *reply)
+{
+	const char *cmd = args[0];
+	string_t *data_reply;
+
+	if (strcasecmp(cmd, "AUTH") == 0 && count == 2) {
+		if (server_set.password != NULL &&
+		    strcmp(args[1], server_set.password) == 0) {
+			client->authenticated = TRUE;
+			str_append(reply, "+OK\r\n");
+		} else {
+			str_append(reply, "-WRONGPASS invalid password\r\n");
+		}
+		return;
+	}
+	if (server_set.password != NULL && !client->authenticated) {
+		str_append(reply, "-NOAUTH Authentication required.\r\n");
+		return;
+	}
+
+	if (strcasecmp(cmd, "SELECT") == 0 || strcasecmp(cmd, "ASKING") == 0) {
+		str_append(reply, "+OK\r\n");
+	} else if (strcasecmp(cmd, "CLUSTER") == 0) {
+		if (!server_set.cluster) {
+			str_append(reply, "-ERR This instance has cluster "
+				   "support disabled\r\n");
+			return;
+		}
+		str_printfa(reply,
+			"*2\r\n"
+			"*3\r\n:0\r\n:%u\r\n*2\r\n$%zu\r\n%s\r\n:%u\r\n"
+			"*3\r\n:%u\r\n:%u\r\n*2\r\n$%zu\r\n%s\r\n:%u\r\n",
+			SERVER_CLUSTER_SLOT_COUNT/2 - 1,
+			strlen(net_ip2addr(&bind_ip)), net_ip2addr(&bind_ip),
+			server_ports[0],
+			SERVER_CLUSTER_SLOT_COUNT/2, SERVER_CLUSTER_SLOT_COUNT - 1,
+			strlen(net_ip2addr(&bind_ip)), net_ip2addr(&bind_ip),
+			server_ports[1]);
+	} else if (strcasecmp(cmd, "MULTI") == 0) {
+		client->multi = TRUE;
+		client->multi_failed = FALSE;
+		client->queued_count = 0;
+		str_truncate(client->queued_replies, 0);
+		str_append(reply, "+OK\r\n");
+	} else if (strcasecmp(cmd, "EXEC") == 0) {
+		if (client->multi_failed) {
+			str_append(reply, "-EXECABORT Transaction discarded "
+				   "because of previous errors.\r\n");
+		} else {
+			str_printfa(reply, "*%u\r\n", client->queued_count);
+			str_append_str(reply, client->queued_replies);
+		}
+		client->multi = FALSE;
+	} else if (client->multi) {
+		/* Execute immediately, but return the replies only in
+		   EXEC. Good enough for testing. */
+		if (!test_server_check_slot(client, args + 1, 1, reply)) {
+			client->multi_failed = TRUE;
+			return;
+		}
+		data_reply = t_str_new(64);
+		test_server_cmd_data(client, args, count, data_reply);
+		str_append_str(client->queued_replies, data_reply);
+		client->queued_count++;
+		str_append(reply, "+QUEUED\r\n");
+	} else {
+		if (count > 1 &&
+		    !test_server_check_slot(client, args + 1,
+			strcasecmp(cmd, "MGET") == 0 ? count - 1 : 1, reply))
+			return;
+		test_server_cmd_data(client, args, count, reply);
+	}
+}
+
+static void test_server_client_destroy(struct test_server_client *client)
+{
+	DLLIST_REMOVE(&server_clients, client);
+	server_client_count--;
+	io_remove(&client->io);
+	i_stream_unref(&client->input);
+	o_stream_unref(&client->output);
+	i_close_fd(&client->fd);
+	str_free(&client->queued_replies);
+	pool_unref(&client->pool);
+	i_free(client);
+}
+
+static int
+test_server_client_input_line(struct test_server_client *client,
+			      const char *line)
+{
+	const char *value;
+	unsigned int count;
+
+	if (client->args_left == 0) {
+		if (line[0] != '*' || str_to_uint(line + 1, &count) < 0 ||
+		    count == 0)
+			return -1;
+		p_clear(client->pool);
+		p_array_init(&client->args, client->pool, count);
+		client->args_left = count;
+		return 0;
+	}
+	if (!client->want_data) {
+		if (line[0] != '$')
+			return -1;
+		client->want_data = TRUE;
+		return 0;
+	}
+	client->want_data = FALSE;
+	value = p_strdup(client->pool, line);
+	array_push_back(&client->args, &value);
+	if (--client->args_left > 0)
+		return 0;
+
+	if (strcmp(array_idx_elem(&client->args, 0), "GET") == 0 &&
+	    strcmp(array_idx_elem(&client->args, 1), "test:disconnect") == 0)
+		return -1;
+
+	string_t *reply = t_str_new(128);
+	test_server_cmd(client, array_front(&client->args),
+			array_count(&client->args), reply);
+	o_stream_nsend(client->output, str_data(reply), str_len(reply));
+	return 0;
+}
+
+static void test_server_client_input(struct test_server_client *client)
+{
+	const char *line;
+
+	while ((line = i_stream_read_next_line(client->input)) != NULL) {
+		if (debug)
+			i_debug("Node %u received: %s", client->node_idx, line);
+		if (test_server_client_input_line(client, line) < 0) {
+			test_server_client_destroy(client);
+			return;
+		}
+	}
+	if (client->input->eof || client->input->stream_errno != 0)
+		test_server_client_destroy(client);
+}
+
+static void test_server_accept(void *context)
+{
+	unsigned int node_idx = POINTER_CAST_TO(context, unsigned int);
+	struct test_server_client *client;
+	int fd;
+
+	fd = net_accept(server_fd_listen[node_idx], NULL, NULL);
+	if (fd < 0)
+		return;
+	fd_set_nonblock(fd, TRUE);
+	client = i_new(struct test_server_client, 1);
+	client->node_idx = node_idx;
+	client->fd = fd;
+	client->input = i_stream_create_fd(fd, SIZE_MAX);
+	client->output = o_stream_create_fd(fd, SIZE_MAX);
+	o_stream_set_no_error_handling(client->output, TRUE);
+	client->pool = pool_alloconly_create("test server client", 1024);
+	client->queued_replies = str_new(default_pool, 256);
+	client->io = io_add(fd, IO_READ, test_server_client_input, client);
+	DLLIST_PREPEND(&server_clients, client);
+	server_client_count++;
+}
+
+static int test_run_server(void *context ATTR_UNUSED)
+{
+	struct hash_iterate_context *iter;
+	struct ioloop *ioloop;
+	char *key, *value;
+	unsigned int i;
+
+	i_set_failure_prefix("SERVER: ");
+
+	ioloop = io_loop_create();
+	hash_table_create(&server_store, default_pool, 0, str_hash, strcmp);
+	for (i = 0; i < SERVER_NODE_COUNT; i++) {
+		fd_set_nonblock(server_fd_listen[i], TRUE);
+		server_io_listen[i] = io_add(server_fd_listen[i], IO_READ,
+					     test_server_accept,
+					     POINTER_CAST(i));
+	}
+	io_loop_run(ioloop);
+
+	while (server_clients != NULL)
+		test_server_client_destroy(server_clients);
+	for (i = 0; i < SERVER_NODE_COUNT; i++) {
+		io_remove(&server_io_listen[i]);
+		i_close_fd(&server_fd_listen[i]);
+	}
+	iter = hash_table_iterate_init(server_store);
+	while (hash_table_iterate(iter, server_store, &key, &value)) {
+		i_free(key);
+		i_free(value);
+	}
+	hash_table_iterate_deinit(&iter);
+	hash_table_destroy(&server_store);
+	io_loop_destroy(&ioloop);
+	return 0;
+}
+
+/*
+ * Test client
+ */
+
+static void
+test_run_client_server(const struct test_server_settings *set,
+		       const char *uri_params,
+		       void (*client_test)(struct dict *dict))
+{
+	const struct dict_settings dict_set = {
+		.base_dir = ".",
+	};
+	struct dict *dict;
+	struct ioloop *ioloop;
+	const char *uri, *error;
+	unsigned int i;
+
+	server_set = *set;
+	for (i = 0; i < SERVER_NODE_COUNT; i++) {
+		server_ports[i] = 0;
+		server_fd_listen[i] = net_listen(&bind_ip, &server_ports[i], 128);
+		if (server_fd_listen[i] == -1)
+			i_fatal("listen(%s) failed: %m", net_ip2addr(&bind_ip));
+	}
+	test_subprocess_fork(test_run_server, (void *)NULL, TRUE);
+	for (i = 0; i < SERVER_NODE_COUNT; i++)
+		i_close_fd(&server_fd_listen[i]);
+
+	ioloop = io_loop_create();
+	uri = t_strdup_printf("redis:host=%s:port=%u%s",
+			      net_ip2addr(&bind_ip), server_ports[0],
+			      uri_params);
+	if (dict_init(uri, &dict_set, &dict, &error) < 0)
+		i_fatal("dict_init(%s) failed: %s", uri, error);
+	client_test(dict);
+	dict_deinit(&dict);
+	io_loop_destroy(&ioloop);
+
+	test_subprocess_kill_all(SERVER_KILL_TIMEOUT_SECS);
+}
+
+static const struct dict_op_settings test_op_set = {
+	.username = "testuser",
+};
+
+static void test_dict_set(struct dict *dict, const char *key, const char *value)
+{
+	struct dict_transaction_context *trans;
+	const char *error;
+
+	trans = dict_transaction_begin(dict, &test_op_set);
+	dict_set(trans, key, value);
+	test_assert(dict_transaction_commit(&trans, &error) == 1);
+}
+
+static const char *test_dict_get(struct dict *dict, const char *key)
+{
+	const char *value, *error;
+	int ret;
+
+	ret = dict_lookup(dict, &test_op_set, pool_datastack_create(), key,
+			  &value, &error);
+	test_assert(ret >= 0);
+	return ret > 0 ? value : NULL;
+}
+
+static void test_dict_redis_basic_client(struct dict *dict)
+{
+	struct dict_transaction_context *trans;
+	const char *error;
+
+	test_assert(test_dict_get(dict, "shared/foo") == NULL);
+	test_dict_set(dict, "shared/foo", "bar");
+	test_assert_strcmp(test_dict_get(dict, "shared/foo"), "bar");
+
+	trans = dict_transaction_begin(dict, &test_op_set);
+	dict_set(trans, "priv/quota", "10");
+	dict_atomic_inc(trans, "priv/quota", 5);
+	dict_atomic_inc(trans, "priv/count", -1);
+	dict_unset(trans, "shared/foo");
+	test_assert(dict_transaction_commit(&trans, &error) == 1);
+	test_assert_strcmp(test_dict_get(dict, "priv/quota"), "15");
+	test_assert_strcmp(test_dict_get(dict, "priv/count"), "-1");
+	test_assert(test_dict_get(dict, "shared/foo") == NULL);
+
+	/* rollback doesn't send anything */
+	trans = dict_transaction_begin(dict, &test_op_set);
+	dict_set(trans, "shared/foo", "rollback");
+	dict_transaction_rollback(&trans);
+	test_assert(test_dict_get(dict, "shared/foo") == NULL);
+
+	/* failing command inside a transaction */
+	trans = dict_transaction_begin(dict, &test_op_set);
+	dict_set(trans, "shared/foo", "notnumber");
+	dict_atomic_inc(trans, "shared/foo", 1);
+	test_assert(dict_transaction_commit(&trans, &error) < 0);
+	test_assert(strstr(error, "not an integer") != NULL);
+}
+
+static void test_dict_redis_basic(void)
+{
+	const struct test_server_settings set = {
+		.password = "secret",
+	};
+
+	test_begin("dict redis basic");
+	test_run_client_server(&set, ":password=secret:db=1",
+			       test_dict_redis_basic_client);
+	test_end();
+}
+
+struct test_lookup_ctx {
+	unsigned int idx;
+	unsigned int *pending;
+};
+
+static void
+test_dict_redis_pipeline_lookup_callback(const struct dict_lookup_result *result,
+					 struct test_lookup_ctx *ctx)
+{
+	test_assert_idx(result->ret == 1, ctx->idx);
+	if (result->ret == 1) {
+		test_assert_strcmp_idx(result->value, dec2str(ctx->idx),
+				       ctx->idx);
+	}
+	(*ctx->pending)--;
+}
+
+static void
+test_dict_redis_pipeline_commit_callback(const struct dict_commit_result *result,
+					 unsigned int *pending)
+{
+	test_assert(result->ret == DICT_COMMIT_RET_OK);
+	(*pending)--;
+}
+
+static void test_dict_redis_pipeline_client(struct dict *dict)
+{
+	struct dict_transaction_context *trans;
+	struct test_lookup_ctx ctx[100];
+	unsigned int i, pending = 0;
+
+	for (i = 0; i < N_ELEMENTS(ctx); i++) {
+		trans = dict_transaction_begin(dict, &test_op_set);
+		dict_set(trans, t_strdup_printf("shared/key%u", i), dec2str(i));
+		pending++;
+		dict_transaction_commit_async(&trans,
+			test_dict_redis_pipeline_commit_callback, &pending);
+	}
+	for (i = 0; i < N_ELEMENTS(ctx); i++) {
+		ctx[i].idx = i;
+		ctx[i].pending = &pending;
+		pending++;
+		dict_lookup_async(dict, &test_op_set,
+				  t_strdup_printf("shared/key%u", i),
+				  test_dict_redis_pipeline_lookup_callback,
+				  &ctx[i]);
+	}
+	/* nothing is done before waiting */
+	test_assert(pending == N_ELEMENTS(ctx) * 2);
+	dict_wait(dict);
+	test_assert(pending == 0);
+
+	/* the pool was grown while requests were pending */
+	test_assert_strcmp(test_dict_get(dict, "shared/test:connections"), "4");
+}
+
+static void test_dict_redis_pipeline(void)
+{
+	const struct test_server_settings set = { .password = NULL };
+
+	test_begin("dict redis pipeline");
+	test_run_client_server(&set, ":connections=4",
+			       test_dict_redis_pipeline_client);
+	test_end();
+}
+
+static void
+test_dict_redis_lookup_multi_callback(const struct dict_lookup_result *results,
+				      unsigned int count, unsigned int *called)
+{
+	test_assert(count == 3);
+	if (count == 3) {
+		test_assert(results[0].ret == 1);
+		test_assert_strcmp(results[0].value, "1");
+		test_assert(results[1].ret == 0);
+		test_assert(results[2].ret == 1);
+		test_assert_strcmp(results[2].value, "2");
+	}
+	(*called)++;
+}
+
+static void test_dict_redis_lookup_multi_client(struct dict *dict)
+{
+	const char *const keys[] = {
+		"shared/{user}/1", "shared/{user}/missing", "priv/2", NULL
+	};
+	unsigned int called = 0;
+
+	test_dict_set(dict, "shared/{user}/1", "1");
+	test_dict_set(dict, "priv/2", "2");
+	dict_lookup_multi_async(dict, &test_op_set, keys,
+				test_dict_redis_lookup_multi_callback, &called);
+	dict_wait(dict);
+	test_assert(called == 1);
+}
+
+static void test_dict_redis_lookup_multi(void)
+{
+	const struct test_server_settings set = { .password = NULL };
+
+	test_begin("dict redis lookup multi");
+	test_run_client_server(&set, "", test_dict_redis_lookup_multi_client);
+	test_end();
+}
+
+static void test_dict_redis_lookup_multi_mget_client(struct dict *dict)
+{
+	test_dict_redis_lookup_multi_client(dict);
+	/* all keys were looked up with a single MGET */
+	test_assert_strcmp(test_dict_get(dict, "shared/test:mget"), "1");
+}
+
+static void test_dict_redis_lookup_multi_mget(void)
+{
+	const struct test_server_settings set = { .password = NULL };
+
+	test_begin("dict redis lookup multi mget");
+	test_run_client_server(&set, "",
+			       test_dict_redis_lookup_multi_mget_client);
+	test_end();
+}
+
+static void
+test_dict_redis_cluster_multi_callback(const struct dict_lookup_result *results,
+				       unsigned int count, unsigned int *called)
+{
+	unsigned int i;
+
+	test_assert(count == 20);
+	for (i = 0; i < count; i++) {
+		test_assert_idx(results[i].ret == 1, i);
+		if (results[i].ret == 1)
+			test_assert_strcmp_idx(results[i].value, dec2str(i), i);
+	}
+	(*called)++;
+}
+
+static void test_dict_redis_cluster_client(struct dict *dict)
+{
+	struct dict_transaction_context *trans;
+	const char *keys[21], *error;
+	unsigned int i, called = 0;
+
+	/* The keys are spread across both nodes. The first requests go to
+	   the seed node, which redirects them. */
+	trans = dict_transaction_begin(dict, &test_op_set);
+	for (i = 0; i < 20; i++) {
+		keys[i] = t_strdup_printf("shared/key%u", i);
+		dict_set(trans, keys[i], dec2str(i));
+	}
+	keys[i] = NULL;
+	test_assert(dict_transaction_commit(&trans, &error) == 1);
+	for (i = 0; i < 20; i++)
+		test_assert_strcmp_idx(test_dict_get(dict, keys[i]), dec2str(i), i);
+
+	/* keys with the same hashtag are looked up with one MGET */
+	test_dict_redis_lookup_multi_client(dict);
+
+	/* multi-key lookup across slots */
+	dict_lookup_multi_async(dict, &test_op_set, keys,
+		test_dict_redis_cluster_multi_callback, &called);
+	dict_wait(dict);
+	test_assert(called == 1);
+}
+
+static void test_dict_redis_cluster(void)
+{
+	const struct test_server_settings set = { .cluster = TRUE };
+
+	test_begin("dict redis cluster");
+	test_run_client_server(&set, ":cluster=yes:connections=2",
+			       test_dict_redis_cluster_client);
+	test_end();
+}
+
+static void test_dict_redis_auth_failed_client(struct dict *dict)
+{
+	const char *value, *error;
+
+	test_expect_error_string("AUTH failed: WRONGPASS");
+	test_assert(dict_lookup(dict, &test_op_set, pool_datastack_create(),
+				"shared/foo", &value, &error) < 0);
+	test_assert(strstr(error, "WRONGPASS") != NULL);
+	test_expect_no_more_errors();
+}
+
+static void test_dict_redis_auth_failed(void)
+{
+	const struct test_server_settings set = {
+		.password = "secret",
+	};
+
+	test_begin("dict redis auth failed");
+	test_run_client_server(&set, ":password=wrong",
+			       test_dict_redis_auth_failed_client);
+	test_end();
+}
+
+static void test_dict_redis_disconnect_client(struct dict *dict)
+{
+	const char *value, *error;
+
+	test_dict_set(dict, "shared/foo", "bar");
+	test_assert(dict_lookup(dict, &test_op_set, pool_datastack_create(),
+				"shared/test:disconnect", &value, &error) < 0);
+	test_assert(strstr(error, "Disconnected") != NULL);
+	/* reconnects */
+	test_assert_strcmp(test_dict_get(dict, "shared/foo"), "bar");
+}
+
+static void test_dict_redis_disconnect(void)
+{
+	const struct test_server_settings set = { .password = NULL };
+
+	test_begin("dict redis disconnect");
+	test_run_client_server(&set, "", test_dict_redis_disconnect_client);
+	test_end();
+}
+
+int main(int argc, char *argv[])
+{
+	static void (*const test_functions[])(void) = {
+		test_dict_redis_basic,
+		test_dict_redis_pipeline,
+		test_dict_redis_lookup_multi,
+		test_dict_redis_lookup_multi_mget,
+		test_dict_redis_cluster,
+		test_dict_redis_auth_failed,
+		test_dict_redis_disconnect,
+		NULL
+	};
+	int c, ret;
+
+	lib_init();
+	while ((c = getopt(argc, argv, "D")) > 0) {
+		switch (c) {
+		case 'D':
+			debug = TRUE;
+			break;
+		default:
+			i_fatal("Usage: %s [-D]", argv[0]);
+		}
+	}
+
+	test_subprocesses_init(debug);
+	dict_driver_register(&dict_driver_redis);
+
+	/* listen on localhost */
+	i_zero(&bind_ip);
+	bind_ip.family = AF_INET;
+	bind_ip.u.ip4.s_addr = htonl(INADDR_LOOPBACK);
+
+	ret = test_run(test_functions);
+
+	dict_driver_unregister(&dict_driver_redis);
+	test_subprocesses_deinit();
+	lib_deinit();
+	return ret;
+}
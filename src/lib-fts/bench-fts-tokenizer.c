@@ -0,0 +1,108 @@
+/* Copyright (c) 2023 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "buffer.h"
+#include "istream.h"
+#include "strnum.h"
+#include "time-util.h"
+#include "fts-tokenizer.h"
+
+#include <stdio.h>
+
+#define UDHR_FRA_NAME "/udhr_fra.txt"
+#define BENCH_DEFAULT_ROUNDS 200
+
+/* Measures the generic tokenizer's throughput with both word boundary
+   algorithms. The French UDHR text from the unit tests is used as-is and
+   also with all the non-ASCII characters dropped, which mimics the mostly
+   ASCII mail text that is typically indexed. */
+
+static void read_corpus(buffer_t *dest)
+{
+	const char *path = UDHRDIR UDHR_FRA_NAME;
+	struct istream *input;
+	const unsigned char *data;
+	size_t size;
+
+	input = i_stream_create_file(path, IO_BLOCK_SIZE);
+	while (i_stream_read_more(input, &data, &size) > 0) {
+		buffer_append(dest, data, size);
+		i_stream_skip(input, size);
+	}
+	if (input->stream_errno != 0)
+		i_fatal("read(%s) failed: %s", path, i_stream_get_error(input));
+	i_stream_unref(&input);
+}
+
+static void
+bench_tokenizer(const char *name, const char *const *settings,
+		const buffer_t *corpus, unsigned int rounds)
+{
+	struct fts_tokenizer *tok;
+	const char *token, *error;
+	unsigned int i, token_count = 0;
+	uint64_t ts_0, ts_1;
+
+	if (fts_tokenizer_create(fts_tokenizer_generic, NULL, settings,
+				 &tok, &error) < 0)
+		i_fatal("fts_tokenizer_create() failed: %s", error);
+
+	ts_0 = i_nanoseconds();
+	for (i = 0; i < rounds; i++) T_BEGIN {
+		while (fts_tokenizer_next(tok, corpus->data, corpus->used,
+					  &token, &error) > 0)
+			token_count++;
+		while (fts_tokenizer_final(tok, &token, &error) > 0)
+			token_count++;
+	} T_END;
+	ts_1 = i_nanoseconds();
+	fts_tokenizer_unref(&tok);
+
+	double secs = (double)(ts_1 - ts_0) / 1000000000.0;
+	double mbytes = (double)corpus->used * rounds / (1024.0 * 1024.0);
+	printf("%-12s %10u tokens %8.3f s %8.2f MB/s\n",
+	       name, token_count, secs, mbytes / secs);
+}
+
+static void bench_corpus(const char *name, const buffer_t *corpus,
+			 unsigned int rounds)
+{
+	static const char *const tr29_settings[] = {
+		"algorithm", "tr29", NULL
+	};
+
+	printf("%s (%zu bytes, %u rounds):\n", name, corpus->used, rounds);
+	bench_tokenizer("simple", NULL, corpus, rounds);
+	bench_tokenizer("tr29", tr29_settings, corpus, rounds);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int rounds = BENCH_DEFAULT_ROUNDS;
+	buffer_t *corpus, *ascii_corpus;
+	const unsigned char *data;
+	size_t i;
+
+	lib_init();
+	if (argc > 1 && (str_to_uint(argv[1], &rounds) < 0 || rounds == 0))
+		i_fatal("Usage: %s [<rounds>]", argv[0]);
+
+	corpus = buffer_create_dynamic(default_pool, 16384);
+	read_corpus(corpus);
+	ascii_corpus = buffer_create_dynamic(default_pool, corpus->used);
+	data = corpus->data;
+	for (i = 0; i < corpus->used; i++) {
+		if (data[i] < 0x80)
+			buffer_append_c(ascii_corpus, data[i]);
+	}
+
+	fts_tokenizers_init();
+	bench_corpus("udhr_fra.txt", corpus, rounds);
+	bench_corpus("udhr_fra.txt ASCII only", ascii_corpus, rounds);
+	fts_tokenizers_deinit();
+
+	buffer_free(&corpus);
+	buffer_free(&ascii_corpus);
+	lib_deinit();
+	return 0;
+}
@@ -32,6 +32,13 @@ static unsigned char fts_ascii_word_breaks[128] = {
 	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 0  /* 112-127: {|}~ */
 };
 
+/* TR29 letter types for ASCII characters, so that the common case doesn't
+   need to go through the binary searches in letter_type(). */
+static unsigned char fts_ascii_letter_types[128];
+static bool fts_ascii_letter_types_initialized = FALSE;
+
+static void fts_ascii_letter_types_init(void);
+
 static int
 fts_tokenizer_generic_create(const char *const *settings,
 			     struct fts_tokenizer **tokenizer_r,
@@ -91,6 +98,10 @@ fts_tokenizer_generic_create(const char *const *settings,
 		return -1;
 	}
 
+	if (algo == BOUNDARY_ALGORITHM_TR29 &&
+	    !fts_ascii_letter_types_initialized)
+		fts_ascii_letter_types_init();
+
 	tok = i_new(struct generic_fts_tokenizer, 1);
 	if (algo == BOUNDARY_ALGORITHM_TR29)
 		tok->tokenizer.v = &generic_tokenizer_vfuncs_tr29;
@@ -230,6 +241,13 @@ fts_simple_is_word_break(const struct generic_fts_tokenizer *tok,
 		   ? FTS_FROM_WORD : FTS_FROM_STOP);
 }
 
+/* Returns TRUE if c is an ASCII character that continues a word without any
+   special handling, i.e. it's not a word break or an apostrophe. */
+static inline bool fts_ascii_is_word_char(unsigned char c)
+{
+	return c < 0x80 && fts_ascii_word_breaks[c] == 0 && c != '\'';
+}
+
 static void fts_tokenizer_generic_reset(struct fts_tokenizer *_tok)
 {
 	struct generic_fts_tokenizer *tok =
@@ -355,8 +373,24 @@ fts_tokenizer_generic_simple_next(struct fts_tokenizer *_tok,
 
 	start = tok->token->used > 0 ? 0 : skip_base64(data, size);
 	for (i = start; i < size; i += char_size) {
-		char_size = uni_utf8_get_char_n(data + i, size - i, &c);
-		i_assert(char_size > 0);
+		if (tok->prev_type == LETTER_TYPE_ALETTER &&
+		    fts_ascii_is_word_char(data[i])) {
+			/* Fast path: A run of ASCII word characters following
+			   a word character doesn't change the state. */
+			char_size = 1;
+			while (i + char_size < size &&
+			       fts_ascii_is_word_char(data[i + char_size]))
+				char_size++;
+			shift_prev_type(tok, LETTER_TYPE_ALETTER);
+			continue;
+		}
+		if (data[i] < 0x80) {
+			c = data[i];
+			char_size = 1;
+		} else {
+			char_size = uni_utf8_get_char_n(data + i, size - i, &c);
+			i_assert(char_size > 0);
+		}
 
 		apostrophe = IS_APOSTROPHE(c);
 		if ((tok->prefixsplat && IS_PREFIX_SPLAT(c)) &&
@@ -458,6 +492,15 @@ static enum letter_type letter_type(unichar_t c)
 	return LETTER_TYPE_OTHER;
 }
 
+static void fts_ascii_letter_types_init(void)
+{
+	unichar_t c;
+
+	for (c = 0; c < N_ELEMENTS(fts_ascii_letter_types); c++)
+		fts_ascii_letter_types[c] = letter_type(c);
+	fts_ascii_letter_types_initialized = TRUE;
+}
+
 static bool letter_panic(struct generic_fts_tokenizer *tok ATTR_UNUSED)
 {
 	i_panic("Letter type should not be used.");
@@ -811,11 +854,29 @@ fts_tokenizer_generic_tr29_next(struct fts_tokenizer *_tok,
 
 	start_pos = tok->token->used > 0 ? 0 : skip_base64(data, size);
 	for (i = start_pos; i < size; ) {
+		if (tok->prev_type == LETTER_TYPE_ALETTER && !tok->wb5a &&
+		    data[i] < 0x80 &&
+		    fts_ascii_letter_types[data[i]] == LETTER_TYPE_ALETTER) {
+			/* Fast path: WB5 never breaks between two letters, so
+			   a run of ASCII letters needs no further checks. */
+			do {
+				i++;
+			} while (i < size && data[i] < 0x80 &&
+				 fts_ascii_letter_types[data[i]] == LETTER_TYPE_ALETTER);
+			add_prev_type(tok, LETTER_TYPE_ALETTER);
+			continue;
+		}
 		char_start_i = i;
-		char_size = uni_utf8_get_char_n(data + i, size - i, &c);
-		i_assert(char_size > 0);
+		if (data[i] < 0x80) {
+			c = data[i];
+			char_size = 1;
+			lt = fts_ascii_letter_types[c];
+		} else {
+			char_size = uni_utf8_get_char_n(data + i, size - i, &c);
+			i_assert(char_size > 0);
+			lt = letter_type(c);
+		}
 		i += char_size;
-		lt = letter_type(c);
 
 		/* The WB5a break is detected only when the "after
 		   break" char is inspected. That char needs to be
@@ -66,6 +66,11 @@ enum master_login_state {
 /* getenv(MASTER_CONFIG_FILE_ENV) provides path to configuration file/socket */
 #define MASTER_CONFIG_FILE_ENV "CONFIG_FILE"
 
+/* getenv(MASTER_CONFIG_BLOB_ENV) provides path to the precompiled settings
+   blob written by the config process */
+#define MASTER_CONFIG_BLOB_ENV "CONFIG_BLOB"
+#define MASTER_CONFIG_BLOB_FILENAME "config.blob"
+
 /* getenv(MASTER_DOVECOT_VERSION_ENV) provides master's version number
    (unset if version_ignore=yes) */
 #define MASTER_DOVECOT_VERSION_ENV "DOVECOT_VERSION"
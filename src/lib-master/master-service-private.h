@@ -37,6 +37,9 @@ struct master_service {
 	char *config_path;
 	ARRAY_TYPE(const_string) config_overrides;
 	int config_fd;
+	/* precompiled settings blob written by the config process */
+	char *config_blob_path;
+	struct master_service_settings_blob *config_blob;
 	int syslog_facility;
 	data_stack_frame_t datastack_frame_id;
 
@@ -80,6 +83,10 @@ struct master_service {
 	volatile sig_atomic_t killed_signal;
 	volatile struct timeval killed_time;
 
+	/* DISCONNECT commands waiting to be written to anvil */
+	string_t *anvil_send_buf;
+	struct timeout *to_anvil_flush;
+
 	struct stats_client *stats_client;
 	struct master_service_haproxy_conn *haproxy_conns;
 	struct event_filter *process_shutdown_filter;
@@ -99,6 +106,7 @@ struct master_service {
 	bool init_finished:1;
 	bool killed_signal_logged:1;
 	bool io_status_waiting:1;
+	bool anvil_send_direct:1;
 };
 
 void master_service_io_listeners_add(struct master_service *service);
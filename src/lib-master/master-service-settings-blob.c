@@ -0,0 +1,408 @@
+/* Copyright (c) 2023 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "buffer.h"
+#include "hash.h"
+#include "hostpid.h"
+#include "mmap-util.h"
+#include "write-full.h"
+#include "master-service-settings-blob.h"
+
+#include <stddef.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#define BLOB_ALIGN(size) (((size) + 3) & ~3U)
+
+struct master_service_settings_blob {
+	char *path;
+	int fd;
+
+	void *mmap_base;
+	size_t mmap_size;
+};
+
+struct master_service_settings_blob_writer {
+	pool_t pool;
+	char *path;
+	int fd;
+
+	uoff_t max_size;
+	uint32_t used_size;
+	HASH_TABLE(char *, char *) keys;
+};
+
+const char *master_service_settings_blob_key(const char *const *args,
+					     bool with_local)
+{
+	ARRAY_TYPE(const_string) key_args;
+
+	t_array_init(&key_args, 8);
+	for (; *args != NULL; args++) {
+		if (str_begins_with(*args, "user=") ||
+		    str_begins_with(*args, "rip="))
+			continue;
+		if (!with_local && (str_begins_with(*args, "lip=") ||
+				    str_begins_with(*args, "lname=")))
+			continue;
+		array_push_back(&key_args, args);
+	}
+	array_append_zero(&key_args);
+	return t_strarray_join(array_front(&key_args), "\t");
+}
+
+static void
+master_service_settings_blob_unmap(struct master_service_settings_blob *blob)
+{
+	if (blob->mmap_base == NULL)
+		return;
+	if (munmap(blob->mmap_base, blob->mmap_size) < 0)
+		i_error("munmap(%s) failed: %m", blob->path);
+	blob->mmap_base = NULL;
+	blob->mmap_size = 0;
+}
+
+static int
+master_service_settings_blob_map(struct master_service_settings_blob *blob,
+				 const char **error_r)
+{
+	const struct master_service_settings_blob_header *hdr;
+	struct stat st;
+
+	master_service_settings_blob_unmap(blob);
+	if (fstat(blob->fd, &st) < 0) {
+		*error_r = t_strdup_printf("fstat(%s) failed: %m", blob->path);
+		return -1;
+	}
+	if ((uoff_t)st.st_size < sizeof(*hdr)) {
+		*error_r = t_strdup_printf("%s: File too small (%"PRIuUOFF_T")",
+					   blob->path, st.st_size);
+		return -1;
+	}
+	blob->mmap_size = st.st_size;
+	blob->mmap_base = mmap(NULL, blob->mmap_size, PROT_READ, MAP_SHARED,
+			       blob->fd, 0);
+	if (blob->mmap_base == MAP_FAILED) {
+		blob->mmap_base = NULL;
+		blob->mmap_size = 0;
+		*error_r = t_strdup_printf("mmap(%s) failed: %m", blob->path);
+		return -1;
+	}
+
+	hdr = blob->mmap_base;
+	if (memcmp(hdr->magic, MASTER_SERVICE_SETTINGS_BLOB_MAGIC,
+		   sizeof(hdr->magic)) != 0) {
+		*error_r = t_strdup_printf("%s: Invalid magic", blob->path);
+		return -1;
+	}
+	if (hdr->version != MASTER_SERVICE_SETTINGS_BLOB_VERSION) {
+		*error_r = t_strdup_printf("%s: Unsupported version %u",
+					   blob->path, hdr->version);
+		return -1;
+	}
+	if (hdr->hdr_size < sizeof(*hdr) || hdr->hdr_size % 4 != 0 ||
+	    hdr->hdr_size > blob->mmap_size) {
+		*error_r = t_strdup_printf("%s: Invalid header size %u",
+					   blob->path, hdr->hdr_size);
+		return -1;
+	}
+	return 0;
+}
+
+static int
+master_service_settings_blob_reopen(struct master_service_settings_blob *blob,
+				    const char **error_r)
+{
+	master_service_settings_blob_unmap(blob);
+	i_close_fd(&blob->fd);
+
+	blob->fd = open(blob->path, O_RDONLY);
+	if (blob->fd == -1) {
+		if (errno == ENOENT || errno == EACCES)
+			return 0;
+		*error_r = t_strdup_printf("open(%s) failed: %m", blob->path);
+		return -1;
+	}
+	fd_close_on_exec(blob->fd, TRUE);
+	if (master_service_settings_blob_map(blob, error_r) < 0) {
+		master_service_settings_blob_unmap(blob);
+		i_close_fd(&blob->fd);
+		return -1;
+	}
+	return 1;
+}
+
+int master_service_settings_blob_open(const char *path,
+				      struct master_service_settings_blob **blob_r,
+				      const char **error_r)
+{
+	struct master_service_settings_blob *blob;
+	int ret;
+
+	blob = i_new(struct master_service_settings_blob, 1);
+	blob->path = i_strdup(path);
+	blob->fd = -1;
+	if ((ret = master_service_settings_blob_reopen(blob, error_r)) <= 0) {
+		master_service_settings_blob_close(&blob);
+		return ret;
+	}
+	*blob_r = blob;
+	return 1;
+}
+
+void master_service_settings_blob_close(struct master_service_settings_blob **_blob)
+{
+	struct master_service_settings_blob *blob = *_blob;
+
+	if (blob == NULL)
+		return;
+	*_blob = NULL;
+
+	master_service_settings_blob_unmap(blob);
+	i_close_fd(&blob->fd);
+	i_free(blob->path);
+	i_free(blob);
+}
+
+static bool
+blob_record_key_matches(const char *rec_key, const char *const *keys)
+{
+	for (; *keys != NULL; keys++) {
+		if (strcmp(rec_key, *keys) == 0)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+int master_service_settings_blob_lookup(struct master_service_settings_blob *blob,
+					const char *const *keys,
+					struct master_service_settings_blob_record *rec_r,
+					const char **error_r)
+{
+	const struct master_service_settings_blob_header *hdr;
+	const struct master_service_settings_blob_record_header *rec;
+	const unsigned char *p, *end;
+	const char *rec_key;
+	int ret;
+
+	if (blob->mmap_base == NULL)
+		return 0;
+	hdr = blob->mmap_base;
+	if (hdr->obsolete != 0) {
+		/* config was reloaded - switch to the new file */
+		if ((ret = master_service_settings_blob_reopen(blob, error_r)) <= 0)
+			return ret;
+		hdr = blob->mmap_base;
+	}
+	if ((size_t)hdr->hdr_size + hdr->used_size > blob->mmap_size) {
+		/* more records were appended since we mapped the file */
+		if (master_service_settings_blob_map(blob, error_r) < 0)
+			return -1;
+		hdr = blob->mmap_base;
+		if ((size_t)hdr->hdr_size + hdr->used_size > blob->mmap_size) {
+			*error_r = t_strdup_printf(
+				"%s: used_size %u points outside file",
+				blob->path, hdr->used_size);
+			return -1;
+		}
+	}
+
+	p = CONST_PTR_OFFSET(blob->mmap_base, hdr->hdr_size);
+	end = p + hdr->used_size;
+	while (p < end) {
+		rec = (const void *)p;
+		if ((size_t)(end - p) < sizeof(*rec) ||
+		    rec->size < sizeof(*rec) || rec->size % 4 != 0 ||
+		    rec->size > (size_t)(end - p) ||
+		    rec->key_size == 0 ||
+		    rec->key_size > rec->size - sizeof(*rec)) {
+			*error_r = t_strdup_printf(
+				"%s: Broken record at offset %zu", blob->path,
+				(size_t)(p - (const unsigned char *)blob->mmap_base));
+			return -1;
+		}
+		rec_key = (const char *)(rec + 1);
+		if (rec_key[rec->key_size-1] == '\0' &&
+		    blob_record_key_matches(rec_key, keys)) {
+			i_zero(rec_r);
+			rec_r->flags = rec->flags;
+			rec_r->settings_count = rec->settings_count;
+			rec_r->data = rec_key + rec->key_size;
+			rec_r->end = (const char *)p + rec->size;
+			return 1;
+		}
+		p += rec->size;
+	}
+	return 0;
+}
+
+bool master_service_settings_blob_record_next(
+	struct master_service_settings_blob_record *rec,
+	const char **key_r, const char **value_r)
+{
+	const char *key_end, *value_end;
+
+	if (rec->settings_count == 0)
+		return FALSE;
+
+	key_end = memchr(rec->data, '\0', rec->end - rec->data);
+	if (key_end == NULL)
+		return FALSE;
+	value_end = memchr(key_end + 1, '\0', rec->end - (key_end + 1));
+	if (value_end == NULL)
+		return FALSE;
+
+	*key_r = rec->data;
+	*value_r = key_end + 1;
+	rec->data = value_end + 1;
+	rec->settings_count--;
+	return TRUE;
+}
+
+static void
+master_service_settings_blob_mark_obsolete(const char *path)
+{
+	uint32_t obsolete = 1;
+	int fd;
+
+	fd = open(path, O_WRONLY);
+	if (fd == -1) {
+		if (errno != ENOENT)
+			i_error("open(%s) failed: %m", path);
+		return;
+	}
+	if (pwrite_full(fd, &obsolete, sizeof(obsolete),
+			offsetof(struct master_service_settings_blob_header,
+				 obsolete)) < 0)
+		i_error("pwrite(%s) failed: %m", path);
+	i_close_fd(&fd);
+}
+
+int master_service_settings_blob_writer_create(const char *path,
+	uoff_t max_size, struct master_service_settings_blob_writer **writer_r,
+	const char **error_r)
+{
+	struct master_service_settings_blob_writer *writer;
+	struct master_service_settings_blob_header hdr;
+	const char *temp_path;
+	int fd;
+
+	temp_path = t_strdup_printf("%s.%s.tmp", path, my_pid);
+	fd = open(temp_path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1) {
+		*error_r = t_strdup_printf("open(%s) failed: %m", temp_path);
+		return -1;
+	}
+
+	i_zero(&hdr);
+	memcpy(hdr.magic, MASTER_SERVICE_SETTINGS_BLOB_MAGIC,
+	       sizeof(hdr.magic));
+	hdr.version = MASTER_SERVICE_SETTINGS_BLOB_VERSION;
+	hdr.hdr_size = sizeof(hdr);
+	if (write_full(fd, &hdr, sizeof(hdr)) < 0) {
+		*error_r = t_strdup_printf("write(%s) failed: %m", temp_path);
+		i_close_fd(&fd);
+		i_unlink(temp_path);
+		return -1;
+	}
+
+	master_service_settings_blob_mark_obsolete(path);
+	if (rename(temp_path, path) < 0) {
+		*error_r = t_strdup_printf("rename(%s, %s) failed: %m",
+					   temp_path, path);
+		i_close_fd(&fd);
+		i_unlink(temp_path);
+		return -1;
+	}
+
+	pool_t pool = pool_alloconly_create("settings blob writer", 1024);
+	writer = p_new(pool, struct master_service_settings_blob_writer, 1);
+	writer->pool = pool;
+	writer->path = p_strdup(pool, path);
+	writer->fd = fd;
+	writer->max_size = max_size;
+	hash_table_create(&writer->keys, pool, 0, str_hash, strcmp);
+	*writer_r = writer;
+	return 0;
+}
+
+void master_service_settings_blob_writer_destroy(
+	struct master_service_settings_blob_writer **_writer)
+{
+	struct master_service_settings_blob_writer *writer = *_writer;
+
+	if (writer == NULL)
+		return;
+	*_writer = NULL;
+
+	hash_table_destroy(&writer->keys);
+	i_close_fd(&writer->fd);
+	pool_unref(&writer->pool);
+}
+
+void master_service_settings_blob_append_setting(buffer_t *settings,
+						 const char *key,
+						 const char *value)
+{
+	buffer_append(settings, key, strlen(key) + 1);
+	buffer_append(settings, value, strlen(value) + 1);
+}
+
+int master_service_settings_blob_writer_add(
+	struct master_service_settings_blob_writer *writer, const char *key,
+	enum master_service_settings_blob_flags flags,
+	const buffer_t *settings, unsigned int settings_count,
+	const char **error_r)
+{
+	struct master_service_settings_blob_record_header rec;
+	uint32_t used_size;
+	size_t size;
+	buffer_t *buf;
+	char *key_dup;
+
+	if (hash_table_lookup(writer->keys, key) != NULL)
+		return 0;
+
+	i_zero(&rec);
+	rec.flags = flags;
+	rec.key_size = strlen(key) + 1;
+	rec.settings_count = settings_count;
+	size = BLOB_ALIGN(sizeof(rec) + rec.key_size + settings->used);
+	if (sizeof(struct master_service_settings_blob_header) +
+	    writer->used_size + size > writer->max_size) {
+		/* blob is full - the rest go through the config socket */
+		return 0;
+	}
+	rec.size = size;
+
+	buf = t_buffer_create(size);
+	buffer_append(buf, &rec, sizeof(rec));
+	buffer_append(buf, key, rec.key_size);
+	buffer_append_buf(buf, settings, 0, SIZE_MAX);
+	buffer_append_zero(buf, size - buf->used);
+
+	if (pwrite_full(writer->fd, buf->data, buf->used,
+			sizeof(struct master_service_settings_blob_header) +
+			writer->used_size) < 0) {
+		*error_r = t_strdup_printf("pwrite(%s) failed: %m",
+					   writer->path);
+		return -1;
+	}
+	/* the record is visible to readers only after used_size is updated */
+	used_size = writer->used_size + size;
+	if (pwrite_full(writer->fd, &used_size, sizeof(used_size),
+			offsetof(struct master_service_settings_blob_header,
+				 used_size)) < 0) {
+		*error_r = t_strdup_printf("pwrite(%s) failed: %m",
+					   writer->path);
+		return -1;
+	}
+	writer->used_size = used_size;
+
+	key_dup = p_strdup(writer->pool, key);
+	hash_table_insert(writer->keys, key_dup, key_dup);
+	return 1;
+}
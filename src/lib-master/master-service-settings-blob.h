@@ -0,0 +1,100 @@
+#ifndef MASTER_SERVICE_SETTINGS_BLOB_H
+#define MASTER_SERVICE_SETTINGS_BLOB_H
+
+/* Precompiled settings blob. The config process appends the already
+   filter-resolved settings of each (service, modules, local IP/name) request
+   it answers into a file, which the other processes mmap() read-only and look
+   up their settings from without a config socket roundtrip. The blob is
+   append-only while the config process runs. When it's recreated (e.g. on
+   config reload), the old file is marked obsolete and replaced with rename(),
+   so readers know to reopen it. */
+
+struct master_service_settings_blob;
+struct master_service_settings_blob_writer;
+
+#define MASTER_SERVICE_SETTINGS_BLOB_MAGIC "DCFGBLOB"
+#define MASTER_SERVICE_SETTINGS_BLOB_VERSION 1
+
+enum master_service_settings_blob_flags {
+	MASTER_SERVICE_SETTINGS_BLOB_FLAG_SERVICE_USES_LOCAL	= 0x01,
+	MASTER_SERVICE_SETTINGS_BLOB_FLAG_USED_LOCAL		= 0x02,
+	MASTER_SERVICE_SETTINGS_BLOB_FLAG_USED_REMOTE		= 0x04,
+};
+
+struct master_service_settings_blob_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t hdr_size;
+	/* Size of the records following the header. This is updated only
+	   after the records have been fully written. */
+	uint32_t used_size;
+	/* Non-zero if the blob has been replaced by a newer file. */
+	uint32_t obsolete;
+};
+
+struct master_service_settings_blob_record_header {
+	/* Size of the whole record including this header, padded to 32bit
+	   alignment. */
+	uint32_t size;
+	uint32_t flags; /* enum master_service_settings_blob_flags */
+	/* Size of the NUL-terminated key following this header */
+	uint32_t key_size;
+	/* Number of NUL-terminated key and value pairs following the key */
+	uint32_t settings_count;
+};
+
+struct master_service_settings_blob_record {
+	enum master_service_settings_blob_flags flags;
+	unsigned int settings_count;
+
+	/* private: */
+	const char *data, *end;
+};
+
+/* Returns the blob key for the given config REQ arguments. The username and
+   the remote IP are always dropped, because records are written only for
+   results that don't depend on them. Local IP and name are kept only if
+   with_local is TRUE. */
+const char *master_service_settings_blob_key(const char *const *args,
+					     bool with_local);
+
+/* Open the blob for reading. Returns 1 if opened, 0 if it doesn't exist (or
+   we have no permission to it), -1 on error. */
+int master_service_settings_blob_open(const char *path,
+				      struct master_service_settings_blob **blob_r,
+				      const char **error_r);
+void master_service_settings_blob_close(struct master_service_settings_blob **blob);
+
+/* Find the first record matching any of the NULL-terminated keys. The record
+   points to the mmaped data, so it's valid only until the next lookup.
+   Returns 1 if found, 0 if not, -1 if the blob is broken. */
+int master_service_settings_blob_lookup(struct master_service_settings_blob *blob,
+					const char *const *keys,
+					struct master_service_settings_blob_record *rec_r,
+					const char **error_r);
+/* Returns the next setting in the record, or FALSE when there are no more. */
+bool master_service_settings_blob_record_next(
+	struct master_service_settings_blob_record *rec,
+	const char **key_r, const char **value_r);
+
+/* Recreate the blob file. Any existing blob in the path is marked obsolete.
+   Records are appended only as long as the file is below max_size. */
+int master_service_settings_blob_writer_create(const char *path,
+	uoff_t max_size, struct master_service_settings_blob_writer **writer_r,
+	const char **error_r);
+void master_service_settings_blob_writer_destroy(
+	struct master_service_settings_blob_writer **writer);
+
+/* Append key=value into the settings buffer given to _writer_add(). */
+void master_service_settings_blob_append_setting(buffer_t *settings,
+						 const char *key,
+						 const char *value);
+/* Append a new record to the blob. Returns 1 if added, 0 if the key already
+   exists or the blob is full, -1 on I/O error. */
+int master_service_settings_blob_writer_add(
+	struct master_service_settings_blob_writer *writer, const char *key,
+	enum master_service_settings_blob_flags flags,
+	const buffer_t *settings, unsigned int settings_count,
+	const char **error_r);
+
+#endif
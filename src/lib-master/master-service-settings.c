@@ -17,6 +17,7 @@
 #include "master-service-private.h"
 #include "master-service-ssl-settings.h"
 #include "master-service-settings.h"
+#include "master-service-settings-blob.h"
 
 #include <stddef.h>
 #include <unistd.h>
@@ -491,6 +492,84 @@ config_read_reply_header(struct istream *istream, const char *path, pool_t pool,
 	return 0;
 }
 
+static void
+master_service_config_blob_try_open(struct master_service *service)
+{
+	const char *error;
+
+	if (service->config_blob != NULL || service->config_blob_path == NULL)
+		return;
+	if (master_service_settings_blob_open(service->config_blob_path,
+					      &service->config_blob,
+					      &error) < 0)
+		i_error("%s", error);
+}
+
+static bool
+master_service_config_blob_find(struct master_service *service,
+				const struct master_service_settings_input *input,
+				struct master_service_settings_blob_record *rec_r)
+{
+	const char *const *args, *keys[3], *error;
+	string_t *str;
+	int ret;
+
+	/* Only the master's config socket answers the same way as the
+	   blob. Requests without a service aren't written to it. */
+	if (input->config_path != NULL || input->service == NULL ||
+	    service->config_path_changed_with_param)
+		return FALSE;
+	master_service_config_blob_try_open(service);
+	if (service->config_blob == NULL)
+		return FALSE;
+
+	str = t_str_new(128);
+	config_build_request(service, str, input);
+	str_truncate(str, str_len(str) - 1);
+	args = t_strsplit_tabescaped(str_c(str));
+	i_assert(strcmp(args[0], "REQ") == 0);
+
+	/* The record is keyed by the local IP/name only if the service has
+	   local filters, so try first with them and then without. */
+	keys[0] = master_service_settings_blob_key(args + 1, TRUE);
+	keys[1] = master_service_settings_blob_key(args + 1, FALSE);
+	keys[2] = NULL;
+	ret = master_service_settings_blob_lookup(service->config_blob, keys,
+						  rec_r, &error);
+	if (ret < 0) {
+		i_error("%s", error);
+		master_service_settings_blob_close(&service->config_blob);
+	}
+	return ret > 0;
+}
+
+static int
+master_service_config_blob_apply(struct setting_parser_context *parser,
+				 struct master_service_settings_blob_record *rec,
+				 struct master_service_settings_output *output_r,
+				 const char **error_r)
+{
+	const char *key, *value;
+
+	output_r->service_uses_local = (rec->flags &
+		MASTER_SERVICE_SETTINGS_BLOB_FLAG_SERVICE_USES_LOCAL) != 0;
+	output_r->used_local = (rec->flags &
+		MASTER_SERVICE_SETTINGS_BLOB_FLAG_USED_LOCAL) != 0;
+	output_r->used_remote = (rec->flags &
+		MASTER_SERVICE_SETTINGS_BLOB_FLAG_USED_REMOTE) != 0;
+
+	while (master_service_settings_blob_record_next(rec, &key, &value)) {
+		/* unknown keys are ignored, like with the config socket */
+		if (settings_parse_keyvalue(parser, key, value) < 0) {
+			*error_r = t_strdup_printf(
+				"Invalid setting %s in config blob: %s", key,
+				settings_parser_get_error(parser));
+			return -1;
+		}
+	}
+	return 0;
+}
+
 void master_service_config_socket_try_open(struct master_service *service)
 {
 	struct master_service_settings_input input;
@@ -512,6 +591,8 @@ void master_service_config_socket_try_open(struct master_service *service)
 	fd = master_service_open_config(service, &input, &path, &error);
 	if (fd != -1)
 		service->config_fd = fd;
+	/* open the blob also now, while we still have the privileges */
+	master_service_config_blob_try_open(service);
 }
 
 int master_service_settings_get_filters(struct master_service *service,
@@ -570,17 +651,22 @@ int master_service_settings_read(struct master_service *service,
 	ARRAY(const struct setting_parser_info *) all_roots;
 	const struct setting_parser_info *tmp_root;
 	struct setting_parser_context *parser;
+	struct master_service_settings_blob_record blob_rec;
 	struct istream *istream;
 	const char *path = NULL, *error;
 	void **sets;
 	unsigned int i;
 	int ret, fd = -1;
 	time_t now, timeout;
-	bool use_environment, retry;
+	bool use_environment, retry, blob_found = FALSE;
 
 	i_zero(output_r);
 
 	if (getenv("DOVECONF_ENV") == NULL &&
+	    (service->flags & MASTER_SERVICE_FLAG_NO_CONFIG_SETTINGS) == 0)
+		blob_found = master_service_config_blob_find(service, input,
+							     &blob_rec);
+	if (getenv("DOVECONF_ENV") == NULL && !blob_found &&
 	    (service->flags & MASTER_SERVICE_FLAG_NO_CONFIG_SETTINGS) == 0) {
 		retry = service->config_fd != -1;
 		for (;;) {
@@ -632,7 +718,14 @@ int master_service_settings_read(struct master_service *service,
 			array_front(&all_roots), array_count(&all_roots),
 			SETTINGS_PARSER_FLAG_IGNORE_UNKNOWN_KEYS);
 
-	if (fd != -1) {
+	if (blob_found) {
+		if (master_service_config_blob_apply(parser, &blob_rec,
+						     output_r, error_r) < 0) {
+			settings_parser_deinit(&parser);
+			return -1;
+		}
+		use_environment = FALSE;
+	} else if (fd != -1) {
 		istream = i_stream_create_fd(fd, SIZE_MAX);
 		now = time(NULL);
 		timeout = now + CONFIG_READ_TIMEOUT_SECS;
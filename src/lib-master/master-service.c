@@ -25,6 +25,7 @@
 #include "master-service-ssl.h"
 #include "master-service-private.h"
 #include "master-service-settings.h"
+#include "master-service-settings-blob.h"
 #include "iostream-ssl.h"
 
 #include <unistd.h>
@@ -500,8 +501,11 @@ master_service_init(const char *name, enum master_service_flags flags,
 	service->config_path = i_strdup(getenv(MASTER_CONFIG_FILE_ENV));
 	if (service->config_path == NULL)
 		service->config_path = i_strdup(DEFAULT_CONFIG_FILE_PATH);
-	else
+	else {
 		service->config_path_from_master = TRUE;
+		service->config_blob_path =
+			i_strdup(getenv(MASTER_CONFIG_BLOB_ENV));
+	}
 
 	if ((flags & MASTER_SERVICE_FLAG_STANDALONE) == 0) {
 		service->version_string = getenv(MASTER_DOVECOT_VERSION_ENV);
@@ -803,6 +807,7 @@ bool master_service_parse_option(struct master_service *service,
 	switch (opt) {
 	case 'c':
 		i_free(service->config_path);
+		i_free(service->config_blob_path);
 		service->config_path = i_strdup(arg);
 		service->config_path_changed_with_param = TRUE;
 		service->config_path_from_master = FALSE;
@@ -1173,14 +1178,11 @@ bool master_service_is_master_stopped(struct master_service *service)
 }
 
 static bool
-master_service_anvil_send(struct master_service *service, const char *cmd)
+master_service_anvil_write(const char *data, size_t size)
 {
 	ssize_t ret;
 
-	if ((service->flags & MASTER_SERVICE_FLAG_STANDALONE) != 0)
-		return FALSE;
-
-	ret = write(MASTER_ANVIL_FD, cmd, strlen(cmd));
+	ret = write(MASTER_ANVIL_FD, data, size);
 	if (ret < 0) {
 		if (errno == EPIPE) {
 			/* anvil process was probably recreated, don't bother
@@ -1193,11 +1195,85 @@ master_service_anvil_send(struct master_service *service, const char *cmd)
 		i_error("write(anvil) failed: EOF");
 		return FALSE;
 	} else {
-		i_assert((size_t)ret == strlen(cmd));
+		i_assert((size_t)ret == size);
 		return TRUE;
 	}
 }
 
+static void master_service_anvil_flush(struct master_service *service)
+{
+	timeout_remove(&service->to_anvil_flush);
+	if (service->anvil_send_buf == NULL ||
+	    str_len(service->anvil_send_buf) == 0)
+		return;
+
+	if (!master_service_anvil_write(str_c(service->anvil_send_buf),
+					str_len(service->anvil_send_buf))) {
+		/* the callers already consider these DISCONNECTs sent */
+		const char *p = str_c(service->anvil_send_buf);
+		unsigned int count = 0;
+
+		for (; *p != '\0'; p++) {
+			if (*p == '\n')
+				count++;
+		}
+		i_warning("Dropped %u buffered anvil DISCONNECT commands",
+			  count);
+	}
+	str_truncate(service->anvil_send_buf, 0);
+}
+
+static bool
+master_service_anvil_send(struct master_service *service, const char *cmd,
+			  bool batch)
+{
+	size_t cmd_len = strlen(cmd);
+	bool ret;
+
+	if ((service->flags & MASTER_SERVICE_FLAG_STANDALONE) != 0)
+		return FALSE;
+
+	/* Multiple processes write to the same anvil pipe, so each write()
+	   must stay within PIPE_BUF to keep it atomic. */
+	if (service->anvil_send_buf != NULL &&
+	    str_len(service->anvil_send_buf) + cmd_len > PIPE_BUF)
+		master_service_anvil_flush(service);
+	if (cmd_len > PIPE_BUF || current_ioloop != service->ioloop ||
+	    service->ioloop == NULL || service->anvil_send_direct) {
+		/* can't batch - write immediately */
+		master_service_anvil_flush(service);
+		return master_service_anvil_write(cmd, cmd_len);
+	}
+	if (!batch) {
+		/* The caller needs to know whether the command was really
+		   sent. Write it now, together with the buffered commands
+		   so they stay in order. */
+		if (service->anvil_send_buf == NULL ||
+		    str_len(service->anvil_send_buf) == 0)
+			return master_service_anvil_write(cmd, cmd_len);
+		timeout_remove(&service->to_anvil_flush);
+		str_append_data(service->anvil_send_buf, cmd, cmd_len);
+		ret = master_service_anvil_write(
+			str_c(service->anvil_send_buf),
+			str_len(service->anvil_send_buf));
+		str_truncate(service->anvil_send_buf, 0);
+		return ret;
+	}
+
+	/* Batch the commands sent during this ioloop run into a single
+	   write(). This reduces the number of syscalls and anvil wakeups when
+	   many sessions are destroyed at the same time. */
+	if (service->anvil_send_buf == NULL)
+		service->anvil_send_buf = str_new(default_pool, PIPE_BUF);
+	str_append_data(service->anvil_send_buf, cmd, cmd_len);
+	if (service->to_anvil_flush == NULL) {
+		service->to_anvil_flush =
+			timeout_add_short_to(service->ioloop, 0,
+					     master_service_anvil_flush, service);
+	}
+	return TRUE;
+}
+
 static void
 master_service_anvil_session_to_cmd(string_t *cmd,
 	const struct master_service_anvil_session *session)
@@ -1246,7 +1322,7 @@ bool master_service_anvil_connect(struct master_service *service,
 		str_append_tabescaped(cmd, str_c(alt_usernames));
 	}
 	str_append_c(cmd, '\n');
-	return master_service_anvil_send(service, str_c(cmd));
+	return master_service_anvil_send(service, str_c(cmd), FALSE);
 }
 
 void master_service_anvil_disconnect(struct master_service *service,
@@ -1259,7 +1335,7 @@ void master_service_anvil_disconnect(struct master_service *service,
 	str_append_c(cmd, '\t');
 	master_service_anvil_session_to_cmd(cmd, session);
 	str_append_c(cmd, '\n');
-	(void)master_service_anvil_send(service, str_c(cmd));
+	(void)master_service_anvil_send(service, str_c(cmd), TRUE);
 }
 
 void master_service_client_connection_created(struct master_service *service)
@@ -1427,6 +1503,7 @@ static void master_service_refresh_login_state(struct master_service *service)
 void master_service_close_config_fd(struct master_service *service)
 {
 	i_close_fd(&service->config_fd);
+	master_service_settings_blob_close(&service->config_blob);
 }
 
 static void master_service_deinit_real(struct master_service **_service)
@@ -1455,6 +1532,9 @@ static void master_service_deinit_real(struct master_service **_service)
 	if (service->stats_client != NULL)
 		stats_client_deinit(&service->stats_client);
 	master_service_close_config_fd(service);
+	master_service_anvil_flush(service);
+	str_free(&service->anvil_send_buf);
+	service->anvil_send_direct = TRUE;
 	timeout_remove(&service->to_overflow_call);
 	timeout_remove(&service->to_die);
 	timeout_remove(&service->to_overflow_state);
@@ -244,13 +244,18 @@ void master_service_get_kill_time(struct master_service *service,
 bool master_service_is_master_stopped(struct master_service *service);
 
 /* Send CONNECT command to anvil process, if it's still connected. Returns TRUE
-   and connection GUID if it was successfully sent. If kick_supported=TRUE, the
-   process implements the KICK-USER command in anvil and admin sockets. */
+   and connection GUID if it was sent. If kick_supported=TRUE, the process
+   implements the KICK-USER command in anvil and admin sockets. */
 bool master_service_anvil_connect(struct master_service *service,
 	const struct master_service_anvil_session *session,
 	bool kick_supported, guid_128_t conn_guid_r);
 /* Send DISCONNECT command to anvil process, if it's still connected.
-   The conn_guid must match the guid returned by _connect(). */
+   The conn_guid must match the guid returned by _connect().
+
+   The DISCONNECT commands sent within the same ioloop run are batched and
+   written to anvil together once the ioloop gets back to handling timeouts,
+   or with the next CONNECT. If writing them fails, the failure is only
+   logged. */
 void master_service_anvil_disconnect(struct master_service *service,
 	const struct master_service_anvil_session *session,
 	const guid_128_t conn_guid);
@@ -12,12 +12,18 @@
 
 #define STATS_CLIENT_TIMEOUT_MSECS (5*1000)
 #define STATS_CLIENT_RECONNECT_INTERVAL_MSECS (10*1000)
+/* Events are buffered and written to stats in batches. The batch is written
+   when it grows larger than STATS_CLIENT_FLUSH_MAX_BUFFER_SIZE or after
+   STATS_CLIENT_FLUSH_INTERVAL_MSECS, whichever comes first. */
+#define STATS_CLIENT_FLUSH_MAX_BUFFER_SIZE (64*1024)
+#define STATS_CLIENT_FLUSH_INTERVAL_MSECS 50
 
 struct stats_client {
 	struct connection conn;
 	struct event_filter *filter;
 	struct ioloop *ioloop;
 	struct timeout *to_reconnect;
+	struct timeout *to_flush;
 	bool handshaked;
 	bool handshake_received_at_least_once;
 	bool silent_notfound_errors;
@@ -27,6 +33,37 @@ static struct connection_list *stats_clients;
 
 static void stats_client_connect(struct stats_client *client);
 
+static void stats_client_flush_output(struct stats_client *client)
+{
+	timeout_remove(&client->to_flush);
+	if (client->conn.output != NULL)
+		o_stream_uncork(client->conn.output);
+}
+
+static void stats_client_output_begin(struct stats_client *client)
+{
+	o_stream_cork(client->conn.output);
+}
+
+static void
+stats_client_output_end(struct stats_client *client, bool flush)
+{
+	if (flush || client->ioloop != NULL ||
+	    client->conn.ioloop != current_ioloop ||
+	    o_stream_get_buffer_used_size(client->conn.output) >=
+	    STATS_CLIENT_FLUSH_MAX_BUFFER_SIZE) {
+		/* Write immediately. Only batch writes in the connection's
+		   own ioloop, so the flush timeout can't be left behind in
+		   a temporary ioloop. */
+		stats_client_flush_output(client);
+	} else if (client->to_flush == NULL) {
+		client->to_flush =
+			timeout_add_short_to(client->conn.ioloop,
+					     STATS_CLIENT_FLUSH_INTERVAL_MSECS,
+					     stats_client_flush_output, client);
+	}
+}
+
 static int
 client_handshake_filter(const char *const *args, struct event_filter **filter_r,
 			const char **error_r)
@@ -99,6 +136,7 @@ static void stats_client_destroy(struct connection *conn)
 		event->sent_to_stats_id = 0;
 
 	client->handshaked = FALSE;
+	timeout_remove(&client->to_flush);
 	connection_disconnect(conn);
 	if (client->ioloop != NULL) {
 		/* waiting for stats handshake to finish */
@@ -202,8 +240,8 @@ stats_client_send_event(struct stats_client *client, struct event *event,
 	/* Need to send the event for stats and/or export */
 	string_t *str = t_str_new(256);
 
-	if (++recursion == 0)
-		o_stream_cork(client->conn.output);
+	if (++recursion == 1)
+		stats_client_output_begin(client);
 	struct event *global_event = event_get_global();
 	if (global_event != NULL)
 		stats_event_write(client, global_event, NULL, ctx, str, TRUE);
@@ -212,8 +250,12 @@ stats_client_send_event(struct stats_client *client, struct event *event,
 	o_stream_nsend(client->conn.output, str_data(str), str_len(str));
 
 	i_assert(recursion > 0);
-	if (--recursion == 0)
-		o_stream_uncork(client->conn.output);
+	if (--recursion == 0) {
+		/* Don't delay sending fatal errors. The process is most
+		   likely going to die before the flush timeout. */
+		stats_client_output_end(client, ctx->type == LOG_TYPE_FATAL ||
+					ctx->type == LOG_TYPE_PANIC);
+	}
 }
 
 static void
@@ -221,8 +263,10 @@ stats_client_free_event(struct stats_client *client, struct event *event)
 {
 	if (event->sent_to_stats_id == 0)
 		return;
+	stats_client_output_begin(client);
 	o_stream_nsend_str(client->conn.output,
 			   t_strdup_printf("END\t%"PRIu64"\n", event->id));
+	stats_client_output_end(client, FALSE);
 }
 
 static bool
@@ -273,7 +317,9 @@ static void stats_category_registered(struct event_category *category)
 
 	string_t *str = t_str_new(64);
 	stats_category_append(str, category);
+	stats_client_output_begin(client);
 	o_stream_nsend(client->conn.output, str_data(str), str_len(str));
+	stats_client_output_end(client, FALSE);
 }
 
 static void stats_global_init(void)
@@ -357,12 +403,18 @@ stats_client_init(const char *path, bool silent_notfound_errors)
 	return client;
 }
 
+void stats_client_flush(struct stats_client *client)
+{
+	stats_client_flush_output(client);
+}
+
 void stats_client_deinit(struct stats_client **_client)
 {
 	struct stats_client *client = *_client;
 
 	*_client = NULL;
 
+	stats_client_flush_output(client);
 	event_filter_unref(&client->filter);
 	connection_deinit(&client->conn);
 	timeout_remove(&client->to_reconnect);
@@ -5,4 +5,8 @@ struct stats_client *
 stats_client_init(const char *path, bool silent_notfound_errors);
 void stats_client_deinit(struct stats_client **client);
 
+/* Write all the buffered events to stats now. Events are normally written
+   in batches after a short delay. */
+void stats_client_flush(struct stats_client *client);
+
 #endif
@@ -86,6 +86,7 @@ static struct connection_list *stats_conn_list;
 static struct ioloop *ioloop;
 
 static pid_t stats_pid;
+static struct stats_client *stats_client;
 
 static int run_tests(void);
 static void signal_process(const char *signal_file);
@@ -264,6 +265,8 @@ static bool compare_test_stats_to(const char *format, ...)
 	va_start (args, format);
 	str_vprintfa (reference, format, args);
 	va_end (args);
+	/* events are written in batches - make sure they're all sent */
+	stats_client_flush(stats_client);
 	/* signal stats process to receive and record stats data */
 	signal_process(test_done);
 	/* Wait stats data to be recorded by stats process */
@@ -305,6 +308,7 @@ static void register_all_categories(void)
 		e_info(ev, "message");
 		event_unref(&ev);
 	}
+	stats_client_flush(stats_client);
 	signal_process(test_done);
 }
 
@@ -728,7 +732,7 @@ static int run_tests(void)
 		NULL
 	};
 	struct ioloop *ioloop = io_loop_create();
-	struct stats_client *stats_client = stats_client_init(SOCK_FULL, FALSE);
+	stats_client = stats_client_init(SOCK_FULL, FALSE);
 	register_all_categories();
 	wait_for_signal(stats_ready);
 	/* Remove stats data file containing register categories related stuff */
@@ -0,0 +1,168 @@
+/* Copyright (c) 2023 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "buffer.h"
+#include "test-common.h"
+#include "master-service-settings-blob.h"
+
+#include <unistd.h>
+
+#define TEST_BLOB_PATH ".test-settings.blob"
+
+static void
+test_blob_add(struct master_service_settings_blob_writer *writer,
+	      const char *key, enum master_service_settings_blob_flags flags,
+	      const char *const *settings, int expected_ret)
+{
+	buffer_t *buf = t_buffer_create(128);
+	unsigned int count = 0;
+	const char *error;
+
+	for (; settings[0] != NULL; settings += 2) {
+		master_service_settings_blob_append_setting(buf, settings[0],
+							    settings[1]);
+		count++;
+	}
+	test_assert(master_service_settings_blob_writer_add(writer, key,
+		flags, buf, count, &error) == expected_ret);
+}
+
+static void test_master_service_settings_blob_key(void)
+{
+	const char *const args[] = {
+		"module=imap", "service=imap", "user=foo", "lip=1.2.3.4",
+		"rip=5.6.7.8", "lname=example.com", NULL
+	};
+
+	test_begin("master service settings blob key");
+	test_assert_strcmp(master_service_settings_blob_key(args, TRUE),
+			   "module=imap\tservice=imap\tlip=1.2.3.4\tlname=example.com");
+	test_assert_strcmp(master_service_settings_blob_key(args, FALSE),
+			   "module=imap\tservice=imap");
+	test_end();
+}
+
+static void test_master_service_settings_blob_lookup(void)
+{
+	const char *const settings1[] = {
+		"foo", "bar", "multi", "line1\nline2", "empty", "", NULL
+	};
+	const char *const settings2[] = { "foo", "local", NULL };
+	const char *const keys[] = {
+		"service=imap\tlip=1.2.3.4", "service=imap", NULL
+	};
+	const char *const local_keys[] = {
+		"service=pop3\tlip=1.2.3.4", "service=pop3", NULL
+	};
+	const char *const missing_keys[] = {
+		"service=pop3\tlip=1.2.3.5", "service=lmtp", NULL
+	};
+	struct master_service_settings_blob_writer *writer;
+	struct master_service_settings_blob *blob;
+	struct master_service_settings_blob_record rec;
+	const char *key, *value, *error;
+
+	test_begin("master service settings blob lookup");
+	i_unlink_if_exists(TEST_BLOB_PATH);
+	test_assert(master_service_settings_blob_open(TEST_BLOB_PATH, &blob,
+						      &error) == 0);
+
+	test_assert(master_service_settings_blob_writer_create(TEST_BLOB_PATH,
+		1024*1024, &writer, &error) == 0);
+	test_assert(master_service_settings_blob_open(TEST_BLOB_PATH, &blob,
+						      &error) == 1);
+	test_assert(master_service_settings_blob_lookup(blob, keys, &rec,
+							&error) == 0);
+
+	/* records appended after opening are found */
+	test_blob_add(writer, "service=imap", 0, settings1, 1);
+	test_blob_add(writer, "service=imap", 0, settings1, 0);
+	test_assert(master_service_settings_blob_lookup(blob, keys, &rec,
+							&error) == 1);
+	test_assert(rec.flags == 0);
+	test_assert(rec.settings_count == 3);
+	test_assert(master_service_settings_blob_record_next(&rec, &key, &value));
+	test_assert_strcmp(key, "foo");
+	test_assert_strcmp(value, "bar");
+	test_assert(master_service_settings_blob_record_next(&rec, &key, &value));
+	test_assert_strcmp(key, "multi");
+	test_assert_strcmp(value, "line1\nline2");
+	test_assert(master_service_settings_blob_record_next(&rec, &key, &value));
+	test_assert_strcmp(key, "empty");
+	test_assert_strcmp(value, "");
+	test_assert(!master_service_settings_blob_record_next(&rec, &key, &value));
+
+	/* records keyed by local IP */
+	test_blob_add(writer, "service=pop3\tlip=1.2.3.4",
+		      MASTER_SERVICE_SETTINGS_BLOB_FLAG_SERVICE_USES_LOCAL |
+		      MASTER_SERVICE_SETTINGS_BLOB_FLAG_USED_LOCAL,
+		      settings2, 1);
+	test_assert(master_service_settings_blob_lookup(blob, local_keys, &rec,
+							&error) == 1);
+	test_assert(rec.flags ==
+		    (MASTER_SERVICE_SETTINGS_BLOB_FLAG_SERVICE_USES_LOCAL |
+		     MASTER_SERVICE_SETTINGS_BLOB_FLAG_USED_LOCAL));
+	test_assert(master_service_settings_blob_record_next(&rec, &key, &value));
+	test_assert_strcmp(value, "local");
+	test_assert(master_service_settings_blob_lookup(blob, missing_keys,
+							&rec, &error) == 0);
+
+	/* recreating the blob makes the reader switch to the new file */
+	master_service_settings_blob_writer_destroy(&writer);
+	test_assert(master_service_settings_blob_writer_create(TEST_BLOB_PATH,
+		1024*1024, &writer, &error) == 0);
+	test_assert(master_service_settings_blob_lookup(blob, keys, &rec,
+							&error) == 0);
+	test_blob_add(writer, "service=imap", 0, settings2, 1);
+	test_assert(master_service_settings_blob_lookup(blob, keys, &rec,
+							&error) == 1);
+	test_assert(rec.settings_count == 1);
+
+	master_service_settings_blob_close(&blob);
+	master_service_settings_blob_writer_destroy(&writer);
+	i_unlink(TEST_BLOB_PATH);
+	test_end();
+}
+
+static void test_master_service_settings_blob_max_size(void)
+{
+	const char *const settings[] = { "foo", "bar", NULL };
+	struct master_service_settings_blob_writer *writer;
+	struct master_service_settings_blob *blob;
+	struct master_service_settings_blob_record rec;
+	const char *keys[] = { NULL, NULL };
+	const char *error;
+
+	test_begin("master service settings blob max size");
+	test_assert(master_service_settings_blob_writer_create(TEST_BLOB_PATH,
+		150, &writer, &error) == 0);
+	test_blob_add(writer, "service=imap", 0, settings, 1);
+	test_blob_add(writer, "service=pop3", 0, settings, 1);
+	test_blob_add(writer, "service=submission", 0, settings, 1);
+	test_blob_add(writer, "service=lmtp", 0, settings, 0);
+
+	test_assert(master_service_settings_blob_open(TEST_BLOB_PATH, &blob,
+						      &error) == 1);
+	keys[0] = "service=submission";
+	test_assert(master_service_settings_blob_lookup(blob, keys, &rec,
+							&error) == 1);
+	keys[0] = "service=lmtp";
+	test_assert(master_service_settings_blob_lookup(blob, keys, &rec,
+							&error) == 0);
+
+	master_service_settings_blob_close(&blob);
+	master_service_settings_blob_writer_destroy(&writer);
+	i_unlink(TEST_BLOB_PATH);
+	test_end();
+}
+
+int main(void)
+{
+	static void (*const test_functions[])(void) = {
+		test_master_service_settings_blob_key,
+		test_master_service_settings_blob_lookup,
+		test_master_service_settings_blob_max_size,
+		NULL
+	};
+	return test_run(test_functions);
+}
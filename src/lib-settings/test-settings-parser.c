@@ -21,6 +21,7 @@ static const char *test_settings_blobs[] =
 	"port=2205\n"
 	"str=test string\n"
 	"expand_str=test %{string}\n"
+	"expand_str_plain=plain string\n"
 	"strlist=\n"
 	"strlist/x=a\n"
 	"strlist/y=b\n"
@@ -234,6 +235,7 @@ static void test_settings_parser_get(void)
 		in_port_t port;
 		const char *str;
 		const char *expand_str;
+		const char *expand_str_plain;
 		ARRAY_TYPE(const_string) strlist;
 	} test_defaults = {
 		FALSE, /* for negation test */
@@ -246,6 +248,7 @@ static void test_settings_parser_get(void)
 		0,
 		"",
 		"",
+		"",
 		ARRAY_INIT,
 	};
 	const struct setting_define defs[] = {
@@ -261,6 +264,8 @@ static void test_settings_parser_get(void)
 		SETTING_DEFINE_STRUCT_STR("str", str, struct test_settings),
 		{ .type = SET_STR_VARS, .key = "expand_str",
 		  offsetof(struct test_settings, expand_str), NULL },
+		{ .type = SET_STR_VARS, .key = "expand_str_plain",
+		  offsetof(struct test_settings, expand_str_plain), NULL },
 		{ .type = SET_STRLIST, .key = "strlist",
 		  offsetof(struct test_settings, strlist), NULL },
 		SETTING_DEFINE_LIST_END
@@ -322,6 +327,8 @@ static void test_settings_parser_get(void)
 
 	/* check that the setting got expanded */
 	test_assert_strcmp(settings->expand_str, "test value");
+	/* values without variables are used as-is */
+	test_assert_strcmp(settings->expand_str_plain, "plain string");
 
 	settings_parser_deinit(&ctx);
 	pool_unref(&pool);
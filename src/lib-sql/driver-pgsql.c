@@ -4,6 +4,7 @@
 #include "array.h"
 #include "ioloop.h"
 #include "hex-binary.h"
+#include "hash.h"
 #include "str.h"
 #include "time-util.h"
 #include "sql-api-private.h"
@@ -36,10 +37,29 @@ struct pgsql_db {
 
 	char *error;
 	const char *connect_state;
+	unsigned int prep_stmt_counter;
 
 	bool fatal_error:1;
 };
 
+struct pgsql_prepared_statement {
+	struct sql_prepared_statement prep_stmt;
+
+	/* server side name for the statement */
+	char *name;
+	/* query_template with ? placeholders converted to $1, $2, ... */
+	char *query;
+	/* The statement has been prepared in the current session */
+	bool prepared;
+};
+
+struct pgsql_statement {
+	struct sql_statement stmt;
+
+	/* NULL for non-prepared statements */
+	struct pgsql_prepared_statement *prep;
+};
+
 struct pgsql_binary_value {
 	unsigned char *value;
 	size_t size;
@@ -64,6 +84,10 @@ struct pgsql_result {
 	sql_query_callback_t *callback;
 	void *context;
 
+	/* The query begins with PREPARE for this statement. Its result is
+	   skipped once the statement is successfully prepared. */
+	struct pgsql_prepared_statement *prepare_stmt;
+
 	bool timeout:1;
 };
 
@@ -133,10 +157,30 @@ static void driver_pgsql_stop_io(struct pgsql_db *db)
 	}
 }
 
+static void driver_pgsql_prepared_statements_reset(struct pgsql_db *db)
+{
+	struct hash_iterate_context *iter;
+	struct sql_prepared_statement *prep_stmt;
+	char *query;
+
+	/* prepared statements exist only for the duration of the session */
+	if (!hash_table_is_created(db->api.prepared_stmt_hash))
+		return;
+	iter = hash_table_iterate_init(db->api.prepared_stmt_hash);
+	while (hash_table_iterate(iter, db->api.prepared_stmt_hash,
+				  &query, &prep_stmt)) {
+		struct pgsql_prepared_statement *pg_prep_stmt =
+			(struct pgsql_prepared_statement *)prep_stmt;
+		pg_prep_stmt->prepared = FALSE;
+	}
+	hash_table_iterate_deinit(&iter);
+}
+
 static void driver_pgsql_close(struct pgsql_db *db)
 {
 	db->io_dir = 0;
 	db->fatal_error = FALSE;
+	driver_pgsql_prepared_statements_reset(db);
 
 	driver_pgsql_stop_io(db);
 
@@ -321,28 +365,60 @@ static enum sql_db_flags driver_pgsql_get_flags(struct sql_db *db)
 }
 
 static int driver_pgsql_init_full_v(const struct sql_settings *set,
-				    struct sql_db **db_r, const char **error_r ATTR_UNUSED)
+				    struct sql_db **db_r, const char **error_r)
 {
 	struct pgsql_db *db;
-	const char *value;
+	const char *value, *error = NULL;
+	bool prepared_statements = FALSE;
 
 	db = i_new(struct pgsql_db, 1);
-	db->connect_string = i_strdup(set->connect_string);
 	db->api = driver_pgsql_db;
 	db->api.event = event_create(set->event_parent);
 	event_add_category(db->api.event, &event_category_pgsql);
 
 	/* NOTE: Connection string will be parsed by pgsql itself
-		 We only pick the host part here */
+		 We only pick the host part here, and remove our own
+		 prepared_statements setting. */
 	T_BEGIN {
-		const char *const *arg = t_strsplit(db->connect_string, " ");
+		const char *const *arg = t_strsplit(set->connect_string, " ");
+		ARRAY_TYPE(const_string) pg_args;
 
+		t_array_init(&pg_args, 16);
 		for (; *arg != NULL; arg++) {
+			if (str_begins(*arg, "prepared_statements=", &value)) {
+				if (strcmp(value, "yes") == 0)
+					prepared_statements = TRUE;
+				else if (strcmp(value, "no") == 0)
+					prepared_statements = FALSE;
+				else {
+					error = t_strdup_printf(
+						"Invalid value for prepared_statements: %s",
+						value);
+				}
+				continue;
+			}
 			if (str_begins(*arg, "host=", &value))
 				db->host = i_strdup(value);
-
+			array_push_back(&pg_args, arg);
 		}
-	} T_END;
+		array_append_zero(&pg_args);
+		db->connect_string =
+			i_strdup(t_strarray_join(array_front(&pg_args), " "));
+	} T_END_PASS_STR_IF(error != NULL, &error);
+
+	if (error != NULL) {
+		*error_r = error;
+		event_unref(&db->api.event);
+		i_free(db->host);
+		i_free(db->connect_string);
+		i_free(db);
+		return -1;
+	}
+	/* Server-side prepared statements are session-specific, so they
+	   don't work behind a transaction pooling proxy (e.g. pgbouncer).
+	   Without them the statements are sent as plain queries. */
+	if (!prepared_statements)
+		db->api.flags &= ENUM_NEGATE(SQL_DB_FLAG_PREP_STATEMENTS);
 
 	event_set_append_log_prefix(db->api.event, t_strdup_printf("pgsql(%s): ", db->host));
 
@@ -510,6 +586,16 @@ static void get_result(struct pgsql_result *result)
 	}
 
 	result->pgres = PQgetResult(db->pg);
+	if (result->prepare_stmt != NULL && result->pgres != NULL &&
+	    PQresultStatus(result->pgres) == PGRES_COMMAND_OK) {
+		/* PREPARE succeeded. The next result is for the EXECUTE. */
+		result->prepare_stmt->prepared = TRUE;
+		result->prepare_stmt = NULL;
+		PQclear(result->pgres);
+		result->pgres = NULL;
+		get_result(result);
+		return;
+	}
 	result_finish(result);
 }
 
@@ -626,8 +712,10 @@ static void driver_pgsql_exec(struct sql_db *db, const char *query)
 	do_query(result, query);
 }
 
-static void driver_pgsql_query(struct sql_db *db, const char *query,
-			       sql_query_callback_t *callback, void *context)
+static void
+driver_pgsql_query_full(struct sql_db *db, const char *query,
+			struct pgsql_prepared_statement *prepare_stmt,
+			sql_query_callback_t *callback, void *context)
 {
 	struct pgsql_result *result;
 
@@ -638,9 +726,16 @@ static void driver_pgsql_query(struct sql_db *db, const char *query,
 	result->api.event = event_create(db->event);
 	result->callback = callback;
 	result->context = context;
+	result->prepare_stmt = prepare_stmt;
 	do_query(result, query);
 }
 
+static void driver_pgsql_query(struct sql_db *db, const char *query,
+			       sql_query_callback_t *callback, void *context)
+{
+	driver_pgsql_query_full(db, query, NULL, callback, context);
+}
+
 static void pgsql_query_s_callback(struct sql_result *result, void *context)
 {
         struct pgsql_db *db = context;
@@ -682,7 +777,8 @@ static void driver_pgsql_sync_deinit(struct pgsql_db *db)
 }
 
 static struct sql_result *
-driver_pgsql_sync_query(struct pgsql_db *db, const char *query)
+driver_pgsql_sync_query(struct pgsql_db *db, const char *query,
+			struct pgsql_prepared_statement *prepare_stmt)
 {
 	struct sql_result *result;
 
@@ -699,7 +795,8 @@ driver_pgsql_sync_query(struct pgsql_db *db, const char *query)
 		break;
 	}
 
-	driver_pgsql_query(&db->api, query, pgsql_query_s_callback, db);
+	driver_pgsql_query_full(&db->api, query, prepare_stmt,
+				pgsql_query_s_callback, db);
 	if (db->sync_result == NULL)
 		io_loop_run(db->ioloop);
 
@@ -726,7 +823,7 @@ driver_pgsql_query_s(struct sql_db *_db, const char *query)
 	struct sql_result *result;
 
 	driver_pgsql_sync_init(db);
-	result = driver_pgsql_sync_query(db, query);
+	result = driver_pgsql_sync_query(db, query, NULL);
 	driver_pgsql_sync_deinit(db);
 	return result;
 }
@@ -1128,7 +1225,7 @@ driver_pgsql_transaction_commit_multi(struct pgsql_transaction_context *ctx)
 	struct sql_result *result;
 	struct sql_transaction_query *query;
 
-	result = driver_pgsql_sync_query(db, "BEGIN");
+	result = driver_pgsql_sync_query(db, "BEGIN", NULL);
 	if (sql_result_next_row(result) < 0) {
 		commit_multi_fail(ctx, result, "BEGIN");
 		return NULL;
@@ -1137,7 +1234,7 @@ driver_pgsql_transaction_commit_multi(struct pgsql_transaction_context *ctx)
 
 	/* send queries */
 	for (query = ctx->ctx.head; query != NULL; query = query->next) {
-		result = driver_pgsql_sync_query(db, query->query);
+		result = driver_pgsql_sync_query(db, query->query, NULL);
 		if (sql_result_next_row(result) < 0) {
 			commit_multi_fail(ctx, result, query->query);
 			break;
@@ -1154,7 +1251,7 @@ driver_pgsql_transaction_commit_multi(struct pgsql_transaction_context *ctx)
 	}
 
 	return driver_pgsql_sync_query(db, ctx->failed ?
-				       "ROLLBACK" : "COMMIT");
+				       "ROLLBACK" : "COMMIT", NULL);
 }
 
 static void
@@ -1268,6 +1365,140 @@ driver_pgsql_escape_blob(struct sql_db *_db ATTR_UNUSED,
 	return str_c(str);
 }
 
+static struct sql_prepared_statement *
+driver_pgsql_prepared_statement_init(struct sql_db *_db,
+				     const char *query_template)
+{
+	struct pgsql_db *db = (struct pgsql_db *)_db;
+	struct pgsql_prepared_statement *prep_stmt;
+	string_t *query = t_str_new(128);
+	unsigned int i, arg_pos = 0;
+
+	for (i = 0; query_template[i] != '\0'; i++) {
+		if (query_template[i] == '?')
+			str_printfa(query, "$%u", ++arg_pos);
+		else
+			str_append_c(query, query_template[i]);
+	}
+
+	prep_stmt = i_new(struct pgsql_prepared_statement, 1);
+	prep_stmt->prep_stmt.db = _db;
+	prep_stmt->prep_stmt.refcount = 1;
+	prep_stmt->prep_stmt.query_template = i_strdup(query_template);
+	prep_stmt->name = i_strdup_printf("dovecot_stmt_%u",
+					  ++db->prep_stmt_counter);
+	prep_stmt->query = i_strdup(str_c(query));
+	return &prep_stmt->prep_stmt;
+}
+
+static void
+driver_pgsql_prepared_statement_deinit(struct sql_prepared_statement *_prep_stmt)
+{
+	struct pgsql_prepared_statement *prep_stmt =
+		(struct pgsql_prepared_statement *)_prep_stmt;
+
+	i_free(prep_stmt->name);
+	i_free(prep_stmt->query);
+	i_free(prep_stmt->prep_stmt.query_template);
+	i_free(prep_stmt);
+}
+
+static struct sql_statement *
+driver_pgsql_statement_init(struct sql_db *db ATTR_UNUSED,
+			    const char *query_template ATTR_UNUSED)
+{
+	pool_t pool = pool_alloconly_create("pgsql sql statement", 1024);
+	struct pgsql_statement *stmt = p_new(pool, struct pgsql_statement, 1);
+
+	stmt->stmt.pool = pool;
+	return &stmt->stmt;
+}
+
+static struct sql_statement *
+driver_pgsql_statement_init_prepared(struct sql_prepared_statement *_prep_stmt)
+{
+	struct pgsql_prepared_statement *prep_stmt =
+		(struct pgsql_prepared_statement *)_prep_stmt;
+	pool_t pool = pool_alloconly_create("pgsql prepared sql statement", 1024);
+	struct pgsql_statement *stmt = p_new(pool, struct pgsql_statement, 1);
+
+	stmt->stmt.pool = pool;
+	stmt->stmt.query_template =
+		p_strdup(pool, prep_stmt->prep_stmt.query_template);
+	if ((prep_stmt->prep_stmt.db->flags & SQL_DB_FLAG_PREP_STATEMENTS) != 0)
+		stmt->prep = prep_stmt;
+	return &stmt->stmt;
+}
+
+static const char *
+driver_pgsql_statement_get_query(struct pgsql_statement *stmt,
+				 struct pgsql_prepared_statement **prepare_stmt_r)
+{
+	struct pgsql_prepared_statement *prep_stmt = stmt->prep;
+	const char *const *args;
+	unsigned int i, args_count;
+	string_t *query;
+
+	*prepare_stmt_r = NULL;
+	if (prep_stmt == NULL)
+		return sql_statement_get_query(&stmt->stmt);
+
+	/* The bound values are already escaped SQL literals, so they can be
+	   given to EXECUTE as-is. If the statement isn't yet prepared in this
+	   session, send the PREPARE in the same round trip. */
+	query = t_str_new(128);
+	if (!prep_stmt->prepared) {
+		str_printfa(query, "PREPARE %s AS %s; ",
+			    prep_stmt->name, prep_stmt->query);
+		*prepare_stmt_r = prep_stmt;
+	}
+	str_printfa(query, "EXECUTE %s", prep_stmt->name);
+
+	args = array_get(&stmt->stmt.args, &args_count);
+	for (i = 0; i < args_count; i++) {
+		if (args[i] == NULL) {
+			i_panic("lib-sql: Missing bind for arg #%u in statement: %s",
+				i, stmt->stmt.query_template);
+		}
+		str_append(query, i == 0 ? "(" : ", ");
+		str_append(query, args[i]);
+	}
+	if (args_count > 0)
+		str_append_c(query, ')');
+	return str_c(query);
+}
+
+static void
+driver_pgsql_statement_query(struct sql_statement *_stmt,
+			     sql_query_callback_t *callback, void *context)
+{
+	struct pgsql_statement *stmt = (struct pgsql_statement *)_stmt;
+	struct pgsql_prepared_statement *prepare_stmt;
+	const char *query;
+
+	query = driver_pgsql_statement_get_query(stmt, &prepare_stmt);
+	driver_pgsql_query_full(_stmt->db, query, prepare_stmt,
+				callback, context);
+	pool_unref(&_stmt->pool);
+}
+
+static struct sql_result *
+driver_pgsql_statement_query_s(struct sql_statement *_stmt)
+{
+	struct pgsql_statement *stmt = (struct pgsql_statement *)_stmt;
+	struct pgsql_db *db = (struct pgsql_db *)_stmt->db;
+	struct pgsql_prepared_statement *prepare_stmt;
+	struct sql_result *result;
+	const char *query;
+
+	query = driver_pgsql_statement_get_query(stmt, &prepare_stmt);
+	driver_pgsql_sync_init(db);
+	result = driver_pgsql_sync_query(db, query, prepare_stmt);
+	driver_pgsql_sync_deinit(db);
+	pool_unref(&_stmt->pool);
+	return result;
+}
+
 static bool driver_pgsql_have_work(struct pgsql_db *db)
 {
 	return db->next_callback != NULL || db->pending_results != NULL ||
@@ -1295,7 +1526,7 @@ static void driver_pgsql_wait(struct sql_db *_db)
 
 const struct sql_db driver_pgsql_db = {
 	.name = "pgsql",
-	.flags = SQL_DB_FLAG_POOLED,
+	.flags = SQL_DB_FLAG_POOLED | SQL_DB_FLAG_PREP_STATEMENTS,
 
 	.v = {
 		.get_flags = driver_pgsql_get_flags,
@@ -1317,6 +1548,13 @@ const struct sql_db driver_pgsql_db = {
 		.update = driver_pgsql_update,
 
 		.escape_blob = driver_pgsql_escape_blob,
+
+		.prepared_statement_init = driver_pgsql_prepared_statement_init,
+		.prepared_statement_deinit = driver_pgsql_prepared_statement_deinit,
+		.statement_init = driver_pgsql_statement_init,
+		.statement_init_prepared = driver_pgsql_statement_init_prepared,
+		.statement_query = driver_pgsql_statement_query,
+		.statement_query_s = driver_pgsql_statement_query_s,
 	}
 };
 
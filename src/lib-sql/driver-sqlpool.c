@@ -4,10 +4,21 @@
 #include "array.h"
 #include "llist.h"
 #include "ioloop.h"
+#include "time-util.h"
+#include "settings-parser.h"
 #include "sql-api-private.h"
 
 #include <time.h>
 
+#define SQLPOOL_REQUEST_FINISHED "sqlpool_request_finished"
+
+/* How often to check whether the pool can be shrunk (or idle_timeout if
+   it's smaller) */
+#define SQLPOOL_ADJUST_INTERVAL_SECS 10
+/* Default number of seconds a connection must be unused before it can be
+   closed. Each host always keeps at least one connection. */
+#define SQLPOOL_DEFAULT_IDLE_TIMEOUT_SECS 60
+
 /* sqlpool events are separate from category:sql, because
    they are usually not very interesting, and would only
    make logging too noisy. They can be enabled explicitly.
@@ -25,6 +36,8 @@ struct sqlpool_host {
 struct sqlpool_connection {
 	struct sql_db *db;
 	unsigned int host_idx;
+	/* last time a request was sent to or finished in this connection */
+	struct timeval last_used;
 };
 
 struct sqlpool_db {
@@ -33,6 +46,7 @@ struct sqlpool_db {
 	pool_t pool;
 	const struct sql_db *driver;
 	unsigned int connection_limit;
+	unsigned int idle_timeout_msecs;
 
 	ARRAY(struct sqlpool_host) hosts;
 	/* all connections from all hosts */
@@ -43,7 +57,17 @@ struct sqlpool_db {
 
 	/* queued requests */
 	struct sqlpool_request *requests_head, *requests_tail;
+	unsigned int requests_queued;
 	struct timeout *request_to;
+
+	/* number of requests currently being handled by connections */
+	unsigned int requests_active;
+	/* Peak usage since the last pool size adjustment. These are used to
+	   decide how many connections are actually needed. */
+	unsigned int peak_requests_active;
+	unsigned int peak_requests_queued;
+	uint64_t queue_wait_usecs;
+	struct timeout *to_adjust;
 };
 
 struct sqlpool_request {
@@ -51,6 +75,9 @@ struct sqlpool_request {
 
 	struct sqlpool_db *db;
 	time_t created;
+	struct timeval created_tv;
+	/* how long the request waited for a free connection */
+	long long queue_wait_usecs;
 
 	unsigned int host_idx;
 	unsigned int retry_count;
@@ -59,6 +86,9 @@ struct sqlpool_request {
 
 	/* requests are a) queries */
 	char *query;
+	/* prepared statement for the query. This is forwarded to the
+	   connection, so each connection prepares it only once. */
+	struct sql_statement *stmt;
 	sql_query_callback_t *callback;
 	void *context;
 
@@ -74,6 +104,13 @@ struct sqlpool_transaction_context {
 
 	pool_t query_pool;
 	struct sqlpool_request *commit_request;
+	struct event *event;
+	long long queue_wait_usecs;
+};
+
+struct sqlpool_statement {
+	struct sql_statement api;
+	bool prepared;
 };
 
 extern struct sql_db driver_sqlpool_db;
@@ -97,6 +134,7 @@ sqlpool_request_new(struct sqlpool_db *db, const char *query)
 	request = i_new(struct sqlpool_request, 1);
 	request->db = db;
 	request->created = time(NULL);
+	request->created_tv = ioloop_timeval;
 	request->query = i_strdup(query);
 	request->event = event_create(db->api.event);
 	return request;
@@ -110,11 +148,79 @@ sqlpool_request_free(struct sqlpool_request **_request)
 	*_request = NULL;
 
 	i_assert(request->prev == NULL && request->next == NULL);
+	if (request->stmt != NULL)
+		pool_unref(&request->stmt->pool);
 	event_unref(&request->event);
 	i_free(request->query);
 	i_free(request);
 }
 
+static struct sqlpool_connection *
+sqlpool_connection_find(struct sqlpool_db *db, struct sql_db *conndb)
+{
+	struct sqlpool_connection *conn;
+
+	array_foreach_modifiable(&db->all_connections, conn) {
+		if (conn->db == conndb)
+			return conn;
+	}
+	return NULL;
+}
+
+static void sqlpool_connection_used(struct sqlpool_db *db,
+				    struct sql_db *conndb)
+{
+	struct sqlpool_connection *conn;
+
+	conn = sqlpool_connection_find(db, conndb);
+	if (conn != NULL)
+		conn->last_used = ioloop_timeval;
+}
+
+static void
+sqlpool_request_started(struct sqlpool_db *db, struct sql_db *conndb,
+			long long *queue_wait_usecs_r, struct timeval *created_tv)
+{
+	*queue_wait_usecs_r = timeval_diff_usecs(&ioloop_timeval, created_tv);
+	if (*queue_wait_usecs_r < 0)
+		*queue_wait_usecs_r = 0;
+	db->queue_wait_usecs += *queue_wait_usecs_r;
+
+	db->requests_active++;
+	if (db->peak_requests_active < db->requests_active)
+		db->peak_requests_active = db->requests_active;
+	sqlpool_connection_used(db, conndb);
+}
+
+static void
+sqlpool_request_finished(struct sqlpool_db *db, struct sql_db *conndb,
+			 struct event *event, long long queue_wait_usecs,
+			 unsigned int retry_count, const char *error)
+{
+	struct event_passthrough *e;
+
+	e = event_create_passthrough(event)->
+		set_name(SQLPOOL_REQUEST_FINISHED)->
+		add_int("queue_wait_usecs", queue_wait_usecs)->
+		add_int("retries", retry_count)->
+		add_int("connections", array_count(&db->all_connections))->
+		add_int("connections_in_use", db->requests_active)->
+		add_int("queue_length", db->requests_queued);
+
+	i_assert(db->requests_active > 0);
+	db->requests_active--;
+	if (conndb != NULL)
+		sqlpool_connection_used(db, conndb);
+	if (error != NULL) {
+		e->add_str("error", error);
+		e_debug(e->event(), "Request failed after waiting %lld usecs "
+			"for a connection: %s", queue_wait_usecs, error);
+	} else {
+		e_debug(e->event(), "Request finished after waiting %lld usecs "
+			"for a connection", queue_wait_usecs);
+	}
+}
+
 static void
 sqlpool_request_abort(struct sqlpool_request **_request)
 {
@@ -129,6 +235,8 @@ sqlpool_request_abort(struct sqlpool_request **_request)
 		 request->db->requests_head == request);
 	DLLIST2_REMOVE(&request->db->requests_head,
 		       &request->db->requests_tail, request);
+	i_assert(request->db->requests_queued > 0);
+	request->db->requests_queued--;
 	sqlpool_request_free(&request);
 }
 
@@ -153,14 +261,57 @@ static void
 sqlpool_request_handle_transaction(struct sql_db *conndb,
 				   struct sqlpool_transaction_context *trans)
 {
+	struct sqlpool_db *db = trans->commit_request->db;
 	struct sql_transaction_context *conn_trans;
 
+	sqlpool_request_started(db, conndb, &trans->queue_wait_usecs,
+				&trans->commit_request->created_tv);
+	trans->event = trans->commit_request->event;
+	trans->commit_request->event = NULL;
 	sqlpool_request_free(&trans->commit_request);
 	conn_trans = driver_sqlpool_new_conn_trans(trans, conndb);
 	sql_transaction_commit(&conn_trans,
 			       driver_sqlpool_commit_callback, trans);
 }
 
+static struct sql_statement *
+sqlpool_statement_init_conn(struct sql_db *conndb, struct sql_statement *stmt)
+{
+	struct sql_prepared_statement *prep_stmt;
+	struct sql_statement *conn_stmt;
+
+	if ((sql_get_flags(conndb) & SQL_DB_FLAG_PREP_STATEMENTS) == 0)
+		return NULL;
+
+	/* Each connection caches its prepared statements by the query
+	   template. The bound values were already escaped into stmt->args,
+	   which is what the pooled drivers use. */
+	prep_stmt = sql_prepared_statement_init(conndb, stmt->query_template);
+	conn_stmt = sql_statement_init_prepared(prep_stmt);
+	sql_prepared_statement_unref(&prep_stmt);
+	array_append_array(&conn_stmt->args, &stmt->args);
+	return conn_stmt;
+}
+
+static void
+sqlpool_request_query(struct sql_db *conndb, struct sqlpool_request *request)
+{
+	struct sql_statement *conn_stmt = NULL;
+
+	sqlpool_request_started(request->db, conndb,
+				&request->queue_wait_usecs,
+				&request->created_tv);
+	if (request->stmt != NULL)
+		conn_stmt = sqlpool_statement_init_conn(conndb, request->stmt);
+	if (conn_stmt != NULL) {
+		sql_statement_query(&conn_stmt, driver_sqlpool_query_callback,
+				    request);
+	} else {
+		sql_query(conndb, request->query,
+			  driver_sqlpool_query_callback, request);
+	}
+}
+
 static void
 sqlpool_request_send_next(struct sqlpool_db *db, struct sql_db *conndb)
 {
@@ -171,11 +322,12 @@ sqlpool_request_send_next(struct sqlpool_db *db, struct sql_db *conndb)
 
 	request = db->requests_head;
 	DLLIST2_REMOVE(&db->requests_head, &db->requests_tail, request);
+	i_assert(db->requests_queued > 0);
+	db->requests_queued--;
 	timeout_reset(db->request_to);
 
 	if (request->query != NULL) {
-		sql_query(conndb, request->query,
-			  driver_sqlpool_query_callback, request);
+		sqlpool_request_query(conndb, request);
 	} else if (request->trans != NULL) {
 		sqlpool_request_handle_transaction(conndb, request->trans);
 	} else {
@@ -303,9 +455,64 @@ sqlpool_add_connection(struct sqlpool_db *db, struct sqlpool_host *host,
 	conn = array_append_space(&db->all_connections);
 	conn->host_idx = host_idx;
 	conn->db = conndb;
+	conn->last_used = ioloop_timeval;
 	return conn;
 }
 
+static bool sqlpool_connection_can_close(struct sqlpool_db *db,
+					 const struct sqlpool_connection *conn)
+{
+	const struct sqlpool_host *host =
+		array_idx(&db->hosts, conn->host_idx);
+
+	if (host->connection_count <= 1)
+		return FALSE;
+	if (conn->db->state != SQL_DB_STATE_IDLE &&
+	    conn->db->state != SQL_DB_STATE_DISCONNECTED)
+		return FALSE;
+	return timeval_diff_msecs(&ioloop_timeval, &conn->last_used) >=
+		(long long)db->idle_timeout_msecs;
+}
+
+static void sqlpool_adjust(struct sqlpool_db *db)
+{
+	struct sqlpool_connection *conns;
+	struct sqlpool_host *host;
+	unsigned int i, count, wanted_count;
+
+	/* The pool grows on demand whenever requests can't be sent
+	   immediately. Shrink it back if the connections haven't been needed
+	   for a while: keep enough connections for the peak concurrency and
+	   queue depth seen since the last check, and don't shrink at all if
+	   requests had to wait for a free connection. */
+	wanted_count = db->peak_requests_active + db->peak_requests_queued;
+	if (wanted_count < array_count(&db->hosts))
+		wanted_count = array_count(&db->hosts);
+	if (db->queue_wait_usecs > 0 || db->requests_queued > 0)
+		wanted_count = UINT_MAX;
+
+	conns = array_get_modifiable(&db->all_connections, &count);
+	for (i = count; i > 0 && count > wanted_count; i--) {
+		if (!sqlpool_connection_can_close(db, &conns[i-1]))
+			continue;
+
+		host = array_idx_modifiable(&db->hosts, conns[i-1].host_idx);
+		host->connection_count--;
+		e_debug(db->api.event, "Closing idle connection "
+			"(%u connections, peak usage %u)",
+			count, db->peak_requests_active);
+		sql_unref(&conns[i-1].db);
+		array_delete(&db->all_connections, i-1, 1);
+		conns = array_get_modifiable(&db->all_connections, &count);
+	}
+
+	db->peak_requests_active = db->requests_active;
+	db->peak_requests_queued = db->requests_queued;
+	db->queue_wait_usecs = 0;
+	if (array_count(&db->all_connections) <= array_count(&db->hosts))
+		timeout_remove(&db->to_adjust);
+}
+
 static struct sqlpool_connection *
 sqlpool_add_new_connection(struct sqlpool_db *db)
 {
@@ -315,8 +522,13 @@ sqlpool_add_new_connection(struct sqlpool_db *db)
 	host = sqlpool_find_host_with_least_connections(db, &host_idx);
 	if (host->connection_count >= db->connection_limit)
 		return NULL;
-	else
-		return sqlpool_add_connection(db, host, host_idx);
+
+	if (db->to_adjust == NULL && db->idle_timeout_msecs > 0) {
+		unsigned int msecs = I_MIN(db->idle_timeout_msecs,
+					   SQLPOOL_ADJUST_INTERVAL_SECS * 1000);
+		db->to_adjust = timeout_add(msecs, sqlpool_adjust, db);
+	}
+	return sqlpool_add_connection(db, host, host_idx);
 }
 
 static const struct sqlpool_connection *
@@ -452,7 +664,7 @@ static int
 driver_sqlpool_parse_hosts(struct sqlpool_db *db, const char *connect_string,
 			   const char **error_r)
 {
-	const char *const *args, *key, *value, *hostname;
+	const char *const *args, *key, *value, *hostname, *error;
 	struct sqlpool_host *host;
 	ARRAY_TYPE(const_string) hostnames, connect_args;
 
@@ -479,6 +691,18 @@ driver_sqlpool_parse_hosts(struct sqlpool_db *db, const char *connect_string,
 					value);
 				return -1;
 			}
+		} else if (strcmp(key, "idle_timeout") == 0) {
+			/* plain number is seconds, but allow also units */
+			unsigned int secs;
+
+			if (str_to_uint(value, &secs) == 0)
+				db->idle_timeout_msecs = secs * 1000;
+			else if (settings_get_time_msecs(value,
+					&db->idle_timeout_msecs, &error) < 0) {
+				*error_r = t_strdup_printf("Invalid value for idle_timeout: %s",
+					error);
+				return -1;
+			}
 		} else if (strcmp(key, "host") == 0) {
 			array_push_back(&hostnames, &value);
 		} else {
@@ -534,6 +758,7 @@ int driver_sqlpool_init_full(const struct sql_settings *set, const struct sql_db
 	db->driver = driver;
 	db->api = driver_sqlpool_db;
 	db->api.flags = driver->flags;
+	db->idle_timeout_msecs = SQLPOOL_DEFAULT_IDLE_TIMEOUT_SECS * 1000;
 	db->api.event = event_create(set->event_parent);
 	event_add_category(db->api.event, &event_category_sqlpool);
 	event_set_append_log_prefix(db->api.event,
@@ -578,6 +803,7 @@ static void driver_sqlpool_deinit(struct sql_db *_db)
 	array_clear(&db->all_connections);
 
 	driver_sqlpool_abort_requests(db);
+	timeout_remove(&db->to_adjust);
 
 	array_foreach_modifiable(&db->hosts, host)
 		i_free(host->connect_string);
@@ -671,11 +897,19 @@ static void driver_sqlpool_timeout(struct sqlpool_db *db)
 		timeout_remove(&db->request_to);
 }
 
+static void sqlpool_request_queued(struct sqlpool_db *db)
+{
+	db->requests_queued++;
+	if (db->peak_requests_queued < db->requests_queued)
+		db->peak_requests_queued = db->requests_queued;
+}
+
 static void
 driver_sqlpool_prepend_request(struct sqlpool_db *db,
 			       struct sqlpool_request *request)
 {
 	DLLIST2_PREPEND(&db->requests_head, &db->requests_tail, request);
+	sqlpool_request_queued(db);
 	if (db->request_to == NULL) {
 		db->request_to = timeout_add(SQL_QUERY_TIMEOUT_SECS * 1000,
 					     driver_sqlpool_timeout, db);
@@ -687,6 +921,7 @@ driver_sqlpool_append_request(struct sqlpool_db *db,
 			      struct sqlpool_request *request)
 {
 	DLLIST2_APPEND(&db->requests_head, &db->requests_tail, request);
+	sqlpool_request_queued(db);
 	if (db->request_to == NULL) {
 		db->request_to = timeout_add(SQL_QUERY_TIMEOUT_SECS * 1000,
 					     driver_sqlpool_timeout, db);
@@ -701,10 +936,14 @@ driver_sqlpool_query_callback(struct sql_result *result,
 	const struct sqlpool_connection *conn = NULL;
 	struct sql_db *conndb;
 
+	conndb = result->db;
 	if (result->failed_try_retry &&
 	    request->retry_count < array_count(&db->hosts)) {
 		e_warning(db->api.event, "Query failed, retrying: %s",
 			  sql_result_get_error(result));
+		i_assert(db->requests_active > 0);
+		db->requests_active--;
+		sqlpool_connection_used(db, conndb);
 		request->retry_count++;
 		driver_sqlpool_prepend_request(db, request);
 
@@ -718,7 +957,9 @@ driver_sqlpool_query_callback(struct sql_result *result,
 			e_error(db->api.event, "Query failed, aborting: %s",
 				request->query);
 		}
-		conndb = result->db;
+		sqlpool_request_finished(db, conndb, request->event,
+			request->queue_wait_usecs, request->retry_count,
+			result->failed ? sql_result_get_error(result) : NULL);
 
 		if (request->callback != NULL)
 			request->callback(result, request->context);
@@ -744,8 +985,7 @@ driver_sqlpool_query(struct sql_db *_db, const char *query,
 		driver_sqlpool_append_request(db, request);
 	else {
 		request->host_idx = conn->host_idx;
-		sql_query(conn->db, query, driver_sqlpool_query_callback,
-			  request);
+		sqlpool_request_query(conn->db, request);
 	}
 }
 
@@ -777,6 +1017,93 @@ driver_sqlpool_query_s(struct sql_db *_db, const char *query)
 	return result;
 }
 
+static struct sql_statement *
+driver_sqlpool_statement_init(struct sql_db *db ATTR_UNUSED,
+			      const char *query_template ATTR_UNUSED)
+{
+	pool_t pool = pool_alloconly_create("sqlpool sql statement", 1024);
+	struct sqlpool_statement *stmt =
+		p_new(pool, struct sqlpool_statement, 1);
+
+	stmt->api.pool = pool;
+	return &stmt->api;
+}
+
+static struct sql_statement *
+driver_sqlpool_statement_init_prepared(struct sql_prepared_statement *prep_stmt)
+{
+	struct sql_statement *_stmt;
+	struct sqlpool_statement *stmt;
+
+	_stmt = driver_sqlpool_statement_init(prep_stmt->db,
+					      prep_stmt->query_template);
+	_stmt->query_template = p_strdup(_stmt->pool,
+					 prep_stmt->query_template);
+	stmt = (struct sqlpool_statement *)_stmt;
+	stmt->prepared = TRUE;
+	return _stmt;
+}
+
+static void
+driver_sqlpool_statement_query(struct sql_statement *_stmt,
+			       sql_query_callback_t *callback, void *context)
+{
+	struct sqlpool_statement *stmt = (struct sqlpool_statement *)_stmt;
+	struct sqlpool_db *db = (struct sqlpool_db *)_stmt->db;
+	struct sqlpool_request *request;
+	const struct sqlpool_connection *conn;
+
+	if (!stmt->prepared) {
+		driver_sqlpool_query(_stmt->db, sql_statement_get_query(_stmt),
+				     callback, context);
+		pool_unref(&_stmt->pool);
+		return;
+	}
+
+	/* the request owns the statement until it's finished */
+	request = sqlpool_request_new(db, sql_statement_get_query(_stmt));
+	request->stmt = _stmt;
+	request->callback = callback;
+	request->context = context;
+
+	if (!driver_sqlpool_get_connection(db, UINT_MAX, &conn))
+		driver_sqlpool_append_request(db, request);
+	else {
+		request->host_idx = conn->host_idx;
+		sqlpool_request_query(conn->db, request);
+	}
+}
+
+static struct sql_result *
+driver_sqlpool_statement_query_s(struct sql_statement *_stmt)
+{
+	struct sqlpool_statement *stmt = (struct sqlpool_statement *)_stmt;
+	struct sqlpool_db *db = (struct sqlpool_db *)_stmt->db;
+	const struct sqlpool_connection *conn;
+	struct sql_statement *conn_stmt;
+	struct sql_result *result;
+
+	if (!stmt->prepared || !driver_sqlpool_get_sync_connection(db, &conn)) {
+		result = driver_sqlpool_query_s(_stmt->db,
+						sql_statement_get_query(_stmt));
+		pool_unref(&_stmt->pool);
+		return result;
+	}
+
+	conn_stmt = sqlpool_statement_init_conn(conn->db, _stmt);
+	if (conn_stmt != NULL)
+		result = sql_statement_query_s(&conn_stmt);
+	else
+		result = sql_query_s(conn->db, sql_statement_get_query(_stmt));
+	if (result->failed_try_retry &&
+	    driver_sqlpool_get_sync_connection(db, &conn)) {
+		sql_result_unref(result);
+		result = sql_query_s(conn->db, sql_statement_get_query(_stmt));
+	}
+	pool_unref(&_stmt->pool);
+	return result;
+}
+
 static struct sql_transaction_context *
 driver_sqlpool_transaction_begin(struct sql_db *_db)
 {
@@ -797,6 +1124,7 @@ driver_sqlpool_transaction_free(struct sqlpool_transaction_context *ctx)
 {
 	if (ctx->commit_request != NULL)
 		sqlpool_request_abort(&ctx->commit_request);
+	event_unref(&ctx->event);
 	pool_unref(&ctx->query_pool);
 	i_free(ctx);
 }
@@ -805,6 +1133,12 @@ static void
 driver_sqlpool_commit_callback(const struct sql_commit_result *result,
 			       struct sqlpool_transaction_context *ctx)
 {
+	struct sqlpool_db *db = (struct sqlpool_db *)ctx->ctx.db;
+
+	/* The connection isn't known here. Its last_used timestamp was
+	   already updated when the commit was sent. */
+	sqlpool_request_finished(db, NULL, ctx->event, ctx->queue_wait_usecs,
+				 0, result->error);
 	ctx->callback(result, ctx->context);
 	driver_sqlpool_transaction_free(ctx);
 }
@@ -928,5 +1262,10 @@ struct sql_db driver_sqlpool_db = {
 		.update = driver_sqlpool_update,
 
 		.escape_blob = driver_sqlpool_escape_blob,
+
+		.statement_init = driver_sqlpool_statement_init,
+		.statement_init_prepared = driver_sqlpool_statement_init_prepared,
+		.statement_query = driver_sqlpool_statement_query,
+		.statement_query_s = driver_sqlpool_statement_query_s,
 	}
 };
@@ -1,8 +1,11 @@
 /* Copyright (c) 2021 Dovecot authors, see the included COPYING file */
 
 #include "lib.h"
+#include "ioloop.h"
+#include "lib-event-private.h"
+#include "event-filter.h"
 #include "test-common.h"
-#include "sql-api.h"
+#include "sql-api-private.h"
 #include "driver-test.h"
 
 static struct sql_db *setup_sql(void)
@@ -128,11 +131,252 @@ static void test_sql_stmt_prepared_api(void)
 	test_end();
 }
 
+/* Asynchronous driver for testing sqlpool. Each connection handles one query
+   at a time and finishes it in the next ioloop run. */
+struct test_pool_db {
+	struct sql_db api;
+
+	struct timeout *to;
+	sql_query_callback_t *callback;
+	void *context;
+};
+
+static unsigned int test_pool_queries, test_pool_prepares;
+static unsigned int test_pool_finished_events, test_pool_max_in_use;
+static long long test_pool_max_queue_wait_usecs;
+
+static int test_pool_result_next_row(struct sql_result *result ATTR_UNUSED)
+{
+	return SQL_RESULT_NEXT_LAST;
+}
+
+static void test_pool_result_free(struct sql_result *result ATTR_UNUSED)
+{
+}
+
+static const struct sql_result test_pool_result = {
+	.v = {
+		.free = test_pool_result_free,
+		.next_row = test_pool_result_next_row,
+	},
+};
+
+extern const struct sql_db test_pool_driver;
+
+static int test_pool_init_full(const struct sql_settings *set,
+			       struct sql_db **db_r,
+			       const char **error_r ATTR_UNUSED)
+{
+	struct test_pool_db *db = i_new(struct test_pool_db, 1);
+
+	db->api = test_pool_driver;
+	db->api.event = event_create(set->event_parent);
+	*db_r = &db->api;
+	return 0;
+}
+
+static void test_pool_deinit(struct sql_db *_db)
+{
+	struct test_pool_db *db = (struct test_pool_db *)_db;
+
+	i_assert(db->to == NULL);
+	event_unref(&_db->event);
+	array_free(&_db->module_contexts);
+	i_free(db);
+}
+
+static int test_pool_connect(struct sql_db *db)
+{
+	sql_db_set_state(db, SQL_DB_STATE_IDLE);
+	return 1;
+}
+
+static void test_pool_disconnect(struct sql_db *db)
+{
+	sql_db_set_state(db, SQL_DB_STATE_DISCONNECTED);
+}
+
+static const char *
+test_pool_escape_string(struct sql_db *db ATTR_UNUSED, const char *string)
+{
+	return string;
+}
+
+static void test_pool_query_finish(struct test_pool_db *db)
+{
+	struct sql_result result = test_pool_result;
+
+	timeout_remove(&db->to);
+	result.db = &db->api;
+	result.refcount = 1;
+	db->callback(&result, db->context);
+	sql_db_set_state(&db->api, SQL_DB_STATE_IDLE);
+}
+
+static void test_pool_query(struct sql_db *_db, const char *query,
+			    sql_query_callback_t *callback, void *context)
+{
+	struct test_pool_db *db = (struct test_pool_db *)_db;
+
+	test_assert_strcmp(query, "SELECT foo FROM bar WHERE id = 'x'");
+	test_pool_queries++;
+
+	sql_db_set_state(_db, SQL_DB_STATE_BUSY);
+	db->callback = callback;
+	db->context = context;
+	db->to = timeout_add_short(0, test_pool_query_finish, db);
+}
+
+static struct sql_prepared_statement *
+test_pool_prepared_statement_init(struct sql_db *db,
+				  const char *query_template)
+{
+	struct sql_prepared_statement *prep_stmt;
+
+	test_pool_prepares++;
+	prep_stmt = i_new(struct sql_prepared_statement, 1);
+	prep_stmt->db = db;
+	prep_stmt->refcount = 1;
+	prep_stmt->query_template = i_strdup(query_template);
+	return prep_stmt;
+}
+
+const struct sql_db test_pool_driver = {
+	.name = "testpool",
+	.flags = SQL_DB_FLAG_POOLED | SQL_DB_FLAG_PREP_STATEMENTS,
+
+	.v = {
+		.init_full = test_pool_init_full,
+		.deinit = test_pool_deinit,
+		.connect = test_pool_connect,
+		.disconnect = test_pool_disconnect,
+		.escape_string = test_pool_escape_string,
+		.query = test_pool_query,
+		.prepared_statement_init = test_pool_prepared_statement_init,
+	}
+};
+
+static bool
+test_sqlpool_event_callback(struct event *event,
+			    enum event_callback_type type,
+			    struct failure_context *ctx ATTR_UNUSED,
+			    const char *fmt ATTR_UNUSED,
+			    va_list args ATTR_UNUSED)
+{
+	const struct event_field *field;
+
+	if (type != EVENT_CALLBACK_TYPE_SEND ||
+	    null_strcmp(event->sending_name, "sqlpool_request_finished") != 0)
+		return TRUE;
+
+	test_pool_finished_events++;
+	field = event_find_field_nonrecursive(event, "connections_in_use");
+	test_assert(field != NULL);
+	if (field != NULL && test_pool_max_in_use < field->value.intmax)
+		test_pool_max_in_use = field->value.intmax;
+	field = event_find_field_nonrecursive(event, "queue_wait_usecs");
+	test_assert(field != NULL);
+	if (field != NULL &&
+	    test_pool_max_queue_wait_usecs < field->value.intmax)
+		test_pool_max_queue_wait_usecs = field->value.intmax;
+	test_assert(event_find_field_nonrecursive(event, "error") == NULL);
+	return FALSE;
+}
+
+static void test_sqlpool_callback(struct sql_result *result,
+				  unsigned int *counter)
+{
+	test_assert(!result->failed);
+	(*counter)++;
+	io_loop_stop(current_ioloop);
+}
+
+static void test_sqlpool_idle_timeout(struct ioloop *ioloop)
+{
+	io_loop_stop(ioloop);
+}
+
+static void test_sqlpool(void)
+{
+	const struct sql_settings set = {
+		.connect_string = "maxconns=3 idle_timeout=10ms",
+	};
+	struct sql_prepared_statement *prep_stmt;
+	struct sql_statement *stmt;
+	struct event_filter *filter;
+	struct ioloop *ioloop;
+	struct timeout *to;
+	struct sql_db *db;
+	unsigned int i, finished = 0;
+	const char *error;
+
+	test_begin("sqlpool");
+	ioloop = io_loop_create();
+	event_register_callback(test_sqlpool_event_callback);
+	filter = event_filter_create();
+	test_assert(event_filter_parse("event=sqlpool_request_finished",
+				       filter, &error) == 0);
+	event_set_global_debug_log_filter(filter);
+	event_filter_unref(&filter);
+
+	test_assert(driver_sqlpool_init_full(&set, &test_pool_driver,
+					     &db, &error) == 0);
+	sql_init_common(db);
+	test_assert((sql_get_flags(db) & SQL_DB_FLAG_PREP_STATEMENTS) != 0);
+
+	/* the pool grows up to maxconns connections, and the rest of the
+	   queries wait in queue */
+	prep_stmt = sql_prepared_statement_init(db,
+		"SELECT foo FROM bar WHERE id = ?");
+	for (i = 0; i < 10; i++) {
+		stmt = sql_statement_init_prepared(prep_stmt);
+		sql_statement_bind_str(stmt, 0, "x");
+		sql_statement_query(&stmt, test_sqlpool_callback, &finished);
+	}
+	sql_prepared_statement_unref(&prep_stmt);
+	while (finished < 10)
+		io_loop_run(ioloop);
+
+	test_assert(test_pool_queries == 10);
+	test_assert(test_pool_finished_events == 10);
+	test_assert(test_pool_max_in_use == 3);
+	test_assert(test_pool_max_queue_wait_usecs >= 0);
+	/* each connection prepared the statement only once */
+	test_assert(test_pool_prepares == 3);
+
+	/* idle connections get closed, except for one per host. They prepare
+	   the statement again if they're reconnected. */
+	to = timeout_add_short(50, test_sqlpool_idle_timeout, ioloop);
+	io_loop_run(ioloop);
+	timeout_remove(&to);
+
+	stmt = sql_statement_init(db, "SELECT foo FROM bar WHERE id = ?");
+	sql_statement_bind_str(stmt, 0, "x");
+	sql_statement_query(&stmt, test_sqlpool_callback, &finished);
+	prep_stmt = sql_prepared_statement_init(db,
+		"SELECT foo FROM bar WHERE id = ?");
+	stmt = sql_statement_init_prepared(prep_stmt);
+	sql_prepared_statement_unref(&prep_stmt);
+	sql_statement_bind_str(stmt, 0, "x");
+	sql_statement_query(&stmt, test_sqlpool_callback, &finished);
+	while (finished < 12)
+		io_loop_run(ioloop);
+	test_assert(test_pool_queries == 12);
+	test_assert(test_pool_prepares == 4);
+
+	sql_unref(&db);
+	event_unset_global_debug_log_filter();
+	event_unregister_callback(test_sqlpool_event_callback);
+	io_loop_destroy(&ioloop);
+	test_end();
+}
+
 int main(void) {
 	static void (*const test_functions[])(void) = {
 		test_sql_api,
 		test_sql_stmt_api,
 		test_sql_stmt_prepared_api,
+		test_sqlpool,
 		NULL
 	};
 	return test_run(test_functions);
@@ -1,6 +1,9 @@
 /* Copyright (c) 2009-2018 Dovecot authors, see the included COPYING file */
 
 #include "lib.h"
+#include "array.h"
+#include "buffer.h"
+#include "hex-binary.h"
 #include "safe-memset.h"
 #include "iostream-openssl.h"
 #include "dovecot-openssl-common.h"
@@ -13,11 +16,25 @@
 #include <openssl/pem.h>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#include <openssl/rand.h>
+#ifdef HAVE_SSL_CTX_SET_TLSEXT_TICKET_KEY_EVP_CB
+#  include <openssl/core_names.h>
+#endif
 
 #if !defined(OPENSSL_NO_ECDH) && OPENSSL_VERSION_NUMBER >= 0x10000000L
 #  define HAVE_ECDH
 #endif
 
+#if defined(HAVE_SSL_CTX_SET_TLSEXT_TICKET_KEY_EVP_CB) || \
+    defined(SSL_CTX_set_tlsext_ticket_key_cb)
+#  define HAVE_SSL_TICKET_KEY_CB
+#endif
+
+/* Sessions are resumable only by contexts with the same session ID context.
+   Use the same fixed value everywhere so that sessions can be resumed
+   by any process sharing the ticket keys. */
+#define OPENSSL_SESSION_ID_CONTEXT "dovecot"
+
 struct ssl_iostream_password_context {
 	const char *password;
 	const char *error;
@@ -186,6 +203,135 @@ ssl_iostream_ctx_use_dh(struct ssl_iostream_context *ctx,
 	return ret;
 }
 
+#ifdef HAVE_SSL_TICKET_KEY_CB
+#ifdef HAVE_SSL_CTX_SET_TLSEXT_TICKET_KEY_EVP_CB
+typedef EVP_MAC_CTX ssl_ticket_mac_ctx_t;
+
+static int
+ssl_ticket_mac_init(EVP_MAC_CTX *hctx,
+		    const struct openssl_iostream_ticket_key *key)
+{
+	OSSL_PARAM params[] = {
+		OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST,
+						 (char *)"SHA256", 0),
+		OSSL_PARAM_construct_end()
+	};
+	return EVP_MAC_init(hctx, key->hmac_key, sizeof(key->hmac_key),
+			    params);
+}
+#else
+typedef HMAC_CTX ssl_ticket_mac_ctx_t;
+
+static int
+ssl_ticket_mac_init(HMAC_CTX *hctx,
+		    const struct openssl_iostream_ticket_key *key)
+{
+	return HMAC_Init_ex(hctx, key->hmac_key, sizeof(key->hmac_key),
+			    EVP_sha256(), NULL);
+}
+#endif
+
+static int
+ssl_ticket_key_callback(SSL *ssl, unsigned char *key_name, unsigned char *iv,
+			EVP_CIPHER_CTX *ectx, ssl_ticket_mac_ctx_t *hctx,
+			int enc)
+{
+	struct ssl_iostream *ssl_io;
+	const struct openssl_iostream_ticket_key *keys;
+	unsigned int i, count;
+
+	ssl_io = SSL_get_ex_data(ssl, dovecot_ssl_extdata_index);
+	keys = array_get(&ssl_io->ctx->ticket_keys, &count);
+	if (count == 0)
+		return 0;
+
+	if (enc == 1) {
+		/* issue a new ticket using the primary key */
+		memcpy(key_name, keys[0].name, sizeof(keys[0].name));
+		if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) != 1)
+			return -1;
+		if (EVP_EncryptInit_ex(ectx, EVP_aes_256_cbc(), NULL,
+				       keys[0].aes_key, iv) != 1 ||
+		    ssl_ticket_mac_init(hctx, &keys[0]) != 1)
+			return -1;
+		return 1;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (memcmp(key_name, keys[i].name, sizeof(keys[i].name)) == 0)
+			break;
+	}
+	if (i == count) {
+		/* unknown or already rotated out key - do a full handshake */
+		if (ssl_io->verbose)
+			i_debug("SSL: Session ticket with unknown key name");
+		return 0;
+	}
+	if (ssl_ticket_mac_init(hctx, &keys[i]) != 1 ||
+	    EVP_DecryptInit_ex(ectx, EVP_aes_256_cbc(), NULL,
+			       keys[i].aes_key, iv) != 1)
+		return -1;
+	/* ask the client to switch to a ticket issued with the primary key */
+	return i == 0 ? 1 : 2;
+}
+#endif
+
+static int
+ssl_iostream_ctx_use_ticket_keys(struct ssl_iostream_context *ctx,
+				 const struct ssl_iostream_settings *set,
+				 const char **error_r)
+{
+	const char *const *hex_keys;
+	struct openssl_iostream_ticket_key *key;
+	buffer_t *buf;
+	int ret = 0;
+
+	hex_keys = t_strsplit_spaces(set->ticket_keys, " \t\r\n");
+	if (hex_keys[0] == NULL)
+		return 0;
+#ifndef HAVE_SSL_TICKET_KEY_CB
+	*error_r = "ssl_ticket_keys is set, but the linked OpenSSL version "
+		"does not support it";
+	return -1;
+#else
+	p_array_init(&ctx->ticket_keys, ctx->pool,
+		     str_array_length(hex_keys));
+	buf = t_buffer_create(OPENSSL_TICKET_KEY_SIZE);
+	for (; *hex_keys != NULL; hex_keys++) {
+		buffer_set_used_size(buf, 0);
+		if (hex_to_binary(*hex_keys, buf) < 0 ||
+		    buf->used != OPENSSL_TICKET_KEY_SIZE) {
+			*error_r = t_strdup_printf(
+				"Invalid session ticket key (ssl_ticket_keys "
+				"setting): Expected %u hex encoded bytes",
+				OPENSSL_TICKET_KEY_SIZE);
+			ret = -1;
+			break;
+		}
+		key = array_append_space(&ctx->ticket_keys);
+		i_assert(sizeof(*key) == OPENSSL_TICKET_KEY_SIZE);
+		memcpy(key, buf->data, sizeof(*key));
+	}
+	safe_memset(buffer_get_modifiable_data(buf, NULL), 0, buf->used);
+	if (ret < 0)
+		return -1;
+
+#ifdef HAVE_SSL_CTX_SET_TLSEXT_TICKET_KEY_EVP_CB
+	if (SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx->ssl_ctx,
+			ssl_ticket_key_callback) != 1) {
+#else
+	if (SSL_CTX_set_tlsext_ticket_key_cb(ctx->ssl_ctx,
+			ssl_ticket_key_callback) != 1) {
+#endif
+		*error_r = t_strdup_printf(
+			"Can't set session ticket key callback: %s",
+			openssl_iostream_error());
+		return -1;
+	}
+	return 0;
+#endif
+}
+
 static int ssl_ctx_use_certificate_chain(SSL_CTX *ctx, const char *cert)
 {
 	/* mostly just copy&pasted from SSL_CTX_use_certificate_chain_file() */
@@ -478,6 +624,20 @@ ssl_iostream_context_set(struct ssl_iostream_context *ctx,
 		if (ssl_iostream_ctx_use_dh(ctx, set, error_r) < 0)
 			return -1;
 	}
+	if (!ctx->client_ctx) {
+		if (SSL_CTX_set_session_id_context(ctx->ssl_ctx,
+				(const unsigned char *)OPENSSL_SESSION_ID_CONTEXT,
+				strlen(OPENSSL_SESSION_ID_CONTEXT)) != 1) {
+			*error_r = t_strdup_printf(
+				"Can't set session ID context: %s",
+				openssl_iostream_error());
+			return -1;
+		}
+	}
+	if (set->ticket_keys != NULL && set->tickets && !ctx->client_ctx) {
+		if (ssl_iostream_ctx_use_ticket_keys(ctx, set, error_r) < 0)
+			return -1;
+	}
 
 	/* set trusted CA certs */
 	if (set->verify_remote_cert) {
@@ -710,6 +870,13 @@ void openssl_iostream_context_unref(struct ssl_iostream_context *ctx)
 		return;
 
 	SSL_CTX_free(ctx->ssl_ctx);
+	if (array_is_created(&ctx->ticket_keys)) {
+		struct openssl_iostream_ticket_key *keys;
+		unsigned int count;
+
+		keys = array_get_modifiable(&ctx->ticket_keys, &count);
+		safe_memset(keys, 0, sizeof(*keys) * count);
+	}
 	pool_unref(&ctx->pool);
 	i_free(ctx);
 }
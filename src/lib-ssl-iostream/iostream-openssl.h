@@ -16,12 +16,27 @@ enum openssl_iostream_sync_type {
 	OPENSSL_IOSTREAM_SYNC_TYPE_HANDSHAKE
 };
 
+/* RFC 5077 style session ticket key: 16 byte name, 32 byte HMAC-SHA256
+   key and 32 byte AES-256 key. */
+#define OPENSSL_TICKET_KEY_NAME_SIZE 16
+#define OPENSSL_TICKET_KEY_SECRET_SIZE 32
+#define OPENSSL_TICKET_KEY_SIZE \
+	(OPENSSL_TICKET_KEY_NAME_SIZE + 2*OPENSSL_TICKET_KEY_SECRET_SIZE)
+
+struct openssl_iostream_ticket_key {
+	unsigned char name[OPENSSL_TICKET_KEY_NAME_SIZE];
+	unsigned char hmac_key[OPENSSL_TICKET_KEY_SECRET_SIZE];
+	unsigned char aes_key[OPENSSL_TICKET_KEY_SECRET_SIZE];
+};
+
 struct ssl_iostream_context {
 	int refcount;
 	SSL_CTX *ssl_ctx;
 
 	pool_t pool;
 	struct ssl_iostream_settings set;
+	/* Shared session ticket keys. The first one is used for encryption. */
+	ARRAY(struct openssl_iostream_ticket_key) ticket_keys;
 
 	int username_nid;
 
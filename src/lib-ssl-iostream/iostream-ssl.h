@@ -24,6 +24,10 @@ struct ssl_iostream_settings {
 	struct ssl_iostream_cert cert; /* both */
 	struct ssl_iostream_cert alt_cert; /* both */
 	const char *dh; /* context-only */
+	/* Space-separated list of hex-encoded TLS session ticket keys.
+	   The first key is used for issuing new tickets, the rest are
+	   accepted only for resuming existing sessions. */
+	const char *ticket_keys; /* context-only */
 	const char *cert_username_field; /* both */
 	const char *crypto_device; /* context-only */
 
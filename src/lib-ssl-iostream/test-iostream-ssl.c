@@ -2,6 +2,7 @@
 
 #include "test-lib.h"
 #include "buffer.h"
+#include "str.h"
 #include "randgen.h"
 #include "istream.h"
 #include "ostream.h"
@@ -544,12 +545,153 @@ static void test_iostream_ssl_small_packets(void)
 	test_end();
 }
 
+static int
+test_iostream_ssl_resume_real(struct ssl_iostream_context *server_ctx,
+			      struct ssl_iostream_context *client_ctx,
+			      const struct ssl_iostream_settings *server_set,
+			      const struct ssl_iostream_settings *client_set,
+			      SSL_SESSION **session, bool *reused_r)
+{
+	struct test_endpoint *server, *client;
+	const char *error;
+	int fd[2], ret = 0;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fd) < 0)
+		i_fatal("socketpair() failed: %m");
+	fd_set_nonblock(fd[0], TRUE);
+	fd_set_nonblock(fd[1], TRUE);
+
+	server = create_test_endpoint(fd[0], server_set);
+	client = create_test_endpoint(fd[1], client_set);
+	client->client = TRUE;
+	server->other = client;
+	client->other = server;
+
+	test_assert(io_stream_create_ssl_server(server_ctx, server->set,
+						&server->input, &server->output,
+						&server->iostream, &error) == 0);
+	test_assert(io_stream_create_ssl_client(client_ctx, "localhost",
+						client->set,
+						&client->input, &client->output,
+						&client->iostream, &error) == 0);
+	/* TLSv1.2 sends the ticket as part of the handshake, so the session
+	   is resumable as soon as the handshake finishes. */
+	SSL_set_max_proto_version(client->iostream->ssl, TLS1_2_VERSION);
+	if (*session != NULL)
+		SSL_set_session(client->iostream->ssl, *session);
+
+	client->io = io_add_istream(client->input, handshake_input_callback, client);
+	server->io = io_add_istream(server->input, handshake_input_callback, server);
+
+	if (ssl_iostream_handshake(client->iostream) < 0)
+		ret = -1;
+	else
+		io_loop_run(current_ioloop);
+	if (client->failed || server->failed)
+		ret = -1;
+
+	*reused_r = SSL_session_reused(client->iostream->ssl) == 1;
+	if (*session == NULL)
+		*session = SSL_get1_session(client->iostream->ssl);
+
+	i_stream_unref(&server->input);
+	o_stream_unref(&server->output);
+	i_stream_unref(&client->input);
+	o_stream_unref(&client->output);
+
+	destroy_test_endpoint(&client);
+	destroy_test_endpoint(&server);
+	return ret;
+}
+
+static const char *test_ticket_key(unsigned char seed)
+{
+	string_t *str = t_str_new(OPENSSL_TICKET_KEY_SIZE * 2);
+
+	for (unsigned int i = 0; i < OPENSSL_TICKET_KEY_SIZE; i++)
+		str_printfa(str, "%02x", (unsigned char)(seed + i));
+	return str_c(str);
+}
+
+static void test_iostream_ssl_session_tickets(void)
+{
+	const char *key1 = test_ticket_key(1);
+	const char *key2 = test_ticket_key(2);
+	const struct {
+		const char *ticket_keys;
+		bool resumed;
+	} tests[] = {
+		/* same keys in a different process */
+		{ key1, TRUE },
+		/* rotated: old key is still accepted */
+		{ t_strconcat(key2, " ", key1, NULL), TRUE },
+		/* old key dropped */
+		{ key2, FALSE },
+		/* process specific random keys */
+		{ NULL, FALSE },
+	};
+	struct ssl_iostream_settings server_set, client_set;
+	struct ssl_iostream_context *server_ctx, *client_ctx;
+	struct ioloop *ioloop;
+	SSL_SESSION *session = NULL;
+	const char *error;
+	bool reused;
+
+	test_begin("ssl: shared session ticket keys");
+
+	ioloop = io_loop_create();
+
+	ssl_iostream_test_settings_server(&server_set);
+	server_set.tickets = TRUE;
+	ssl_iostream_test_settings_client(&client_set);
+	client_set.tickets = TRUE;
+	client_set.allow_invalid_cert = TRUE;
+	test_assert(ssl_iostream_context_init_client(&client_set, &client_ctx,
+						     &error) == 0);
+
+	/* full handshake with the first server */
+	server_set.ticket_keys = key1;
+	test_assert(ssl_iostream_context_init_server(&server_set, &server_ctx,
+						     &error) == 0);
+	test_assert(test_iostream_ssl_resume_real(server_ctx, client_ctx,
+						  &server_set, &client_set,
+						  &session, &reused) == 0);
+	test_assert(!reused);
+	test_assert(session != NULL);
+	ssl_iostream_context_unref(&server_ctx);
+
+	/* resume the session with other servers */
+	for (unsigned int i = 0; i < N_ELEMENTS(tests); i++) {
+		server_set.ticket_keys = tests[i].ticket_keys;
+		test_assert_idx(ssl_iostream_context_init_server(&server_set,
+				&server_ctx, &error) == 0, i);
+		test_assert_idx(test_iostream_ssl_resume_real(server_ctx,
+				client_ctx, &server_set, &client_set,
+				&session, &reused) == 0, i);
+		test_assert_idx(reused == tests[i].resumed, i);
+		ssl_iostream_context_unref(&server_ctx);
+	}
+
+	/* invalid keys */
+	server_set.ticket_keys = "0123456789";
+	test_assert(ssl_iostream_context_init_server(&server_set, &server_ctx,
+						     &error) < 0);
+	test_assert(strstr(error, "ssl_ticket_keys") != NULL);
+
+	SSL_SESSION_free(session);
+	ssl_iostream_context_unref(&client_ctx);
+	io_loop_destroy(&ioloop);
+
+	test_end();
+}
+
 int main(void)
 {
 	static void (*const test_functions[])(void) = {
 		test_iostream_ssl_handshake,
 		test_iostream_ssl_get_buffer_avail_size,
 		test_iostream_ssl_small_packets,
+		test_iostream_ssl_session_tickets,
 		NULL
 	};
 	ssl_iostream_openssl_init();
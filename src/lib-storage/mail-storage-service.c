@@ -64,6 +64,10 @@ struct mail_storage_service_ctx {
 	pool_t userdb_next_pool;
 	const char *const **userdb_next_fieldsp;
 
+	/* mail_plugin_dir and mail_plugins of the last successful
+	   mail_storage_service_load_modules() call */
+	char *loaded_plugin_dir, *loaded_plugins;
+
 	bool debug:1;
 	bool log_initialized:1;
 	bool config_permission_denied:1;
@@ -1145,6 +1149,12 @@ mail_storage_service_load_modules(struct mail_storage_service_ctx *ctx,
 		return 0;
 	if ((ctx->flags & MAIL_STORAGE_SERVICE_FLAG_NO_PLUGINS) != 0)
 		return 0;
+	if (null_strcmp(user_set->mail_plugins, ctx->loaded_plugins) == 0 &&
+	    null_strcmp(user_set->mail_plugin_dir, ctx->loaded_plugin_dir) == 0) {
+		/* Usually all users have the same plugins. Avoid going
+		   through them again for each user lookup. */
+		return 0;
+	}
 
 	i_zero(&mod_set);
 	mod_set.abi_version = DOVECOT_ABI_VERSION;
@@ -1153,10 +1163,52 @@ mail_storage_service_load_modules(struct mail_storage_service_ctx *ctx,
 	mod_set.require_init_funcs = TRUE;
 	mod_set.debug = mail_user_set_get_mail_debug(user_info, user_set);
 
-	return module_dir_try_load_missing(&mail_storage_service_modules,
-					   user_set->mail_plugin_dir,
-					   user_set->mail_plugins,
-					   &mod_set, error_r);
+	if (module_dir_try_load_missing(&mail_storage_service_modules,
+					user_set->mail_plugin_dir,
+					user_set->mail_plugins,
+					&mod_set, error_r) < 0)
+		return -1;
+	i_free(ctx->loaded_plugin_dir);
+	i_free(ctx->loaded_plugins);
+	ctx->loaded_plugin_dir = i_strdup(user_set->mail_plugin_dir);
+	ctx->loaded_plugins = i_strdup(user_set->mail_plugins);
+	return 0;
+}
+
+static int
+mail_storage_service_read_user_set(struct mail_storage_service_ctx *ctx,
+				   const struct mail_storage_service_input *input,
+				   pool_t pool,
+				   const struct setting_parser_info **user_info_r,
+				   const struct setting_parser_context **parser_r,
+				   const struct mail_user_settings **user_set_r,
+				   const char **error_r)
+{
+	void **sets;
+
+	if (mail_storage_service_read_settings(ctx, input, pool, user_info_r,
+					       parser_r, error_r) < 0)
+		return -1;
+	sets = master_service_settings_parser_get_others(master_service,
+							 *parser_r);
+	*user_set_r = sets[0];
+	return 0;
+}
+
+static int
+mail_storage_service_init_global(struct mail_storage_service_ctx *ctx,
+				 const struct setting_parser_info *user_info,
+				 const struct mail_user_settings *user_set,
+				 enum mail_storage_service_flags flags,
+				 bool load_modules, const char **error_r)
+{
+	if (ctx->conn == NULL)
+		mail_storage_service_first_init(ctx, user_info, user_set, flags);
+	if (!load_modules)
+		return 0;
+	/* load global plugins */
+	return mail_storage_service_load_modules(ctx, user_info, user_set,
+						 error_r);
 }
 
 static int extra_field_key_cmp_p(const char *const *s1, const char *const *s2)
@@ -1239,9 +1291,9 @@ mail_storage_service_lookup_real(struct mail_storage_service_ctx *ctx,
 		mail_storage_service_seteuid_root();
 	}
 
-	if (mail_storage_service_read_settings(ctx, input, user_pool,
+	if (mail_storage_service_read_user_set(ctx, input, user_pool,
 					       &user_info, &set_parser,
-					       error_r) < 0) {
+					       &user_set, error_r) < 0) {
 		if (ctx->config_permission_denied) {
 			/* just restart and maybe next time we will open the
 			   config socket before dropping privileges */
@@ -1260,17 +1312,12 @@ mail_storage_service_lookup_real(struct mail_storage_service_ctx *ctx,
 						    ctx->default_log_prefix);
 		update_log_prefix = TRUE;
 	}
-	sets = master_service_settings_parser_get_others(master_service,
-							 set_parser);
-	user_set = sets[0];
 
 	if (update_log_prefix)
 		mail_storage_service_set_log_prefix(ctx, user_set, NULL, input, NULL);
 
-	if (ctx->conn == NULL)
-		mail_storage_service_first_init(ctx, user_info, user_set, flags);
-	/* load global plugins */
-	if (mail_storage_service_load_modules(ctx, user_info, user_set, error_r) < 0) {
+	if (mail_storage_service_init_global(ctx, user_info, user_set, flags,
+					     TRUE, error_r) < 0) {
 		pool_unref(&user_pool);
 		return -1;
 	}
@@ -1652,22 +1699,41 @@ void mail_storage_service_init_settings(struct mail_storage_service_ctx *ctx,
 	const struct setting_parser_context *set_parser;
 	const char *error;
 	pool_t temp_pool;
-	void **sets;
 
 	if (ctx->conn != NULL)
 		return;
 
 	temp_pool = pool_alloconly_create("service all settings", 4096);
-	if (mail_storage_service_read_settings(ctx, input, temp_pool,
+	if (mail_storage_service_read_user_set(ctx, input, temp_pool,
 					       &user_info, &set_parser,
-					       &error) < 0)
+					       &user_set, &error) < 0)
 		i_fatal("%s", error);
-	sets = master_service_settings_parser_get_others(master_service,
-							 set_parser);
-	user_set = sets[0];
+	(void)mail_storage_service_init_global(ctx, user_info, user_set,
+					       ctx->flags, FALSE, &error);
+	pool_unref(&temp_pool);
+}
+
+int mail_storage_service_preload(struct mail_storage_service_ctx *ctx,
+				 const struct mail_storage_service_input *input,
+				 const char **error_r)
+{
+	const struct setting_parser_info *user_info;
+	const struct mail_user_settings *user_set;
+	const struct setting_parser_context *set_parser;
+	pool_t temp_pool;
+	int ret;
 
-	mail_storage_service_first_init(ctx, user_info, user_set, ctx->flags);
+	temp_pool = pool_alloconly_create("service preload settings", 4096);
+	ret = mail_storage_service_read_user_set(ctx, input, temp_pool,
+						 &user_info, &set_parser,
+						 &user_set, error_r);
+	if (ret == 0) {
+		ret = mail_storage_service_init_global(ctx, user_info,
+						       user_set, ctx->flags,
+						       TRUE, error_r);
+	}
 	pool_unref(&temp_pool);
+	return ret;
 }
 
 static int
@@ -1728,6 +1794,8 @@ void mail_storage_service_deinit(struct mail_storage_service_ctx **_ctx)
 
 	if (storage_service_global == ctx)
 		storage_service_global = NULL;
+	i_free(ctx->loaded_plugin_dir);
+	i_free(ctx->loaded_plugins);
 	pool_unref(&ctx->pool);
 
 	module_dir_unload(&mail_storage_service_modules);
@@ -97,6 +97,14 @@ int mail_storage_service_read_settings(struct mail_storage_service_ctx *ctx,
 void mail_storage_service_init_settings(struct mail_storage_service_ctx *ctx,
 					const struct mail_storage_service_input *input)
 	ATTR_NULL(2);
+/* Read the global settings, create the auth connection and load the global
+   mail_plugins before any user has been looked up. This moves the work away
+   from the first mail_storage_service_lookup() call in processes that are
+   created in advance, e.g. with service { process_min_avail }. Returns 0 if
+   ok, -1 on error. */
+int mail_storage_service_preload(struct mail_storage_service_ctx *ctx,
+				 const struct mail_storage_service_input *input,
+				 const char **error_r);
 /* Returns 1 if ok, 0 if user wasn't found, -1 if fatal error,
    -2 if error is user-specific (e.g. invalid settings). */
 int mail_storage_service_lookup(struct mail_storage_service_ctx *ctx,
@@ -0,0 +1,179 @@
+/* Copyright (c) 2023 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "time-util.h"
+#include "strnum.h"
+#include "event-filter.h"
+
+#include <stdio.h>
+
+/**
+ * Measures how fast events are matched against a filter that has a similar
+ * number of queries as a configuration with a few dozen stats metrics. The
+ * queries use the same kinds of expressions as test-event-filter.c: event
+ * names, wildcards, fields and categories.
+ *
+ * For comparison, the same queries are also matched one by one as separate
+ * single-query filters.
+ */
+
+#define BENCH_DEFAULT_ITERATIONS 1000000
+#define BENCH_NAMED_QUERY_COUNT 40
+#define BENCH_QUERY_COUNT \
+	(BENCH_NAMED_QUERY_COUNT + N_ELEMENTS(bench_generic_queries))
+
+static struct event_category bench_category = {
+	.name = "bench",
+};
+
+static const char *const bench_generic_queries[] = {
+	"category=bench AND str=value",
+	"event=bench_wildcard_* AND num>10",
+	"str=other OR category=error",
+};
+
+static void
+bench_filter_add(struct event_filter *filter, const char *query,
+		 void *context)
+{
+	struct event_filter *tmp = event_filter_create();
+	const char *error;
+
+	if (event_filter_parse(query, tmp, &error) < 0)
+		i_fatal("Failed to parse filter '%s': %s", query, error);
+	event_filter_merge_with_context(filter, tmp, context);
+	event_filter_unref(&tmp);
+}
+
+static const char *bench_query(unsigned int idx)
+{
+	if (idx < BENCH_NAMED_QUERY_COUNT)
+		return t_strdup_printf("event=bench_%u AND str=value", idx);
+	return bench_generic_queries[idx - BENCH_NAMED_QUERY_COUNT];
+}
+
+static struct event_filter *bench_filter_create(void)
+{
+	struct event_filter *filter = event_filter_create();
+	unsigned int i;
+
+	for (i = 0; i < BENCH_QUERY_COUNT; i++) T_BEGIN {
+		bench_filter_add(filter, bench_query(i), POINTER_CAST(i + 1));
+	} T_END;
+	return filter;
+}
+
+static struct event_filter **bench_separate_filters_create(void)
+{
+	struct event_filter **filters;
+	unsigned int i;
+
+	filters = i_new(struct event_filter *, BENCH_QUERY_COUNT);
+	for (i = 0; i < BENCH_QUERY_COUNT; i++) T_BEGIN {
+		filters[i] = event_filter_create();
+		bench_filter_add(filters[i], bench_query(i),
+				 POINTER_CAST(i + 1));
+	} T_END;
+	return filters;
+}
+
+static void bench_separate_filters_free(struct event_filter **filters)
+{
+	unsigned int i;
+
+	for (i = 0; i < BENCH_QUERY_COUNT; i++)
+		event_filter_unref(&filters[i]);
+	i_free(filters);
+}
+
+static void
+bench_result(const char *name, uint64_t ts_start, unsigned int matches,
+	     unsigned int iterations)
+{
+	uint64_t diff = i_nanoseconds() - ts_start;
+
+	printf("%-32s %10u matches %10.3f ms %12.0f events/sec\n",
+	       name, matches, diff / 1000000.0,
+	       iterations / (diff / 1000000000.0));
+}
+
+static void
+bench_match(struct event_filter *filter, struct event *event,
+	    const char *name, unsigned int iterations)
+{
+	const struct failure_context failure_ctx = {
+		.type = LOG_TYPE_DEBUG
+	};
+	struct event_filter_match_iter *iter;
+	unsigned int i, matches = 0;
+	uint64_t ts = i_nanoseconds();
+
+	for (i = 0; i < iterations; i++) {
+		iter = event_filter_match_iter_init(filter, event,
+						    &failure_ctx);
+		while (event_filter_match_iter_next(iter) != NULL)
+			matches++;
+		event_filter_match_iter_deinit(&iter);
+	}
+	bench_result(name, ts, matches, iterations);
+}
+
+static void
+bench_match_separate(struct event_filter **filters, struct event *event,
+		     const char *name, unsigned int iterations)
+{
+	const struct failure_context failure_ctx = {
+		.type = LOG_TYPE_DEBUG
+	};
+	unsigned int i, j, matches = 0;
+	uint64_t ts = i_nanoseconds();
+
+	for (i = 0; i < iterations; i++) {
+		for (j = 0; j < BENCH_QUERY_COUNT; j++) {
+			if (event_filter_match(filters[j], event,
+					       &failure_ctx))
+				matches++;
+		}
+	}
+	bench_result(t_strconcat(name, " (separate)", NULL),
+		     ts, matches, iterations);
+}
+
+int main(int argc, char *argv[])
+{
+	struct ioloop *ioloop;
+	struct event_filter *filter, **separate_filters;
+	struct event *event;
+	const char *const names[] = {
+		"bench_1", "bench_wildcard_1", "unknown"
+	};
+	unsigned int i;
+	unsigned int iterations = BENCH_DEFAULT_ITERATIONS;
+
+	lib_init();
+	if (argc > 1 && str_to_uint(argv[1], &iterations) < 0)
+		i_fatal("Usage: %s [<iterations>]", argv[0]);
+	ioloop = io_loop_create();
+	filter = bench_filter_create();
+	separate_filters = bench_separate_filters_create();
+
+	event = event_create(NULL);
+	event_add_category(event, &bench_category);
+	event_add_str(event, "str", "value");
+	event_add_int(event, "num", 20);
+
+	for (i = 0; i < N_ELEMENTS(names); i++) T_BEGIN {
+		event_set_name(event, names[i]);
+		bench_match(filter, event, names[i], iterations);
+		bench_match_separate(separate_filters, event, names[i],
+				     iterations);
+	} T_END;
+
+	event_unref(&event);
+	event_filter_unref(&filter);
+	bench_separate_filters_free(separate_filters);
+	io_loop_destroy(&ioloop);
+	lib_deinit();
+	return 0;
+}
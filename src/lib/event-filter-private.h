@@ -1,6 +1,7 @@
 #ifndef EVENT_FILTER_PRIVATE_H
 #define EVENT_FILTER_PRIVATE_H
 
+#include "hash.h"
 #include "event-filter.h"
 
 enum event_filter_node_op {
@@ -24,8 +25,20 @@ struct event_filter {
 	int refcount;
 	ARRAY(struct event_filter_query_internal) queries;
 
+	/* Dispatch table built from the queries by event_filter_compile()
+	   when the filter is used for matching. Queries that can match only
+	   a known set of event names are looked up by the event name, so
+	   events don't need to be evaluated against the unrelated queries.
+	   The table is rebuilt whenever the queries change. */
+	pool_t compiled_pool;
+	/* event name => query indexes */
+	HASH_TABLE(const char *, ARRAY_TYPE(uint) *) compiled_names;
+	/* indexes of queries that may match any event name */
+	ARRAY_TYPE(uint) compiled_any_name;
+
 	bool fragment;
 	bool named_queries_only;
+	bool compiled;
 };
 
 enum event_filter_node_type {
@@ -41,6 +41,8 @@ struct event_filter_query_internal {
 
 static struct event_filter *event_filters = NULL;
 
+static void event_filter_compiled_free(struct event_filter *filter);
+
 static struct event_filter *event_filter_create_real(pool_t pool, bool fragment)
 {
 	struct event_filter *filter;
@@ -86,6 +88,7 @@ void event_filter_unref(struct event_filter **_filter)
 
 	if (!filter->fragment) {
 		DLLIST_REMOVE(&event_filters, filter);
+		event_filter_compiled_free(filter);
 
 		/* fragments' pools are freed by the consumer */
 		pool_unref(&filter->pool);
@@ -186,6 +189,7 @@ int event_filter_parse(const char *str, struct event_filter *filter,
 
 		filter->named_queries_only = filter->named_queries_only &&
 			filter_node_requires_event_name(state.output);
+		event_filter_compiled_free(filter);
 	} else if (ret != 0) {
 		/* error */
 		i_assert(state.error != NULL);
@@ -261,6 +265,7 @@ event_filter_merge_with_context_internal(struct event_filter *dest,
 {
 	const struct event_filter_query_internal *int_query;
 
+	event_filter_compiled_free(dest);
 	array_foreach(&src->queries, int_query) T_BEGIN {
 		void *context = with_context ? new_context : int_query->context;
 		struct event_filter_query_internal *new;
@@ -283,6 +288,7 @@ bool event_filter_remove_queries_with_context(struct event_filter *filter,
 		if (int_query->context == context) {
 			idx = array_foreach_idx(&filter->queries, int_query);
 			array_delete(&filter->queries, idx, 1);
+			event_filter_compiled_free(filter);
 			return TRUE;
 		}
 	}
@@ -698,6 +704,114 @@ event_filter_query_match(const struct event_filter_query_internal *query,
 					     source_linenum, log_type);
 }
 
+/* Returns TRUE if the node can match only events whose name is one of the
+   names added to the array. */
+static bool
+filter_node_get_event_names(struct event_filter_node *node,
+			    ARRAY_TYPE(const_string) *names)
+{
+	unsigned int old_count = array_count(names);
+
+	switch (node->op) {
+	case EVENT_FILTER_OP_NOT:
+		return FALSE;
+	case EVENT_FILTER_OP_AND:
+		if (filter_node_get_event_names(node->children[0], names))
+			return TRUE;
+		array_delete(names, old_count, array_count(names) - old_count);
+		if (filter_node_get_event_names(node->children[1], names))
+			return TRUE;
+		array_delete(names, old_count, array_count(names) - old_count);
+		return FALSE;
+	case EVENT_FILTER_OP_OR:
+		if (filter_node_get_event_names(node->children[0], names) &&
+		    filter_node_get_event_names(node->children[1], names))
+			return TRUE;
+		array_delete(names, old_count, array_count(names) - old_count);
+		return FALSE;
+	default:
+		if (node->type != EVENT_FILTER_NODE_TYPE_EVENT_NAME_EXACT ||
+		    node->op != EVENT_FILTER_OP_CMP_EQ)
+			return FALSE;
+		array_push_back(names, &node->str);
+		return TRUE;
+	}
+}
+
+static void
+event_filter_compile_query(struct event_filter *filter,
+			   const struct event_filter_query_internal *query,
+			   unsigned int query_idx)
+{
+	ARRAY_TYPE(const_string) names;
+	ARRAY_TYPE(uint) *query_idxs;
+	const char *name;
+
+	t_array_init(&names, 8);
+	if (!filter_node_get_event_names(query->expr, &names)) {
+		array_push_back(&filter->compiled_any_name, &query_idx);
+		return;
+	}
+
+	array_foreach_elem(&names, name) {
+		query_idxs = hash_table_lookup(filter->compiled_names, name);
+		if (query_idxs == NULL) {
+			query_idxs = p_new(filter->compiled_pool,
+					   ARRAY_TYPE(uint), 1);
+			p_array_init(query_idxs, filter->compiled_pool, 2);
+			hash_table_insert(filter->compiled_names, name,
+					  query_idxs);
+		}
+		/* the same name may be in the query multiple times */
+		if (array_count(query_idxs) == 0 ||
+		    *array_back(query_idxs) != query_idx)
+			array_push_back(query_idxs, &query_idx);
+	}
+}
+
+static void event_filter_compile(struct event_filter *filter)
+{
+	const struct event_filter_query_internal *query;
+
+	i_assert(!filter->compiled);
+
+	filter->compiled_pool =
+		pool_alloconly_create("event filter compiled", 1024);
+	hash_table_create(&filter->compiled_names, filter->compiled_pool, 0,
+			  str_hash, strcmp);
+	p_array_init(&filter->compiled_any_name, filter->compiled_pool, 4);
+
+	/* The query indexes are added in ascending order. This keeps the
+	   match iterator returning the queries in their original order. */
+	array_foreach(&filter->queries, query) T_BEGIN {
+		event_filter_compile_query(filter, query,
+			array_foreach_idx(&filter->queries, query));
+	} T_END;
+	filter->compiled = TRUE;
+}
+
+static void event_filter_compiled_free(struct event_filter *filter)
+{
+	if (!filter->compiled)
+		return;
+
+	hash_table_destroy(&filter->compiled_names);
+	pool_unref(&filter->compiled_pool);
+	filter->compiled = FALSE;
+}
+
+static const ARRAY_TYPE(uint) *
+event_filter_get_named_queries(struct event_filter *filter,
+			       struct event *event)
+{
+	if (!filter->compiled)
+		event_filter_compile(filter);
+	if (event->sending_name == NULL)
+		return NULL;
+	return hash_table_lookup(filter->compiled_names,
+				 (const char *)event->sending_name);
+}
+
 static bool
 event_filter_match_fastpath(struct event_filter *filter, struct event *event)
 {
@@ -724,15 +838,28 @@ bool event_filter_match_source(struct event_filter *filter, struct event *event,
 			       unsigned int source_linenum,
 			       const struct failure_context *ctx)
 {
-	const struct event_filter_query_internal *query;
+	const struct event_filter_query_internal *queries;
+	const ARRAY_TYPE(uint) *named_queries;
+	unsigned int idx, count;
 
 	i_assert(!filter->fragment);
 
 	if (!event_filter_match_fastpath(filter, event))
 		return FALSE;
 
-	array_foreach(&filter->queries, query) {
-		if (event_filter_query_match(query, event, source_filename,
+	queries = array_get(&filter->queries, &count);
+	named_queries = event_filter_get_named_queries(filter, event);
+	if (named_queries != NULL) {
+		array_foreach_elem(named_queries, idx) {
+			if (event_filter_query_match(&queries[idx], event,
+						     source_filename,
+						     source_linenum, ctx))
+				return TRUE;
+		}
+	}
+	array_foreach_elem(&filter->compiled_any_name, idx) {
+		if (event_filter_query_match(&queries[idx], event,
+					     source_filename,
 					     source_linenum, ctx))
 			return TRUE;
 	}
@@ -743,7 +870,12 @@ struct event_filter_match_iter {
 	struct event_filter *filter;
 	struct event *event;
 	const struct failure_context *failure_ctx;
-	unsigned int idx;
+	/* Query indexes specific to the event's name. Both these and the
+	   compiled_any_name indexes are in ascending order, so they are
+	   merged to iterate the queries in their original order. */
+	const ARRAY_TYPE(uint) *named_queries;
+	unsigned int named_idx, any_name_idx;
+	bool finished;
 };
 
 struct event_filter_match_iter *
@@ -759,21 +891,49 @@ event_filter_match_iter_init(struct event_filter *filter, struct event *event,
 	iter->event = event;
 	iter->failure_ctx = ctx;
 	if (!event_filter_match_fastpath(filter, event))
-		iter->idx = UINT_MAX;
+		iter->finished = TRUE;
+	else
+		iter->named_queries = event_filter_get_named_queries(filter, event);
 	return iter;
 }
 
+static bool
+event_filter_match_iter_next_idx(struct event_filter_match_iter *iter,
+				 unsigned int *idx_r)
+{
+	const unsigned int *named_idxs = NULL, *any_name_idxs;
+	unsigned int named_count = 0, any_name_count;
+
+	if (iter->finished)
+		return FALSE;
+
+	if (iter->named_queries != NULL)
+		named_idxs = array_get(iter->named_queries, &named_count);
+	any_name_idxs = array_get(&iter->filter->compiled_any_name,
+				  &any_name_count);
+	if (iter->named_idx < named_count &&
+	    (iter->any_name_idx >= any_name_count ||
+	     named_idxs[iter->named_idx] < any_name_idxs[iter->any_name_idx]))
+		*idx_r = named_idxs[iter->named_idx++];
+	else if (iter->any_name_idx < any_name_count)
+		*idx_r = any_name_idxs[iter->any_name_idx++];
+	else {
+		iter->finished = TRUE;
+		return FALSE;
+	}
+	return TRUE;
+}
+
 void *event_filter_match_iter_next(struct event_filter_match_iter *iter)
 {
 	const struct event_filter_query_internal *queries;
-	unsigned int count;
+	unsigned int idx, count;
 
 	queries = array_get(&iter->filter->queries, &count);
-	while (iter->idx < count) {
-		const struct event_filter_query_internal *query =
-			&queries[iter->idx];
+	while (event_filter_match_iter_next_idx(iter, &idx)) {
+		const struct event_filter_query_internal *query = &queries[idx];
 
-		iter->idx++;
+		i_assert(idx < count);
 		if (query->context != NULL &&
 		    event_filter_query_match(query, iter->event,
 					     iter->event->source_filename,
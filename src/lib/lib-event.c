@@ -57,6 +57,9 @@ struct event_internal_category {
 	int refcount;
 };
 
+/* Maximum number of freed event pools kept for reuse */
+#define EVENT_POOL_CACHE_MAX_COUNT 16
+
 struct event_reason {
 	struct event *event;
 };
@@ -72,6 +75,11 @@ static ARRAY(struct event_internal_category *) event_registered_categories_inter
 static ARRAY(struct event_category *) event_registered_categories_representative;
 static ARRAY(struct event *) global_event_stack;
 static uint64_t event_id_counter = 0;
+/* Memory pools of freed events, which are reused by the next created
+   events. Events are created and freed so often that this noticeably
+   reduces the malloc()/free() overhead. */
+static pool_t event_pool_cache[EVENT_POOL_CACHE_MAX_COUNT];
+static unsigned int event_pool_cache_count = 0;
 
 static void get_self_rusage(struct rusage *ru_r)
 {
@@ -385,12 +393,34 @@ struct event *event_minimize(struct event *event)
 	return new_event;
 }
 
+static pool_t event_pool_get(void)
+{
+	if (event_pool_cache_count > 0)
+		return event_pool_cache[--event_pool_cache_count];
+	return pool_alloconly_create(MEMPOOL_GROWING"event", 1024);
+}
+
+static void event_pool_put(pool_t *_pool)
+{
+	pool_t pool = *_pool;
+
+	*_pool = NULL;
+	if (event_pool_cache_count == N_ELEMENTS(event_pool_cache)) {
+		pool_unref(&pool);
+		return;
+	}
+	/* This frees all but the first block and zeroes it, so the next
+	   event starts with an empty pool. */
+	p_clear(pool);
+	event_pool_cache[event_pool_cache_count++] = pool;
+}
+
 static struct event *
 event_create_internal(struct event *parent, const char *source_filename,
 		      unsigned int source_linenum)
 {
 	struct event *event;
-	pool_t pool = pool_alloconly_create(MEMPOOL_GROWING"event", 1024);
+	pool_t pool = event_pool_get();
 
 	event = p_new(pool, struct event, 1);
 	event->refcount = 1;
@@ -479,7 +509,7 @@ void event_unref(struct event **_event)
 	event_unref(&event->parent);
 
 	DLLIST_REMOVE(&events, event);
-	pool_unref(&event->pool);
+	event_pool_put(&event->pool);
 }
 
 struct event *events_get_head(void)
@@ -1761,4 +1791,6 @@ void lib_event_deinit(void)
 	array_free(&event_registered_categories_internal);
 	array_free(&event_registered_categories_representative);
 	array_free(&global_event_stack);
+	while (event_pool_cache_count > 0)
+		pool_unref(&event_pool_cache[--event_pool_cache_count]);
 }
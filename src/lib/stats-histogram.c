@@ -0,0 +1,263 @@
+/* Copyright (c) 2023 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "bits.h"
+#include "stats-histogram.h"
+
+/* Total number of buckets needed for the full uint64_t range */
+#define STATS_HISTOGRAM_MAX_BUCKETS \
+	(STATS_HISTOGRAM_SUB_BUCKET_COUNT * (64 - STATS_HISTOGRAM_SUB_BUCKET_BITS + 1))
+/* The allocated bucket range is grown in steps of this many buckets */
+#define STATS_HISTOGRAM_BUCKET_ALIGN 8
+
+struct stats_histogram {
+	unsigned int count;
+	uint64_t min;
+	uint64_t max;
+	uint64_t sum;
+	/* running mean and sum of squared differences from it
+	   (Welford's algorithm), used for calculating the variance */
+	double mean, m2;
+
+	/* buckets[i] is the number of values in bucket first_bucket+i.
+	   Only the range of buckets containing values is allocated. */
+	unsigned int first_bucket, bucket_count;
+	unsigned int *buckets;
+};
+
+static unsigned int stats_histogram_bucket_idx(uint64_t value)
+{
+	unsigned int bits = bits_required64(value);
+
+	if (bits <= STATS_HISTOGRAM_SUB_BUCKET_BITS)
+		return value;
+	/* the highest set bit selects the power of two and the following
+	   STATS_HISTOGRAM_SUB_BUCKET_BITS select the linear sub-bucket */
+	unsigned int shift = bits - 1 - STATS_HISTOGRAM_SUB_BUCKET_BITS;
+	return STATS_HISTOGRAM_SUB_BUCKET_COUNT * (shift + 1) +
+		((value >> shift) & (STATS_HISTOGRAM_SUB_BUCKET_COUNT - 1));
+}
+
+static uint64_t
+stats_histogram_bucket_value(const struct stats_histogram *hist,
+			     unsigned int idx)
+{
+	uint64_t value;
+
+	if (idx < STATS_HISTOGRAM_SUB_BUCKET_COUNT)
+		value = idx;
+	else {
+		unsigned int shift = idx / STATS_HISTOGRAM_SUB_BUCKET_COUNT - 1;
+		unsigned int sub = idx % STATS_HISTOGRAM_SUB_BUCKET_COUNT;
+		uint64_t width = 1ULL << shift;
+
+		/* use the middle of the bucket */
+		value = ((uint64_t)(STATS_HISTOGRAM_SUB_BUCKET_COUNT + sub)
+			 << shift) + (width - 1) / 2;
+	}
+	/* the min and max are exact, so don't go beyond them */
+	if (value < hist->min)
+		return hist->min;
+	if (value > hist->max)
+		return hist->max;
+	return value;
+}
+
+struct stats_histogram *stats_histogram_init(void)
+{
+	return i_new(struct stats_histogram, 1);
+}
+
+void stats_histogram_deinit(struct stats_histogram **_hist)
+{
+	struct stats_histogram *hist = *_hist;
+
+	if (hist == NULL)
+		return;
+	*_hist = NULL;
+
+	i_free(hist->buckets);
+	i_free(hist);
+}
+
+void stats_histogram_reset(struct stats_histogram *hist)
+{
+	i_free(hist->buckets);
+	i_zero(hist);
+}
+
+static void
+stats_histogram_ensure_bucket(struct stats_histogram *hist, unsigned int idx)
+{
+	unsigned int first, end, *buckets;
+
+	i_assert(idx < STATS_HISTOGRAM_MAX_BUCKETS);
+
+	first = idx & ~(STATS_HISTOGRAM_BUCKET_ALIGN - 1);
+	end = (idx | (STATS_HISTOGRAM_BUCKET_ALIGN - 1)) + 1;
+	if (hist->bucket_count > 0) {
+		if (idx >= hist->first_bucket &&
+		    idx < hist->first_bucket + hist->bucket_count)
+			return;
+		first = I_MIN(first, hist->first_bucket);
+		end = I_MAX(end, hist->first_bucket + hist->bucket_count);
+	}
+
+	buckets = i_new(unsigned int, end - first);
+	if (hist->bucket_count > 0) {
+		memcpy(buckets + (hist->first_bucket - first), hist->buckets,
+		       sizeof(*buckets) * hist->bucket_count);
+	}
+	i_free(hist->buckets);
+	hist->buckets = buckets;
+	hist->first_bucket = first;
+	hist->bucket_count = end - first;
+}
+
+void stats_histogram_add(struct stats_histogram *hist, uint64_t value)
+{
+	unsigned int idx = stats_histogram_bucket_idx(value);
+	double delta;
+
+	stats_histogram_ensure_bucket(hist, idx);
+	hist->buckets[idx - hist->first_bucket]++;
+
+	if (hist->count == 0)
+		hist->min = hist->max = value;
+	else if (hist->min > value)
+		hist->min = value;
+	else if (hist->max < value)
+		hist->max = value;
+	hist->count++;
+	hist->sum += value;
+
+	delta = value - hist->mean;
+	hist->mean += delta / hist->count;
+	hist->m2 += delta * (value - hist->mean);
+}
+
+void stats_histogram_merge(struct stats_histogram *dest,
+			   const struct stats_histogram *src)
+{
+	unsigned int i;
+
+	if (src->count == 0)
+		return;
+
+	stats_histogram_ensure_bucket(dest, src->first_bucket);
+	stats_histogram_ensure_bucket(dest, src->first_bucket +
+				      src->bucket_count - 1);
+	for (i = 0; i < src->bucket_count; i++) {
+		dest->buckets[src->first_bucket - dest->first_bucket + i] +=
+			src->buckets[i];
+	}
+
+	if (dest->count == 0) {
+		dest->min = src->min;
+		dest->max = src->max;
+		dest->mean = src->mean;
+		dest->m2 = src->m2;
+	} else {
+		double count = (double)dest->count + src->count;
+		double delta = src->mean - dest->mean;
+
+		dest->min = I_MIN(dest->min, src->min);
+		dest->max = I_MAX(dest->max, src->max);
+		dest->mean += delta * src->count / count;
+		dest->m2 += src->m2 +
+			delta * delta * dest->count * src->count / count;
+	}
+	dest->count += src->count;
+	dest->sum += src->sum;
+}
+
+unsigned int stats_histogram_get_count(const struct stats_histogram *hist)
+{
+	return hist->count;
+}
+
+uint64_t stats_histogram_get_sum(const struct stats_histogram *hist)
+{
+	return hist->sum;
+}
+
+uint64_t stats_histogram_get_min(const struct stats_histogram *hist)
+{
+	return hist->min;
+}
+
+uint64_t stats_histogram_get_max(const struct stats_histogram *hist)
+{
+	return hist->max;
+}
+
+double stats_histogram_get_avg(const struct stats_histogram *hist)
+{
+	if (hist->count == 0)
+		return 0;
+	return (double)hist->sum / hist->count;
+}
+
+double stats_histogram_get_variance(const struct stats_histogram *hist)
+{
+	if (hist->count == 0)
+		return 0;
+	return hist->m2 / hist->count;
+}
+
+/* Returns the value at the given position in the sorted list of values. */
+static uint64_t
+stats_histogram_get_nth(const struct stats_histogram *hist, unsigned int n)
+{
+	unsigned int i, seen = 0;
+
+	i_assert(n < hist->count);
+
+	/* the min and max are exact */
+	if (n == 0)
+		return hist->min;
+	if (n == hist->count - 1)
+		return hist->max;
+
+	for (i = 0; i < hist->bucket_count; i++) {
+		seen += hist->buckets[i];
+		if (seen > n)
+			break;
+	}
+	i_assert(i < hist->bucket_count);
+	return stats_histogram_bucket_value(hist, hist->first_bucket + i);
+}
+
+uint64_t stats_histogram_get_median(const struct stats_histogram *hist)
+{
+	if (hist->count == 0)
+		return 0;
+	unsigned int idx1 = (hist->count-1)/2, idx2 = hist->count/2;
+	uint64_t value1 = stats_histogram_get_nth(hist, idx1);
+	uint64_t value2 = stats_histogram_get_nth(hist, idx2);
+	return value1 + (value2 - value1) / 2;
+}
+
+uint64_t stats_histogram_get_percentile(const struct stats_histogram *hist,
+					double fraction)
+{
+	unsigned int idx;
+
+	if (hist->count == 0)
+		return 0;
+
+	/* use the same index selection as stats-dist */
+	if (fraction >= 1.)
+		idx = hist->count - 1;
+	else if (fraction <= 0.)
+		idx = 0;
+	else {
+		double idx_float = hist->count * fraction;
+		idx = idx_float;
+		idx_float -= idx;
+		/* Exact boundaries belong to the open range below them. */
+		if (idx_float < 1e-8*hist->count && idx > 0)
+			idx--;
+	}
+	return stats_histogram_get_nth(hist, idx);
+}
@@ -0,0 +1,46 @@
+#ifndef STATS_HISTOGRAM_H
+#define STATS_HISTOGRAM_H
+
+/* Log-linear histogram of uint64_t values. Each power of two is split into
+   STATS_HISTOGRAM_SUB_BUCKET_COUNT linear buckets, so the percentiles have
+   a relative error of at most 1/STATS_HISTOGRAM_SUB_BUCKET_COUNT. Values
+   smaller than STATS_HISTOGRAM_SUB_BUCKET_COUNT are counted exactly.
+   Adding a value is O(1), and the memory usage is bounded by the range of
+   the added values, not by their count. Count, sum, min, max, average and
+   variance are always exact. */
+#define STATS_HISTOGRAM_SUB_BUCKET_BITS 5
+#define STATS_HISTOGRAM_SUB_BUCKET_COUNT (1U << STATS_HISTOGRAM_SUB_BUCKET_BITS)
+
+struct stats_histogram *stats_histogram_init(void);
+void stats_histogram_deinit(struct stats_histogram **hist);
+
+/* Reset all values. */
+void stats_histogram_reset(struct stats_histogram *hist);
+
+/* Add a new value. */
+void stats_histogram_add(struct stats_histogram *hist, uint64_t value);
+/* Add all values from src to dest. The result is the same as if the values
+   had been added to dest directly. */
+void stats_histogram_merge(struct stats_histogram *dest,
+			   const struct stats_histogram *src);
+
+/* Returns number of values added. */
+unsigned int stats_histogram_get_count(const struct stats_histogram *hist);
+/* Returns the sum of all values. */
+uint64_t stats_histogram_get_sum(const struct stats_histogram *hist);
+/* Returns values' minimum. */
+uint64_t stats_histogram_get_min(const struct stats_histogram *hist);
+/* Returns values' maximum. */
+uint64_t stats_histogram_get_max(const struct stats_histogram *hist);
+/* Returns values' average. */
+double stats_histogram_get_avg(const struct stats_histogram *hist);
+/* Returns values' variance. */
+double stats_histogram_get_variance(const struct stats_histogram *hist);
+/* Returns values' approximate median. */
+uint64_t stats_histogram_get_median(const struct stats_histogram *hist);
+/* Returns values' approximate percentile. fraction parameter is in the
+   range (0., 1.], so 95th %-ile is 0.95. */
+uint64_t stats_histogram_get_percentile(const struct stats_histogram *hist,
+					double fraction);
+
+#endif
@@ -2,6 +2,7 @@
 
 #include "test-lib.h"
 #include "ioloop.h"
+#include "str.h"
 #include "event-filter-private.h"
 
 static void test_event_filter_override_parent_fields(void)
@@ -581,6 +582,92 @@ static void test_event_filter_named_separate_from_str(void)
 	test_end();
 }
 
+/* Each query's context points to a different digit in this string */
+static char test_event_filter_contexts[] = "123456789";
+
+static void
+test_event_filter_add_context(struct event_filter *filter, const char *query,
+			      unsigned int num)
+{
+	struct event_filter *tmp = event_filter_create();
+	const char *error;
+
+	test_assert(event_filter_parse(query, tmp, &error) == 0);
+	event_filter_merge_with_context(filter, tmp,
+					&test_event_filter_contexts[num-1]);
+	event_filter_unref(&tmp);
+}
+
+static void
+test_event_filter_iter_contexts(struct event_filter *filter,
+				struct event *event, const char *expected)
+{
+	const struct failure_context failure_ctx = {
+		.type = LOG_TYPE_DEBUG
+	};
+	struct event_filter_match_iter *iter;
+	string_t *str = t_str_new(32);
+	const char *context;
+
+	iter = event_filter_match_iter_init(filter, event, &failure_ctx);
+	while ((context = event_filter_match_iter_next(iter)) != NULL)
+		str_append_c(str, context[0]);
+	event_filter_match_iter_deinit(&iter);
+	test_assert_strcmp(str_c(str), expected);
+}
+
+static void test_event_filter_name_dispatch(void)
+{
+	struct event_filter *filter;
+	const struct failure_context failure_ctx = {
+		.type = LOG_TYPE_DEBUG
+	};
+
+	test_begin("event filter: event name dispatch");
+
+	filter = event_filter_create();
+	test_event_filter_add_context(filter, "event=foo", 1);
+	test_event_filter_add_context(filter, "str=str", 2);
+	test_event_filter_add_context(filter, "event=bar OR event=foo", 3);
+	test_event_filter_add_context(filter, "event=foo* AND str=str", 4);
+	test_event_filter_add_context(filter, "str=str AND event=bar", 5);
+	test_event_filter_add_context(filter, "NOT event=foo", 6);
+	test_event_filter_add_context(filter, "event=foo OR str=str", 7);
+
+	struct event *e_foo = event_create(NULL);
+	event_set_name(e_foo, "foo");
+	struct event *e_foo_str = event_create(NULL);
+	event_set_name(e_foo_str, "foo");
+	event_add_str(e_foo_str, "str", "str");
+	struct event *e_bar_str = event_create(NULL);
+	event_set_name(e_bar_str, "bar");
+	event_add_str(e_bar_str, "str", "str");
+	struct event *e_foobar = event_create(NULL);
+	event_set_name(e_foobar, "foobar");
+
+	test_event_filter_iter_contexts(filter, e_foo, "137");
+	test_event_filter_iter_contexts(filter, e_foo_str, "12347");
+	test_event_filter_iter_contexts(filter, e_bar_str, "23567");
+	test_event_filter_iter_contexts(filter, e_foobar, "6");
+
+	/* changing the filter rebuilds the dispatch table */
+	test_assert(event_filter_remove_queries_with_context(filter,
+			&test_event_filter_contexts[6-1]));
+	test_event_filter_iter_contexts(filter, e_foobar, "");
+	test_assert(!event_filter_match(filter, e_foobar, &failure_ctx));
+	test_event_filter_add_context(filter, "event=foobar", 8);
+	test_event_filter_iter_contexts(filter, e_foobar, "8");
+	test_assert(event_filter_match(filter, e_foobar, &failure_ctx));
+	test_assert(event_filter_match(filter, e_foo, &failure_ctx));
+
+	event_filter_unref(&filter);
+	event_unref(&e_foo);
+	event_unref(&e_foo_str);
+	event_unref(&e_bar_str);
+	event_unref(&e_foobar);
+	test_end();
+}
+
 void test_event_filter(void)
 {
 	test_event_filter_override_parent_fields();
@@ -595,4 +682,5 @@ void test_event_filter(void)
 	test_event_filter_named_and_str();
 	test_event_filter_named_or_str();
 	test_event_filter_named_separate_from_str();
+	test_event_filter_name_dispatch();
 }
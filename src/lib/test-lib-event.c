@@ -1,6 +1,7 @@
 /* Copyright (c) 2021 Dovecot authors, see the included COPYING file */
 
 #include "test-lib.h"
+#include "lib-event-private.h"
 
 static void test_event_strlist(void)
 {
@@ -29,6 +30,38 @@ static void test_event_strlist(void)
 	test_end();
 }
 
+static void test_event_pool_reuse(void)
+{
+	static struct event_category test_category = {
+		.name = "test",
+	};
+	unsigned int i, count;
+
+	test_begin("event pool reuse");
+	for (i = 0; i < 3; i++) {
+		struct event *e1 = event_create(NULL);
+		test_assert_idx(event_find_field_nonrecursive(e1, "key") == NULL, i);
+		(void)event_get_categories(e1, &count);
+		test_assert_idx(count == 0, i);
+		test_assert_idx(e1->sending_name == NULL, i);
+		test_assert_idx(e1->log_prefix == NULL, i);
+
+		event_add_category(e1, &test_category);
+		event_set_name(e1, "name");
+		event_set_append_log_prefix(e1, "prefix: ");
+		for (unsigned int j = 0; j < 100; j++) {
+			/* grow the pool beyond its first block */
+			event_add_str(e1, t_strdup_printf("key%u", j),
+				      t_strdup_printf("%0100u", j));
+		}
+		event_add_str(e1, "key", "value");
+		test_assert_strcmp_idx(event_find_field_recursive_str(e1, "key"),
+				       "value", i);
+		event_unref(&e1);
+	}
+	test_end();
+}
+
 static void test_lib_event_reason_code(void)
 {
 	test_begin("event reason codes");
@@ -42,6 +75,7 @@ static void test_lib_event_reason_code(void)
 void test_lib_event(void)
 {
 	test_event_strlist();
+	test_event_pool_reuse();
 	test_lib_event_reason_code();
 }
 
@@ -0,0 +1,142 @@
+/* Copyright (c) 2023 Dovecot authors, see the included COPYING file */
+
+#include "test-lib.h"
+#include "stats-histogram.h"
+#include "math.h"
+
+#define DBL_EQ(a, b) (fabs((a)-(b)) < 0.001)
+
+/* maximum relative error of the approximate percentiles */
+#define VALUE_IN_RANGE(value, expected) \
+	((value) >= (expected) - (expected) / STATS_HISTOGRAM_SUB_BUCKET_COUNT && \
+	 (value) <= (expected) + (expected) / STATS_HISTOGRAM_SUB_BUCKET_COUNT)
+
+static void test_stats_histogram_small(void)
+{
+	static const uint64_t input[] = {
+		20, 19, 18, 1, 2, 3, 4, 5, 6, 7, 8,
+		9, 10, 11, 12, 13, 14, 15, 16, 17
+	};
+	struct stats_histogram *hist;
+	unsigned int i;
+
+	test_begin("stats_histogram small values");
+	hist = stats_histogram_init();
+	test_assert(stats_histogram_get_count(hist) == 0);
+	test_assert(stats_histogram_get_median(hist) == 0);
+	test_assert(stats_histogram_get_percentile(hist, 0.95) == 0);
+	test_assert(DBL_EQ(stats_histogram_get_variance(hist), 0));
+
+	for (i = 0; i < N_ELEMENTS(input); i++)
+		stats_histogram_add(hist, input[i]);
+	/* small values are counted exactly */
+	test_assert(stats_histogram_get_count(hist) == 20);
+	test_assert(stats_histogram_get_sum(hist) == 210);
+	test_assert(stats_histogram_get_min(hist) == 1);
+	test_assert(stats_histogram_get_max(hist) == 20);
+	test_assert(DBL_EQ(stats_histogram_get_avg(hist), 10.5));
+	test_assert(DBL_EQ(stats_histogram_get_variance(hist), 33.25));
+	test_assert(stats_histogram_get_median(hist) == 10);
+	test_assert(stats_histogram_get_percentile(hist, 0.95) == 19);
+	test_assert(stats_histogram_get_percentile(hist, 1) == 20);
+	test_assert(stats_histogram_get_percentile(hist, 0) == 1);
+
+	stats_histogram_reset(hist);
+	test_assert(stats_histogram_get_count(hist) == 0);
+	test_assert(stats_histogram_get_max(hist) == 0);
+	stats_histogram_add(hist, 5);
+	test_assert(stats_histogram_get_min(hist) == 5);
+	test_assert(stats_histogram_get_median(hist) == 5);
+	stats_histogram_deinit(&hist);
+	test_end();
+}
+
+static void test_stats_histogram_large(void)
+{
+	struct stats_histogram *hist;
+	uint64_t value, expected;
+	unsigned int i;
+
+	test_begin("stats_histogram large values");
+	hist = stats_histogram_init();
+	for (i = 1; i <= 100000; i++)
+		stats_histogram_add(hist, i * 1000ULL);
+	test_assert(stats_histogram_get_count(hist) == 100000);
+	test_assert(stats_histogram_get_sum(hist) == 100000ULL*100001/2*1000);
+	test_assert(stats_histogram_get_min(hist) == 1000);
+	test_assert(stats_histogram_get_max(hist) == 100000000);
+
+	for (i = 1; i < 100; i++) {
+		value = stats_histogram_get_percentile(hist, i / 100.0);
+		expected = i * 1000ULL * 1000;
+		test_assert_idx(VALUE_IN_RANGE(value, expected), i);
+	}
+	value = stats_histogram_get_median(hist);
+	test_assert(VALUE_IN_RANGE(value, 50000500ULL));
+	test_assert(stats_histogram_get_percentile(hist, 1) == 100000000);
+
+	/* the highest values still fit */
+	stats_histogram_add(hist, UINT64_MAX);
+	test_assert(stats_histogram_get_max(hist) == UINT64_MAX);
+	test_assert(stats_histogram_get_percentile(hist, 1) == UINT64_MAX);
+	stats_histogram_deinit(&hist);
+	test_end();
+}
+
+static void test_stats_histogram_merge(void)
+{
+	struct stats_histogram *hist1, *hist2, *all;
+	unsigned int i;
+
+	test_begin("stats_histogram merge");
+	hist1 = stats_histogram_init();
+	hist2 = stats_histogram_init();
+	all = stats_histogram_init();
+
+	/* merging empty histograms does nothing */
+	stats_histogram_merge(hist1, hist2);
+	test_assert(stats_histogram_get_count(hist1) == 0);
+
+	for (i = 0; i < 1000; i++) {
+		uint64_t value = (i * 7919) % 100000;
+
+		stats_histogram_add(i % 3 == 0 ? hist1 : hist2, value);
+		stats_histogram_add(all, value);
+	}
+	stats_histogram_merge(hist1, hist2);
+	test_assert(stats_histogram_get_count(hist1) ==
+		    stats_histogram_get_count(all));
+	test_assert(stats_histogram_get_sum(hist1) ==
+		    stats_histogram_get_sum(all));
+	test_assert(stats_histogram_get_min(hist1) ==
+		    stats_histogram_get_min(all));
+	test_assert(stats_histogram_get_max(hist1) ==
+		    stats_histogram_get_max(all));
+	test_assert(fabs(stats_histogram_get_variance(hist1) -
+			 stats_histogram_get_variance(all)) <
+		    stats_histogram_get_variance(all) * 1e-9);
+	for (i = 1; i <= 100; i++) {
+		test_assert_idx(stats_histogram_get_percentile(hist1, i / 100.0) ==
+				stats_histogram_get_percentile(all, i / 100.0), i);
+	}
+
+	/* merging into an empty histogram copies it */
+	stats_histogram_reset(hist2);
+	stats_histogram_merge(hist2, all);
+	test_assert(stats_histogram_get_median(hist2) ==
+		    stats_histogram_get_median(all));
+	test_assert(DBL_EQ(stats_histogram_get_variance(hist2),
+			   stats_histogram_get_variance(all)));
+
+	stats_histogram_deinit(&hist1);
+	stats_histogram_deinit(&hist2);
+	stats_histogram_deinit(&all);
+	test_end();
+}
+
+void test_stats_histogram(void)
+{
+	test_stats_histogram_small();
+	test_stats_histogram_large();
+	test_stats_histogram_merge();
+}
@@ -557,6 +557,9 @@ static void main_init(const struct master_settings *set)
 
 	create_pid_file(pidfile_path);
 	create_config_symlink(set);
+	/* the settings blob is from the previous run. the config process
+	   creates a new one when it starts. */
+	i_unlink_if_exists(services_get_config_blob_path(services));
 	instance_update(set);
 	master_clients_init();
 
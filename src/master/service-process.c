@@ -258,6 +258,8 @@ static void service_process_setup_config_environment(struct service *service)
 	switch (service->type) {
 	case SERVICE_TYPE_CONFIG:
 		env_put(MASTER_CONFIG_FILE_ENV, service->config_file_path);
+		env_put(MASTER_CONFIG_BLOB_ENV,
+			services_get_config_blob_path(service->list));
 		break;
 	case SERVICE_TYPE_LOG:
 		/* give the log's configuration directly, so it won't depend
@@ -276,6 +278,8 @@ static void service_process_setup_config_environment(struct service *service)
 	default:
 		env_put(MASTER_CONFIG_FILE_ENV,
 			services_get_config_socket_path(service->list));
+		env_put(MASTER_CONFIG_BLOB_ENV,
+			services_get_config_blob_path(service->list));
 		break;
 	}
 }
@@ -685,6 +685,12 @@ const char *services_get_config_socket_path(struct service_list *service_list)
 	return listeners[0]->set.fileset.set->path;
 }
 
+const char *services_get_config_blob_path(struct service_list *service_list)
+{
+	return t_strconcat(service_list->set->base_dir,
+			   "/"MASTER_CONFIG_BLOB_FILENAME, NULL);
+}
+
 static void service_throttle_timeout(struct service *service)
 {
 	timeout_remove(&service->to_throttle);
@@ -176,6 +176,8 @@ void service_list_unref(struct service_list *service_list);
 
 /* Return path to configuration process socket. */
 const char *services_get_config_socket_path(struct service_list *service_list);
+/* Return path to the precompiled settings blob written by the config process */
+const char *services_get_config_blob_path(struct service_list *service_list);
 
 /* Send a signal to all processes in a given service. However, if we're sending
    a SIGTERM and a process hasn't yet sent the initial status notification,
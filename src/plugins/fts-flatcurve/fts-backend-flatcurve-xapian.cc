@@ -5,6 +5,7 @@ extern "C" {
 #include "lib.h"
 #include "file-create-locked.h"
 #include "hash.h"
+#include "llist.h"
 #include "message-header-parser.h"
 #include "path-util.h"
 #include "mail-storage-private.h"
@@ -118,6 +119,14 @@ enum flatcurve_xapian_db_type {
 
 struct flatcurve_xapian_db {
 	Xapian::Database *db;
+	/* Path the read DB was opened from. The shard may have been renamed
+	 * since then. */
+	const char *db_path;
+	/* Identity of the shard at db_path when the read DB was opened.
+	 * Valid only if db_stat_valid is set. */
+	dev_t db_dev;
+	ino_t db_ino;
+	bool db_stat_valid;
 	Xapian::WritableDatabase *dbw;
 	struct flatcurve_xapian_db_path *dbpath;
 	unsigned int changes;
@@ -125,6 +134,18 @@ struct flatcurve_xapian_db {
 };
 HASH_TABLE_DEFINE_TYPE(xapian_db, char *, struct flatcurve_xapian_db *);
 
+/* Read-only shard handle kept open after its mailbox was closed. */
+struct flatcurve_xapian_db_cache {
+	struct flatcurve_xapian_db_cache *prev, *next;
+
+	char *path;
+	Xapian::Database *db;
+	/* Shard names are reused, so these are used to verify that the
+	 * path still refers to the shard that was opened. */
+	dev_t dev;
+	ino_t ino;
+};
+
 struct flatcurve_xapian {
 	/* Current database objects. */
 	struct flatcurve_xapian_db *dbw_current;
@@ -150,6 +171,12 @@ struct flatcurve_xapian {
 	/* List of mailboxes to optimize at shutdown. */
 	HASH_TABLE(char *, char *) optimize;
 
+	/* Read-only shard handles of previously closed mailboxes, most
+	 * recently used first. Not allocated from the pool, since they
+	 * survive switching mailboxes. */
+	struct flatcurve_xapian_db_cache *db_cache_head, *db_cache_tail;
+	unsigned int db_cache_count;
+
 	bool deinit:1;
 };
 
@@ -224,6 +251,109 @@ fts_flatcurve_xapian_db_populate(struct flatcurve_fts_backend *backend,
 				 enum flatcurve_xapian_db_opts opts,
 				 const char **error_r);
 
+static void
+fts_flatcurve_xapian_db_cache_free(struct flatcurve_xapian *x,
+				   struct flatcurve_xapian_db_cache *entry)
+{
+	DLLIST2_REMOVE(&x->db_cache_head, &x->db_cache_tail, entry);
+	i_assert(x->db_cache_count > 0);
+	--x->db_cache_count;
+
+	delete(entry->db);
+	i_free(entry->path);
+	i_free(entry);
+}
+
+static void fts_flatcurve_xapian_db_cache_clear(struct flatcurve_xapian *x)
+{
+	while (x->db_cache_head != NULL)
+		fts_flatcurve_xapian_db_cache_free(x, x->db_cache_head);
+}
+
+/* Drop the cached read DBs of a shard that is being deleted or renamed, so
+ * its files aren't kept open. If dbpath = NULL, drop all the shards of the
+ * current mailbox. */
+static void
+fts_flatcurve_xapian_db_cache_drop(struct flatcurve_fts_backend *backend,
+				   struct flatcurve_xapian_db_path *dbpath)
+{
+	struct flatcurve_xapian *x = backend->xapian;
+	struct flatcurve_xapian_db_cache *entry, *next;
+
+	for (entry = x->db_cache_head; entry != NULL; entry = next) {
+		next = entry->next;
+		if (dbpath == NULL ?
+		    str_begins_with(entry->path, str_c(backend->db_path)) :
+		    strcmp(entry->path, dbpath->path) == 0)
+			fts_flatcurve_xapian_db_cache_free(x, entry);
+	}
+}
+
+/* Returns the cached read DB for path, or NULL if there is none or if the
+ * shard has changed on disk in a way that reopen() can't handle. */
+static Xapian::Database *
+fts_flatcurve_xapian_db_cache_take(struct flatcurve_fts_backend *backend,
+				   const char *path, const struct stat *st)
+{
+	struct flatcurve_xapian *x = backend->xapian;
+	struct flatcurve_xapian_db_cache *entry;
+	Xapian::Database *db;
+
+	for (entry = x->db_cache_head; entry != NULL; entry = entry->next) {
+		if (strcmp(entry->path, path) == 0)
+			break;
+	}
+	if (entry == NULL)
+		return NULL;
+
+	if (st->st_dev != entry->dev || st->st_ino != entry->ino) {
+		/* The shard was deleted, or replaced by another shard with
+		 * the same name. */
+		fts_flatcurve_xapian_db_cache_free(x, entry);
+		return NULL;
+	}
+
+	db = entry->db;
+	entry->db = NULL;
+	fts_flatcurve_xapian_db_cache_free(x, entry);
+
+	try {
+		(void)db->reopen();
+	} catch (Xapian::Error &e) {
+		e_debug(backend->event, "Cached DB (RO; %s) can't be reopened: %s",
+			path, e.get_description().c_str());
+		delete(db);
+		return NULL;
+	}
+	return db;
+}
+
+static void
+fts_flatcurve_xapian_db_cache_put(struct flatcurve_fts_backend *backend,
+				  const char *path, Xapian::Database *db,
+				  dev_t dev, ino_t ino)
+{
+	struct flatcurve_xapian *x = backend->xapian;
+	struct flatcurve_xapian_db_cache *entry;
+
+	unsigned int limit = backend->fuser == NULL ? 0 :
+		backend->fuser->set.db_cache_size;
+	if (limit == 0 || x->deinit) {
+		delete(db);
+		return;
+	}
+
+	entry = i_new(struct flatcurve_xapian_db_cache, 1);
+	entry->path = i_strdup(path);
+	entry->db = db;
+	entry->dev = dev;
+	entry->ino = ino;
+	DLLIST2_PREPEND(&x->db_cache_head, &x->db_cache_tail, entry);
+
+	if (++x->db_cache_count > limit)
+		fts_flatcurve_xapian_db_cache_free(x, x->db_cache_tail);
+}
+
 void fts_flatcurve_xapian_init(struct flatcurve_fts_backend *backend)
 {
 	backend->xapian = p_new(backend->pool, struct flatcurve_xapian, 1);
@@ -257,6 +387,7 @@ void fts_flatcurve_xapian_deinit(struct flatcurve_fts_backend *backend)
 		hash_table_destroy(&x->optimize);
 	}
 	hash_table_destroy(&x->dbs);
+	fts_flatcurve_xapian_db_cache_clear(x);
 	pool_unref(&x->pool);
 	x->deinit = FALSE;
 }
@@ -286,6 +417,7 @@ fts_flatcurve_xapian_delete(struct flatcurve_fts_backend *backend,
 {
 	const char *path = dbpath == NULL ?
 		str_c(backend->db_path) : dbpath->path;
+	fts_flatcurve_xapian_db_cache_drop(backend, dbpath);
 	return fts_backend_flatcurve_delete_dir(path, error_r);
 }
 
@@ -464,6 +596,7 @@ fts_flatcurve_xapian_rename_db(struct flatcurve_fts_backend *backend,
 			       const char **error_r)
 {
 	struct flatcurve_xapian_db_path *newpath = NULL;
+	fts_flatcurve_xapian_db_cache_drop(backend, path);
 	for (unsigned int attempts = 0; attempts < 3; attempts++) {
 		std::ostringstream ss;
 		std::string new_fname(FLATCURVE_XAPIAN_DB_PREFIX);
@@ -609,17 +742,34 @@ fts_flatcurve_xapian_db_read_add(struct flatcurve_fts_backend *backend,
 				 const char **error_r)
 {
 	struct flatcurve_xapian *x = backend->xapian;
+	struct stat st;
 
 	if (x->db_read == NULL)
 		return 0;
 
-	try {
-		xdb->db = new Xapian::Database(xdb->dbpath->path);
-	} catch (Xapian::Error &e) {
-		*error_r = t_strdup_printf("Cannot open DB (RO; %s); %s",
-			xdb->dbpath->fname, e.get_description().c_str());
-		return -1;
+	/* Remember which shard is opened, so a cached handle can later be
+	 * verified to still match the path. stat() before opening, so that
+	 * a shard replaced in between is seen as changed rather than the
+	 * other way around. */
+	xdb->db = NULL;
+	xdb->db_stat_valid = stat(xdb->dbpath->path, &st) == 0;
+	if (xdb->db_stat_valid) {
+		xdb->db_dev = st.st_dev;
+		xdb->db_ino = st.st_ino;
+		xdb->db = fts_flatcurve_xapian_db_cache_take(
+			backend, xdb->dbpath->path, &st);
+	}
+	if (xdb->db == NULL) {
+		try {
+			xdb->db = new Xapian::Database(xdb->dbpath->path);
+		} catch (Xapian::Error &e) {
+			*error_r = t_strdup_printf("Cannot open DB (RO; %s); %s",
+				xdb->dbpath->fname,
+				e.get_description().c_str());
+			return -1;
+		}
 	}
+	xdb->db_path = p_strdup(x->pool, xdb->dbpath->path);
 
 	if (fts_flatcurve_xapian_check_db_version(backend, xdb, error_r) < 0)
 		return -1;
@@ -1436,7 +1586,13 @@ fts_flatcurve_xapian_close_db(struct flatcurve_fts_backend *backend,
 	if (xdb->db != NULL &&
 	    HAS_ANY_BITS(opts, FLATCURVE_XAPIAN_DB_CLOSE_DB |
 	    		       FLATCURVE_XAPIAN_DB_CLOSE_MBOX)) {
-		delete(xdb->db);
+		if (xdb->db_stat_valid) {
+			fts_flatcurve_xapian_db_cache_put(backend,
+				xdb->db_path, xdb->db, xdb->db_dev,
+				xdb->db_ino);
+		} else {
+			delete(xdb->db);
+		}
 		xdb->db = NULL;
 	}
 
@@ -1495,7 +1651,8 @@ int fts_flatcurve_xapian_close(struct flatcurve_fts_backend *backend,
 	x->shards = 0;
 
 	if (x->db_read != NULL) {
-		x->db_read->close();
+		/* Don't close() the combined DB: that would also close the
+		 * shard DBs, which may have been cached above. */
 		delete(x->db_read);
 		x->db_read = NULL;
 	}
@@ -1716,6 +1873,7 @@ int fts_flatcurve_xapian_delete_index(struct flatcurve_fts_backend *backend,
 {
 	const char *error;
 	int ret = fts_flatcurve_xapian_close(backend, error_r);
+	fts_flatcurve_xapian_db_cache_clear(backend->xapian);
 	if (fts_flatcurve_xapian_delete(backend, NULL, &error) < 0) {
 		if (ret < 0)
 			e_error(backend->event, "%s", error);
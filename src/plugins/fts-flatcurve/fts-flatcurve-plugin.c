@@ -12,6 +12,9 @@
 #define FTS_FLATCURVE_PLUGIN_COMMIT_LIMIT "fts_flatcurve_commit_limit"
 #define FTS_FLATCURVE_COMMIT_LIMIT_DEFAULT 500
 
+#define FTS_FLATCURVE_PLUGIN_DB_CACHE_SIZE "fts_flatcurve_db_cache_size"
+#define FTS_FLATCURVE_DB_CACHE_SIZE_DEFAULT 16
+
 #define FTS_FLATCURVE_PLUGIN_MAX_TERM_SIZE "fts_flatcurve_max_term_size"
 #define FTS_FLATCURVE_MAX_TERM_SIZE_DEFAULT 30
 #define FTS_FLATCURVE_MAX_TERM_SIZE_MAX 200
@@ -63,6 +66,17 @@ fts_flatcurve_plugin_init_settings(struct mail_user *user,
 		set->commit_limit = val;
 	}
 
+	set->db_cache_size = FTS_FLATCURVE_DB_CACHE_SIZE_DEFAULT;
+	pset = mail_user_plugin_getenv(user, FTS_FLATCURVE_PLUGIN_DB_CACHE_SIZE);
+	if (pset != NULL) {
+		if (str_to_uint(pset, &val) < 0) {
+			*error_r = t_strdup_printf("Invalid %s: %s",
+				FTS_FLATCURVE_PLUGIN_DB_CACHE_SIZE, pset);
+			return -1;
+		}
+		set->db_cache_size = val;
+	}
+
 	set->max_term_size = FTS_FLATCURVE_MAX_TERM_SIZE_DEFAULT;
 	pset = mail_user_plugin_getenv(user, FTS_FLATCURVE_PLUGIN_MAX_TERM_SIZE);
 	if (pset != NULL) {
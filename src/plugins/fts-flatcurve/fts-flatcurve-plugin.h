@@ -16,6 +16,7 @@
 
 struct fts_flatcurve_settings {
 	unsigned int commit_limit;
+	unsigned int db_cache_size;
 	unsigned int max_term_size;
 	unsigned int min_term_size;
 	unsigned int optimize_limit;
@@ -0,0 +1,816 @@
+/* Copyright (c) 2023 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "str.h"
+#include "unichar.h"
+#include "imap-util.h"
+#include "mail-storage-private.h"
+#include "mail-search-build.h"
+#include "mailbox-list-iter.h"
+#include "fts-native-index.h"
+#include "fts-backend-native.h"
+
+#define FTS_NATIVE_LOCK_TIMEOUT_SECS 60
+
+enum fts_backend_native_action {
+	FTS_BACKEND_NATIVE_ACTION_OPTIMIZE,
+	FTS_BACKEND_NATIVE_ACTION_RESCAN
+};
+
+struct native_fts_backend {
+	struct fts_backend backend;
+	struct fts_native_user *fuser;
+	struct event *event;
+
+	/* Currently opened mailbox */
+	string_t *boxname;
+	struct fts_native_index *index;
+};
+
+struct native_fts_backend_update_context {
+	struct fts_backend_update_context ctx;
+
+	struct native_fts_backend *backend;
+	enum fts_backend_build_key_type type;
+	string_t *hdr_name;
+	uint32_t uid;
+	unsigned int uncommitted_count;
+
+	bool indexed_hdr:1;
+	bool skip_uid:1;
+};
+
+struct event_category event_category_fts_native = {
+	.name = FTS_NATIVE_LABEL,
+	.parent = &event_category_fts
+};
+
+static struct fts_backend *fts_backend_native_alloc(void)
+{
+	struct native_fts_backend *backend;
+
+	backend = i_new(struct native_fts_backend, 1);
+	backend->backend = fts_backend_native;
+	return &backend->backend;
+}
+
+static int
+fts_backend_native_init(struct fts_backend *_backend, const char **error_r)
+{
+	struct native_fts_backend *backend =
+		container_of(_backend, struct native_fts_backend, backend);
+	struct fts_native_user *fuser =
+		FTS_NATIVE_USER_CONTEXT(_backend->ns->user);
+
+	if (fuser == NULL) {
+		*error_r = "Invalid fts-native settings";
+		return -1;
+	}
+	backend->fuser = fuser;
+	backend->boxname = str_new(default_pool, 128);
+
+	backend->event = event_create(_backend->ns->user->event);
+	event_add_category(backend->event, &event_category_fts_native);
+	event_set_append_log_prefix(backend->event, FTS_NATIVE_DEBUG_PREFIX);
+	return 0;
+}
+
+static int
+fts_backend_native_close_mailbox(struct native_fts_backend *backend,
+				 const char **error_r)
+{
+	int ret = 0;
+
+	if (backend->index != NULL) {
+		ret = fts_native_index_flush(backend->index, error_r);
+		fts_native_index_deinit(&backend->index);
+	}
+	str_truncate(backend->boxname, 0);
+	return ret;
+}
+
+static void fts_backend_native_deinit(struct fts_backend *_backend)
+{
+	struct native_fts_backend *backend =
+		container_of(_backend, struct native_fts_backend, backend);
+	const char *error;
+
+	if (fts_backend_native_close_mailbox(backend, &error) < 0)
+		e_error(backend->event, "%s", error);
+	str_free(&backend->boxname);
+	event_unref(&backend->event);
+	i_free(backend);
+}
+
+static int
+fts_backend_native_set_mailbox(struct native_fts_backend *backend,
+			       struct mailbox *box, const char **error_r)
+{
+	struct fts_native_index_settings set;
+	const char *path;
+
+	if (backend->index != NULL &&
+	    strcmp(box->vname, str_c(backend->boxname)) == 0)
+		return 0;
+
+	if (fts_backend_native_close_mailbox(backend, error_r) < 0) {
+		*error_r = t_strdup_printf("Could not close mailbox: %s",
+					   *error_r);
+		return -1;
+	}
+
+	if (mailbox_open(box) < 0 ||
+	    mailbox_get_path_to(box, MAILBOX_LIST_PATH_TYPE_INDEX, &path) <= 0) {
+		*error_r = t_strdup_printf("Could not open mailbox: %s: %s",
+					   box->vname,
+					   mailbox_get_last_internal_error(box, NULL));
+		return -1;
+	}
+
+	i_zero(&set);
+	set.merge_limit = backend->fuser->set.merge_limit;
+	set.lock_method = mailbox_get_storage(box)->set->parsed_lock_method;
+	set.lock_timeout_secs = FTS_NATIVE_LOCK_TIMEOUT_SECS;
+
+	str_append(backend->boxname, box->vname);
+	backend->index = fts_native_index_init(
+		t_strdup_printf("%s/%s", path, FTS_NATIVE_LABEL), &set);
+	return 0;
+}
+
+static int
+fts_backend_native_open_mailbox(struct native_fts_backend *backend,
+				struct mailbox *box, const char **error_r)
+{
+	if (fts_backend_native_set_mailbox(backend, box, error_r) < 0)
+		return -1;
+	if (fts_native_index_refresh(backend->index, error_r) < 0) {
+		*error_r = t_strdup_printf("Could not read index of %s: %s",
+					   box->vname, *error_r);
+		return -1;
+	}
+	return 0;
+}
+
+static int
+fts_backend_native_get_last_uid(struct fts_backend *_backend,
+				struct mailbox *box, uint32_t *last_uid_r)
+{
+	struct native_fts_backend *backend =
+		container_of(_backend, struct native_fts_backend, backend);
+	const char *error;
+
+	if (fts_backend_native_open_mailbox(backend, box, &error) < 0) {
+		e_error(backend->event, "%s", error);
+		return -1;
+	}
+	*last_uid_r = fts_native_index_get_last_uid(backend->index);
+	return 0;
+}
+
+static struct fts_backend_update_context *
+fts_backend_native_update_init(struct fts_backend *_backend)
+{
+	struct native_fts_backend *backend =
+		container_of(_backend, struct native_fts_backend, backend);
+	struct native_fts_backend_update_context *ctx;
+
+	ctx = i_new(struct native_fts_backend_update_context, 1);
+	ctx->ctx.backend = _backend;
+	ctx->backend = backend;
+	ctx->hdr_name = str_new(default_pool, 128);
+	return &ctx->ctx;
+}
+
+static int
+fts_backend_native_update_flush(struct native_fts_backend_update_context *ctx)
+{
+	const char *error;
+
+	ctx->uncommitted_count = 0;
+	if (ctx->backend->index == NULL)
+		return 0;
+	if (fts_native_index_flush(ctx->backend->index, &error) < 0) {
+		e_error(ctx->backend->event, "%s", error);
+		ctx->ctx.failed = TRUE;
+		return -1;
+	}
+	return 0;
+}
+
+static int
+fts_backend_native_update_deinit(struct fts_backend_update_context *_ctx)
+{
+	struct native_fts_backend_update_context *ctx =
+		container_of(_ctx, struct native_fts_backend_update_context, ctx);
+	int ret;
+
+	(void)fts_backend_native_update_flush(ctx);
+	ret = _ctx->failed ? -1 : 0;
+
+	str_free(&ctx->hdr_name);
+	i_free(ctx);
+	return ret;
+}
+
+static void
+fts_backend_native_update_set_mailbox(struct fts_backend_update_context *_ctx,
+				      struct mailbox *box)
+{
+	struct native_fts_backend_update_context *ctx =
+		container_of(_ctx, struct native_fts_backend_update_context, ctx);
+	const char *error;
+	int ret;
+
+	ctx->uid = 0;
+	ctx->uncommitted_count = 0;
+	ret = box == NULL ?
+		fts_backend_native_close_mailbox(ctx->backend, &error) :
+		fts_backend_native_open_mailbox(ctx->backend, box, &error);
+	if (ret < 0) {
+		e_error(ctx->backend->event, "%s", error);
+		_ctx->failed = TRUE;
+	}
+}
+
+static void
+fts_backend_native_update_expunge(struct fts_backend_update_context *_ctx,
+				  uint32_t uid)
+{
+	struct native_fts_backend_update_context *ctx =
+		container_of(_ctx, struct native_fts_backend_update_context, ctx);
+
+	if (ctx->backend->index == NULL)
+		return;
+
+	e_debug(event_create_passthrough(ctx->backend->event)->
+		set_name("fts_native_expunge")->
+		add_str("mailbox", str_c(ctx->backend->boxname))->
+		add_int("uid", uid)->event(),
+		"Expunge uid=%u", uid);
+	fts_native_index_expunge(ctx->backend->index, uid, uid);
+}
+
+static bool
+fts_backend_native_update_set_build_key(struct fts_backend_update_context *_ctx,
+					const struct fts_backend_build_key *key)
+{
+	struct native_fts_backend_update_context *ctx =
+		container_of(_ctx, struct native_fts_backend_update_context, ctx);
+	struct fts_native_index *index = ctx->backend->index;
+
+	if (_ctx->failed || index == NULL)
+		return FALSE;
+
+	if (ctx->uid != key->uid) {
+		ctx->uid = key->uid;
+		/* This UID has already been indexed, so skip all
+		   future update calls for it. */
+		ctx->skip_uid = key->uid <= fts_native_index_get_last_uid(index);
+		if (ctx->skip_uid)
+			return FALSE;
+
+		if (ctx->uncommitted_count >= ctx->backend->fuser->set.commit_limit &&
+		    ctx->backend->fuser->set.commit_limit > 0) {
+			if (fts_backend_native_update_flush(ctx) < 0)
+				return FALSE;
+		}
+		ctx->uncommitted_count++;
+		/* The message may not have any indexable terms */
+		fts_native_index_set_last_uid(index, key->uid);
+
+		e_debug(event_create_passthrough(ctx->backend->event)->
+			set_name("fts_native_index")->
+			add_str("mailbox", str_c(ctx->backend->boxname))->
+			add_int("uid", key->uid)->event(),
+			"Indexing uid=%u", key->uid);
+	} else if (ctx->skip_uid) {
+		return FALSE;
+	}
+	ctx->type = key->type;
+
+	switch (key->type) {
+	case FTS_BACKEND_BUILD_KEY_HDR:
+		i_assert(key->hdr_name != NULL);
+		str_append(ctx->hdr_name, t_str_lcase(key->hdr_name));
+		ctx->indexed_hdr = fts_header_want_indexed(key->hdr_name);
+		T_BEGIN {
+			fts_native_index_add(index, t_strconcat(
+				FTS_NATIVE_TERM_PREFIX_HEADER_EXISTS,
+				str_c(ctx->hdr_name), NULL), key->uid);
+		} T_END;
+		break;
+	case FTS_BACKEND_BUILD_KEY_MIME_HDR:
+	case FTS_BACKEND_BUILD_KEY_BODY_PART:
+		/* noop */
+		break;
+	case FTS_BACKEND_BUILD_KEY_BODY_PART_BINARY:
+		i_unreached();
+	}
+	return TRUE;
+}
+
+static void
+fts_backend_native_update_unset_build_key(struct fts_backend_update_context *_ctx)
+{
+	struct native_fts_backend_update_context *ctx =
+		container_of(_ctx, struct native_fts_backend_update_context, ctx);
+
+	str_truncate(ctx->hdr_name, 0);
+	ctx->indexed_hdr = FALSE;
+}
+
+static int
+fts_backend_native_update_build_more(struct fts_backend_update_context *_ctx,
+				     const unsigned char *data, size_t size)
+{
+	struct native_fts_backend_update_context *ctx =
+		container_of(_ctx, struct native_fts_backend_update_context, ctx);
+	const struct fts_native_settings *set = &ctx->backend->fuser->set;
+	struct fts_native_index *index = ctx->backend->index;
+	const char *term;
+
+	i_assert(ctx->uid != 0);
+
+	if (_ctx->failed || ctx->skip_uid)
+		return -1;
+
+	if (size < set->min_term_size)
+		return 0;
+	size = uni_utf8_data_truncate(data, size, set->max_term_size);
+
+	T_BEGIN {
+		term = t_strndup(data, size);
+		switch (ctx->type) {
+		case FTS_BACKEND_BUILD_KEY_HDR:
+		case FTS_BACKEND_BUILD_KEY_MIME_HDR:
+			fts_native_index_add(index, t_strconcat(
+				FTS_NATIVE_TERM_PREFIX_ALL_HEADERS, term, NULL),
+				ctx->uid);
+			if (ctx->indexed_hdr) {
+				fts_native_index_add(index, t_strconcat(
+					FTS_NATIVE_TERM_PREFIX_HEADER,
+					str_c(ctx->hdr_name), ":", term, NULL),
+					ctx->uid);
+			}
+			break;
+		case FTS_BACKEND_BUILD_KEY_BODY_PART:
+			fts_native_index_add(index, t_strconcat(
+				FTS_NATIVE_TERM_PREFIX_BODY, term, NULL),
+				ctx->uid);
+			break;
+		default:
+			i_unreached();
+		}
+	} T_END;
+	return 0;
+}
+
+static int fts_backend_native_refresh(struct fts_backend *_backend)
+{
+	struct native_fts_backend *backend =
+		container_of(_backend, struct native_fts_backend, backend);
+	const char *error;
+
+	if (backend->index == NULL)
+		return 0;
+	if (fts_native_index_refresh(backend->index, &error) < 0) {
+		e_error(backend->event, "%s", error);
+		return -1;
+	}
+	return 0;
+}
+
+static int
+fts_backend_native_rescan_box(struct native_fts_backend *backend,
+			      struct mailbox *box, const char **error_r)
+{
+	struct mailbox_transaction_context *trans;
+	struct mail_search_args *search_args;
+	struct mail_search_context *search_ctx;
+	struct mail *mail;
+	ARRAY_TYPE(seq_range) expunged;
+	const struct seq_range *range;
+	uint32_t last_uid;
+	int ret = 0;
+
+	last_uid = fts_native_index_get_last_uid(backend->index);
+	if (last_uid == 0)
+		return 0;
+	if (mailbox_sync(box, MAILBOX_SYNC_FLAG_FULL_READ) < 0) {
+		*error_r = mailbox_get_last_internal_error(box, NULL);
+		return -1;
+	}
+
+	/* Drop the indexed UIDs that no longer exist in the mailbox. */
+	t_array_init(&expunged, 32);
+	seq_range_array_add_range(&expunged, 1, last_uid);
+
+	trans = mailbox_transaction_begin(box, 0, __func__);
+	search_args = mail_search_build_init();
+	mail_search_build_add_all(search_args);
+	search_ctx = mailbox_search_init(trans, search_args, NULL, 0, NULL);
+	while (mailbox_search_next(search_ctx, &mail)) {
+		if (mail->uid > last_uid)
+			break;
+		seq_range_array_remove(&expunged, mail->uid);
+	}
+	if (mailbox_search_deinit(&search_ctx) < 0) {
+		*error_r = mailbox_get_last_internal_error(box, NULL);
+		ret = -1;
+	}
+	mail_search_args_unref(&search_args);
+	(void)mailbox_transaction_commit(&trans);
+	if (ret < 0)
+		return -1;
+
+	array_foreach(&expunged, range) {
+		fts_native_index_expunge(backend->index,
+					 range->seq1, range->seq2);
+	}
+	if (array_is_empty(&expunged)) {
+		e_debug(event_create_passthrough(backend->event)->
+			set_name("fts_native_rescan")->
+			add_str("mailbox", box->name)->
+			add_str("status", "ok")->event(),
+			"Rescan: no issues found");
+	} else {
+		string_t *uids = t_str_new(128);
+
+		imap_write_seq_range(uids, &expunged);
+		e_debug(event_create_passthrough(backend->event)->
+			set_name("fts_native_rescan")->
+			add_str("mailbox", box->name)->
+			add_str("status", "expunge_msgs")->
+			add_str("expunged", str_c(uids))->event(),
+			"Rescan: expunge non-existent messages expunged=%s",
+			str_c(uids));
+	}
+	return fts_native_index_flush(backend->index, error_r);
+}
+
+static int
+fts_backend_native_iterate_ns(struct fts_backend *_backend,
+			      enum fts_backend_native_action act)
+{
+	struct native_fts_backend *backend =
+		container_of(_backend, struct native_fts_backend, backend);
+	const enum mailbox_list_iter_flags iter_flags =
+		MAILBOX_LIST_ITER_NO_AUTO_BOXES |
+		MAILBOX_LIST_ITER_RETURN_NO_FLAGS;
+	struct mailbox_list_iterate_context *iter;
+	const struct mailbox_info *info;
+	struct mailbox *box;
+	const char *error;
+	bool failed = FALSE;
+	int ret;
+
+	iter = mailbox_list_iter_init(_backend->ns->list, "*", iter_flags);
+	while ((info = mailbox_list_iter_next(iter)) != NULL) {
+		box = mailbox_alloc(_backend->ns->list, info->vname, 0);
+		T_BEGIN {
+			ret = fts_backend_native_open_mailbox(backend, box,
+							      &error);
+			if (ret == 0) switch (act) {
+			case FTS_BACKEND_NATIVE_ACTION_OPTIMIZE:
+				ret = fts_native_index_optimize(backend->index,
+								&error);
+				break;
+			case FTS_BACKEND_NATIVE_ACTION_RESCAN:
+				ret = fts_backend_native_rescan_box(backend,
+								    box, &error);
+				break;
+			}
+			if (ret < 0) {
+				e_error(backend->event, "%s: %s",
+					info->vname, error);
+				failed = TRUE;
+			}
+		} T_END;
+		/* don't keep the index of the freed mailbox open */
+		if (fts_backend_native_close_mailbox(backend, &error) < 0) {
+			e_error(backend->event, "%s", error);
+			failed = TRUE;
+		}
+		mailbox_free(&box);
+	}
+	if (mailbox_list_iter_deinit(&iter) < 0) {
+		e_error(backend->event, "%s",
+			mailbox_list_get_last_internal_error(_backend->ns->list,
+							     NULL));
+		failed = TRUE;
+	}
+	return failed ? -1 : 0;
+}
+
+static int fts_backend_native_optimize(struct fts_backend *backend)
+{
+	return fts_backend_native_iterate_ns(backend,
+			FTS_BACKEND_NATIVE_ACTION_OPTIMIZE);
+}
+
+static int fts_backend_native_rescan(struct fts_backend *backend)
+{
+	return fts_backend_native_iterate_ns(backend,
+			FTS_BACKEND_NATIVE_ACTION_RESCAN);
+}
+
+static int
+fts_backend_native_lookup_term(struct native_fts_backend *backend,
+			       const struct mail_search_arg *arg,
+			       const char *term, ARRAY_TYPE(seq_range) *uids,
+			       bool *maybe_r, const char **error_r)
+{
+	struct fts_native_index *index = backend->index;
+	const char *hdr_name;
+	uint32_t last_uid;
+	size_t len;
+
+	if (*term != '\0' &&
+	    strlen(term) < backend->fuser->set.min_term_size) {
+		/* Shorter terms weren't indexed, so any mail may match. */
+		*maybe_r = TRUE;
+		last_uid = fts_native_index_get_last_uid(index);
+		if (last_uid > 0)
+			seq_range_array_add_range(uids, 1, last_uid);
+		return 0;
+	}
+
+	/* terms longer than max_term_size were truncated when indexing */
+	len = uni_utf8_data_truncate((const unsigned char *)term, strlen(term),
+				     backend->fuser->set.max_term_size);
+	term = t_strndup(term, len);
+
+	switch (arg->type) {
+	case SEARCH_TEXT:
+		if (fts_native_index_lookup(index, t_strconcat(
+				FTS_NATIVE_TERM_PREFIX_ALL_HEADERS, term, NULL),
+				TRUE, uids, error_r) < 0)
+			return -1;
+		/* fall through */
+	case SEARCH_BODY:
+		return fts_native_index_lookup(index, t_strconcat(
+			FTS_NATIVE_TERM_PREFIX_BODY, term, NULL),
+			TRUE, uids, error_r);
+	case SEARCH_HEADER:
+	case SEARCH_HEADER_ADDRESS:
+	case SEARCH_HEADER_COMPRESS_LWSP:
+		hdr_name = t_str_lcase(arg->hdr_field_name);
+		if (*term == '\0') {
+			/* existence search */
+			return fts_native_index_lookup(index, t_strconcat(
+				FTS_NATIVE_TERM_PREFIX_HEADER_EXISTS,
+				hdr_name, NULL), FALSE, uids, error_r);
+		}
+		if (fts_header_want_indexed(arg->hdr_field_name)) {
+			return fts_native_index_lookup(index, t_strconcat(
+				FTS_NATIVE_TERM_PREFIX_HEADER, hdr_name, ":",
+				term, NULL), TRUE, uids, error_r);
+		}
+		/* Non-indexed headers only match if the term appears in
+		   any of the message's headers, so this is only a maybe
+		   match. */
+		*maybe_r = TRUE;
+		return fts_native_index_lookup(index, t_strconcat(
+			FTS_NATIVE_TERM_PREFIX_ALL_HEADERS, term, NULL),
+			TRUE, uids, error_r);
+	default:
+		i_unreached();
+	}
+}
+
+static int
+fts_backend_native_lookup_arg(struct native_fts_backend *backend,
+			      struct mail_search_arg *arg,
+			      ARRAY_TYPE(seq_range) *uids, bool *maybe_r,
+			      const char **error_r)
+{
+	ARRAY_TYPE(seq_range) term_uids;
+	uint32_t last_uid = fts_native_index_get_last_uid(backend->index);
+	const char *const *parts;
+	unsigned int i, count;
+	bool maybe = FALSE;
+
+	/* Phrase searching isn't supported, since there is no positional
+	   information in the index. Search each word separately and AND them
+	   together as a maybe match. */
+	parts = t_strsplit_spaces(arg->value.str, " ");
+	count = str_array_length(parts);
+	if (count == 0) {
+		if (arg->type == SEARCH_TEXT || arg->type == SEARCH_BODY) {
+			/* matches everything */
+			if (last_uid > 0)
+				seq_range_array_add_range(uids, 1, last_uid);
+		} else if (fts_backend_native_lookup_term(backend, arg, "",
+						uids, &maybe, error_r) < 0)
+			return -1;
+	} else if (fts_backend_native_lookup_term(backend, arg, parts[0],
+						  uids, &maybe, error_r) < 0)
+		return -1;
+	if (count > 1) {
+		maybe = TRUE;
+		t_array_init(&term_uids, 32);
+	}
+	for (i = 1; i < count && array_count(uids) > 0; i++) {
+		array_clear(&term_uids);
+		if (fts_backend_native_lookup_term(backend, arg, parts[i],
+						   &term_uids, &maybe,
+						   error_r) < 0)
+			return -1;
+		seq_range_array_intersect(uids, &term_uids);
+	}
+
+	if (arg->match_not) {
+		if (last_uid == 0)
+			array_clear(uids);
+		else if (maybe) {
+			/* the NOT of a maybe match can't exclude anything */
+			array_clear(uids);
+			seq_range_array_add_range(uids, 1, last_uid);
+		} else {
+			if (last_uid < (uint32_t)-1) {
+				seq_range_array_remove_range(uids, last_uid + 1,
+							     (uint32_t)-1);
+			}
+			seq_range_array_invert(uids, 1, last_uid);
+		}
+	}
+	if (maybe)
+		*maybe_r = TRUE;
+	return 0;
+}
+
+/* Returns 1 if the args had something to search, 0 if not, -1 on error. */
+static int
+fts_backend_native_lookup_box(struct native_fts_backend *backend,
+			      struct mail_search_arg *args,
+			      enum fts_lookup_flags flags,
+			      ARRAY_TYPE(seq_range) *uids, bool *maybe_r,
+			      const char **error_r)
+{
+	ARRAY_TYPE(seq_range) arg_uids;
+	bool and_args = (flags & FTS_LOOKUP_FLAG_AND_ARGS) != 0;
+	bool have_args = FALSE;
+
+	*maybe_r = FALSE;
+	t_array_init(&arg_uids, 32);
+	for (; args != NULL; args = args->next) {
+		if (args->no_fts)
+			continue;
+
+		switch (args->type) {
+		case SEARCH_TEXT:
+		case SEARCH_BODY:
+		case SEARCH_HEADER:
+		case SEARCH_HEADER_ADDRESS:
+		case SEARCH_HEADER_COMPRESS_LWSP:
+			/* Valid search term. Set match_always, as required by
+			   FTS API, to avoid this argument being looked up
+			   later via regular search code. */
+			args->match_always = TRUE;
+			break;
+		default:
+			/* SEARCH_OR and SEARCH_SUB are looked up separately
+			   by the FTS API. SEARCH_MAILBOX has already been
+			   handled by selecting the mailbox. Anything else
+			   is ignored, which errs on the side of returning
+			   too many results. */
+			continue;
+		}
+
+		array_clear(&arg_uids);
+		if (fts_backend_native_lookup_arg(backend, args, &arg_uids,
+						  maybe_r, error_r) < 0)
+			return -1;
+		if (!have_args)
+			array_append_array(uids, &arg_uids);
+		else if (and_args)
+			seq_range_array_intersect(uids, &arg_uids);
+		else
+			seq_range_array_merge(uids, &arg_uids);
+		have_args = TRUE;
+	}
+	return have_args ? 1 : 0;
+}
+
+static int
+fts_backend_native_lookup_multi(struct fts_backend *_backend,
+				struct mailbox *const boxes[],
+				struct mail_search_arg *args,
+				enum fts_lookup_flags flags,
+				struct fts_multi_result *result)
+{
+	struct native_fts_backend *backend =
+		container_of(_backend, struct native_fts_backend, backend);
+	ARRAY(struct fts_result) box_results;
+	ARRAY_TYPE(seq_range) uids;
+	struct fts_result *r;
+	const char *error;
+	unsigned int i;
+	bool maybe = FALSE;
+	int ret = 0;
+
+	p_array_init(&box_results, result->pool, 8);
+	for (i = 0; boxes[i] != NULL && ret == 0; i++) T_BEGIN {
+		r = array_append_space(&box_results);
+		r->box = boxes[i];
+		p_array_init(&uids, result->pool, 32);
+
+		ret = fts_backend_native_open_mailbox(backend, r->box, &error);
+		if (ret == 0) {
+			ret = fts_backend_native_lookup_box(backend, args,
+				flags, &uids, &maybe, &error);
+		}
+		if (ret < 0)
+			e_error(backend->event, "%s", error);
+		else {
+			if (maybe ||
+			    (flags & FTS_LOOKUP_FLAG_NO_AUTO_FUZZY) != 0)
+				r->maybe_uids = uids;
+			else
+				r->definite_uids = uids;
+
+			if (ret > 0) {
+				string_t *str = t_str_new(128);
+
+				imap_write_seq_range(str, &uids);
+				e_debug(event_create_passthrough(backend->event)->
+					set_name("fts_native_query")->
+					add_int("count", array_count(&uids))->
+					add_str("mailbox", r->box->vname)->
+					add_str("maybe", maybe ? "yes" : "no")->
+					add_str("uids", str_c(str))->event(),
+					"Query %smatches=%u uids=%s",
+					maybe ? "maybe_" : "",
+					array_count(&uids), str_c(str));
+			}
+			ret = 0;
+		}
+	} T_END;
+	if (ret < 0)
+		return -1;
+
+	array_append_zero(&box_results);
+	result->box_results = array_idx_modifiable(&box_results, 0);
+	return 0;
+}
+
+static int
+fts_backend_native_lookup(struct fts_backend *_backend, struct mailbox *box,
+			  struct mail_search_arg *args,
+			  enum fts_lookup_flags flags,
+			  struct fts_result *result)
+{
+	struct mailbox *boxes[2];
+	struct fts_multi_result multi_result;
+	const struct fts_result *br;
+	int ret;
+
+	boxes[0] = box;
+	boxes[1] = NULL;
+
+	i_zero(&multi_result);
+	multi_result.pool = pool_alloconly_create(FTS_NATIVE_LABEL
+						  " results pool", 4096);
+	ret = fts_backend_native_lookup_multi(_backend, boxes, args,
+					      flags, &multi_result);
+	if (ret == 0) {
+		br = &multi_result.box_results[0];
+		result->box = br->box;
+		if (array_is_created(&br->definite_uids))
+			array_append_array(&result->definite_uids,
+					   &br->definite_uids);
+		if (array_is_created(&br->maybe_uids))
+			array_append_array(&result->maybe_uids,
+					   &br->maybe_uids);
+		result->scores_sorted = TRUE;
+	}
+	pool_unref(&multi_result.pool);
+	return ret;
+}
+
+struct fts_backend fts_backend_native = {
+	.name = "native",
+	.flags = FTS_BACKEND_FLAG_TOKENIZED_INPUT,
+	.v = {
+		.alloc = fts_backend_native_alloc,
+		.init = fts_backend_native_init,
+		.deinit = fts_backend_native_deinit,
+		.get_last_uid = fts_backend_native_get_last_uid,
+		.update_init = fts_backend_native_update_init,
+		.update_deinit = fts_backend_native_update_deinit,
+		.update_set_mailbox = fts_backend_native_update_set_mailbox,
+		.update_expunge = fts_backend_native_update_expunge,
+		.update_set_build_key = fts_backend_native_update_set_build_key,
+		.update_unset_build_key = fts_backend_native_update_unset_build_key,
+		.update_build_more = fts_backend_native_update_build_more,
+		.refresh = fts_backend_native_refresh,
+		.rescan = fts_backend_native_rescan,
+		.optimize = fts_backend_native_optimize,
+		.can_lookup = fts_backend_default_can_lookup,
+		.lookup = fts_backend_native_lookup,
+		.lookup_multi = fts_backend_native_lookup_multi,
+		.lookup_done = NULL,
+	}
+};
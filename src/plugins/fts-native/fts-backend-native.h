@@ -0,0 +1,18 @@
+#ifndef FTS_BACKEND_NATIVE_H
+#define FTS_BACKEND_NATIVE_H
+
+#include "fts-native-plugin.h"
+
+#define FTS_NATIVE_LABEL "fts-native"
+#define FTS_NATIVE_DEBUG_PREFIX FTS_NATIVE_LABEL ": "
+
+/* Term prefixes used in the index */
+#define FTS_NATIVE_TERM_PREFIX_BODY "b"
+#define FTS_NATIVE_TERM_PREFIX_ALL_HEADERS "h"
+/* Followed by the lowercased header name, ':' and the term. Used for headers
+   where fts_header_want_indexed() is TRUE. */
+#define FTS_NATIVE_TERM_PREFIX_HEADER "H"
+/* Followed by the lowercased header name. Added for each existing header. */
+#define FTS_NATIVE_TERM_PREFIX_HEADER_EXISTS "E"
+
+#endif
@@ -0,0 +1,1030 @@
+/* Copyright (c) 2023 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "buffer.h"
+#include "hash.h"
+#include "str.h"
+#include "numpack.h"
+#include "sort.h"
+#include "mmap-util.h"
+#include "read-full.h"
+#include "write-full.h"
+#include "ostream.h"
+#include "file-create-locked.h"
+#include "fts-native-index.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#define FTS_NATIVE_MANIFEST_VERSION 1
+#define FTS_NATIVE_SEGMENT_VERSION 1
+/* How many times to retry reading the manifest if a segment listed in it
+   was already removed by a concurrent merge. */
+#define FTS_NATIVE_REFRESH_RETRY_COUNT 3
+
+struct fts_native_manifest_header {
+	uint32_t version;
+	uint32_t hdr_size;
+	uint32_t last_uid;
+	uint32_t next_segment_id;
+	uint32_t segment_count;
+	uint32_t expunged_count;
+	/* uint32_t segment_ids[segment_count]; */
+	/* struct seq_range expunged[expunged_count]; */
+};
+
+struct fts_native_segment_header {
+	uint32_t version;
+	uint32_t hdr_size;
+	uint32_t term_count;
+	/* Offset to uint32_t term_offsets[term_count], sorted by the term.
+	   Each offset points to a NUL-terminated term followed by its
+	   numpack'ed posting list: the number of UIDs, the first UID and
+	   then the deltas between the following UIDs. */
+	uint32_t dict_offset;
+};
+
+struct fts_native_segment {
+	uint32_t id;
+	char *path;
+
+	void *mmap_base;
+	size_t mmap_size;
+	const uint32_t *dict;
+	unsigned int term_count;
+};
+
+struct fts_native_pending_term {
+	const char *term;
+	ARRAY_TYPE(uint32_t) uids;
+};
+
+struct fts_native_segment_writer {
+	char *path;
+	int fd;
+	struct ostream *output;
+	buffer_t *postings;
+	ARRAY_TYPE(uint32_t) dict;
+};
+
+struct fts_native_index {
+	char *dir, *manifest_path;
+	struct fts_native_index_settings set;
+
+	/* Currently active view to the index */
+	struct stat manifest_st;
+	bool manifest_exists;
+	uint32_t last_uid, next_segment_id;
+	ARRAY(struct fts_native_segment *) segments;
+	ARRAY_TYPE(seq_range) expunged;
+
+	/* Buffered changes */
+	pool_t pending_pool;
+	HASH_TABLE(char *, struct fts_native_pending_term *) pending_terms;
+	ARRAY_TYPE(seq_range) pending_expunges;
+	uint32_t pending_last_uid;
+};
+
+struct fts_native_index *
+fts_native_index_init(const char *dir,
+		      const struct fts_native_index_settings *set)
+{
+	struct fts_native_index *index;
+
+	index = i_new(struct fts_native_index, 1);
+	index->dir = i_strdup(dir);
+	index->manifest_path = i_strconcat(dir, "/",
+		FTS_NATIVE_MANIFEST_FNAME, NULL);
+	index->set = *set;
+	i_array_init(&index->segments, 8);
+	i_array_init(&index->expunged, 8);
+
+	index->pending_pool =
+		pool_alloconly_create("fts native pending terms", 16384);
+	hash_table_create(&index->pending_terms, index->pending_pool, 0,
+			  str_hash, strcmp);
+	i_array_init(&index->pending_expunges, 8);
+	return index;
+}
+
+static void fts_native_segment_free(struct fts_native_segment **_seg)
+{
+	struct fts_native_segment *seg = *_seg;
+
+	*_seg = NULL;
+	if (seg->mmap_base != NULL) {
+		if (munmap(seg->mmap_base, seg->mmap_size) < 0)
+			i_error("munmap(%s) failed: %m", seg->path);
+	}
+	i_free(seg->path);
+	i_free(seg);
+}
+
+static void fts_native_index_pending_clear(struct fts_native_index *index)
+{
+	struct hash_iterate_context *iter;
+	struct fts_native_pending_term *pterm;
+	char *term;
+
+	iter = hash_table_iterate_init(index->pending_terms);
+	while (hash_table_iterate(iter, index->pending_terms, &term, &pterm))
+		array_free(&pterm->uids);
+	hash_table_iterate_deinit(&iter);
+	hash_table_clear(index->pending_terms, TRUE);
+	p_clear(index->pending_pool);
+
+	array_clear(&index->pending_expunges);
+	index->pending_last_uid = 0;
+}
+
+void fts_native_index_deinit(struct fts_native_index **_index)
+{
+	struct fts_native_index *index = *_index;
+	struct fts_native_segment **segp;
+
+	*_index = NULL;
+
+	fts_native_index_pending_clear(index);
+	hash_table_destroy(&index->pending_terms);
+	pool_unref(&index->pending_pool);
+	array_free(&index->pending_expunges);
+
+	array_foreach_modifiable(&index->segments, segp)
+		fts_native_segment_free(segp);
+	array_free(&index->segments);
+	array_free(&index->expunged);
+	i_free(index->manifest_path);
+	i_free(index->dir);
+	i_free(index);
+}
+
+static const char *
+fts_native_segment_path(struct fts_native_index *index, uint32_t id)
+{
+	return t_strdup_printf("%s/"FTS_NATIVE_SEGMENT_FNAME_PREFIX"%u",
+			       index->dir, id);
+}
+
+/* Returns 1 if opened, 0 if the segment doesn't exist, -1 on error. */
+static int
+fts_native_segment_open(struct fts_native_index *index, uint32_t id,
+			struct fts_native_segment **seg_r,
+			const char **error_r)
+{
+	const struct fts_native_segment_header *hdr;
+	struct fts_native_segment *seg;
+	const char *path = fts_native_segment_path(index, id);
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		if (errno == ENOENT)
+			return 0;
+		*error_r = t_strdup_printf("open(%s) failed: %m", path);
+		return -1;
+	}
+
+	seg = i_new(struct fts_native_segment, 1);
+	seg->id = id;
+	seg->path = i_strdup(path);
+	seg->mmap_base = mmap_ro_file(fd, &seg->mmap_size);
+	if (seg->mmap_base == MAP_FAILED) {
+		seg->mmap_base = NULL;
+		*error_r = t_strdup_printf("mmap(%s) failed: %m", path);
+		fts_native_segment_free(&seg);
+		i_close_fd(&fd);
+		return -1;
+	}
+	i_close_fd(&fd);
+
+	hdr = seg->mmap_base;
+	if (seg->mmap_size < sizeof(*hdr) ||
+	    hdr->version != FTS_NATIVE_SEGMENT_VERSION ||
+	    hdr->hdr_size < sizeof(*hdr) ||
+	    hdr->dict_offset < hdr->hdr_size ||
+	    hdr->dict_offset % sizeof(uint32_t) != 0 ||
+	    hdr->dict_offset > seg->mmap_size ||
+	    (seg->mmap_size - hdr->dict_offset) / sizeof(uint32_t) !=
+	    hdr->term_count) {
+		*error_r = t_strdup_printf("Corrupted segment %s: "
+					   "Invalid header", path);
+		fts_native_segment_free(&seg);
+		return -1;
+	}
+	(void)my_madvise(seg->mmap_base, seg->mmap_size, MADV_RANDOM);
+	seg->dict = CONST_PTR_OFFSET(seg->mmap_base, hdr->dict_offset);
+	seg->term_count = hdr->term_count;
+	*seg_r = seg;
+	return 1;
+}
+
+static int
+fts_native_segment_get_term(struct fts_native_segment *seg, unsigned int idx,
+			    const char **term_r, const uint8_t **postings_r,
+			    const char **error_r)
+{
+	const struct fts_native_segment_header *hdr = seg->mmap_base;
+	uint32_t offset = seg->dict[idx];
+	const char *term, *term_end;
+
+	i_assert(idx < seg->term_count);
+
+	if (offset < hdr->hdr_size || offset >= hdr->dict_offset) {
+		*error_r = t_strdup_printf("Corrupted segment %s: "
+			"Invalid term offset %u", seg->path, offset);
+		return -1;
+	}
+	term = CONST_PTR_OFFSET(seg->mmap_base, offset);
+	term_end = memchr(term, '\0', hdr->dict_offset - offset);
+	if (term_end == NULL) {
+		*error_r = t_strdup_printf("Corrupted segment %s: "
+			"Term at offset %u isn't NUL-terminated",
+			seg->path, offset);
+		return -1;
+	}
+	*term_r = term;
+	*postings_r = (const uint8_t *)term_end + 1;
+	return 0;
+}
+
+/* Decode the posting list and call the callback for each UID. */
+static int
+fts_native_segment_read_postings(struct fts_native_segment *seg,
+				 const uint8_t *p,
+				 void (*callback)(uint32_t uid, void *context),
+				 void *context, const char **error_r)
+{
+	const struct fts_native_segment_header *hdr = seg->mmap_base;
+	const uint8_t *end = CONST_PTR_OFFSET(seg->mmap_base, hdr->dict_offset);
+	uint32_t count, delta, uid = 0;
+
+	if (numpack_decode32(&p, end, &count) < 0)
+		goto corrupted;
+	for (; count > 0; count--) {
+		if (numpack_decode32(&p, end, &delta) < 0 ||
+		    delta == 0 || uid > (uint32_t)-1 - delta)
+			goto corrupted;
+		uid += delta;
+		callback(uid, context);
+	}
+	return 0;
+corrupted:
+	*error_r = t_strdup_printf("Corrupted segment %s: "
+				   "Invalid posting list", seg->path);
+	return -1;
+}
+
+static void fts_native_seq_range_add(uint32_t uid, void *context)
+{
+	ARRAY_TYPE(seq_range) *uids = context;
+
+	seq_range_array_add(uids, uid);
+}
+
+static void fts_native_uid_array_add(uint32_t uid, void *context)
+{
+	ARRAY_TYPE(uint32_t) *uids = context;
+
+	array_push_back(uids, &uid);
+}
+
+static int
+fts_native_segment_lookup(struct fts_native_segment *seg, const char *term,
+			  bool prefix, ARRAY_TYPE(seq_range) *uids,
+			  const char **error_r)
+{
+	const uint8_t *postings;
+	const char *seg_term;
+	size_t term_len = strlen(term);
+	unsigned int idx, left_idx = 0, right_idx = seg->term_count;
+
+	/* find the first term >= the searched term */
+	while (left_idx < right_idx) {
+		idx = (left_idx + right_idx) / 2;
+		if (fts_native_segment_get_term(seg, idx, &seg_term,
+						&postings, error_r) < 0)
+			return -1;
+		if (strcmp(seg_term, term) < 0)
+			left_idx = idx + 1;
+		else
+			right_idx = idx;
+	}
+
+	for (idx = left_idx; idx < seg->term_count; idx++) {
+		if (fts_native_segment_get_term(seg, idx, &seg_term,
+						&postings, error_r) < 0)
+			return -1;
+		if (prefix ? strncmp(seg_term, term, term_len) != 0 :
+		    strcmp(seg_term, term) != 0)
+			break;
+		if (fts_native_segment_read_postings(seg, postings,
+				fts_native_seq_range_add, uids, error_r) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/* Returns 1 if read, 0 if the manifest doesn't exist, -1 on error. */
+static int
+fts_native_manifest_read(struct fts_native_index *index, struct stat *st_r,
+			 buffer_t *buf, const char **error_r)
+{
+	const struct fts_native_manifest_header *hdr;
+	int fd, ret;
+
+	fd = open(index->manifest_path, O_RDONLY);
+	if (fd == -1) {
+		if (errno == ENOENT)
+			return 0;
+		*error_r = t_strdup_printf("open(%s) failed: %m",
+					   index->manifest_path);
+		return -1;
+	}
+	if (fstat(fd, st_r) < 0) {
+		*error_r = t_strdup_printf("fstat(%s) failed: %m",
+					   index->manifest_path);
+		i_close_fd(&fd);
+		return -1;
+	}
+	ret = read_full(fd, buffer_append_space_unsafe(buf, st_r->st_size),
+			st_r->st_size);
+	if (ret < 0) {
+		*error_r = t_strdup_printf("read(%s) failed: %m",
+					   index->manifest_path);
+		i_close_fd(&fd);
+		return -1;
+	}
+	i_close_fd(&fd);
+
+	hdr = buf->data;
+	if (ret == 0 || buf->used < sizeof(*hdr) ||
+	    hdr->version != FTS_NATIVE_MANIFEST_VERSION ||
+	    hdr->hdr_size < sizeof(*hdr) ||
+	    buf->used != (uint64_t)hdr->hdr_size +
+			 (uint64_t)hdr->segment_count * sizeof(uint32_t) +
+			 (uint64_t)hdr->expunged_count *
+			 sizeof(struct seq_range)) {
+		*error_r = t_strdup_printf("Corrupted manifest %s",
+					   index->manifest_path);
+		return -1;
+	}
+	return 1;
+}
+
+static void fts_native_index_close_segments(struct fts_native_index *index)
+{
+	struct fts_native_segment **segp;
+
+	array_foreach_modifiable(&index->segments, segp)
+		fts_native_segment_free(segp);
+	array_clear(&index->segments);
+}
+
+/* Returns 1 if refreshed, 0 if a segment disappeared and the refresh should
+   be retried, -1 on error. */
+static int
+fts_native_index_refresh_try(struct fts_native_index *index,
+			     const char **error_r)
+{
+	const struct fts_native_manifest_header *hdr;
+	const struct seq_range *expunged;
+	const uint32_t *ids;
+	ARRAY(struct fts_native_segment *) new_segments;
+	struct fts_native_segment *seg, **segp;
+	struct stat st;
+	buffer_t *buf;
+	unsigned int i;
+	int ret;
+
+	if (stat(index->manifest_path, &st) < 0) {
+		if (errno != ENOENT) {
+			*error_r = t_strdup_printf("stat(%s) failed: %m",
+						   index->manifest_path);
+			return -1;
+		}
+		/* no index yet */
+		fts_native_index_close_segments(index);
+		array_clear(&index->expunged);
+		index->manifest_exists = FALSE;
+		index->last_uid = 0;
+		index->next_segment_id = 0;
+		return 1;
+	}
+	if (index->manifest_exists &&
+	    st.st_ino == index->manifest_st.st_ino &&
+	    CMP_DEV_T(st.st_dev, index->manifest_st.st_dev) &&
+	    st.st_size == index->manifest_st.st_size &&
+	    st.st_mtime == index->manifest_st.st_mtime &&
+	    st.st_ctime == index->manifest_st.st_ctime)
+		return 1;
+
+	buf = t_buffer_create(st.st_size);
+	if ((ret = fts_native_manifest_read(index, &st, buf, error_r)) <= 0)
+		return ret;
+	hdr = buf->data;
+	ids = CONST_PTR_OFFSET(buf->data, hdr->hdr_size);
+	expunged = (const void *)(ids + hdr->segment_count);
+
+	/* keep the already mapped segments and open the new ones */
+	t_array_init(&new_segments, hdr->segment_count);
+	for (i = 0; i < hdr->segment_count; i++) {
+		seg = NULL;
+		array_foreach_modifiable(&index->segments, segp) {
+			if (*segp != NULL && (*segp)->id == ids[i]) {
+				seg = *segp;
+				*segp = NULL;
+				break;
+			}
+		}
+		if (seg == NULL &&
+		    (ret = fts_native_segment_open(index, ids[i], &seg,
+						   error_r)) <= 0)
+			break;
+		array_push_back(&new_segments, &seg);
+	}
+	array_foreach_modifiable(&index->segments, segp) {
+		if (*segp != NULL)
+			fts_native_segment_free(segp);
+	}
+	array_clear(&index->segments);
+	if (i < hdr->segment_count) {
+		/* drop the whole view - the next refresh reopens it */
+		array_foreach_modifiable(&new_segments, segp)
+			fts_native_segment_free(segp);
+		index->manifest_exists = FALSE;
+		return ret;
+	}
+	array_append_array(&index->segments, &new_segments);
+
+	array_clear(&index->expunged);
+	array_append(&index->expunged, expunged, hdr->expunged_count);
+	index->manifest_st = st;
+	index->manifest_exists = TRUE;
+	index->last_uid = hdr->last_uid;
+	index->next_segment_id = hdr->next_segment_id;
+	return 1;
+}
+
+int fts_native_index_refresh(struct fts_native_index *index,
+			     const char **error_r)
+{
+	unsigned int i;
+	int ret;
+
+	for (i = 0; i < FTS_NATIVE_REFRESH_RETRY_COUNT; i++) {
+		T_BEGIN {
+			ret = fts_native_index_refresh_try(index, error_r);
+		} T_END_PASS_STR_IF(ret < 0, error_r);
+		if (ret != 0)
+			return ret < 0 ? -1 : 0;
+	}
+	*error_r = t_strdup_printf("%s: Segments keep disappearing",
+				   index->manifest_path);
+	return -1;
+}
+
+uint32_t fts_native_index_get_last_uid(struct fts_native_index *index)
+{
+	return I_MAX(index->last_uid, index->pending_last_uid);
+}
+
+unsigned int fts_native_index_get_segment_count(struct fts_native_index *index)
+{
+	return array_count(&index->segments);
+}
+
+void fts_native_index_add(struct fts_native_index *index,
+			  const char *term, uint32_t uid)
+{
+	struct fts_native_pending_term *pterm;
+	const uint32_t *last_uid;
+
+	i_assert(uid > 0);
+
+	pterm = hash_table_lookup(index->pending_terms, term);
+	if (pterm == NULL) {
+		pterm = p_new(index->pending_pool,
+			      struct fts_native_pending_term, 1);
+		pterm->term = p_strdup(index->pending_pool, term);
+		i_array_init(&pterm->uids, 4);
+		hash_table_insert(index->pending_terms,
+				  (char *)pterm->term, pterm);
+	} else {
+		last_uid = array_back(&pterm->uids);
+		if (*last_uid == uid)
+			return;
+	}
+	array_push_back(&pterm->uids, &uid);
+	fts_native_index_set_last_uid(index, uid);
+}
+
+void fts_native_index_set_last_uid(struct fts_native_index *index,
+				   uint32_t uid)
+{
+	if (index->pending_last_uid < uid)
+		index->pending_last_uid = uid;
+}
+
+void fts_native_index_expunge(struct fts_native_index *index,
+			      uint32_t uid1, uint32_t uid2)
+{
+	seq_range_array_add_range(&index->pending_expunges, uid1, uid2);
+}
+
+bool fts_native_index_have_changes(struct fts_native_index *index)
+{
+	return hash_table_count(index->pending_terms) > 0 ||
+		array_count(&index->pending_expunges) > 0 ||
+		index->pending_last_uid > index->last_uid;
+}
+
+static int
+fts_native_index_lock(struct fts_native_index *index,
+		      struct file_lock **lock_r, const char **error_r)
+{
+	struct file_create_settings set;
+	const char *path, *error;
+	bool created;
+
+	i_zero(&set);
+	set.lock_timeout_secs = index->set.lock_timeout_secs;
+	set.lock_settings.lock_method = index->set.lock_method;
+	set.lock_settings.unlink_on_free = TRUE;
+	set.lock_settings.close_on_free = TRUE;
+	set.mkdir_mode = 0700;
+
+	path = t_strconcat(index->dir, "/", FTS_NATIVE_LOCK_FNAME, NULL);
+	if (file_create_locked(path, &set, lock_r, &created, &error) == -1) {
+		*error_r = t_strdup_printf("file_create_locked(%s) failed: %s",
+					   path, error);
+		return -1;
+	}
+	return 0;
+}
+
+static struct fts_native_segment_writer *
+fts_native_segment_writer_init(struct fts_native_index *index, uint32_t id,
+			       const char **error_r)
+{
+	struct fts_native_segment_writer *writer;
+	struct fts_native_segment_header hdr;
+	const char *path = fts_native_segment_path(index, id);
+	int fd;
+
+	/* The segment isn't referenced by the manifest yet, so it's safe to
+	   overwrite any leftover file from a previously failed write. */
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1) {
+		*error_r = t_strdup_printf("open(%s) failed: %m", path);
+		return NULL;
+	}
+
+	writer = i_new(struct fts_native_segment_writer, 1);
+	writer->path = i_strdup(path);
+	writer->fd = fd;
+	writer->output = o_stream_create_fd_file(fd, 0, FALSE);
+	writer->postings = buffer_create_dynamic(default_pool, 256);
+	i_array_init(&writer->dict, 1024);
+
+	/* the header is written when finishing */
+	i_zero(&hdr);
+	o_stream_nsend(writer->output, &hdr, sizeof(hdr));
+	return writer;
+}
+
+static void
+fts_native_segment_writer_free(struct fts_native_segment_writer **_writer)
+{
+	struct fts_native_segment_writer *writer = *_writer;
+
+	*_writer = NULL;
+	o_stream_destroy(&writer->output);
+	i_close_fd(&writer->fd);
+	buffer_free(&writer->postings);
+	array_free(&writer->dict);
+	i_free(writer->path);
+	i_free(writer);
+}
+
+static void
+fts_native_segment_writer_abort(struct fts_native_segment_writer **_writer)
+{
+	struct fts_native_segment_writer *writer = *_writer;
+
+	o_stream_abort(writer->output);
+	i_unlink_if_exists(writer->path);
+	fts_native_segment_writer_free(_writer);
+}
+
+/* The UIDs must be sorted and unique. */
+static void
+fts_native_segment_writer_add(struct fts_native_segment_writer *writer,
+			      const char *term, const uint32_t *uids,
+			      unsigned int count)
+{
+	uint32_t offset, prev_uid = 0;
+	unsigned int i;
+
+	i_assert(count > 0);
+
+	if (writer->output->offset > (uint32_t)-1) {
+		/* too large segment - the error is returned by finish */
+		return;
+	}
+	offset = writer->output->offset;
+	array_push_back(&writer->dict, &offset);
+
+	buffer_set_used_size(writer->postings, 0);
+	buffer_append(writer->postings, term, strlen(term) + 1);
+	numpack_encode(writer->postings, count);
+	for (i = 0; i < count; i++) {
+		i_assert(uids[i] > prev_uid);
+		numpack_encode(writer->postings, uids[i] - prev_uid);
+		prev_uid = uids[i];
+	}
+	o_stream_nsend(writer->output, writer->postings->data,
+		       writer->postings->used);
+}
+
+static int
+fts_native_segment_writer_finish(struct fts_native_segment_writer **_writer,
+				 const char **error_r)
+{
+	struct fts_native_segment_writer *writer = *_writer;
+	struct fts_native_segment_header hdr;
+	static const uint8_t padding[sizeof(uint32_t)] = { 0, };
+	size_t pad;
+
+	pad = writer->output->offset % sizeof(uint32_t);
+	if (pad != 0)
+		o_stream_nsend(writer->output, padding, sizeof(uint32_t) - pad);
+
+	i_zero(&hdr);
+	hdr.version = FTS_NATIVE_SEGMENT_VERSION;
+	hdr.hdr_size = sizeof(hdr);
+	hdr.term_count = array_count(&writer->dict);
+	hdr.dict_offset = writer->output->offset;
+	if (writer->output->offset > (uint32_t)-1) {
+		*error_r = t_strdup_printf("%s: Segment became too large",
+					   writer->path);
+		fts_native_segment_writer_abort(_writer);
+		return -1;
+	}
+	o_stream_nsend(writer->output, array_front(&writer->dict),
+		       array_count(&writer->dict) * sizeof(uint32_t));
+	if (o_stream_finish(writer->output) < 0) {
+		*error_r = t_strdup_printf("write(%s) failed: %s", writer->path,
+					   o_stream_get_error(writer->output));
+		fts_native_segment_writer_abort(_writer);
+		return -1;
+	}
+	if (pwrite_full(writer->fd, &hdr, sizeof(hdr), 0) < 0) {
+		*error_r = t_strdup_printf("pwrite(%s) failed: %m",
+					   writer->path);
+		fts_native_segment_writer_abort(_writer);
+		return -1;
+	}
+	fts_native_segment_writer_free(_writer);
+	return 0;
+}
+
+static int fts_native_pending_term_cmp(struct fts_native_pending_term *const *t1,
+				       struct fts_native_pending_term *const *t2)
+{
+	return strcmp((*t1)->term, (*t2)->term);
+}
+
+static void fts_native_uids_sort_unique(ARRAY_TYPE(uint32_t) *uids)
+{
+	uint32_t *data;
+	unsigned int i, j, count;
+
+	array_sort(uids, uint32_cmp);
+	data = array_get_modifiable(uids, &count);
+	for (i = j = 1; i < count; i++) {
+		if (data[i] != data[j-1])
+			data[j++] = data[i];
+	}
+	if (count > 0)
+		array_delete(uids, j, count - j);
+}
+
+static int
+fts_native_index_write_pending(struct fts_native_index *index, uint32_t id,
+			       const char **error_r)
+{
+	ARRAY(struct fts_native_pending_term *) terms;
+	struct fts_native_pending_term *pterm, *const *ptermp;
+	struct fts_native_segment_writer *writer;
+	struct hash_iterate_context *iter;
+	char *term;
+
+	t_array_init(&terms, hash_table_count(index->pending_terms));
+	iter = hash_table_iterate_init(index->pending_terms);
+	while (hash_table_iterate(iter, index->pending_terms, &term, &pterm))
+		array_push_back(&terms, &pterm);
+	hash_table_iterate_deinit(&iter);
+	array_sort(&terms, fts_native_pending_term_cmp);
+
+	writer = fts_native_segment_writer_init(index, id, error_r);
+	if (writer == NULL)
+		return -1;
+	array_foreach(&terms, ptermp) {
+		pterm = *ptermp;
+		fts_native_uids_sort_unique(&pterm->uids);
+		fts_native_segment_writer_add(writer, pterm->term,
+					      array_front(&pterm->uids),
+					      array_count(&pterm->uids));
+	}
+	return fts_native_segment_writer_finish(&writer, error_r);
+}
+
+struct fts_native_merge_cursor {
+	struct fts_native_segment *seg;
+	unsigned int idx;
+	const char *term;
+	const uint8_t *postings;
+};
+
+static int
+fts_native_merge_cursor_next(struct fts_native_merge_cursor *cursor,
+			     const char **error_r)
+{
+	if (cursor->idx == cursor->seg->term_count) {
+		cursor->term = NULL;
+		return 0;
+	}
+	return fts_native_segment_get_term(cursor->seg, cursor->idx++,
+					   &cursor->term, &cursor->postings,
+					   error_r);
+}
+
+static int
+fts_native_index_merge_segments(struct fts_native_index *index, uint32_t id,
+				const ARRAY_TYPE(seq_range) *expunged,
+				const char **error_r)
+{
+	ARRAY(struct fts_native_merge_cursor) cursors;
+	struct fts_native_merge_cursor *cursor;
+	struct fts_native_segment *const *segp;
+	struct fts_native_segment_writer *writer;
+	ARRAY_TYPE(uint32_t) uids;
+	uint32_t *data;
+	unsigned int i, j, count;
+	const char *min_term;
+	int ret = 0;
+
+	t_array_init(&cursors, array_count(&index->segments));
+	array_foreach(&index->segments, segp) {
+		cursor = array_append_space(&cursors);
+		cursor->seg = *segp;
+		if (fts_native_merge_cursor_next(cursor, error_r) < 0)
+			return -1;
+	}
+
+	writer = fts_native_segment_writer_init(index, id, error_r);
+	if (writer == NULL)
+		return -1;
+
+	t_array_init(&uids, 128);
+	for (;;) {
+		/* the segment count is small, so a linear scan for the
+		   smallest term is good enough */
+		min_term = NULL;
+		array_foreach_modifiable(&cursors, cursor) {
+			if (cursor->term != NULL &&
+			    (min_term == NULL ||
+			     strcmp(cursor->term, min_term) < 0))
+				min_term = cursor->term;
+		}
+		if (min_term == NULL)
+			break;
+
+		array_clear(&uids);
+		array_foreach_modifiable(&cursors, cursor) {
+			if (cursor->term == NULL ||
+			    strcmp(cursor->term, min_term) != 0)
+				continue;
+			if (fts_native_segment_read_postings(cursor->seg,
+					cursor->postings,
+					fts_native_uid_array_add, &uids,
+					error_r) < 0 ||
+			    fts_native_merge_cursor_next(cursor, error_r) < 0) {
+				ret = -1;
+				break;
+			}
+		}
+		if (ret < 0)
+			break;
+
+		fts_native_uids_sort_unique(&uids);
+		data = array_get_modifiable(&uids, &count);
+		for (i = j = 0; i < count; i++) {
+			if (!seq_range_exists(expunged, data[i]))
+				data[j++] = data[i];
+		}
+		if (j > 0)
+			fts_native_segment_writer_add(writer, min_term, data, j);
+	}
+	if (ret < 0) {
+		fts_native_segment_writer_abort(&writer);
+		return -1;
+	}
+	return fts_native_segment_writer_finish(&writer, error_r);
+}
+
+static int
+fts_native_manifest_write(struct fts_native_index *index, uint32_t last_uid,
+			  uint32_t next_segment_id,
+			  const ARRAY_TYPE(uint32_t) *segment_ids,
+			  const ARRAY_TYPE(seq_range) *expunged,
+			  const char **error_r)
+{
+	struct fts_native_manifest_header hdr;
+	const char *temp_path;
+	buffer_t *buf;
+	int fd;
+
+	i_zero(&hdr);
+	hdr.version = FTS_NATIVE_MANIFEST_VERSION;
+	hdr.hdr_size = sizeof(hdr);
+	hdr.last_uid = last_uid;
+	hdr.next_segment_id = next_segment_id;
+	hdr.segment_count = array_count(segment_ids);
+	hdr.expunged_count = array_count(expunged);
+
+	buf = t_buffer_create(sizeof(hdr) +
+			      hdr.segment_count * sizeof(uint32_t) +
+			      hdr.expunged_count * sizeof(struct seq_range));
+	buffer_append(buf, &hdr, sizeof(hdr));
+	if (hdr.segment_count > 0) {
+		buffer_append(buf, array_front(segment_ids),
+			      hdr.segment_count * sizeof(uint32_t));
+	}
+	if (hdr.expunged_count > 0) {
+		buffer_append(buf, array_front(expunged),
+			      hdr.expunged_count * sizeof(struct seq_range));
+	}
+
+	/* we're holding the lock, so a fixed temp path is fine */
+	temp_path = t_strconcat(index->manifest_path, ".tmp", NULL);
+	fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1) {
+		*error_r = t_strdup_printf("open(%s) failed: %m", temp_path);
+		return -1;
+	}
+	if (write_full(fd, buf->data, buf->used) < 0) {
+		*error_r = t_strdup_printf("write(%s) failed: %m", temp_path);
+		i_close_fd(&fd);
+		i_unlink(temp_path);
+		return -1;
+	}
+	i_close_fd(&fd);
+	if (rename(temp_path, index->manifest_path) < 0) {
+		*error_r = t_strdup_printf("rename(%s, %s) failed: %m",
+					   temp_path, index->manifest_path);
+		i_unlink(temp_path);
+		return -1;
+	}
+	return 0;
+}
+
+static int
+fts_native_index_write_locked(struct fts_native_index *index, bool merge_all,
+			      const char **error_r)
+{
+	ARRAY_TYPE(uint32_t) segment_ids, old_segment_ids;
+	ARRAY_TYPE(seq_range) expunged;
+	struct fts_native_segment *const *segp, *seg;
+	uint32_t last_uid, next_segment_id, id;
+	const uint32_t *idp;
+	int ret;
+
+	if (fts_native_index_refresh(index, error_r) < 0)
+		return -1;
+
+	last_uid = I_MAX(index->last_uid, index->pending_last_uid);
+	next_segment_id = index->next_segment_id;
+	t_array_init(&segment_ids, array_count(&index->segments) + 1);
+	array_foreach(&index->segments, segp)
+		array_push_back(&segment_ids, &(*segp)->id);
+	t_array_init(&expunged, array_count(&index->expunged) +
+		     array_count(&index->pending_expunges));
+	array_append_array(&expunged, &index->expunged);
+	seq_range_array_merge(&expunged, &index->pending_expunges);
+
+	if (hash_table_count(index->pending_terms) > 0) {
+		id = next_segment_id++;
+		if (fts_native_index_write_pending(index, id, error_r) < 0)
+			return -1;
+		/* open it already, so it's included in a merge */
+		if ((ret = fts_native_segment_open(index, id, &seg,
+						   error_r)) <= 0) {
+			if (ret == 0) {
+				*error_r = t_strdup_printf(
+					"Segment %s disappeared",
+					fts_native_segment_path(index, id));
+			}
+			return -1;
+		}
+		array_push_back(&index->segments, &seg);
+		array_push_back(&segment_ids, &id);
+	}
+
+	t_array_init(&old_segment_ids, 1);
+	if (array_count(&segment_ids) > 0 &&
+	    (merge_all ? (array_count(&segment_ids) > 1 ||
+			  array_count(&expunged) > 0) :
+	     (index->set.merge_limit > 0 &&
+	      array_count(&segment_ids) > index->set.merge_limit))) {
+		id = next_segment_id++;
+		if (fts_native_index_merge_segments(index, id, &expunged,
+						    error_r) < 0)
+			return -1;
+		array_append_array(&old_segment_ids, &segment_ids);
+		array_clear(&segment_ids);
+		array_push_back(&segment_ids, &id);
+		/* all segments were merged, so the expunged UIDs are gone */
+		array_clear(&expunged);
+	}
+
+	if (fts_native_manifest_write(index, last_uid, next_segment_id,
+				      &segment_ids, &expunged, error_r) < 0)
+		return -1;
+
+	/* readers that have the old segments mmaped can still use them */
+	array_foreach(&old_segment_ids, idp)
+		i_unlink_if_exists(fts_native_segment_path(index, *idp));
+	return 0;
+}
+
+static int
+fts_native_index_write(struct fts_native_index *index, bool merge_all,
+		       const char **error_r)
+{
+	struct file_lock *lock;
+	int ret;
+
+	if (fts_native_index_lock(index, &lock, error_r) < 0)
+		return -1;
+	T_BEGIN {
+		ret = fts_native_index_write_locked(index, merge_all, error_r);
+	} T_END_PASS_STR_IF(ret < 0, error_r);
+	file_lock_free(&lock);
+
+	if (ret < 0) {
+		/* the view may contain segments that didn't make it to the
+		   manifest - make sure the next refresh rebuilds it */
+		index->manifest_exists = FALSE;
+		return -1;
+	}
+	fts_native_index_pending_clear(index);
+	return fts_native_index_refresh(index, error_r);
+}
+
+int fts_native_index_flush(struct fts_native_index *index,
+			   const char **error_r)
+{
+	if (!fts_native_index_have_changes(index))
+		return 0;
+	return fts_native_index_write(index, FALSE, error_r);
+}
+
+int fts_native_index_optimize(struct fts_native_index *index,
+			      const char **error_r)
+{
+	if (fts_native_index_refresh(index, error_r) < 0)
+		return -1;
+	if (!fts_native_index_have_changes(index) &&
+	    array_count(&index->segments) <= 1 &&
+	    array_count(&index->expunged) == 0)
+		return 0;
+	return fts_native_index_write(index, TRUE, error_r);
+}
+
+int fts_native_index_lookup(struct fts_native_index *index,
+			    const char *term, bool prefix,
+			    ARRAY_TYPE(seq_range) *uids, const char **error_r)
+{
+	struct fts_native_segment *const *segp;
+	ARRAY_TYPE(seq_range) found;
+	int ret = 0;
+
+	i_array_init(&found, 64);
+	array_foreach(&index->segments, segp) {
+		if (fts_native_segment_lookup(*segp, term, prefix,
+					      &found, error_r) < 0) {
+			ret = -1;
+			break;
+		}
+	}
+	if (ret == 0) {
+		seq_range_array_remove_seq_range(&found, &index->expunged);
+		seq_range_array_merge(uids, &found);
+	}
+	array_free(&found);
+	return ret;
+}
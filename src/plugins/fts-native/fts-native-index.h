@@ -0,0 +1,77 @@
+#ifndef FTS_NATIVE_INDEX_H
+#define FTS_NATIVE_INDEX_H
+
+#include "file-lock.h"
+#include "seq-range-array.h"
+
+/* Per-mailbox inverted index. The index directory contains immutable
+   segment files and a manifest listing the currently active segments, the
+   last indexed UID and the expunged UIDs that haven't yet been dropped from
+   the segments.
+
+   Each segment has a sorted term dictionary and for each term a posting list
+   of UIDs stored as numpack'ed deltas. Segments are mmap()ed for lookups.
+   New terms are buffered in memory and written as a new segment by
+   fts_native_index_flush(). Once there are too many segments, they're merged
+   into a single segment. The manifest is always replaced with rename(), so
+   readers never need to lock anything. */
+
+#define FTS_NATIVE_MANIFEST_FNAME "manifest"
+#define FTS_NATIVE_SEGMENT_FNAME_PREFIX "segment."
+#define FTS_NATIVE_LOCK_FNAME "lock"
+
+struct fts_native_index_settings {
+	/* Merge all segments into one when there are more than this many
+	   segments. 0 = never merge automatically. */
+	unsigned int merge_limit;
+
+	enum file_lock_method lock_method;
+	unsigned int lock_timeout_secs;
+};
+
+/* Allocate the index. Nothing is read from disk yet. */
+struct fts_native_index *
+fts_native_index_init(const char *dir,
+		      const struct fts_native_index_settings *set);
+/* Free the index. Any unflushed changes are dropped. */
+void fts_native_index_deinit(struct fts_native_index **index);
+
+/* Re-read the manifest if it has changed. A nonexistent index is handled
+   as an empty index. Returns 0 on success, -1 on error. */
+int fts_native_index_refresh(struct fts_native_index *index,
+			     const char **error_r);
+/* Returns the last indexed UID as of the last refresh, including any
+   unflushed changes. */
+uint32_t fts_native_index_get_last_uid(struct fts_native_index *index);
+/* Returns the number of active segments as of the last refresh. */
+unsigned int fts_native_index_get_segment_count(struct fts_native_index *index);
+
+/* Add UID to the term's posting list. The change is buffered until flush. */
+void fts_native_index_add(struct fts_native_index *index,
+			  const char *term, uint32_t uid);
+/* Mark the UID as indexed even if it had no terms. */
+void fts_native_index_set_last_uid(struct fts_native_index *index,
+				   uint32_t uid);
+/* Mark the UIDs as expunged. The change is buffered until flush. */
+void fts_native_index_expunge(struct fts_native_index *index,
+			      uint32_t uid1, uint32_t uid2);
+/* Returns TRUE if there are unflushed changes. */
+bool fts_native_index_have_changes(struct fts_native_index *index);
+
+/* Write the buffered changes to disk and merge the segments if there are
+   more than merge_limit of them. Returns 0 on success, -1 on error. */
+int fts_native_index_flush(struct fts_native_index *index,
+			   const char **error_r);
+/* Merge all the segments into one, dropping expunged UIDs.
+   Returns 0 on success, -1 on error. */
+int fts_native_index_optimize(struct fts_native_index *index,
+			      const char **error_r);
+
+/* Add the non-expunged UIDs containing the term to uids. If prefix is TRUE,
+   all terms beginning with the term are matched. Returns 0 on success, -1 if
+   the index is corrupted. */
+int fts_native_index_lookup(struct fts_native_index *index,
+			    const char *term, bool prefix,
+			    ARRAY_TYPE(seq_range) *uids, const char **error_r);
+
+#endif
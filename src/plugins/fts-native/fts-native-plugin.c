@@ -0,0 +1,109 @@
+/* Copyright (c) 2023 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "mail-storage-hooks.h"
+#include "fts-user.h"
+#include "fts-backend-native.h"
+#include "fts-native-plugin.h"
+
+#define FTS_NATIVE_PLUGIN_COMMIT_LIMIT "fts_native_commit_limit"
+#define FTS_NATIVE_COMMIT_LIMIT_DEFAULT 500
+
+#define FTS_NATIVE_PLUGIN_MAX_TERM_SIZE "fts_native_max_term_size"
+#define FTS_NATIVE_MAX_TERM_SIZE_DEFAULT 30
+#define FTS_NATIVE_MAX_TERM_SIZE_MAX 200
+
+#define FTS_NATIVE_PLUGIN_MIN_TERM_SIZE "fts_native_min_term_size"
+#define FTS_NATIVE_MIN_TERM_SIZE_DEFAULT 2
+
+#define FTS_NATIVE_PLUGIN_MERGE_LIMIT "fts_native_merge_limit"
+#define FTS_NATIVE_MERGE_LIMIT_DEFAULT 8
+
+const char *fts_native_plugin_version = DOVECOT_ABI_VERSION;
+
+struct fts_native_user_module fts_native_user_module =
+	MODULE_CONTEXT_INIT(&mail_user_module_register);
+
+static void fts_native_mail_user_deinit(struct mail_user *user)
+{
+	struct fts_native_user *fuser = FTS_NATIVE_USER_CONTEXT_REQUIRE(user);
+
+	fts_mail_user_deinit(user);
+	fuser->module_ctx.super.deinit(user);
+}
+
+static int
+fts_native_plugin_get_uint(struct mail_user *user, const char *name,
+			   unsigned int default_value, unsigned int *value_r,
+			   const char **error_r)
+{
+	const char *value = mail_user_plugin_getenv(user, name);
+
+	*value_r = default_value;
+	if (value != NULL && str_to_uint(value, value_r) < 0) {
+		*error_r = t_strdup_printf("Invalid %s: %s", name, value);
+		return -1;
+	}
+	return 0;
+}
+
+static int
+fts_native_plugin_init_settings(struct mail_user *user,
+				struct fts_native_settings *set,
+				const char **error_r)
+{
+	if (fts_native_plugin_get_uint(user, FTS_NATIVE_PLUGIN_COMMIT_LIMIT,
+				       FTS_NATIVE_COMMIT_LIMIT_DEFAULT,
+				       &set->commit_limit, error_r) < 0 ||
+	    fts_native_plugin_get_uint(user, FTS_NATIVE_PLUGIN_MAX_TERM_SIZE,
+				       FTS_NATIVE_MAX_TERM_SIZE_DEFAULT,
+				       &set->max_term_size, error_r) < 0 ||
+	    fts_native_plugin_get_uint(user, FTS_NATIVE_PLUGIN_MIN_TERM_SIZE,
+				       FTS_NATIVE_MIN_TERM_SIZE_DEFAULT,
+				       &set->min_term_size, error_r) < 0 ||
+	    fts_native_plugin_get_uint(user, FTS_NATIVE_PLUGIN_MERGE_LIMIT,
+				       FTS_NATIVE_MERGE_LIMIT_DEFAULT,
+				       &set->merge_limit, error_r) < 0)
+		return -1;
+	set->max_term_size = I_MIN(set->max_term_size,
+				   FTS_NATIVE_MAX_TERM_SIZE_MAX);
+	return 0;
+}
+
+static void fts_native_mail_user_created(struct mail_user *user)
+{
+	struct mail_user_vfuncs *v = user->vlast;
+	struct fts_native_user *fuser;
+	const char *error;
+
+	fuser = p_new(user->pool, struct fts_native_user, 1);
+
+	if (fts_native_plugin_init_settings(user, &fuser->set, &error) < 0 ||
+	    fts_mail_user_init(user, TRUE, &error) < 0) {
+		e_error(user->event, FTS_NATIVE_DEBUG_PREFIX "%s", error);
+		return;
+	}
+
+	fuser->module_ctx.super = *v;
+	user->vlast = &fuser->module_ctx.super;
+	v->deinit = fts_native_mail_user_deinit;
+	MODULE_CONTEXT_SET(user, fts_native_user_module, fuser);
+}
+
+static struct mail_storage_hooks fts_backend_mail_storage_hooks = {
+	.mail_user_created = fts_native_mail_user_created
+};
+
+void fts_native_plugin_init(struct module *module)
+{
+	fts_backend_register(&fts_backend_native);
+	mail_storage_hooks_add(module, &fts_backend_mail_storage_hooks);
+}
+
+void fts_native_plugin_deinit(void)
+{
+	fts_backend_unregister(fts_backend_native.name);
+	mail_storage_hooks_remove(&fts_backend_mail_storage_hooks);
+}
+
+const char *fts_native_plugin_dependencies[] = { "fts", NULL };
@@ -0,0 +1,213 @@
+/* Copyright (c) 2023 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "str.h"
+#include "unlink-directory.h"
+#include "test-common.h"
+#include "fts-native-index.h"
+
+#include <unistd.h>
+
+#define TEST_INDEX_DIR ".test-fts-native-index"
+
+static const struct fts_native_index_settings test_set = {
+	.merge_limit = 0,
+	.lock_method = FILE_LOCK_METHOD_FCNTL,
+	.lock_timeout_secs = 1,
+};
+
+static void test_index_cleanup(void)
+{
+	const char *error;
+
+	if (unlink_directory(TEST_INDEX_DIR, UNLINK_DIRECTORY_FLAG_RMDIR,
+			     &error) < 0)
+		i_fatal("unlink_directory(%s) failed: %s", TEST_INDEX_DIR, error);
+}
+
+static const char *
+test_lookup(struct fts_native_index *index, const char *term, bool prefix)
+{
+	ARRAY_TYPE(seq_range) uids;
+	const struct seq_range *range;
+	string_t *str = t_str_new(64);
+	const char *error;
+
+	t_array_init(&uids, 8);
+	test_assert(fts_native_index_lookup(index, term, prefix, &uids,
+					    &error) == 0);
+	array_foreach(&uids, range) {
+		if (str_len(str) > 0)
+			str_append_c(str, ',');
+		if (range->seq1 == range->seq2)
+			str_printfa(str, "%u", range->seq1);
+		else
+			str_printfa(str, "%u:%u", range->seq1, range->seq2);
+	}
+	return str_c(str);
+}
+
+static void test_fts_native_index_lookup(void)
+{
+	struct fts_native_index *index;
+	const char *error;
+
+	test_begin("fts native index lookup");
+	test_index_cleanup();
+	index = fts_native_index_init(TEST_INDEX_DIR, &test_set);
+
+	/* nonexistent index is empty */
+	test_assert(fts_native_index_refresh(index, &error) == 0);
+	test_assert(fts_native_index_get_last_uid(index) == 0);
+	test_assert_strcmp(test_lookup(index, "foo", TRUE), "");
+
+	fts_native_index_add(index, "foo", 1);
+	fts_native_index_add(index, "foo", 1);
+	fts_native_index_add(index, "foobar", 2);
+	fts_native_index_add(index, "bar", 2);
+	fts_native_index_add(index, "foo", 3);
+	fts_native_index_set_last_uid(index, 5);
+	test_assert(fts_native_index_get_last_uid(index) == 5);
+	/* nothing is visible before flushing */
+	test_assert_strcmp(test_lookup(index, "foo", FALSE), "");
+	test_assert(fts_native_index_flush(index, &error) == 0);
+	test_assert(!fts_native_index_have_changes(index));
+	test_assert(fts_native_index_get_segment_count(index) == 1);
+
+	test_assert_strcmp(test_lookup(index, "foo", FALSE), "1,3");
+	test_assert_strcmp(test_lookup(index, "foo", TRUE), "1:3");
+	test_assert_strcmp(test_lookup(index, "fo", TRUE), "1:3");
+	test_assert_strcmp(test_lookup(index, "fo", FALSE), "");
+	test_assert_strcmp(test_lookup(index, "bar", FALSE), "2");
+	test_assert_strcmp(test_lookup(index, "baz", TRUE), "");
+	test_assert_strcmp(test_lookup(index, "zzz", TRUE), "");
+	test_assert(fts_native_index_get_last_uid(index) == 5);
+
+	/* a second segment */
+	fts_native_index_add(index, "foo", 6);
+	fts_native_index_add(index, "baz", 7);
+	test_assert(fts_native_index_flush(index, &error) == 0);
+	test_assert(fts_native_index_get_segment_count(index) == 2);
+	test_assert_strcmp(test_lookup(index, "foo", FALSE), "1,3,6");
+	test_assert_strcmp(test_lookup(index, "ba", TRUE), "2,7");
+	test_assert(fts_native_index_get_last_uid(index) == 7);
+
+	/* expunges are filtered out */
+	fts_native_index_expunge(index, 3, 6);
+	test_assert(fts_native_index_flush(index, &error) == 0);
+	test_assert(fts_native_index_get_segment_count(index) == 2);
+	test_assert_strcmp(test_lookup(index, "foo", TRUE), "1:2");
+
+	fts_native_index_deinit(&index);
+	test_index_cleanup();
+	test_end();
+}
+
+static void test_fts_native_index_merge(void)
+{
+	struct fts_native_index_settings set = test_set;
+	struct fts_native_index *index, *reader;
+	const char *error;
+	char term[32];
+	uint32_t uid;
+
+	test_begin("fts native index merge");
+	test_index_cleanup();
+	set.merge_limit = 3;
+	index = fts_native_index_init(TEST_INDEX_DIR, &set);
+	reader = fts_native_index_init(TEST_INDEX_DIR, &set);
+
+	for (uid = 1; uid <= 3; uid++) {
+		i_snprintf(term, sizeof(term), "term%u", uid);
+		fts_native_index_add(index, term, uid);
+		fts_native_index_add(index, "all", uid);
+		test_assert(fts_native_index_flush(index, &error) == 0);
+	}
+	test_assert(fts_native_index_get_segment_count(index) == 3);
+	test_assert(fts_native_index_refresh(reader, &error) == 0);
+	test_assert_strcmp(test_lookup(reader, "all", FALSE), "1:3");
+
+	/* the fourth segment triggers a merge */
+	fts_native_index_expunge(index, 2, 2);
+	fts_native_index_add(index, "all", 4);
+	test_assert(fts_native_index_flush(index, &error) == 0);
+	test_assert(fts_native_index_get_segment_count(index) == 1);
+	test_assert_strcmp(test_lookup(index, "all", FALSE), "1,3:4");
+	test_assert_strcmp(test_lookup(index, "term", TRUE), "1,3");
+
+	/* the reader can still use its mmaped segments until refresh */
+	test_assert_strcmp(test_lookup(reader, "all", FALSE), "1:3");
+	test_assert(fts_native_index_refresh(reader, &error) == 0);
+	test_assert(fts_native_index_get_segment_count(reader) == 1);
+	test_assert_strcmp(test_lookup(reader, "all", FALSE), "1,3:4");
+	test_assert(fts_native_index_get_last_uid(reader) == 4);
+
+	/* optimize drops the expunged UIDs even with a single segment */
+	fts_native_index_expunge(index, 1, 1);
+	test_assert(fts_native_index_flush(index, &error) == 0);
+	test_assert(fts_native_index_optimize(index, &error) == 0);
+	test_assert(fts_native_index_get_segment_count(index) == 1);
+	test_assert_strcmp(test_lookup(index, "all", FALSE), "3:4");
+	test_assert_strcmp(test_lookup(index, "term1", FALSE), "");
+	test_assert(fts_native_index_get_last_uid(index) == 4);
+
+	fts_native_index_deinit(&reader);
+	fts_native_index_deinit(&index);
+	test_index_cleanup();
+	test_end();
+}
+
+static void test_fts_native_index_large(void)
+{
+	struct fts_native_index *index;
+	const char *error;
+	char term[32];
+	uint32_t uid;
+	unsigned int i;
+
+	test_begin("fts native index large");
+	test_index_cleanup();
+	index = fts_native_index_init(TEST_INDEX_DIR, &test_set);
+	for (uid = 1; uid <= 1000; uid++) {
+		for (i = 0; i < 10; i++) {
+			if (uid % (i + 1) != 0)
+				continue;
+			i_snprintf(term, sizeof(term), "mod%u", i + 1);
+			fts_native_index_add(index, term, uid * 1000);
+		}
+		if (uid % 100 == 0)
+			test_assert(fts_native_index_flush(index, &error) == 0);
+	}
+	test_assert(fts_native_index_optimize(index, &error) == 0);
+	test_assert(fts_native_index_get_segment_count(index) == 1);
+	test_assert_strcmp(test_lookup(index, "mod1000", FALSE), "");
+	T_BEGIN {
+		ARRAY_TYPE(seq_range) uids;
+
+		t_array_init(&uids, 8);
+		test_assert(fts_native_index_lookup(index, "mod", TRUE,
+						    &uids, &error) == 0);
+		test_assert(seq_range_count(&uids) == 1000);
+		array_clear(&uids);
+		test_assert(fts_native_index_lookup(index, "mod7", FALSE,
+						    &uids, &error) == 0);
+		test_assert(seq_range_count(&uids) == 1000 / 7);
+		test_assert(seq_range_exists(&uids, 7000));
+		test_assert(!seq_range_exists(&uids, 8000));
+	} T_END;
+	fts_native_index_deinit(&index);
+	test_index_cleanup();
+	test_end();
+}
+
+int main(void)
+{
+	static void (*const test_functions[])(void) = {
+		test_fts_native_index_lookup,
+		test_fts_native_index_merge,
+		test_fts_native_index_large,
+		NULL
+	};
+	return test_run(test_functions);
+}
@@ -1,36 +1,83 @@
 /* Copyright (c) 2014-2018 Dovecot authors, see the included COPYING file */
 
 #include "lib.h"
+#include "array.h"
 #include "ioloop.h"
 #include "istream.h"
+#include "ostream.h"
+#include "iostream-temp.h"
+#include "str.h"
+#include "hex-binary.h"
+#include "sha1.h"
+#include "hash-format.h"
+#include "mkdir-parents.h"
+#include "safe-mkstemp.h"
 #include "module-context.h"
 #include "iostream-ssl.h"
 #include "http-url.h"
 #include "http-client.h"
 #include "message-parser.h"
+#include "settings-parser.h"
 #include "mail-user.h"
+#include "mail-storage-settings.h"
 #include "fts-parser.h"
 
+#include <dirent.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <utime.h>
+#include <sys/stat.h>
+
 #define TIKA_USER_CONTEXT(obj) \
 	MODULE_CONTEXT(obj, fts_parser_tika_user_module)
 
+#define FTS_TIKA_CACHE_MAX_SIZE_DEFAULT (1024*1024*1024)
+/* Check the cache size at most this often */
+#define FTS_TIKA_CACHE_CLEANUP_INTERVAL_SECS (60*60)
+#define FTS_TIKA_CACHE_CLEANUP_STAMP_FNAME ".cleanup"
+#define FTS_TIKA_CACHE_TEMP_FNAME_PREFIX ".temp."
+
 struct fts_parser_tika_user {
 	union mail_user_module_context module_ctx;
 	struct http_url *http_url;
+
+	/* Directory for caching the extracted text by attachment hash and
+	   content type, NULL if caching is disabled. */
+	const char *cache_dir;
+	uoff_t cache_max_size;
 };
 
 struct tika_fts_parser {
 	struct fts_parser parser;
 	struct mail_user *user;
+	struct fts_parser_tika_user *tuser;
 	struct http_client_request *http_req;
 
 	struct ioloop *ioloop;
 	struct io *io;
 	struct istream *payload;
 
+	/* With caching the body is hashed and buffered until it's finished,
+	   so that the cache can be looked up before sending it to Tika. */
+	struct hash_format *hash;
+	struct ostream *body_output;
+	char *content_type, *content_disposition;
+
+	/* Tika's response is written to the cache while it's returned. */
+	struct ostream *cache_output;
+	char *cache_path, *cache_temp_path;
+
 	bool failed;
 };
 
+struct fts_tika_cache_file {
+	const char *path;
+	time_t mtime;
+	uoff_t size;
+};
+ARRAY_DEFINE_TYPE(fts_tika_cache_file, struct fts_tika_cache_file);
+
 static struct http_client *tika_http_client = NULL;
 static MODULE_CONTEXT_DEFINE_INIT(fts_parser_tika_user_module,
 				  &mail_user_module_register);
@@ -41,7 +88,7 @@ tika_get_http_client_url(struct mail_user *user, struct http_url **http_url_r)
 	struct fts_parser_tika_user *tuser = TIKA_USER_CONTEXT(user);
 	struct http_client_settings http_set;
 	struct ssl_iostream_settings ssl_set;
-	const char *url, *error;
+	const char *url, *str, *error;
 
 	url = mail_user_plugin_getenv(user, "fts_tika");
 	if (url == NULL) {
@@ -63,6 +110,18 @@ tika_get_http_client_url(struct mail_user *user, struct http_url **http_url_r)
 		return -1;
 	}
 
+	tuser->cache_dir = mail_user_plugin_getenv(user, "fts_tika_cache_dir");
+	if (tuser->cache_dir != NULL && tuser->cache_dir[0] == '\0')
+		tuser->cache_dir = NULL;
+	tuser->cache_max_size = FTS_TIKA_CACHE_MAX_SIZE_DEFAULT;
+	str = mail_user_plugin_getenv(user, "fts_tika_cache_max_size");
+	if (str != NULL &&
+	    settings_get_size(str, &tuser->cache_max_size, &error) < 0) {
+		i_error("fts_tika: Invalid fts_tika_cache_max_size: %s - "
+			"caching disabled", error);
+		tuser->cache_dir = NULL;
+	}
+
 	if (tika_http_client == NULL) {
 		mail_user_init_ssl_client_settings(user, &ssl_set);
 
@@ -139,12 +198,39 @@ fts_tika_parser_response(const struct http_response *response,
 	io_loop_stop(current_ioloop);
 }
 
+static void
+fts_parser_tika_request_init(struct tika_fts_parser *parser,
+			     const char *content_type,
+			     const char *content_disposition)
+{
+	struct http_url *http_url = parser->tuser->http_url;
+	struct http_client_request *http_req;
+
+	http_req = http_client_request(tika_http_client, "PUT",
+			http_url->host.name,
+			t_strconcat(http_url->path, http_url->enc_query, NULL),
+			fts_tika_parser_response, parser);
+	http_client_request_set_port(http_req, http_url->port);
+	http_client_request_set_ssl(http_req, http_url->have_ssl);
+	if (content_type != NULL)
+		http_client_request_add_header(http_req, "Content-Type",
+					       content_type);
+	if (content_disposition != NULL)
+		http_client_request_add_header(http_req, "Content-Disposition",
+					       content_disposition);
+	http_client_request_add_header(http_req, "Accept", "text/plain");
+
+	parser->http_req = http_req;
+}
+
 static struct fts_parser *
 fts_parser_tika_try_init(struct fts_parser_context *parser_context)
 {
 	struct tika_fts_parser *parser;
 	struct http_url *http_url;
-	struct http_client_request *http_req;
+	const struct mail_storage_settings *mail_set;
+	string_t *temp_prefix;
+	const char *error;
 
 	if (tika_get_http_client_url(parser_context->user, &http_url) < 0)
 		return NULL;
@@ -154,25 +240,313 @@ fts_parser_tika_try_init(struct fts_parser_context *parser_context)
 	parser = i_new(struct tika_fts_parser, 1);
 	parser->parser.v = fts_parser_tika;
 	parser->user = parser_context->user;
+	parser->tuser = TIKA_USER_CONTEXT(parser->user);
 
-	http_req = http_client_request(tika_http_client, "PUT",
-			http_url->host.name,
-			t_strconcat(http_url->path, http_url->enc_query, NULL),
-			fts_tika_parser_response, parser);
-	http_client_request_set_port(http_req, http_url->port);
-	http_client_request_set_ssl(http_req, http_url->have_ssl);
-	if (parser_context->content_type != NULL)
-		http_client_request_add_header(http_req, "Content-Type",
-					       parser_context->content_type);
-	if (parser_context->content_disposition != NULL)
-		http_client_request_add_header(http_req, "Content-Disposition",
-					       parser_context->content_disposition);
-	http_client_request_add_header(http_req, "Accept", "text/plain");
+	if (parser->tuser->cache_dir == NULL) {
+		fts_parser_tika_request_init(parser,
+			parser_context->content_type,
+			parser_context->content_disposition);
+		return &parser->parser;
+	}
 
-	parser->http_req = http_req;
+	/* Use the same hash as for attachments in single instance storage,
+	   so identical attachments share the same cache file. */
+	mail_set = mail_user_set_get_storage_set(parser->user);
+	if (hash_format_init(mail_set->mail_attachment_hash,
+			     &parser->hash, &error) < 0) {
+		/* we already checked this when verifying settings */
+		i_panic("mail_attachment_hash=%s unexpectedly failed: %s",
+			mail_set->mail_attachment_hash, error);
+	}
+	temp_prefix = t_str_new(128);
+	mail_user_set_get_temp_prefix(temp_prefix, parser->user->set);
+	parser->body_output =
+		iostream_temp_create_named(str_c(temp_prefix), 0, "fts_tika");
+	parser->content_type = i_strdup(parser_context->content_type);
+	parser->content_disposition =
+		i_strdup(parser_context->content_disposition);
 	return &parser->parser;
 }
 
+static int
+fts_tika_cache_file_cmp(const struct fts_tika_cache_file *f1,
+			const struct fts_tika_cache_file *f2)
+{
+	if (f1->mtime < f2->mtime)
+		return -1;
+	if (f1->mtime > f2->mtime)
+		return 1;
+	return 0;
+}
+
+static void fts_tika_cache_cleanup_dir(struct fts_parser_tika_user *tuser)
+{
+	ARRAY_TYPE(fts_tika_cache_file) files;
+	struct fts_tika_cache_file *file;
+	struct dirent *d;
+	struct stat st;
+	uoff_t total_size = 0;
+	DIR *dirp;
+
+	dirp = opendir(tuser->cache_dir);
+	if (dirp == NULL) {
+		i_error("fts_tika: opendir(%s) failed: %m", tuser->cache_dir);
+		return;
+	}
+
+	t_array_init(&files, 128);
+	while ((d = readdir(dirp)) != NULL) {
+		const char *path = t_strconcat(tuser->cache_dir, "/",
+					       d->d_name, NULL);
+		if (d->d_name[0] == '.') {
+			/* drop temp files left behind by crashed processes */
+			if (str_begins_with(d->d_name,
+					    FTS_TIKA_CACHE_TEMP_FNAME_PREFIX) &&
+			    stat(path, &st) == 0 &&
+			    st.st_mtime < ioloop_time -
+					  FTS_TIKA_CACHE_CLEANUP_INTERVAL_SECS)
+				i_unlink_if_exists(path);
+			continue;
+		}
+		if (stat(path, &st) < 0) {
+			if (errno != ENOENT)
+				i_error("fts_tika: stat(%s) failed: %m", path);
+			continue;
+		}
+		file = array_append_space(&files);
+		file->path = path;
+		file->mtime = st.st_mtime;
+		file->size = st.st_size;
+		total_size += st.st_size;
+	}
+	if (closedir(dirp) < 0)
+		i_error("fts_tika: closedir(%s) failed: %m", tuser->cache_dir);
+
+	if (total_size <= tuser->cache_max_size)
+		return;
+
+	/* the mtime is updated on each cache hit, so remove the least
+	   recently used files first */
+	array_sort(&files, fts_tika_cache_file_cmp);
+	array_foreach_modifiable(&files, file) {
+		if (total_size <= tuser->cache_max_size)
+			break;
+		if (i_unlink_if_exists(file->path) > 0)
+			total_size -= file->size;
+	}
+}
+
+/* Returns the mode for files created to the cache directory. The cache can
+   be shared by users with different UIDs by giving the directory a common
+   group and the setgid bit, similar to fs-posix's mode=auto that is used
+   for SIS attachment directories. Then the files are created with the
+   directory's group permissions. Otherwise they're private to the UID. */
+static mode_t fts_tika_cache_get_file_mode(const char *dir)
+{
+	struct stat st;
+	const char *p;
+
+	while (stat(dir, &st) < 0) {
+		if (errno != ENOENT || (p = strrchr(dir, '/')) == NULL ||
+		    p == dir)
+			return 0600;
+		dir = t_strdup_until(dir, p);
+	}
+	if ((st.st_mode & S_ISGID) != 0)
+		return (st.st_mode & 0666) | 0600;
+	return 0600;
+}
+
+static void fts_tika_cache_cleanup(struct fts_parser_tika_user *tuser)
+{
+	const char *stamp_path;
+	struct stat st;
+	mode_t mode, old_umask;
+	int fd;
+
+	stamp_path = t_strconcat(tuser->cache_dir,
+				 "/"FTS_TIKA_CACHE_CLEANUP_STAMP_FNAME, NULL);
+	if (stat(stamp_path, &st) == 0 &&
+	    st.st_mtime > ioloop_time - FTS_TIKA_CACHE_CLEANUP_INTERVAL_SECS)
+		return;
+
+	/* update the stamp first, so other processes don't start cleaning
+	   up at the same time */
+	mode = fts_tika_cache_get_file_mode(tuser->cache_dir);
+	old_umask = umask(0666 ^ mode);
+	fd = open(stamp_path, O_WRONLY | O_CREAT, 0666);
+	umask(old_umask);
+	if (fd == -1) {
+		i_error("fts_tika: open(%s) failed: %m", stamp_path);
+		return;
+	}
+	i_close_fd(&fd);
+	if (utime(stamp_path, NULL) < 0) {
+		i_error("fts_tika: utime(%s) failed: %m", stamp_path);
+		return;
+	}
+	T_BEGIN {
+		fts_tika_cache_cleanup_dir(tuser);
+	} T_END;
+}
+
+static int fts_tika_cache_create_temp(const char *dir, string_t *path)
+{
+	mode_t mode, dir_mode;
+	int fd;
+
+	mode = fts_tika_cache_get_file_mode(dir);
+	str_printfa(path, "%s/"FTS_TIKA_CACHE_TEMP_FNAME_PREFIX, dir);
+	fd = safe_mkstemp_hostpid(path, mode, (uid_t)-1, (gid_t)-1);
+	if (fd == -1 && errno == ENOENT) {
+		dir_mode = mode | 0100;
+		if ((mode & 0060) != 0)
+			dir_mode |= 0010;
+		if ((mode & 0006) != 0)
+			dir_mode |= 0001;
+		if (mkdir_parents(dir, dir_mode) < 0 && errno != EEXIST) {
+			i_error("fts_tika: mkdir_parents(%s) failed: %m", dir);
+			return -1;
+		}
+		str_truncate(path, 0);
+		str_printfa(path, "%s/"FTS_TIKA_CACHE_TEMP_FNAME_PREFIX, dir);
+		fd = safe_mkstemp_hostpid(path, mode, (uid_t)-1, (gid_t)-1);
+	}
+	if (fd == -1) {
+		i_error("fts_tika: safe_mkstemp(%s) failed: %m",
+			str_c(path));
+	}
+	return fd;
+}
+
+static void fts_parser_tika_cache_create(struct tika_fts_parser *parser)
+{
+	string_t *temp_path = t_str_new(256);
+	int fd;
+
+	fd = fts_tika_cache_create_temp(parser->tuser->cache_dir, temp_path);
+	if (fd == -1) {
+		i_free(parser->cache_path);
+		return;
+	}
+	parser->cache_temp_path = i_strdup(str_c(temp_path));
+	parser->cache_output = o_stream_create_fd_autoclose(&fd, 0);
+}
+
+static void
+fts_parser_tika_cache_finish(struct tika_fts_parser *parser, bool success)
+{
+	if (success && o_stream_finish(parser->cache_output) < 0) {
+		i_error("fts_tika: write(%s) failed: %s",
+			parser->cache_temp_path,
+			o_stream_get_error(parser->cache_output));
+		success = FALSE;
+	}
+	if (!success)
+		o_stream_abort(parser->cache_output);
+	o_stream_destroy(&parser->cache_output);
+
+	if (success && rename(parser->cache_temp_path, parser->cache_path) < 0) {
+		i_error("fts_tika: rename(%s, %s) failed: %m",
+			parser->cache_temp_path, parser->cache_path);
+		success = FALSE;
+	}
+	if (!success)
+		i_unlink_if_exists(parser->cache_temp_path);
+	i_free(parser->cache_temp_path);
+	i_free(parser->cache_path);
+
+	if (success)
+		fts_tika_cache_cleanup(parser->tuser);
+}
+
+/* Tika's output depends also on the Content-Type hint sent with the body,
+   so it's part of the cache key. The Content-Disposition filename isn't,
+   so that identical attachments with different names share the same cache
+   file. For them the first extraction's text is used. */
+static void
+fts_tika_cache_key_append_content_type(string_t *dest,
+				       const char *content_type)
+{
+	unsigned char digest[SHA1_RESULTLEN];
+
+	if (content_type == NULL)
+		content_type = "";
+	content_type = t_str_lcase(content_type);
+	sha1_get_digest(content_type, strlen(content_type), digest);
+	str_append_c(dest, '-');
+	binary_to_hex_append(dest, digest, 8);
+}
+
+/* The whole body has been buffered. Use the cached text if it exists,
+   otherwise send the body to Tika. */
+static void fts_parser_tika_cache_lookup(struct tika_fts_parser *parser)
+{
+	struct istream *input;
+	const unsigned char *data;
+	size_t size;
+	string_t *hash;
+	int fd;
+
+	hash = t_str_new(64);
+	hash_format_deinit(&parser->hash, hash);
+	if (o_stream_flush(parser->body_output) < 0) {
+		i_error("fts_tika: write(%s) failed: %s",
+			o_stream_get_name(parser->body_output),
+			o_stream_get_error(parser->body_output));
+		o_stream_destroy(&parser->body_output);
+		parser->failed = TRUE;
+		return;
+	}
+	input = iostream_temp_finish(&parser->body_output, IO_BLOCK_SIZE);
+	fts_tika_cache_key_append_content_type(hash, parser->content_type);
+
+	parser->cache_path = i_strdup_printf("%s/%s", parser->tuser->cache_dir,
+					     str_c(hash));
+	fd = open(parser->cache_path, O_RDONLY);
+	if (fd != -1) {
+		/* update mtime for the LRU cleanup */
+		if (utime(parser->cache_path, NULL) < 0 && errno != ENOENT) {
+			i_error("fts_tika: utime(%s) failed: %m",
+				parser->cache_path);
+		}
+		e_debug(parser->user->event, "fts_tika: Using cached text %s",
+			parser->cache_path);
+		parser->payload = i_stream_create_fd_autoclose(&fd,
+							       IO_BLOCK_SIZE);
+		i_free(parser->cache_path);
+		i_stream_unref(&input);
+		return;
+	}
+	if (errno == EACCES) {
+		/* written by another user into a cache directory that isn't
+		   group-shared - treat it as a miss, but don't try to
+		   replace it either */
+		e_debug(parser->user->event, "fts_tika: Can't read cached "
+			"text %s: %m", parser->cache_path);
+		i_free(parser->cache_path);
+	} else if (errno != ENOENT) {
+		i_error("fts_tika: open(%s) failed: %m", parser->cache_path);
+		i_free(parser->cache_path);
+	}
+
+	fts_parser_tika_request_init(parser, parser->content_type,
+				     parser->content_disposition);
+	while (!parser->failed &&
+	       i_stream_read_more(input, &data, &size) > 0) {
+		if (http_client_request_send_payload(&parser->http_req,
+						     data, size) < 0)
+			parser->failed = TRUE;
+		i_stream_skip(input, size);
+	}
+	if (input->stream_errno != 0) {
+		i_error("fts_tika: read(%s) failed: %s",
+			i_stream_get_name(input), i_stream_get_error(input));
+		parser->failed = TRUE;
+	}
+	i_stream_unref(&input);
+}
+
 static void fts_parser_tika_more(struct fts_parser *_parser,
 				 struct message_block *block)
 {
@@ -183,6 +557,14 @@ static void fts_parser_tika_more(struct fts_parser *_parser,
 	ssize_t ret;
 
 	if (block->size > 0) {
+		if (parser->body_output != NULL) {
+			hash_format_loop(parser->hash, block->data,
+					 block->size);
+			o_stream_nsend(parser->body_output, block->data,
+				       block->size);
+			block->size = 0;
+			return;
+		}
 		/* first we'll send everything to Tika */
 		if (!parser->failed &&
 		    http_client_request_send_payload(&parser->http_req,
@@ -194,15 +576,23 @@ static void fts_parser_tika_more(struct fts_parser *_parser,
 	}
 
 	if (parser->payload == NULL) {
-		/* read the result from Tika */
-		if (!parser->failed &&
-		    http_client_request_finish_payload(&parser->http_req) < 0)
-			parser->failed = TRUE;
-		if (!parser->failed && parser->payload == NULL)
-			http_client_wait(tika_http_client);
-		if (parser->failed)
-			return;
-		i_assert(parser->payload != NULL);
+		if (parser->body_output != NULL)
+			fts_parser_tika_cache_lookup(parser);
+		if (parser->payload != NULL) {
+			/* found from cache */
+		} else {
+			/* read the result from Tika */
+			if (!parser->failed &&
+			    http_client_request_finish_payload(&parser->http_req) < 0)
+				parser->failed = TRUE;
+			if (!parser->failed && parser->payload == NULL)
+				http_client_wait(tika_http_client);
+			if (parser->failed)
+				return;
+			i_assert(parser->payload != NULL);
+			if (parser->cache_path != NULL)
+				fts_parser_tika_cache_create(parser);
+		}
 	}
 	/* continue returning data from Tika. we'll create a new ioloop just
 	   for reading this one payload. */
@@ -229,6 +619,8 @@ static void fts_parser_tika_more(struct fts_parser *_parser,
 		block->data = data;
 		block->size = size;
 		i_stream_skip(parser->payload, size);
+		if (parser->cache_output != NULL)
+			o_stream_nsend(parser->cache_output, data, size);
 	} else {
 		/* finished */
 		i_assert(ret == -1);
@@ -238,6 +630,11 @@ static void fts_parser_tika_more(struct fts_parser *_parser,
 				i_stream_get_error(parser->payload));
 			parser->failed = TRUE;
 		}
+		/* don't cache errors that may go away when retrying */
+		if (parser->cache_output != NULL) {
+			fts_parser_tika_cache_finish(parser,
+				!parser->failed && !_parser->may_need_retry);
+		}
 	}
 }
 
@@ -260,6 +657,14 @@ static int fts_parser_tika_deinit(struct fts_parser *_parser, const char **retri
 		io_loop_set_current(parser->ioloop);
 		io_loop_destroy(&parser->ioloop);
 	}
+	if (parser->cache_output != NULL)
+		fts_parser_tika_cache_finish(parser, FALSE);
+	if (parser->hash != NULL)
+		hash_format_deinit_free(&parser->hash);
+	o_stream_destroy(&parser->body_output);
+	i_free(parser->cache_path);
+	i_free(parser->content_type);
+	i_free(parser->content_disposition);
 	i_free(parser);
 	return ret;
 }
@@ -0,0 +1,118 @@
+/* Copyright (c) 2023 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "buffer.h"
+#include "hash.h"
+#include "llist.h"
+#include "fts-search-cache.h"
+
+struct fts_search_cache_entry {
+	struct fts_search_cache_entry *prev, *next;
+
+	pool_t pool;
+	const char *key;
+	struct fts_search_cache_result result;
+};
+
+struct fts_search_cache {
+	unsigned int max_entries;
+
+	HASH_TABLE(const char *, struct fts_search_cache_entry *) entries;
+	/* most recently used first */
+	struct fts_search_cache_entry *head, *tail;
+};
+
+struct fts_search_cache *fts_search_cache_init(unsigned int max_entries)
+{
+	struct fts_search_cache *cache;
+
+	i_assert(max_entries > 0);
+
+	cache = i_new(struct fts_search_cache, 1);
+	cache->max_entries = max_entries;
+	hash_table_create(&cache->entries, default_pool, 0, str_hash, strcmp);
+	return cache;
+}
+
+static void
+fts_search_cache_entry_free(struct fts_search_cache *cache,
+			    struct fts_search_cache_entry *entry)
+{
+	hash_table_remove(cache->entries, entry->key);
+	DLLIST2_REMOVE(&cache->head, &cache->tail, entry);
+	pool_unref(&entry->pool);
+}
+
+void fts_search_cache_deinit(struct fts_search_cache **_cache)
+{
+	struct fts_search_cache *cache = *_cache;
+
+	*_cache = NULL;
+	while (cache->head != NULL)
+		fts_search_cache_entry_free(cache, cache->head);
+	hash_table_destroy(&cache->entries);
+	i_free(cache);
+}
+
+const struct fts_search_cache_result *
+fts_search_cache_lookup(struct fts_search_cache *cache, const char *key)
+{
+	struct fts_search_cache_entry *entry;
+
+	entry = hash_table_lookup(cache->entries, key);
+	if (entry == NULL)
+		return NULL;
+
+	DLLIST2_REMOVE(&cache->head, &cache->tail, entry);
+	DLLIST2_PREPEND(&cache->head, &cache->tail, entry);
+	return &entry->result;
+}
+
+static void
+fts_search_cache_copy_uids(pool_t pool, ARRAY_TYPE(seq_range) *dest,
+			   const ARRAY_TYPE(seq_range) *src)
+{
+	if (!array_is_created(src)) {
+		p_array_init(dest, pool, 1);
+		return;
+	}
+	p_array_init(dest, pool, I_MAX(array_count(src), 1));
+	array_append_array(dest, src);
+}
+
+void fts_search_cache_add(struct fts_search_cache *cache, const char *key,
+			  const struct fts_result *result,
+			  const buffer_t *args_matches)
+{
+	struct fts_search_cache_entry *entry;
+	unsigned int score_count;
+	pool_t pool;
+
+	entry = hash_table_lookup(cache->entries, key);
+	if (entry != NULL)
+		fts_search_cache_entry_free(cache, entry);
+
+	pool = pool_alloconly_create("fts search cache entry", 512);
+	entry = p_new(pool, struct fts_search_cache_entry, 1);
+	entry->pool = pool;
+	entry->key = p_strdup(pool, key);
+	fts_search_cache_copy_uids(pool, &entry->result.definite_uids,
+				   &result->definite_uids);
+	fts_search_cache_copy_uids(pool, &entry->result.maybe_uids,
+				   &result->maybe_uids);
+	score_count = !array_is_created(&result->scores) ? 0 :
+		array_count(&result->scores);
+	p_array_init(&entry->result.scores, pool, I_MAX(score_count, 1));
+	if (score_count > 0)
+		array_append_array(&entry->result.scores, &result->scores);
+	entry->result.args_matches =
+		buffer_create_dynamic(pool, args_matches->used);
+	buffer_append_buf(entry->result.args_matches, args_matches,
+			  0, SIZE_MAX);
+
+	hash_table_insert(cache->entries, entry->key, entry);
+	DLLIST2_PREPEND(&cache->head, &cache->tail, entry);
+	if (hash_table_count(cache->entries) > cache->max_entries)
+		fts_search_cache_entry_free(cache, cache->tail);
+}
@@ -0,0 +1,33 @@
+#ifndef FTS_SEARCH_CACHE_H
+#define FTS_SEARCH_CACHE_H
+
+#include "seq-range-array.h"
+#include "fts-api.h"
+
+/* Cache of backend lookup results. The caller is responsible for building
+   a key that changes whenever the backend's results could change, e.g. by
+   including the mailbox GUID and the last indexed UID. Old keys are simply
+   never looked up again and they're dropped once the cache is full. */
+
+struct fts_search_cache_result {
+	ARRAY_TYPE(seq_range) definite_uids, maybe_uids;
+	ARRAY_TYPE(fts_score_map) scores;
+	/* fts_search_serialize() output for the args after the lookup */
+	buffer_t *args_matches;
+};
+
+/* Create a cache that holds at most max_entries results. */
+struct fts_search_cache *fts_search_cache_init(unsigned int max_entries);
+void fts_search_cache_deinit(struct fts_search_cache **cache);
+
+/* Returns the cached result for the key, or NULL if it's not cached.
+   The result is valid until the next fts_search_cache_add() call. */
+const struct fts_search_cache_result *
+fts_search_cache_lookup(struct fts_search_cache *cache, const char *key);
+/* Add the lookup result to the cache, replacing any existing result for
+   the key. */
+void fts_search_cache_add(struct fts_search_cache *cache, const char *key,
+			  const struct fts_result *result,
+			  const buffer_t *args_matches);
+
+#endif
@@ -5,10 +5,13 @@
 #include "str.h"
 #include "seq-range-array.h"
 #include "mail-search.h"
+#include "mail-storage-private.h"
 #include "fts-api-private.h"
 #include "fts-search-args.h"
+#include "fts-search-cache.h"
 #include "fts-search-serialize.h"
 #include "fts-storage.h"
+#include "fts-user.h"
 #include "hash.h"
 
 static void
@@ -33,14 +36,80 @@ uid_range_to_seqs(struct fts_search_context *fctx,
 	}
 }
 
+static const char *
+fts_search_cache_key(struct fts_search_context *fctx,
+		     struct mail_search_arg *args, enum fts_lookup_flags flags)
+{
+	string_t *key = t_str_new(128);
+	const struct mail_search_arg *arg;
+	const char *error;
+
+	str_printfa(key, "%s\t%x\t", fctx->search_cache_prefix, flags);
+	for (arg = args; arg != NULL; arg = arg->next) {
+		if (arg != args)
+			str_append_c(key, ' ');
+		switch (arg->type) {
+		case SEARCH_MAILBOX:
+		case SEARCH_MAILBOX_GUID:
+		case SEARCH_MAILBOX_GLOB:
+			/* These can't be written as IMAP. The mailbox is
+			   already in the prefix, so just keep the key
+			   unambiguous. */
+			str_printfa(key, "%s%d:%zu:%s",
+				    arg->match_not ? "NOT " : "", arg->type,
+				    strlen(arg->value.str), arg->value.str);
+			break;
+		default:
+			if (!mail_search_arg_to_imap(key, arg, &error))
+				return NULL;
+			break;
+		}
+	}
+	return str_c(key);
+}
+
+static void
+fts_search_lookup_level_cached(struct fts_search_context *fctx,
+			       struct mail_search_arg *args,
+			       const struct fts_search_cache_result *cached)
+{
+	struct fts_search_level *level;
+
+	fts_search_deserialize(args, cached->args_matches);
+	level = array_append_space(&fctx->levels);
+	level->args_matches = buffer_create_dynamic(fctx->result_pool,
+						    cached->args_matches->used);
+	buffer_append_buf(level->args_matches, cached->args_matches,
+			  0, SIZE_MAX);
+
+	uid_range_to_seqs(fctx, &cached->definite_uids, &level->definite_seqs);
+	uid_range_to_seqs(fctx, &cached->maybe_uids, &level->maybe_seqs);
+	p_array_init(&level->score_map, fctx->result_pool,
+		     I_MAX(array_count(&cached->scores), 1));
+	array_append_array(&level->score_map, &cached->scores);
+}
+
 static int fts_search_lookup_level_single(struct fts_search_context *fctx,
 					  struct mail_search_arg *args,
 					  bool and_args)
 {
 	enum fts_lookup_flags flags = fctx->flags |
 		(and_args ? FTS_LOOKUP_FLAG_AND_ARGS : 0);
+	const struct fts_search_cache_result *cached;
 	struct fts_search_level *level;
 	struct fts_result result;
+	const char *cache_key = NULL;
+
+	mail_search_args_reset(args, TRUE);
+	if (fctx->search_cache_prefix != NULL)
+		cache_key = fts_search_cache_key(fctx, args, flags);
+	if (cache_key != NULL) {
+		cached = fts_search_cache_lookup(fctx->search_cache, cache_key);
+		if (cached != NULL) {
+			fts_search_lookup_level_cached(fctx, args, cached);
+			return 0;
+		}
+	}
 
 	i_zero(&result);
 	result.search_state = fctx->search_state;
@@ -49,7 +118,6 @@ static int fts_search_lookup_level_single(struct fts_search_context *fctx,
 	p_array_init(&result.maybe_uids, fctx->result_pool, 32);
 	p_array_init(&result.scores, fctx->result_pool, 32);
 
-	mail_search_args_reset(args, TRUE);
 	if (fts_backend_lookup(fctx->backend, fctx->box, args, flags,
 			       &result) < 0)
 		return -1;
@@ -62,6 +130,11 @@ static int fts_search_lookup_level_single(struct fts_search_context *fctx,
 	uid_range_to_seqs(fctx, &result.definite_uids, &level->definite_seqs);
 	uid_range_to_seqs(fctx, &result.maybe_uids, &level->maybe_seqs);
 	level->score_map = result.scores;
+
+	if (cache_key != NULL) {
+		fts_search_cache_add(fctx->search_cache, cache_key, &result,
+				     level->args_matches);
+	}
 	return 0;
 }
 
@@ -372,9 +445,34 @@ int fts_search_get_first_missing_uid(struct fts_backend *backend,
 	i_unreached();
 }
 
+static void
+fts_search_cache_prefix_init(struct fts_search_context *fctx,
+			     uint32_t last_indexed_uid)
+{
+	struct mailbox_metadata metadata;
+	const struct mail_index_header *hdr;
+
+	fctx->search_cache_prefix = NULL;
+	fctx->search_cache =
+		fts_user_get_search_cache(fctx->box->storage->user);
+	if (fctx->search_cache == NULL || fctx->virtual_mailbox)
+		return;
+
+	/* The backend's results can change only when more mails are
+	   indexed. Expunged UIDs are dropped by uid_range_to_seqs(). */
+	if (mailbox_get_metadata(fctx->box, MAILBOX_METADATA_GUID,
+				 &metadata) < 0)
+		return;
+	hdr = mail_index_get_header(fctx->box->view);
+	fctx->search_cache_prefix =
+		p_strdup_printf(fctx->result_pool, "%s\t%u\t%u",
+				guid_128_to_string(metadata.guid),
+				hdr->uid_validity, last_indexed_uid);
+}
+
 static void fts_search_try_lookup(struct fts_search_context *fctx)
 {
-	uint32_t last_uid, seq1, seq2;
+	uint32_t last_uid, seq1, seq2, count;
 	int ret;
 
 	i_assert(array_count(&fctx->levels) == 0);
@@ -388,11 +486,17 @@ static void fts_search_try_lookup(struct fts_search_context *fctx)
 	if (ret > 0) {
 		/* everything is already indexed */
 		seq1 = seq2 = 0;
+		count = mail_index_view_get_messages_count(fctx->box->view);
+		if (count == 0)
+			last_uid = 0;
+		else
+			mail_index_lookup_uid(fctx->box->view, count, &last_uid);
 	} else {
 		mailbox_get_seq_range(fctx->box, last_uid+1, (uint32_t)-1,
 				      &seq1, &seq2);
 	}
 	fctx->first_unindexed_seq = seq1 != 0 ? seq1 : (uint32_t)-1;
+	fts_search_cache_prefix_init(fctx, last_uid);
 
 	if (fctx->virtual_mailbox) {
 		hash_table_clear(fctx->last_indexed_virtual_uids, TRUE);
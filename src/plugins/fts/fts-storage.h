@@ -47,6 +47,11 @@ struct fts_search_context {
 	struct fts_indexer_context *indexer_ctx;
 	struct fts_search_state *search_state;
 
+	/* Lookup results are cached if search_cache_prefix is non-NULL.
+	   It identifies the mailbox and the backend's indexing state. */
+	struct fts_search_cache *search_cache;
+	const char *search_cache_prefix;
+
 	bool virtual_mailbox:1;
 	bool fts_lookup_success:1;
 	bool indexing_timed_out:1;
@@ -8,8 +8,11 @@
 #include "fts-language.h"
 #include "fts-filter.h"
 #include "fts-tokenizer.h"
+#include "fts-search-cache.h"
 #include "fts-user.h"
 
+#define FTS_SEARCH_CACHE_SIZE_DEFAULT 16
+
 #define FTS_USER_CONTEXT(obj) \
 	MODULE_CONTEXT(obj, fts_user_module)
 
@@ -22,6 +25,7 @@ struct fts_user {
 	ARRAY_TYPE(fts_user_language) languages, data_languages;
 
 	struct mailbox_match_plugin *autoindex_exclude;
+	struct fts_search_cache *search_cache;
 };
 
 static MODULE_CONTEXT_DEFINE_INIT(fts_user_module,
@@ -347,6 +351,13 @@ bool fts_user_autoindex_exclude(struct mailbox *box)
 	return mailbox_match_plugin_exclude(fuser->autoindex_exclude, box);
 }
 
+struct fts_search_cache *fts_user_get_search_cache(struct mail_user *user)
+{
+	struct fts_user *fuser = FTS_USER_CONTEXT(user);
+
+	return fuser == NULL ? NULL : fuser->search_cache;
+}
+
 static void fts_user_language_free(struct fts_user_language *user_lang)
 {
 	if (user_lang->filter != NULL)
@@ -369,6 +380,8 @@ static void fts_user_free(struct fts_user *fuser)
 			fts_user_language_free(user_lang);
 	}
 	mailbox_match_plugin_deinit(&fuser->autoindex_exclude);
+	if (fuser->search_cache != NULL)
+		fts_search_cache_deinit(&fuser->search_cache);
 }
 
 static int
@@ -385,6 +398,24 @@ fts_mail_user_init_libfts(struct mail_user *user, struct fts_user *fuser,
 	return 0;
 }
 
+static int
+fts_mail_user_init_search_cache(struct mail_user *user, struct fts_user *fuser,
+				const char **error_r)
+{
+	const char *str;
+	unsigned int size = FTS_SEARCH_CACHE_SIZE_DEFAULT;
+
+	str = mail_user_plugin_getenv(user, "fts_search_cache_size");
+	if (str != NULL && str_to_uint(str, &size) < 0) {
+		*error_r = t_strdup_printf(
+			"Invalid fts_search_cache_size: %s", str);
+		return -1;
+	}
+	if (size > 0)
+		fuser->search_cache = fts_search_cache_init(size);
+	return 0;
+}
+
 int fts_mail_user_init(struct mail_user *user, bool initialize_libfts,
 		       const char **error_r)
 {
@@ -404,6 +435,10 @@ int fts_mail_user_init(struct mail_user *user, bool initialize_libfts,
 			return -1;
 		}
 	}
+	if (fts_mail_user_init_search_cache(user, fuser, error_r) < 0) {
+		fts_user_free(fuser);
+		return -1;
+	}
 	fuser->autoindex_exclude =
 		mailbox_match_plugin_init(user, "fts_autoindex_exclude");
 
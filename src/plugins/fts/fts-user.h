@@ -19,6 +19,8 @@ const ARRAY_TYPE(fts_user_language) *
 fts_user_get_data_languages(struct mail_user *user);
 
 bool fts_user_autoindex_exclude(struct mailbox *box);
+/* Returns the user's FTS lookup result cache, or NULL if it's disabled. */
+struct fts_search_cache *fts_user_get_search_cache(struct mail_user *user);
 
 int fts_mail_user_init(struct mail_user *user, bool initialize_libfts,
 		       const char **error_r);
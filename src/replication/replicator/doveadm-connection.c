@@ -35,16 +35,24 @@ static int client_input_status_overview(struct doveadm_connection *client)
 	unsigned int pending_counts[REPLICATION_PRIORITY_SYNC+1];
 	unsigned int user_count, next_secs, pending_failed_count;
 	unsigned int pending_full_resync_count, waiting_failed_count;
+	unsigned int coalescing_count, lag, max_lag;
 	string_t *str = t_str_new(256);
 
 	memset(pending_counts, 0, sizeof(pending_counts));
 	pending_failed_count = 0; waiting_failed_count = 0;
 	pending_full_resync_count = 0;
+	coalescing_count = 0; max_lag = 0;
 
 	user_count = 0;
 	iter = replicator_queue_iter_init(queue);
 	while ((user = replicator_queue_iter_next(iter)) != NULL) {
-		if (user->priority != REPLICATION_PRIORITY_NONE)
+		lag = replicator_queue_get_user_lag(user);
+		if (lag > max_lag)
+			max_lag = lag;
+
+		if (user->coalesce_until != 0)
+			coalescing_count++;
+		else if (user->priority != REPLICATION_PRIORITY_NONE)
 			pending_counts[user->priority]++;
 		else if (replicator_queue_want_sync_now(queue, user, &next_secs)) {
 			if (user->last_sync_failed)
@@ -70,6 +78,9 @@ static int client_input_status_overview(struct doveadm_connection *client)
 		    pending_full_resync_count);
 	str_printfa(str, "Waiting 'failed' requests\t%u\n",
 		    waiting_failed_count);
+	str_printfa(str, "Waiting 'coalesce' requests\t%u\n",
+		    coalescing_count);
+	str_printfa(str, "Oldest queued request age\t%u\n", max_lag);
 	str_printfa(str, "Total number of known users\t%u\n", user_count);
 	str_append_c(str, '\n');
 	o_stream_nsend(client->conn.output, str_data(str), str_len(str));
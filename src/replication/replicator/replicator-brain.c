@@ -11,6 +11,9 @@
 struct replicator_sync_context {
 	struct replicator_brain *brain;
 	struct replicator_user *user;
+	struct event *event;
+	/* seconds the user's changes waited in the queue */
+	unsigned int queue_lag;
 };
 
 struct replicator_brain {
@@ -18,6 +21,7 @@ struct replicator_brain {
 	struct replicator_queue *queue;
 	const struct replicator_settings *set;
 	struct timeout *to;
+	struct event *event;
 
 	ARRAY_TYPE(dsync_client) dsync_clients;
 
@@ -54,6 +58,7 @@ replicator_brain_init(struct replicator_queue *queue,
 	brain->pool = pool;
 	brain->queue = queue;
 	brain->set = set;
+	brain->event = event_create(NULL);
 	p_array_init(&brain->dsync_clients, pool, 16);
 	replicator_queue_set_change_callback(queue,
 		replicator_brain_queue_changed, brain);
@@ -72,6 +77,7 @@ void replicator_brain_deinit(struct replicator_brain **_brain)
 	array_foreach_elem(&brain->dsync_clients, conn)
 		dsync_client_deinit(&conn);
 	timeout_remove(&brain->to);
+	event_unref(&brain->event);
 	pool_unref(&brain->pool);
 }
 
@@ -112,12 +118,36 @@ get_dsync_client(struct replicator_brain *brain)
 	return conn;
 }
 
+static void
+replicator_sync_finished(struct replicator_sync_context *ctx,
+			 enum dsync_reply reply)
+{
+	switch (reply) {
+	case DSYNC_REPLY_OK:
+		break;
+	case DSYNC_REPLY_FAIL:
+		event_add_str(ctx->event, "error", "failed");
+		break;
+	case DSYNC_REPLY_NOUSER:
+		event_add_str(ctx->event, "error", "nouser");
+		break;
+	case DSYNC_REPLY_NOREPLICATE:
+		event_add_str(ctx->event, "error", "noreplicate");
+		break;
+	}
+	event_set_name(ctx->event, "replicator_sync_finished");
+	e_debug(ctx->event, "Replication finished for user %s "
+		"(queue lag %u secs)", ctx->user->username, ctx->queue_lag);
+}
+
 static void dsync_callback(enum dsync_reply reply, const char *state,
 			   void *context)
 {
 	struct replicator_sync_context *ctx = context;
 	struct replicator_user *user = ctx->user;
 
+	replicator_sync_finished(ctx, reply);
+
 	if (!replicator_user_unref(&user)) {
 		/* user was already removed */
 	} else if (reply == DSYNC_REPLY_NOUSER ||
@@ -135,6 +165,7 @@ static void dsync_callback(enum dsync_reply reply, const char *state,
 	}
 	if (!ctx->brain->deinitializing)
 		replicator_brain_fill(ctx->brain);
+	event_unref(&ctx->event);
 	i_free(ctx);
 }
 
@@ -160,13 +191,20 @@ dsync_replicate(struct replicator_brain *brain, struct replicator_user *user)
 		user->last_full_sync = ioloop_time;
 		user->force_full_sync = FALSE;
 	}
-	/* reset priority also. if more updates arrive during replication
-	   we'll do another replication to make sure nothing gets lost */
-	user->priority = REPLICATION_PRIORITY_NONE;
 
 	ctx = i_new(struct replicator_sync_context, 1);
 	ctx->brain = brain;
 	ctx->user = user;
+	ctx->queue_lag = replicator_queue_get_user_lag(user);
+	/* reset priority also. if more updates arrive during replication
+	   we'll do another replication to make sure nothing gets lost */
+	user->priority = REPLICATION_PRIORITY_NONE;
+
+	ctx->event = event_create(brain->event);
+	event_add_str(ctx->event, "user", user->username);
+	event_add_int(ctx->event, "queue_lag", ctx->queue_lag);
+	if (full)
+		event_add_str(ctx->event, "full_sync", "yes");
 	replicator_user_ref(user);
 	dsync_client_sync(conn, user->username, user->state, full,
 			  dsync_callback, ctx);
@@ -28,9 +28,13 @@ struct replicator_queue {
 	HASH_TABLE(char *, struct replicator_user *) user_hash;
 
 	ARRAY(struct replicator_sync_lookup) sync_lookups;
+	/* users waiting for their coalesce_until time */
+	ARRAY(struct replicator_user *) coalesce_users;
+	struct timeout *to_coalesce;
 
 	unsigned int full_sync_interval;
 	unsigned int failure_resync_interval;
+	unsigned int sync_coalesce_interval;
 
 	void (*change_callback)(void *context);
 	void *change_context;
@@ -80,17 +84,20 @@ static int user_priority_cmp(const void *p1, const void *p2)
 
 struct replicator_queue *
 replicator_queue_init(unsigned int full_sync_interval,
-		      unsigned int failure_resync_interval)
+		      unsigned int failure_resync_interval,
+		      unsigned int sync_coalesce_interval)
 {
 	struct replicator_queue *queue;
 
 	queue = i_new(struct replicator_queue, 1);
 	queue->full_sync_interval = full_sync_interval;
 	queue->failure_resync_interval = failure_resync_interval;
+	queue->sync_coalesce_interval = sync_coalesce_interval;
 	queue->user_queue = priorityq_init(user_priority_cmp, 1024);
 	hash_table_create(&queue->user_hash, default_pool, 1024,
 			  str_hash, strcmp);
 	i_array_init(&queue->sync_lookups, 32);
+	i_array_init(&queue->coalesce_users, 16);
 	return queue;
 }
 
@@ -109,11 +116,18 @@ void replicator_queue_deinit(struct replicator_queue **_queue)
 		user->popped = TRUE;
 		replicator_queue_remove(queue, &user);
 	}
+	while (array_count(&queue->coalesce_users) > 0) {
+		struct replicator_user *user =
+			array_idx_elem(&queue->coalesce_users, 0);
+		replicator_queue_remove(queue, &user);
+	}
+	timeout_remove(&queue->to_coalesce);
 
 	priorityq_deinit(&queue->user_queue);
 	hash_table_destroy(&queue->user_hash);
 	i_assert(array_count(&queue->sync_lookups) == 0);
 	array_free(&queue->sync_lookups);
+	array_free(&queue->coalesce_users);
 	i_free(queue);
 }
 
@@ -152,6 +166,69 @@ replicator_queue_lookup(struct replicator_queue *queue, const char *username)
 	return hash_table_lookup(queue->user_hash, username);
 }
 
+static void replicator_queue_coalesce_timeout(struct replicator_queue *queue);
+
+static void replicator_queue_coalesce_schedule(struct replicator_queue *queue)
+{
+	struct replicator_user *user;
+	time_t next_time = 0;
+
+	timeout_remove(&queue->to_coalesce);
+	array_foreach_elem(&queue->coalesce_users, user) {
+		if (next_time == 0 || user->coalesce_until < next_time)
+			next_time = user->coalesce_until;
+	}
+	if (next_time == 0)
+		return;
+	queue->to_coalesce = next_time <= ioloop_time ?
+		timeout_add_short(0, replicator_queue_coalesce_timeout, queue) :
+		timeout_add((next_time - ioloop_time) * 1000,
+			    replicator_queue_coalesce_timeout, queue);
+}
+
+static void
+replicator_queue_coalesce_remove(struct replicator_queue *queue,
+				 struct replicator_user *user)
+{
+	struct replicator_user *const *users;
+	unsigned int i, count;
+
+	i_assert(user->coalesce_until != 0);
+
+	users = array_get(&queue->coalesce_users, &count);
+	for (i = 0; i < count; i++) {
+		if (users[i] == user) {
+			array_delete(&queue->coalesce_users, i, 1);
+			break;
+		}
+	}
+	user->coalesce_until = 0;
+	replicator_queue_coalesce_schedule(queue);
+}
+
+static void replicator_queue_coalesce_timeout(struct replicator_queue *queue)
+{
+	struct replicator_user *user;
+	unsigned int i;
+	bool changed = FALSE;
+
+	for (i = 0; i < array_count(&queue->coalesce_users); ) {
+		user = array_idx_elem(&queue->coalesce_users, i);
+		if (user->coalesce_until > ioloop_time)
+			i++;
+		else {
+			array_delete(&queue->coalesce_users, i, 1);
+			user->coalesce_until = 0;
+			priorityq_add(queue->user_queue, &user->item);
+			changed = TRUE;
+		}
+	}
+	replicator_queue_coalesce_schedule(queue);
+
+	if (changed && queue->change_callback != NULL)
+		queue->change_callback(queue->change_context);
+}
+
 static struct replicator_user *
 replicator_queue_add_int(struct replicator_queue *queue, const char *username,
 			 enum replication_priority priority)
@@ -169,13 +246,22 @@ replicator_queue_add_int(struct replicator_queue *queue, const char *username,
 			/* user already has a higher priority than this */
 			return user;
 		}
-		if (!user->popped)
+		if (user->coalesce_until != 0) {
+			/* don't make sync requests wait for coalescing */
+			if (priority == REPLICATION_PRIORITY_SYNC)
+				replicator_queue_coalesce_remove(queue, user);
+		} else if (!user->popped)
 			priorityq_remove(queue->user_queue, &user->item);
 	}
+	if (user->priority == REPLICATION_PRIORITY_NONE &&
+	    priority != REPLICATION_PRIORITY_NONE)
+		user->queued_since = ioloop_time;
+	if (user->popped && priority != REPLICATION_PRIORITY_NONE)
+		user->changed_during_sync = TRUE;
 	user->priority = priority;
 	user->last_update = ioloop_time;
 
-	if (!user->popped)
+	if (!user->popped && user->coalesce_until == 0)
 		priorityq_add(queue->user_queue, &user->item);
 	return user;
 }
@@ -219,7 +305,9 @@ void replicator_queue_remove(struct replicator_queue *queue,
 	struct replicator_user *user = *_user;
 
 	*_user = NULL;
-	if (!user->popped)
+	if (user->coalesce_until != 0)
+		replicator_queue_coalesce_remove(queue, user);
+	else if (!user->popped)
 		priorityq_remove(queue->user_queue, &user->item);
 	hash_table_remove(queue->user_hash, user->username);
 	replicator_user_unref(&user);
@@ -307,9 +395,24 @@ void replicator_queue_push(struct replicator_queue *queue,
 			   struct replicator_user *user)
 {
 	i_assert(user->popped);
+	i_assert(user->coalesce_until == 0);
 
-	priorityq_add(queue->user_queue, &user->item);
 	user->popped = FALSE;
+	if (user->changed_during_sync &&
+	    queue->sync_coalesce_interval > 0 &&
+	    user->priority != REPLICATION_PRIORITY_SYNC &&
+	    user->last_fast_sync + (time_t)queue->sync_coalesce_interval >
+	    ioloop_time) {
+		/* more changes arrived while the user was being replicated.
+		   wait for a while so they can be replicated together. */
+		user->coalesce_until = user->last_fast_sync +
+			queue->sync_coalesce_interval;
+		array_push_back(&queue->coalesce_users, &user);
+		replicator_queue_coalesce_schedule(queue);
+	} else {
+		priorityq_add(queue->user_queue, &user->item);
+	}
+	user->changed_during_sync = FALSE;
 
 	T_BEGIN {
 		replicator_queue_handle_sync_lookups(queue, user);
@@ -454,6 +557,14 @@ int replicator_queue_export(struct replicator_queue *queue, const char *path)
 	return ret;
 }
 
+unsigned int replicator_queue_get_user_lag(struct replicator_user *user)
+{
+	if (user->priority == REPLICATION_PRIORITY_NONE ||
+	    user->queued_since >= ioloop_time)
+		return 0;
+	return ioloop_time - user->queued_since;
+}
+
 struct replicator_queue_iter *
 replicator_queue_iter_init(struct replicator_queue *queue)
 {
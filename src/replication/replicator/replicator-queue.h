@@ -12,6 +12,12 @@ struct replicator_user {
 	char *state;
 	/* last time this user's state was updated */
 	time_t last_update;
+	/* when the user's priority was raised from none, i.e. the time of
+	   the oldest change that hasn't been replicated yet */
+	time_t queued_since;
+	/* If non-zero, the user isn't in the replication queue until this
+	   time, so more changes can be coalesced into the same sync. */
+	time_t coalesce_until;
 	/* last_fast_sync is always >= last_full_sync. */
 	time_t last_fast_sync, last_full_sync, last_successful_sync;
 
@@ -23,13 +29,21 @@ struct replicator_user {
 	bool last_sync_failed:1;
 	/* Force a full sync on the next replication */
 	bool force_full_sync:1;
+	/* More changes were added while the user was being replicated */
+	bool changed_during_sync:1;
 };
 
 typedef void replicator_sync_callback_t(bool success, void *context);
 
+/* If sync_coalesce_interval is non-zero, users that got new changes while
+   they were being replicated aren't replicated again (unless the priority is
+   sync) until the interval has passed since the previous replication began.
+   This keeps users with a high change rate from being replicated constantly
+   at the expense of the others. */
 struct replicator_queue *
 replicator_queue_init(unsigned int full_sync_interval,
-		      unsigned int failure_resync_interval);
+		      unsigned int failure_resync_interval,
+		      unsigned int sync_coalesce_interval);
 void replicator_queue_deinit(struct replicator_queue **queue);
 
 /* Call the specified callback when data is added/removed/moved in queue
@@ -65,7 +79,8 @@ void replicator_queue_remove(struct replicator_queue *queue,
 struct replicator_user *
 replicator_queue_pop(struct replicator_queue *queue,
 		     unsigned int *next_secs_r);
-/* Add user back to queue. */
+/* Add user back to queue. If the user got more changes while it was being
+   replicated, it may be delayed by the sync coalesce interval. */
 void replicator_queue_push(struct replicator_queue *queue,
 			   struct replicator_user *user);
 
@@ -77,6 +92,9 @@ int replicator_queue_export(struct replicator_queue *queue, const char *path);
 bool replicator_queue_want_sync_now(struct replicator_queue *queue,
 				    struct replicator_user *user,
 				    unsigned int *next_secs_r);
+/* Returns the number of seconds the user's oldest unreplicated change has
+   been waiting, or 0 if there is nothing to replicate. */
+unsigned int replicator_queue_get_user_lag(struct replicator_user *user);
 /* Iterate through all users in the queue. */
 struct replicator_queue_iter *
 replicator_queue_iter_init(struct replicator_queue *queue);
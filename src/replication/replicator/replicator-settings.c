@@ -58,6 +58,7 @@ static const struct setting_define replicator_setting_defines[] = {
 	DEF(STR, replication_dsync_parameters),
 
 	DEF(TIME, replication_full_sync_interval),
+	DEF(TIME, replication_sync_coalesce_interval),
 	DEF(UINT, replication_max_conns),
 
 	SETTING_DEFINE_LIST_END
@@ -69,6 +70,7 @@ const struct replicator_settings replicator_default_settings = {
 	.replication_dsync_parameters = "-d -N -l 30 -U",
 
 	.replication_full_sync_interval = 60*60*24,
+	.replication_sync_coalesce_interval = 0,
 	.replication_max_conns = 10
 };
 
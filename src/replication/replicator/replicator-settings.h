@@ -7,6 +7,7 @@ struct replicator_settings {
 	const char *replication_dsync_parameters;
 
 	unsigned int replication_full_sync_interval;
+	unsigned int replication_sync_coalesce_interval;
 	unsigned int replication_max_conns;
 };
 
@@ -61,7 +61,8 @@ static void main_init(void)
 	set = sets[0];
 
 	queue = replicator_queue_init(set->replication_full_sync_interval,
-				      REPLICATOR_FAILURE_RESYNC_INTERVAL_SECS);
+				      REPLICATOR_FAILURE_RESYNC_INTERVAL_SECS,
+				      set->replication_sync_coalesce_interval);
 	replication_add_users(queue);
 	to_dump = timeout_add(REPLICATOR_DB_DUMP_INTERVAL_MSECS,
 			      replicator_dump_timeout, NULL);
@@ -3,7 +3,7 @@
 #include "stats-common.h"
 #include "array.h"
 #include "str.h"
-#include "stats-dist.h"
+#include "stats-histogram.h"
 #include "strescape.h"
 #include "connection.h"
 #include "ostream.h"
@@ -36,30 +36,32 @@ static void reader_client_destroy(struct connection *conn)
 	master_service_client_connection_destroyed(master_service);
 }
 
-static void reader_client_dump_stats(string_t *str, struct stats_dist *stats,
-				     const char *const *fields)
+static void
+reader_client_dump_stats(string_t *str, struct stats_histogram *stats,
+			 const char *const *fields)
 {
 	for (unsigned int i = 0; fields[i] != NULL; i++) {
 		const char *field = fields[i];
 
 		str_append_c(str, '\t');
 		if (strcmp(field, "count") == 0)
-			str_printfa(str, "%u", stats_dist_get_count(stats));
+			str_printfa(str, "%u", stats_histogram_get_count(stats));
 		else if (strcmp(field, "sum") == 0)
-			str_printfa(str, "%"PRIu64, stats_dist_get_sum(stats));
+			str_printfa(str, "%"PRIu64, stats_histogram_get_sum(stats));
 		else if (strcmp(field, "min") == 0)
-			str_printfa(str, "%"PRIu64, stats_dist_get_min(stats));
+			str_printfa(str, "%"PRIu64, stats_histogram_get_min(stats));
 		else if (strcmp(field, "max") == 0)
-			str_printfa(str, "%"PRIu64, stats_dist_get_max(stats));
+			str_printfa(str, "%"PRIu64, stats_histogram_get_max(stats));
 		else if (strcmp(field, "avg") == 0)
-			str_printfa(str, "%.02f", stats_dist_get_avg(stats));
+			str_printfa(str, "%.02f", stats_histogram_get_avg(stats));
 		else if (strcmp(field, "median") == 0)
-			str_printfa(str, "%"PRIu64, stats_dist_get_median(stats));
+			str_printfa(str, "%"PRIu64, stats_histogram_get_median(stats));
 		else if (strcmp(field, "variance") == 0)
-			str_printfa(str, "%.02f", stats_dist_get_variance(stats));
+			str_printfa(str, "%.02f", stats_histogram_get_variance(stats));
 		else if (field[0] == '%') {
 			str_printfa(str, "%"PRIu64,
-				    stats_dist_get_percentile(stats, strtod(field+1, NULL)/100.0));
+				    stats_histogram_get_percentile(stats,
+					strtod(field+1, NULL)/100.0));
 		} else {
 			/* return unknown fields as empty */
 		}
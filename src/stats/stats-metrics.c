@@ -4,7 +4,7 @@
 #include "array.h"
 #include "str.h"
 #include "str-sanitize.h"
-#include "stats-dist.h"
+#include "stats-histogram.h"
 #include "time-util.h"
 #include "event-filter.h"
 #include "event-exporter.h"
@@ -88,14 +88,14 @@ stats_metric_alloc(pool_t pool, const char *name,
 	struct metric *metric = p_new(pool, struct metric, 1);
 	metric->name = p_strdup(pool, name);
 	metric->set = set;
-	metric->duration_stats = stats_dist_init();
+	metric->duration_stats = stats_histogram_init();
 	metric->fields_count = str_array_length(fields);
 	if (metric->fields_count > 0) {
 		metric->fields = p_new(pool, struct metric_field,
 				       metric->fields_count);
 		for (unsigned int i = 0; i < metric->fields_count; i++) {
 			metric->fields[i].field_key = p_strdup(pool, fields[i]);
-			metric->fields[i].stats = stats_dist_init();
+			metric->fields[i].stats = stats_histogram_init();
 		}
 	}
 	return metric;
@@ -265,9 +265,9 @@ struct stats_metrics *stats_metrics_init(const struct stats_settings *set)
 static void stats_metric_free(struct metric *metric)
 {
 	struct metric *sub_metric;
-	stats_dist_deinit(&metric->duration_stats);
+	stats_histogram_deinit(&metric->duration_stats);
 	for (unsigned int i = 0; i < metric->fields_count; i++)
-		stats_dist_deinit(&metric->fields[i].stats);
+		stats_histogram_deinit(&metric->fields[i].stats);
 	if (!array_is_created(&metric->sub_metrics))
 		return;
 	array_foreach_elem(&metric->sub_metrics, sub_metric)
@@ -299,9 +299,9 @@ void stats_metrics_deinit(struct stats_metrics **_metrics)
 static void stats_metric_reset(struct metric *metric)
 {
 	struct metric *sub_metric;
-	stats_dist_reset(metric->duration_stats);
+	stats_histogram_reset(metric->duration_stats);
 	for (unsigned int i = 0; i < metric->fields_count; i++)
-		stats_dist_reset(metric->fields[i].stats);
+		stats_histogram_reset(metric->fields[i].stats);
 	if (!array_is_created(&metric->sub_metrics))
 		return;
 	array_foreach_elem(&metric->sub_metrics, sub_metric)
@@ -610,7 +610,7 @@ stats_metric_group_by(struct metric *metric, struct event *event, pool_t pool)
 
 static void
 stats_metric_event_field(struct event *event, const char *fieldname,
-			 struct stats_dist *stats)
+			 struct stats_histogram *stats)
 {
 	const struct event_field *field =
 		event_find_field_recursive(event, fieldname);
@@ -632,7 +632,7 @@ stats_metric_event_field(struct event *event, const char *fieldname,
 		break;
 	}
 
-	stats_dist_add(stats, num);
+	stats_histogram_add(stats, num);
 }
 
 static void
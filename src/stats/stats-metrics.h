@@ -55,7 +55,7 @@ struct metric_export_info {
 
 struct metric_field {
 	const char *field_key;
-	struct stats_dist *stats;
+	struct stats_histogram *stats;
 };
 
 enum metric_value_type {
@@ -91,7 +91,7 @@ struct metric {
 	const char *sub_name;
 
 	/* Timing for how long the event existed */
-	struct stats_dist *duration_stats;
+	struct stats_histogram *duration_stats;
 
 	unsigned int fields_count;
 	struct metric_field *fields;
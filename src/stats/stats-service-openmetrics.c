@@ -7,7 +7,7 @@
 #include "json-parser.h"
 #include "ioloop.h"
 #include "ostream.h"
-#include "stats-dist.h"
+#include "stats-histogram.h"
 #include "http-server.h"
 #include "client-http.h"
 #include "stats-settings.h"
@@ -147,12 +147,12 @@ openmetrics_export_metric_value(struct openmetrics_request *req, string_t *out,
 	switch (req->metric_type) {
 	case OPENMETRICS_METRIC_TYPE_COUNT:
 		str_printfa(out, " %u\n",
-			    stats_dist_get_count(metric->duration_stats));
+			    stats_histogram_get_count(metric->duration_stats));
 		break;
 	case OPENMETRICS_METRIC_TYPE_DURATION:
 		/* Convert from microseconds to seconds */
 		str_printfa(out, " %.6f\n",
-			    stats_dist_get_sum(metric->duration_stats)/1e6F);
+			    stats_histogram_get_sum(metric->duration_stats)/1e6F);
 		break;
 	case OPENMETRICS_METRIC_TYPE_HISTOGRAM:
 		i_unreached();
@@ -221,8 +221,8 @@ openmetrics_export_histogram(struct openmetrics_request *req, string_t *out,
 			openmetrics_find_histogram_bucket(metric, i);
 
 		if (sub_metric != NULL) {
-			sum += stats_dist_get_sum(sub_metric->duration_stats);
-			count += stats_dist_get_count(
+			sum += stats_histogram_get_sum(sub_metric->duration_stats);
+			count += stats_histogram_get_count(
 				sub_metric->duration_stats);
 		}
 
@@ -89,9 +89,9 @@ uint64_t get_stats_dist_field(const char *metric_name, enum stats_dist_field fie
 
         switch(field) {
         case STATS_DIST_COUNT:
-                return stats_dist_get_count(metric->duration_stats);
+                return stats_histogram_get_count(metric->duration_stats);
         case STATS_DIST_SUM:
-                return stats_dist_get_sum(metric->duration_stats);
+                return stats_histogram_get_sum(metric->duration_stats);
         default:
                 i_unreached();
         }
@@ -8,7 +8,7 @@
 #include "str.h"
 #include "test-common.h"
 #include "lib-event-private.h"
-#include "stats-dist.h"
+#include "stats-histogram.h"
 #include "stats-event-category.h"
 #include "stats-metrics.h"
 
@@ -106,7 +106,7 @@ static void test_stats_metrics_group_by_check_one(const struct metric *metric,
 	else
 		test_assert(metric->sub_name == NULL);
 
-	test_assert(stats_dist_get_count(metric->duration_stats) == total_count);
+	test_assert(stats_histogram_get_count(metric->duration_stats) == total_count);
 
 	if (submetric_count > 0) {
 		test_assert(array_is_created(&metric->sub_metrics));